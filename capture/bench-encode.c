@@ -0,0 +1,337 @@
+/******************************************************************************/
+/* bench-encode.c  -- Compare the session document encoders on a recorded dump
+ *
+ *   make bench-encode
+ *   ./bench-encode <dump> [loops]
+ *
+ * The dump is JSON capture produced, a _bulk body saved on the way to ES or
+ * the output of moloch-capture --tests.  Every string and whole number in it
+ * is encoded with the old encoders, BSB_EXPORT_sprintf and the byte at a time
+ * escape, which are kept below as they were, and with the ones db.c uses now.
+ * The outputs must match byte for byte, then each is timed over loops passes
+ * and the JSON bytes produced per second printed.
+ *
+ * db.c is included so its static helpers are the ones timed.  The functions
+ * it calls that the benchmark never reaches are stubbed at the end.
+ *
+ * Copyright 2012-2015 AOL Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <ctype.h>
+#include <time.h>
+#include "db.c"
+
+MolochConfig_t         config;
+uint64_t               totalPackets;
+uint64_t               totalBytes;
+uint64_t               totalSessions;
+uint32_t               pluginsCbs;
+unsigned char          moloch_char_to_hexstr[256][3];
+
+#define BENCH_OUT_SIZE (1024*1024)
+
+/* The strings and numbers pulled out of the dump, strings are NUL separated */
+static unsigned char  *strs;
+static uint32_t        strsLen;
+static uint32_t        strsNum;
+static int64_t        *nums;
+static uint32_t        numsNum;
+
+static unsigned char   out[BENCH_OUT_SIZE + 0x10000];
+
+/******************************************************************************/
+/* The escape moloch_db_js0n_str replaced */
+static void bench_old_js0n_str(BSB *bsb, unsigned char *in, gboolean utf8)
+{
+    BSB_EXPORT_u08(*bsb, '"');
+    while (*in) {
+        switch(*in) {
+        case '\b':
+            BSB_EXPORT_cstr(*bsb, "\\b");
+            break;
+        case '\n':
+            BSB_EXPORT_cstr(*bsb, "\\n");
+            break;
+        case '\r':
+            BSB_EXPORT_cstr(*bsb, "\\r");
+            break;
+        case '\f':
+            BSB_EXPORT_cstr(*bsb, "\\f");
+            break;
+        case '\t':
+            BSB_EXPORT_cstr(*bsb, "\\t");
+            break;
+        case '"':
+            BSB_EXPORT_cstr(*bsb, "\\\"");
+            break;
+        case '\\':
+            BSB_EXPORT_cstr(*bsb, "\\\\");
+            break;
+        case '/':
+            BSB_EXPORT_cstr(*bsb, "\\/");
+            break;
+        default:
+            if(*in < 32) {
+                BSB_EXPORT_sprintf(*bsb, "\\u%04x", *in);
+            } else if (utf8) {
+                if ((*in & 0xf0) == 0xf0) {
+                    BSB_EXPORT_u08(*bsb, *(in++));
+                    BSB_EXPORT_u08(*bsb, *(in++));
+                    BSB_EXPORT_u08(*bsb, *(in++));
+                    BSB_EXPORT_u08(*bsb, *in);
+                } else if ((*in & 0xf0) == 0xe0) {
+                    BSB_EXPORT_u08(*bsb, *(in++));
+                    BSB_EXPORT_u08(*bsb, *(in++));
+                    BSB_EXPORT_u08(*bsb, *in);
+                } else if ((*in & 0xf0) == 0xd0) {
+                    BSB_EXPORT_u08(*bsb, *(in++));
+                    BSB_EXPORT_u08(*bsb, *in);
+                } else {
+                    BSB_EXPORT_u08(*bsb, *in);
+                }
+            } else {
+                if(*in & 0x80) {
+                    BSB_EXPORT_u08(*bsb, (0xc0 | (*in >> 6)));
+                    BSB_EXPORT_u08(*bsb, (0x80 | (*in & 0x3f)));
+                } else {
+                    BSB_EXPORT_u08(*bsb, *in);
+                }
+            }
+            break;
+        }
+        in++;
+    }
+
+    BSB_EXPORT_u08(*bsb, '"');
+}
+/******************************************************************************/
+static void bench_utf8(unsigned char **o, uint32_t c)
+{
+    if (c < 0x80) {
+        *((*o)++) = c;
+    } else if (c < 0x800) {
+        *((*o)++) = 0xc0 | (c >> 6);
+        *((*o)++) = 0x80 | (c & 0x3f);
+    } else {
+        *((*o)++) = 0xe0 | (c >> 12);
+        *((*o)++) = 0x80 | ((c >> 6) & 0x3f);
+        *((*o)++) = 0x80 | (c & 0x3f);
+    }
+}
+/******************************************************************************/
+/* Pull every string and whole number out of the dump, strings are unescaped */
+static void bench_load(char *filename)
+{
+    gchar  *data;
+    gsize   len;
+    GError *error = 0;
+
+    if (!g_file_get_contents(filename, &data, &len, &error)) {
+        printf("Couldn't read %s: %s\n", filename, error->message);
+        exit(1);
+    }
+
+    strs = malloc(len + 1);
+    nums = malloc((len/2 + 1) * sizeof(int64_t));
+
+    unsigned char *in = (unsigned char *)data;
+    unsigned char *end = in + len;
+    unsigned char *o = strs;
+
+    while (in < end) {
+        if (*in == '"') {
+            unsigned char *start = o;
+            for (in++; in < end && *in != '"'; in++) {
+                if (*in != '\\' || in + 1 >= end) {
+                    *(o++) = *in;
+                    continue;
+                }
+                in++;
+                switch (*in) {
+                case 'b': *(o++) = '\b'; break;
+                case 'f': *(o++) = '\f'; break;
+                case 'n': *(o++) = '\n'; break;
+                case 'r': *(o++) = '\r'; break;
+                case 't': *(o++) = '\t'; break;
+                case 'u':
+                    if (in + 4 < end) {
+                        char hex[5] = {in[1], in[2], in[3], in[4], 0};
+                        bench_utf8(&o, strtoul(hex, NULL, 16));
+                        in += 4;
+                    }
+                    break;
+                default:
+                    *(o++) = *in;
+                }
+            }
+            in++;
+
+            /* A \u0000 would end the string early for both encoders */
+            if (memchr(start, 0, o - start)) {
+                o = start;
+                continue;
+            }
+            *(o++) = 0;
+            strsNum++;
+        } else if (*in == '-' || isdigit(*in)) {
+            char *next;
+            int64_t v = strtoll((char *)in, &next, 10);
+            if ((unsigned char *)next == in) {
+                in++;
+                continue;
+            }
+            in = (unsigned char *)next;
+            if (in < end && (*in == '.' || *in == 'e' || *in == 'E')) {
+                while (in < end && (isalnum(*in) || *in == '.' || *in == '-' || *in == '+'))
+                    in++;
+                continue;
+            }
+            nums[numsNum++] = v;
+        } else {
+            in++;
+        }
+    }
+    strsLen = o - strs;
+    g_free(data);
+}
+/******************************************************************************/
+/* Encode every string, or every number when strings is 0, returns bytes made */
+static uint64_t bench_run(int useNew, int strings, int check, unsigned char *expect, uint64_t *expectLen)
+{
+    BSB       bsb;
+    uint64_t  total = 0;
+    uint32_t  i;
+    uint64_t  pos = 0;
+
+    BSB_INIT(bsb, out, BENCH_OUT_SIZE);
+
+#define BENCH_ROLL()                                            \
+    if (BSB_REMAINING(bsb) < 0x10000 || check) {                \
+        if (check == 1)                                         \
+            memcpy(expect + *expectLen, out, BSB_LENGTH(bsb));  \
+        else if (check == 2 && memcmp(expect + *expectLen, out, BSB_LENGTH(bsb)) != 0) { \
+            printf("Encoders differ on %s %u\n", strings?"string":"number", i); \
+            exit(1);                                            \
+        }                                                       \
+        if (check)                                              \
+            *expectLen += BSB_LENGTH(bsb);                      \
+        total += BSB_LENGTH(bsb);                               \
+        BSB_INIT(bsb, out, BENCH_OUT_SIZE);                     \
+    }
+
+    if (strings) {
+        for (i = 0; i < strsNum; i++) {
+            unsigned char *str = strs + pos;
+            pos += strlen((char *)str) + 1;
+            if (useNew)
+                moloch_db_js0n_str(&bsb, str, TRUE);
+            else
+                bench_old_js0n_str(&bsb, str, TRUE);
+            BENCH_ROLL();
+        }
+    } else {
+        for (i = 0; i < numsNum; i++) {
+            if (useNew)
+                BSB_EXPORT_int(bsb, nums[i]);
+            else
+                BSB_EXPORT_sprintf(bsb, "%" PRId64, nums[i]);
+            BSB_EXPORT_u08(bsb, ',');
+            BENCH_ROLL();
+        }
+    }
+    total += BSB_LENGTH(bsb);
+    return total;
+}
+/******************************************************************************/
+static void bench_time(const char *name, int strings, int loops)
+{
+    uint64_t        bytes[2] = {0, 0};
+    double          secs[2];
+    struct timespec start, stop;
+    int             useNew, l;
+
+    /* Same output first, escaping at most grows a string 6x and a number is at most 21 bytes */
+    uint64_t        expectLen = 0, checkLen = 0;
+    unsigned char  *expect = malloc((strings?(uint64_t)strsLen*6 + strsNum*2:(uint64_t)numsNum*21) + 1024);
+    bench_run(0, strings, 1, expect, &expectLen);
+    bench_run(1, strings, 2, expect, &checkLen);
+    free(expect);
+
+    for (useNew = 0; useNew < 2; useNew++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (l = 0; l < loops; l++)
+            bytes[useNew] += bench_run(useNew, strings, 0, NULL, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        secs[useNew] = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec)/1e9;
+    }
+
+    printf("%-8s old %8.1f MB/s  new %8.1f MB/s  %.2fx  (%" PRIu64 " bytes/loop)\n", name,
+           bytes[0]/secs[0]/1e6, bytes[1]/secs[1]/1e6, secs[0]/secs[1], bytes[0]/loops);
+}
+/******************************************************************************/
+int main(int argc, char **argv)
+{
+    int i;
+
+    if (argc < 2) {
+        printf("Usage: %s <dump> [loops]\n", argv[0]);
+        exit(1);
+    }
+    int loops = (argc > 2)?atoi(argv[2]):5;
+
+    for (i = 0; i < 256; i++) {
+        moloch_char_to_hexstr[i][0] = "0123456789abcdef"[(i >> 4) & 0xf];
+        moloch_char_to_hexstr[i][1] = "0123456789abcdef"[i & 0xf];
+    }
+
+    bench_load(argv[1]);
+    printf("%u strings, %u numbers, %d loops\n", strsNum, numsNum, loops);
+
+    bench_time("strings", 1, loops);
+    bench_time("numbers", 0, loops);
+    return 0;
+}
+/******************************************************************************/
+/* Never called by the benchmark, they only let db.c link */
+void *moloch_size_alloc(int size, int zero) { return zero?calloc(1, size):malloc(size); }
+int   moloch_size_free(void *mem) { free(mem); return 0; }
+int   moloch_field_by_db(char *UNUSED(dbField)) { return -1; }
+void  moloch_field_certsinfo_free(MolochCertsInfo_t *UNUSED(certs)) {}
+void  moloch_field_define_json(unsigned char *UNUSED(expression), int UNUSED(expression_len), unsigned char *UNUSED(data), int UNUSED(data_len)) {}
+gboolean moloch_field_int_add(int UNUSED(pos), MolochSession_t *UNUSED(session), int UNUSED(i)) { return FALSE; }
+void *moloch_http_create_server(char *UNUSED(hostname), int UNUSED(defaultPort), int UNUSED(maxConns), int UNUSED(maxOutstandingRequests), int UNUSED(compress)) { return NULL; }
+void  moloch_http_free_server(void *UNUSED(server)) {}
+unsigned char *moloch_http_get(void *UNUSED(server), char *UNUSED(key), int UNUSED(key_len), size_t *UNUSED(mlen)) { return NULL; }
+gboolean moloch_http_send(void *UNUSED(serverV), char *UNUSED(method), char *UNUSED(key), uint32_t UNUSED(key_len), char *UNUSED(data), uint32_t UNUSED(data_len), char **UNUSED(headers), gboolean UNUSED(dropable), MolochHttpResponse_cb UNUSED(func), gpointer UNUSED(uw)) { return FALSE; }
+unsigned char *moloch_http_send_sync(void *UNUSED(serverV), char *UNUSED(method), char *UNUSED(key), uint32_t UNUSED(key_len), char *UNUSED(data), uint32_t UNUSED(data_len), char **UNUSED(headers), size_t *UNUSED(return_len)) { return NULL; }
+gboolean moloch_http_set(void *UNUSED(server), char *UNUSED(key), int UNUSED(key_len), char *UNUSED(data), uint32_t UNUSED(data_len), MolochHttpResponse_cb UNUSED(func), gpointer UNUSED(uw)) { return FALSE; }
+uint32_t moloch_int_hash(const void *key) { return (uint32_t)(long)key; }
+int   moloch_int_cmp(const void *UNUSED(keyv), const void *UNUSED(elementv)) { return 0; }
+uint32_t moloch_string_hash(const void *UNUSED(key)) { return 0; }
+int   moloch_string_ncmp(const void *UNUSED(keyv), const void *UNUSED(elementv)) { return 0; }
+unsigned char *moloch_js0n_get(unsigned char *UNUSED(data), uint32_t UNUSED(len), char *UNUSED(key), uint32_t *UNUSED(olen)) { return NULL; }
+uint64_t moloch_nids_dont_save_hits(int UNUSED(i)) { return 0; }
+uint32_t moloch_nids_dropped_packets() { return 0; }
+void  moloch_nids_interface_stats(int UNUSED(num), MolochInterfaceStats_t *UNUSED(stats)) {}
+int   moloch_nids_interfaces() { return 0; }
+uint32_t moloch_nids_monitoring_sessions() { return 0; }
+void  moloch_packet_pos_free(MolochPacketPos_t *UNUSED(pp)) {}
+void  moloch_packet_pos_json(MolochPacketPos_t *UNUSED(pp), BSB *UNUSED(jbsb)) {}
+void  moloch_plugins_cb_save(MolochSession_t *UNUSED(session), int UNUSED(final)) {}
+void  moloch_tpacketv3_shunt_stats(MolochTpacketv3Stats_t *stats) { memset(stats, 0, sizeof(*stats)); }
+gint  moloch_watch_fd(gint UNUSED(fd), GIOCondition UNUSED(cond), MolochWatchFd_func UNUSED(func), gpointer UNUSED(data)) { return 0; }
+void  writer_disk_pool_stats(MolochWriterPoolStats_t *stats) { memset(stats, 0, sizeof(*stats)); }
+int   writer_tee_secondaries() { return 0; }
+void  writer_tee_stats(int UNUSED(num), MolochTeeWriterStats_t *stats) { memset(stats, 0, sizeof(*stats)); }
+MolochWriterQueueLength moloch_writer_queue_length;
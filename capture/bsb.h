@@ -10,6 +10,9 @@
 #ifndef _BSB_HEADER
 #define _BSB_HEADER
 
+#include <stdint.h>
+#include <string.h>
+
 #define BSB_INIT(b, buffer, size)                 \
 do {                                              \
     (b).buf = (unsigned char*)buffer;             \
@@ -77,6 +80,59 @@ do {                                              \
         (b).end = 0;                              \
 } while (0)
 
+/* Decimal text of an unsigned number, two digits at a time into the end of
+ * tmp, returns where the text starts.
+ */
+static inline unsigned char *bsb_uint_to_dec(unsigned char tmp[20], uint64_t v)
+{
+    static const char digits[201] =
+        "00010203040506070809101112131415161718192021222324"
+        "25262728293031323334353637383940414243444546474849"
+        "50515253545556575859606162636465666768697071727374"
+        "75767778798081828384858687888990919293949596979899";
+    unsigned char *p = tmp + 20;
+
+    while (v >= 100) {
+        const uint32_t i = (v % 100) * 2;
+        v /= 100;
+        p -= 2;
+        memcpy(p, digits + i, 2);
+    }
+
+    if (v >= 10) {
+        p -= 2;
+        memcpy(p, digits + v * 2, 2);
+    } else {
+        *(--p) = '0' + v;
+    }
+    return p;
+}
+
+/* Unsigned number as decimal text, replaces BSB_EXPORT_sprintf "%u" */
+#define BSB_EXPORT_uint(b, x)                     \
+do {                                              \
+    unsigned char  _tmp[20];                      \
+    unsigned char *_p = bsb_uint_to_dec(_tmp, x); \
+    const int      _l = _tmp + 20 - _p;           \
+    if ((b).ptr + _l <= (b).end) {                \
+        memcpy((b).ptr, _p, _l);                  \
+        (b).ptr += _l;                            \
+    } else                                        \
+        (b).end = 0;                              \
+} while (0)
+
+/* Signed number as decimal text, replaces BSB_EXPORT_sprintf "%d" */
+#define BSB_EXPORT_int(b, x)                      \
+do {                                              \
+    const int64_t _v = x;                         \
+    if (_v < 0) {                                 \
+        BSB_EXPORT_u08(b, '-');                   \
+        BSB_EXPORT_uint(b, -(uint64_t)_v);        \
+    } else {                                      \
+        BSB_EXPORT_uint(b, (uint64_t)_v);         \
+    }                                             \
+} while (0)
+
 #define BSB_EXPORT_skip(b, size)                  \
 do {                                              \
     if ((b).ptr + size <= (b).end) {              \
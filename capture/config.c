@@ -323,9 +323,20 @@ void moloch_config_load()
     }
 
     config.elasticsearch    = moloch_config_str(keyfile, "elasticsearch", "localhost:9200");
-    config.interface        = moloch_config_str(keyfile, "interface", NULL);
+    config.interface        = moloch_config_str_list(keyfile, "interface", NULL);
+    config.pcapReadMethod   = moloch_config_str(keyfile, "pcapReadMethod", "libpcap");
     config.pcapDir          = moloch_config_str_list(keyfile, "pcapDir", NULL);
     config.bpf              = moloch_config_str(keyfile, "bpf", NULL);
+
+    /* bpf-<interface> replaces bpf for just that interface */
+    if (config.interface) {
+        config.interfaceBpf = g_new0(char *, g_strv_length(config.interface) + 1);
+        for (i = 0; config.interface[i]; i++) {
+            char key[100];
+            snprintf(key, sizeof(key), "bpf-%s", config.interface[i]);
+            config.interfaceBpf[i] = moloch_config_str(keyfile, key, config.bpf);
+        }
+    }
     config.yara             = moloch_config_str(keyfile, "yara", NULL);
     config.emailYara        = moloch_config_str(keyfile, "emailYara", NULL);
     config.geoipFile        = moloch_config_str(keyfile, "geoipFile", NULL);
@@ -351,17 +362,72 @@ void moloch_config_load()
     config.tcpTimeout            = moloch_config_int(keyfile, "tcpTimeout", 60*8, 10, 0xffff);
     config.tcpSaveTimeout        = moloch_config_int(keyfile, "tcpSaveTimeout", 60*8, 10, 60*120);
     config.maxStreams            = moloch_config_int(keyfile, "maxStreams", 1500000, 1, 16777215);
+    config.timeoutsPerPacket     = moloch_config_int(keyfile, "timeoutsPerPacket", 16, 1, 10000);
+    config.timeoutsPerTick       = moloch_config_int(keyfile, "timeoutsPerTick", 10000, 1, 1000000);
+    config.maxTcpOutOfOrderPackets = moloch_config_int(keyfile, "maxTcpOutOfOrderPackets", 256, 64, 10000);
+    config.maxTcpOutOfOrderBytes = moloch_config_int(keyfile, "maxTcpOutOfOrderBytes", 1024*1024, 64*1024, 64*1024*1024);
     config.maxPackets            = moloch_config_int(keyfile, "maxPackets", 10000, 1, 1000000);
     config.minFreeSpaceG         = moloch_config_int(keyfile, "freeSpaceG", 100, 1, 100000);
     config.dbBulkSize            = moloch_config_int(keyfile, "dbBulkSize", 200000, MOLOCH_HTTP_BUFFER_SIZE*2, 1000000);
     config.dbFlushTimeout        = moloch_config_int(keyfile, "dbFlushTimeout", 5, 1, 60*30);
+    config.dbIndexerQueueSize    = moloch_config_int(keyfile, "dbIndexerQueueSize", 65536, 1024, 4194304);
     config.maxESConns            = moloch_config_int(keyfile, "maxESConns", 20, 5, 1000);
     config.maxESRequests         = moloch_config_int(keyfile, "maxESRequests", 500, 10, 5000);
     config.logEveryXPackets      = moloch_config_int(keyfile, "logEveryXPackets", 50000, 1000, 1000000);
     config.packetsPerPoll        = moloch_config_int(keyfile, "packetsPerPoll", 50000, 1000, 1000000);
+    config.offlineParallelFiles  = moloch_config_int(keyfile, "offlineParallelFiles", 1, 1, MOLOCH_MAX_SESSION_SETS);
+    config.packetThreads         = moloch_config_int(keyfile, "packetThreads", 1, 1, MOLOCH_MAX_PACKET_THREADS);
+    config.offlineMaxDiskQueue   = moloch_config_int(keyfile, "offlineMaxDiskQueue", 10, 1, 10000);
+    config.offlineMaxESQueue     = moloch_config_int(keyfile, "offlineMaxESQueue", 100, 10, 100000);
+    config.offlineMmap           = moloch_config_boolean(keyfile, "offlineMmap", TRUE);
+    config.pcapDirStripe         = moloch_config_boolean(keyfile, "pcapDirStripe", FALSE);
     config.pcapBufferSize        = moloch_config_int(keyfile, "pcapBufferSize", 300000000, 100000, 0xffffffff);
+    config.tpacketv3BlockSize    = moloch_config_int(keyfile, "tpacketv3BlockSize", 0x100000, getpagesize(), 0x10000000);
+    config.tpacketv3NumBlocks    = moloch_config_int(keyfile, "tpacketv3NumBlocks", 64, MOLOCH_READER_BATCHES + 1, 0xffff);
+    config.tpacketv3FanoutGroup  = moloch_config_int(keyfile, "tpacketv3FanoutGroup", 0, 0, 0xffff);
+    config.tpacketv3MaxShunts    = moloch_config_int(keyfile, "tpacketv3MaxShunts", 0, 0, 150);
+
+    /* Plugins expect to be called from one thread */
+    if (config.packetThreads > 1 && config.plugins) {
+        printf("packetThreads %u can't be used with plugins\n", config.packetThreads);
+        exit(1);
+    }
+
+    /* A session's set number is 8 bits */
+    if (config.pcapReadOffline && config.offlineParallelFiles * config.packetThreads > 255) {
+        printf("offlineParallelFiles %u times packetThreads %u must be at most 255\n", config.offlineParallelFiles, config.packetThreads);
+        exit(1);
+    }
+
+    if (config.tpacketv3BlockSize % getpagesize() != 0) {
+        printf("tpacketv3BlockSize %u must be a multiple of %d\n", config.tpacketv3BlockSize, getpagesize());
+        exit(1);
+    }
+
+    if (strcmp(config.pcapReadMethod, "libpcap") != 0 && strcmp(config.pcapReadMethod, "tpacketv3") != 0) {
+        printf("Unknown pcapReadMethod '%s'\n", config.pcapReadMethod);
+        exit(1);
+    }
     config.pcapWriteSize         = moloch_config_int(keyfile, "pcapWriteSize", 0x40000, 0x40000, 0x800000);
     config.maxFreeOutputBuffers  = moloch_config_int(keyfile, "maxFreeOutputBuffers", 50, 0, 0xffff);
+    config.pcapWriteUringDepth   = moloch_config_int(keyfile, "pcapWriteUringDepth", 8, 1, 64);
+    config.pcapWriteBufferPool   = moloch_config_int(keyfile, "pcapWriteBufferPool", 0, 0, 0xffff);
+    config.pcapWriteBufferHugePages = moloch_config_boolean(keyfile, "pcapWriteBufferHugePages", FALSE);
+    config.pcapWriteBufferLock   = moloch_config_boolean(keyfile, "pcapWriteBufferLock", FALSE);
+
+    config.pcapCompression       = moloch_config_str(keyfile, "pcapCompression", "none");
+    config.pcapCompressionBlockSize = moloch_config_int(keyfile, "pcapCompressionBlockSize", 0x10000, 0x4000, 0xf0000);
+    config.pcapCompressionThreads = moloch_config_int(keyfile, "pcapCompressionThreads", 2, 1, 32);
+    config.pcapCompressionLevel  = moloch_config_int(keyfile, "pcapCompressionLevel", 1, 1, 9);
+    config.pcapTimeIndexPackets  = moloch_config_int(keyfile, "pcapTimeIndexPackets", 1000, 0, 0xffffff);
+    config.pcapTimeIndexMs       = moloch_config_int(keyfile, "pcapTimeIndexMs", 1000, 1, 3600000);
+    config.pcapTeeWriters        = moloch_config_str_list(keyfile, "pcapTeeWriters", NULL);
+    config.pcapTeeMaxQueue       = moloch_config_int(keyfile, "pcapTeeMaxQueue", 200, 1, 100000);
+
+    if (strcmp(config.pcapCompression, "none") != 0 && strcmp(config.pcapCompression, "deflate") != 0) {
+        printf("Unknown pcapCompression '%s'\n", config.pcapCompression);
+        exit(1);
+    }
 
 
     config.logUnknownProtocols   = moloch_config_boolean(keyfile, "logUnknownProtocols", config.debug);
@@ -373,6 +439,8 @@ void moloch_config_load()
     config.parseCookieValue      = moloch_config_boolean(keyfile, "parseCookieValue", FALSE);
     config.compressES            = moloch_config_boolean(keyfile, "compressES", FALSE);
     config.antiSynDrop           = moloch_config_boolean(keyfile, "antiSynDrop", TRUE);
+    config.sessionHugePages      = moloch_config_boolean(keyfile, "sessionHugePages", FALSE);
+    config.packetPosRanges       = moloch_config_boolean(keyfile, "packetPosRanges", FALSE);
 
 }
 /******************************************************************************/
@@ -563,13 +631,22 @@ void moloch_config_init()
         LOG("nodeClass: %s", config.nodeClass);
         LOG("elasticsearch: %s", config.elasticsearch);
         LOG("prefix: %s", config.prefix);
-        LOG("interface: %s", config.interface);
+        if (config.interface) {
+            str = g_strjoinv(";", config.interface);
+            LOG("interface: %s", str);
+            g_free(str);
+        }
+        LOG("pcapReadMethod: %s", config.pcapReadMethod);
         if (config.pcapDir) {
             str = g_strjoinv(";", config.pcapDir);
             LOG("pcapDir: %s", str);
             g_free(str);
         }
         LOG("bpf: %s", config.bpf);
+        for (i = 0; config.interface && config.interface[i]; i++) {
+            if (g_strcmp0(config.interfaceBpf[i], config.bpf) != 0)
+                LOG("bpf-%s: %s", config.interface[i], config.interfaceBpf[i]);
+        }
         LOG("yara: %s", config.yara);
         LOG("geoipFile: %s", config.geoipFile);
         LOG("geoipASNFile: %s", config.geoipASNFile);
@@ -609,17 +686,48 @@ void moloch_config_init()
         LOG("tcpTimeout: %u", config.tcpTimeout);
         LOG("tcpSaveTimeout: %u", config.tcpSaveTimeout);
         LOG("maxStreams: %u", config.maxStreams);
+        LOG("timeoutsPerPacket: %u", config.timeoutsPerPacket);
+        LOG("timeoutsPerTick: %u", config.timeoutsPerTick);
+        LOG("maxTcpOutOfOrderPackets: %u", config.maxTcpOutOfOrderPackets);
+        LOG("maxTcpOutOfOrderBytes: %u", config.maxTcpOutOfOrderBytes);
         LOG("maxPackets: %u", config.maxPackets);
         LOG("minFreeSpaceG: %u", config.minFreeSpaceG);
         LOG("dbBulkSize: %u", config.dbBulkSize);
         LOG("dbFlushTimeout: %u", config.dbFlushTimeout);
+        LOG("dbIndexerQueueSize: %u", config.dbIndexerQueueSize);
         LOG("maxESConns: %u", config.maxESConns);
         LOG("maxESRequests: %u", config.maxESRequests);
         LOG("logEveryXPackets: %u", config.logEveryXPackets);
         LOG("packetsPerPoll: %u", config.packetsPerPoll);
+        LOG("offlineParallelFiles: %u", config.offlineParallelFiles);
+        LOG("packetThreads: %u", config.packetThreads);
+        LOG("offlineMaxDiskQueue: %u", config.offlineMaxDiskQueue);
+        LOG("offlineMaxESQueue: %u", config.offlineMaxESQueue);
+        LOG("offlineMmap: %s", (config.offlineMmap?"true":"false"));
+        LOG("pcapDirStripe: %s", (config.pcapDirStripe?"true":"false"));
         LOG("pcapBufferSize: %u", config.pcapBufferSize);
+        LOG("tpacketv3BlockSize: %u", config.tpacketv3BlockSize);
+        LOG("tpacketv3NumBlocks: %u", config.tpacketv3NumBlocks);
+        LOG("tpacketv3FanoutGroup: %u", config.tpacketv3FanoutGroup);
+        LOG("tpacketv3MaxShunts: %u", config.tpacketv3MaxShunts);
         LOG("pcapWriteSize: %u", config.pcapWriteSize);
         LOG("maxFreeOutputBuffers: %u", config.maxFreeOutputBuffers);
+        LOG("pcapWriteUringDepth: %u", config.pcapWriteUringDepth);
+        LOG("pcapWriteBufferPool: %u", config.pcapWriteBufferPool);
+        LOG("pcapWriteBufferHugePages: %s", (config.pcapWriteBufferHugePages?"true":"false"));
+        LOG("pcapWriteBufferLock: %s", (config.pcapWriteBufferLock?"true":"false"));
+        LOG("pcapCompression: %s", config.pcapCompression);
+        LOG("pcapCompressionBlockSize: %u", config.pcapCompressionBlockSize);
+        LOG("pcapCompressionThreads: %u", config.pcapCompressionThreads);
+        LOG("pcapCompressionLevel: %u", config.pcapCompressionLevel);
+        LOG("pcapTimeIndexPackets: %u", config.pcapTimeIndexPackets);
+        LOG("pcapTimeIndexMs: %u", config.pcapTimeIndexMs);
+        if (config.pcapTeeWriters) {
+            str = g_strjoinv(";", config.pcapTeeWriters);
+            LOG("pcapTeeWriters: %s", str);
+            g_free(str);
+        }
+        LOG("pcapTeeMaxQueue: %u", config.pcapTeeMaxQueue);
 
         LOG("logUnknownProtocols: %s", (config.logUnknownProtocols?"true":"false"));
         LOG("logESRequests: %s", (config.logESRequests?"true":"false"));
@@ -629,6 +737,8 @@ void moloch_config_init()
         LOG("parseQSValue: %s", (config.parseQSValue?"true":"false"));
         LOG("parseCookieValue: %s", (config.parseCookieValue?"true":"false"));
         LOG("compressES: %s", (config.compressES?"true":"false"));
+        LOG("sessionHugePages: %s", (config.sessionHugePages?"true":"false"));
+        LOG("packetPosRanges: %s", (config.packetPosRanges?"true":"false"));
 
         LOG("rotateIndex = %s", rotates[config.rotate]);
         LOG("offlineFilenameRegex: %s", g_regex_get_pattern(config.offlineRegex));
@@ -648,6 +758,11 @@ void moloch_config_init()
         exit (1);
     }
 
+    if (config.interface && g_strv_length(config.interface) > MOLOCH_MAX_INTERFACES) {
+        printf("Too many interfaces, max is %d\n", MOLOCH_MAX_INTERFACES);
+        exit(1);
+    }
+
     if (!config.pcapDir) {
         printf("Must set a pcapDir to save files to\n");
         exit(1);
@@ -660,8 +775,20 @@ void moloch_config_exit()
 
     if (config.nodeClass)
         g_free(config.nodeClass);
+    /* Entries can be NULL when there is no bpf, so bound by interface */
+    if (config.interfaceBpf) {
+        int i;
+        for (i = 0; config.interface && config.interface[i]; i++) {
+            g_free(config.interfaceBpf[i]);
+        }
+        g_free(config.interfaceBpf);
+    }
     if (config.interface)
-        g_free(config.interface);
+        g_strfreev(config.interface);
+    if (config.pcapReadMethod)
+        g_free(config.pcapReadMethod);
+    if (config.pcapCompression)
+        g_free(config.pcapCompression);
     if (config.elasticsearch)
         g_free(config.elasticsearch);
     if (config.bpf)
@@ -672,6 +799,8 @@ void moloch_config_exit()
         g_free(config.emailYara);
     if (config.pcapDir)
         g_strfreev(config.pcapDir);
+    if (config.pcapTeeWriters)
+        g_strfreev(config.pcapTeeWriters);
     if (config.pluginsDir)
         g_strfreev(config.pluginsDir);
     if (config.parsersDir)
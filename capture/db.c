@@ -22,15 +22,22 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/resource.h>
 #include <sys/statvfs.h>
+#include <sys/eventfd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "moloch.h"
 #include "bsb.h"
 #include "glib.h"
 #include "patricia.h"
 #include "GeoIP.h"
+#include "zlib.h"
 
-#define MOLOCH_MIN_DB_VERSION 25
+#define MOLOCH_MIN_DB_VERSION 26
 
 extern uint64_t         totalPackets;
 extern uint64_t         totalBytes;
@@ -69,6 +76,9 @@ typedef struct moloch_tag {
 
 HASH_VAR(tag_, tags, MolochTag_t, 9337);
 
+/* Tags are only added on the main thread, packet threads look them up */
+static pthread_mutex_t  tagsLock = PTHREAD_MUTEX_INITIALIZER;
+
 /******************************************************************************/
 void moloch_db_add_local_ip(char *str, MolochIpInfo_t *ii)
 {
@@ -91,7 +101,8 @@ void moloch_db_free_local_ip(MolochIpInfo_t *ii)
 }
 /******************************************************************************/
 #define int_ntoa(x)     inet_ntoa(*((struct in_addr *)(int*)&x))
-MolochIpInfo_t *moloch_db_get_local_ip(MolochSession_t *session, uint32_t ip)
+/* Only reads the tree, safe from the moloch-db thread */
+static MolochIpInfo_t *moloch_db_local_ip(uint32_t ip)
 {
     prefix_t prefix;
     patricia_node_t *node;
@@ -103,10 +114,19 @@ MolochIpInfo_t *moloch_db_get_local_ip(MolochSession_t *session, uint32_t ip)
     if ((node = patricia_search_best2 (ipTree, &prefix, 1)) == NULL)
         return 0;
 
+    return node->data;
+}
+/******************************************************************************/
+MolochIpInfo_t *moloch_db_get_local_ip(MolochSession_t *session, uint32_t ip)
+{
+    MolochIpInfo_t *ii = moloch_db_local_ip(ip);
+
+    if (!ii)
+        return 0;
+
     if (tagsField == -1)
         tagsField = moloch_field_by_db("ta");
 
-    MolochIpInfo_t *ii = node->data;
     int t;
 
     for (t = 0; t < ii->numtags; t++) {
@@ -136,12 +156,70 @@ int moloch_db_tag_cmp(const void *keyv, const void *elementv)
     return strcmp(key, element->tagName) == 0;
 }
 
+/******************************************************************************/
+/* Number of bytes at the start of in that go out as is, stopping at the NUL
+ * or anything that needs escaping.  With utf8 bytes over 0x7f are copied,
+ * otherwise they have to be converted.
+ */
+#ifdef __SSE2__
+static inline uint32_t moloch_db_js0n_special(__m128i x, gboolean utf8)
+{
+    __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('"')),
+                                                _mm_cmpeq_epi8(x, _mm_set1_epi8('\\'))),
+                                   _mm_cmpeq_epi8(x, _mm_set1_epi8('/')));
+
+    if (utf8) // x <= 0x1f
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(_mm_max_epu8(x, _mm_set1_epi8(0x1f)), _mm_set1_epi8(0x1f)));
+    else      // signed, so catches x >= 0x80 too
+        special = _mm_or_si128(special, _mm_cmplt_epi8(x, _mm_set1_epi8(0x20)));
+
+    return _mm_movemask_epi8(special);
+}
+
+/* Loads are 16 byte aligned so they never cross into a page past the NUL */
+__attribute__((no_sanitize_address))
+static int moloch_db_js0n_safe(const unsigned char *in, gboolean utf8)
+{
+    const int            off = (uintptr_t)in & 15;
+    const unsigned char *p = in - off;
+    uint32_t             mask;
+
+    mask = moloch_db_js0n_special(_mm_load_si128((const __m128i *)p), utf8) >> off;
+    if (mask)
+        return __builtin_ctz(mask);
+
+    while (1) {
+        p += 16;
+        mask = moloch_db_js0n_special(_mm_load_si128((const __m128i *)p), utf8);
+        if (mask)
+            return p - in + __builtin_ctz(mask);
+    }
+}
+#else
+static int moloch_db_js0n_safe(const unsigned char *in, gboolean utf8)
+{
+    const unsigned char *p = in;
+
+    while (*p >= 0x20 && *p != '"' && *p != '\\' && *p != '/' && (utf8 || *p < 0x80))
+        p++;
+    return p - in;
+}
+#endif
 /******************************************************************************/
 void moloch_db_js0n_str(BSB *bsb, unsigned char *in, gboolean utf8)
 {
     BSB_EXPORT_u08(*bsb, '"');
-    while (*in) {
+    while (1) {
+        const int safe = moloch_db_js0n_safe(in, utf8);
+        if (safe) {
+            BSB_EXPORT_ptr(*bsb, in, safe);
+            in += safe;
+        }
+
         switch(*in) {
+        case 0:
+            BSB_EXPORT_u08(*bsb, '"');
+            return;
         case '\b':
             BSB_EXPORT_cstr(*bsb, "\\b");
             break;
@@ -168,126 +246,360 @@ void moloch_db_js0n_str(BSB *bsb, unsigned char *in, gboolean utf8)
             break;
         default:
             if(*in < 32) {
-                BSB_EXPORT_sprintf(*bsb, "\\u%04x", *in);
-            } else if (utf8) {
-                if ((*in & 0xf0) == 0xf0) {
-                    BSB_EXPORT_u08(*bsb, *(in++));
-                    BSB_EXPORT_u08(*bsb, *(in++));
-                    BSB_EXPORT_u08(*bsb, *(in++));
-                    BSB_EXPORT_u08(*bsb, *in);
-                } else if ((*in & 0xf0) == 0xe0) {
-                    BSB_EXPORT_u08(*bsb, *(in++));
-                    BSB_EXPORT_u08(*bsb, *(in++));
-                    BSB_EXPORT_u08(*bsb, *in);
-                } else if ((*in & 0xf0) == 0xd0) {
-                    BSB_EXPORT_u08(*bsb, *(in++));
-                    BSB_EXPORT_u08(*bsb, *in);
-                } else {
-                    BSB_EXPORT_u08(*bsb, *in);
-                }
+                BSB_EXPORT_cstr(*bsb, "\\u00");
+                BSB_EXPORT_ptr(*bsb, moloch_char_to_hexstr[*in], 2);
             } else {
-                if(*in & 0x80) {
-                    BSB_EXPORT_u08(*bsb, (0xc0 | (*in >> 6)));
-                    BSB_EXPORT_u08(*bsb, (0x80 | (*in & 0x3f)));
-                } else {
-                    BSB_EXPORT_u08(*bsb, *in);
-                }
+                // Only bytes over 0x7f without utf8 get here
+                BSB_EXPORT_u08(*bsb, (0xc0 | (*in >> 6)));
+                BSB_EXPORT_u08(*bsb, (0x80 | (*in & 0x3f)));
             }
             break;
         }
         in++;
     }
-
-    BSB_EXPORT_u08(*bsb, '"');
 }
 
 /******************************************************************************/
-static char *sJson = 0;
-static BSB jbsb;
+/* Saving a session is split in two.  On the packet path the session is only
+ * detached, its fields and packet positions move into a record and the id is
+ * picked.  The moloch-db thread turns records into the bulk JSON, deflates
+ * full buffers when compressES is set and hands them back to the main thread
+ * to send.  The send stays there since the http layer's curl multi handle,
+ * its connections to every esHost and its queue accounting are all driven by
+ * the main loop.  Handing over a finished buffer is one eventfd write and
+ * moloch_http_send only queues it, so the main thread's share is small.
+ *
+ * Records go to the thread over a ring with a single consumer, producers only
+ * take recordLock, and only contend on it with packetThreads.  The packet path
+ * makes no system call unless the ring is full or the thread is asleep waiting
+ * for records.  At most maxESRequests finished buffers wait for the main
+ * thread, past that the http layer would drop them anyway, so the thread
+ * stops and the ring fills up instead.  While the ring is full the main
+ * thread sends the finished buffers itself, packet threads wait.
+ * With dryRun there is no thread and records are encoded right away.
+ */
+typedef struct {
+    MolochField_t        **fields;
+    MolochPacketPos_t      packetPos;
+    struct timeval         firstPacket;
+    struct timeval         lastPacket;
+    uint64_t               bytes[2];
+    uint64_t               databytes[2];
+    uint32_t               packets[2];
+    uint32_t               addr1;
+    uint32_t               addr2;
+    uint32_t               jsonSize;
+    uint16_t               port1;
+    uint16_t               port2;
+    uint16_t               segments;
+    uint8_t                protocol;
+    uint8_t                maxFields;
+    uint8_t                firstBytesLen[2];
+    char                   firstBytes[2][8];
+    char                  *rootId;
+    char                   prefix[32];
+    char                   id[64];
+} MolochDbRecord_t;
+
+typedef struct moloch_db_bulk {
+    struct moloch_db_bulk *b_next, *b_prev;
+    char                  *json;
+    uint32_t               len;
+    char                   deflated;
+} MolochDbBulk_t;
+
+typedef struct {
+    struct moloch_db_bulk *b_next, *b_prev;
+    int                    b_count;
+} MolochDbBulkHead_t;
+
+/* Owned by the moloch-db thread, or the main thread with dryRun */
+static char                *sJson = 0;
+static BSB                  jbsb;
+static z_stream             z_strm;
+
+static GThread             *indexerThread;
+static MolochDbRecord_t   **recordRing;
+static uint32_t             recordMask;
+static uint32_t             recordHead;
+static uint32_t             recordTail;
+static uint64_t             recordRingFull;
+static int                  indexerFlush;
+static int                  indexerQuit;
+static int                  indexerSleeping;   /* The thread is waiting for records */
+static int                  indexerWaiting;    /* The packet path is waiting for room in the ring */
+static pthread_mutex_t      recordLock = PTHREAD_MUTEX_INITIALIZER;        /* Between packet threads adding records */
+
+static MolochDbBulkHead_t   bulkQ;
+static int                  bulkEventFd;
+
+/* Protects bulkQ and is the lock for all three conditions */
+static pthread_mutex_t      indexerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t       indexerCond = PTHREAD_COND_INITIALIZER;      /* Records, a flush or quit for the thread */
+static pthread_cond_t       recordRoomCond = PTHREAD_COND_INITIALIZER;   /* Room in the ring or buffers in bulkQ */
+static pthread_cond_t       bulkRoomCond = PTHREAD_COND_INITIALIZER;     /* Room in bulkQ */
+
+static char                *deflateHeaders[] = {"Content-Encoding: deflate", NULL};
 
-void moloch_db_save_session(MolochSession_t *session, int final)
+/******************************************************************************/
+/* Copy a field that stays with the session for the next linked save */
+static MolochField_t *moloch_db_field_copy(int pos, MolochField_t *field)
 {
-    uint32_t               i;
-    char                   id[100];
-    char                   key[100];
-    int                    key_len;
-    uuid_t                 uuid;
-    MolochString_t        *hstring;
-    MolochInt_t           *hint;
-    MolochStringHashStd_t *shash;
-    MolochIntHashStd_t    *ihash;
-    unsigned char         *startPtr;
-    unsigned char         *dataPtr;
-    uint32_t               jsonSize;
-    int                    pos;
+    MolochField_t *copy = MOLOCH_TYPE_ALLOC(MolochField_t);
+    uint32_t       i;
 
-    /* Let the plugins finish */
-    if (pluginsCbs & MOLOCH_PLUGIN_SAVE)
-        moloch_plugins_cb_save(session, final);
+    copy->jsonSize = field->jsonSize;
 
-    /* jsonSize is an estimate of how much space it will take to encode the session */
-    jsonSize = 1100 + session->filePosArray->len*12 + 10*session->fileNumArray->len + 10*session->fileLenArray->len;
-    for (pos = 0; pos < session->maxFields; pos++) {
-        if (session->fields[pos]) {
-            jsonSize += session->fields[pos]->jsonSize;
+    switch (config.fields[pos]->type) {
+    case MOLOCH_FIELD_TYPE_STR:
+        copy->str = g_strdup(field->str);
+        break;
+    case MOLOCH_FIELD_TYPE_STR_ARRAY:
+        copy->sarray = g_ptr_array_new_with_free_func(g_free);
+        for (i = 0; i < field->sarray->len; i++) {
+            g_ptr_array_add(copy->sarray, g_strdup(g_ptr_array_index(field->sarray, i)));
         }
+        break;
+    case MOLOCH_FIELD_TYPE_STR_HASH: {
+        MolochString_t *hstring, *cstring;
+
+        copy->shash = MOLOCH_TYPE_ALLOC(MolochStringHashStd_t);
+        HASH_INIT(s_, *copy->shash, moloch_string_hash, moloch_string_ncmp);
+        HASH_FORALL(s_, *field->shash, hstring,
+            cstring = MOLOCH_TYPE_ALLOC(MolochString_t);
+            cstring->str  = g_strndup(hstring->str, hstring->len);
+            cstring->len  = hstring->len;
+            cstring->utf8 = hstring->utf8;
+            HASH_ADD_HASH(s_, *copy->shash, hstring->s_hash, cstring->str, cstring);
+        );
+        break;
     }
+    case MOLOCH_FIELD_TYPE_INT_HASH:
+    case MOLOCH_FIELD_TYPE_IP_HASH: {
+        MolochInt_t *hint, *cint;
 
-    /* No Packets */
-    if (!config.dryRun && !session->filePosArray->len)
-        return;
-
-    totalSessions++;
-    session->segments++;
+        copy->ihash = MOLOCH_TYPE_ALLOC(MolochIntHashStd_t);
+        HASH_INIT(i_, *copy->ihash, moloch_int_hash, moloch_int_cmp);
+        HASH_FORALL(i_, *field->ihash, hint,
+            cint = MOLOCH_TYPE_ALLOC(MolochInt_t);
+            HASH_ADD_HASH(i_, *copy->ihash, hint->i_hash, (void *)(long)hint->i_hash, cint);
+        );
+        break;
+    }
+    default:
+        copy->i = field->i;
+        break;
+    }
+    return copy;
+}
+/******************************************************************************/
+/* Add the tags of any local ip networks the session's ips are in while the
+ * session can still be changed, the thread only looks up the ip info.
+ */
+static void moloch_db_local_ip_tags(MolochSession_t *session)
+{
+    MolochInt_t *hint;
+    int          pos;
 
-    static char     prefix[100];
-    static time_t   prefix_time = 0;
+    moloch_db_get_local_ip(session, session->addr1);
+    moloch_db_get_local_ip(session, session->addr2);
 
-    if (prefix_time != session->lastPacket.tv_sec) {
-        prefix_time = session->lastPacket.tv_sec;
-        struct tm *tmp = gmtime(&prefix_time);
+    for (pos = 0; pos < session->maxFields; pos++) {
+        if (!session->fields[pos] || config.fields[pos]->flags & MOLOCH_FIELD_FLAG_DISABLED)
+            continue;
 
-        switch(config.rotate) {
-        case MOLOCH_ROTATE_HOURLY:
-            snprintf(prefix, sizeof(prefix), "%02d%02d%02dh%02d", tmp->tm_year%100, tmp->tm_mon+1, tmp->tm_mday, tmp->tm_hour);
-            break;
-        case MOLOCH_ROTATE_DAILY:
-            snprintf(prefix, sizeof(prefix), "%02d%02d%02d", tmp->tm_year%100, tmp->tm_mon+1, tmp->tm_mday);
+        switch (config.fields[pos]->type) {
+        case MOLOCH_FIELD_TYPE_IP:
+            moloch_db_get_local_ip(session, session->fields[pos]->i);
             break;
-        case MOLOCH_ROTATE_WEEKLY:
-            snprintf(prefix, sizeof(prefix), "%02dw%02d", tmp->tm_year%100, tmp->tm_yday/7);
-            break;
-        case MOLOCH_ROTATE_MONTHLY:
-            snprintf(prefix, sizeof(prefix), "%02dm%02d", tmp->tm_year%100, tmp->tm_mon+1);
+        case MOLOCH_FIELD_TYPE_IP_HASH:
+            HASH_FORALL(i_, *session->fields[pos]->ihash, hint,
+                moloch_db_get_local_ip(session, hint->i_hash);
+            );
             break;
         }
     }
-    uint32_t id_len = snprintf(id, sizeof(id), "%s-", prefix);
+}
+/******************************************************************************/
+static MolochDbRecord_t *moloch_db_record_detach(MolochSession_t *session, int final, uint32_t jsonSize)
+{
+    MolochDbRecord_t *rec = MOLOCH_TYPE_ALLOC(MolochDbRecord_t);
+    int               pos;
+
+    rec->firstPacket      = session->firstPacket;
+    rec->lastPacket       = session->lastPacket;
+    rec->bytes[0]         = session->bytes[0];
+    rec->bytes[1]         = session->bytes[1];
+    rec->databytes[0]     = session->databytes[0];
+    rec->databytes[1]     = session->databytes[1];
+    rec->packets[0]       = session->packets[0];
+    rec->packets[1]       = session->packets[1];
+    rec->addr1            = session->addr1;
+    rec->addr2            = session->addr2;
+    rec->jsonSize         = jsonSize;
+    rec->port1            = session->port1;
+    rec->port2            = session->port2;
+    rec->segments         = session->segments;
+    rec->protocol         = session->protocol;
+    rec->maxFields        = session->maxFields;
+    rec->firstBytesLen[0] = session->firstBytesLen[0];
+    rec->firstBytesLen[1] = session->firstBytesLen[1];
+    memcpy(rec->firstBytes, session->firstBytes, sizeof(rec->firstBytes));
+    rec->rootId           = session->rootId?g_strdup(session->rootId):NULL;
+
+    /* The caller frees or resets the packet positions right after saving */
+    rec->packetPos = session->packetPos;
+    memset(&session->packetPos, 0, sizeof(session->packetPos));
+
+    rec->fields = MOLOCH_SIZE_ALLOC0(fields, sizeof(MolochField_t *)*session->maxFields);
+    for (pos = 0; pos < session->maxFields; pos++) {
+        const int flags = config.fields[pos]->flags;
+        if (!session->fields[pos] || flags & MOLOCH_FIELD_FLAG_DISABLED)
+            continue;
 
-    uuid_generate(uuid);
-    gint state = 0, save = 0;
-    id_len += g_base64_encode_step((guchar*)&myPid, 2, FALSE, id + id_len, &state, &save);
-    id_len += g_base64_encode_step(uuid, sizeof(uuid_t), FALSE, id + id_len, &state, &save);
-    id_len += g_base64_encode_close(FALSE, id + id_len, &state, &save);
-    id[id_len] = 0;
+        if (final || (flags & MOLOCH_FIELD_FLAG_LINKED_SESSIONS) == 0 || config.fields[pos]->type == MOLOCH_FIELD_TYPE_CERTSINFO) {
+            rec->fields[pos] = session->fields[pos];
+            session->fields[pos] = 0;
+        } else {
+            rec->fields[pos] = moloch_db_field_copy(pos, session->fields[pos]);
+        }
+    }
 
-    for (i = 0; i < id_len; i++) {
-        if (id[i] == '+') id[i] = '-';
-        else if (id[i] == '/') id[i] = '_';
+    return rec;
+}
+/******************************************************************************/
+static void moloch_db_record_free(MolochDbRecord_t *rec)
+{
+    moloch_packet_pos_free(&rec->packetPos);
+    MOLOCH_SIZE_FREE(fields, rec->fields);
+    g_free(rec->rootId);
+    MOLOCH_TYPE_FREE(MolochDbRecord_t, rec);
+}
+/******************************************************************************/
+static gboolean moloch_db_send_gfunc(gpointer bulkv)
+{
+    MolochDbBulk_t *bulk = bulkv;
+
+    moloch_http_set(esServer, "/_bulk", 6, bulk->json, bulk->len, NULL, NULL);
+    MOLOCH_TYPE_FREE(MolochDbBulk_t, bulk);
+    return FALSE;
+}
+/******************************************************************************/
+/* libcurl is only driven from the main thread, packet threads hand it buffers */
+static void moloch_db_send(char *json, uint32_t len)
+{
+    if (moloch_main_thread()) {
+        moloch_http_set(esServer, "/_bulk", 6, json, len, NULL, NULL);
+        return;
+    }
+
+    MolochDbBulk_t *bulk = MOLOCH_TYPE_ALLOC0(MolochDbBulk_t);
+    bulk->json = json;
+    bulk->len  = len;
+    g_idle_add(moloch_db_send_gfunc, bulk);
+}
+/******************************************************************************/
+/* Hand a full bulk buffer to be sent, from the moloch-db thread it is
+ * deflated here and queued for the main thread.
+ */
+static void moloch_db_bulk_send(char *json, uint32_t len)
+{
+    if (!indexerThread) {
+        moloch_db_send(json, len);
+        return;
     }
 
-    key_len = snprintf(key, sizeof(key), "/_bulk");
+    MolochDbBulk_t *bulk = MOLOCH_TYPE_ALLOC0(MolochDbBulk_t);
+    bulk->json = json;
+    bulk->len  = len;
 
-    /* If no room left to add, send the buffer */
-    if (sJson && (uint32_t)BSB_REMAINING(jbsb) < jsonSize) {
-        if (BSB_LENGTH(jbsb) > 0) {
-            moloch_http_set(esServer, key, key_len, sJson, BSB_LENGTH(jbsb), NULL, NULL);
+    if (config.compressES && len > 1000) {
+        char *buf = moloch_http_get_buffer(len);
+
+        z_strm.avail_in   = len;
+        z_strm.next_in    = (unsigned char *)json;
+        z_strm.avail_out  = len;
+        z_strm.next_out   = (unsigned char *)buf;
+        if (deflate(&z_strm, Z_FINISH) == Z_STREAM_END) {
+            MOLOCH_SIZE_FREE(buffer, json);
+            bulk->json     = buf;
+            bulk->len      = len - z_strm.avail_out;
+            bulk->deflated = 1;
+        } else {
+            MOLOCH_SIZE_FREE(buffer, buf);
         }
+        deflateReset(&z_strm);
+    }
+
+    pthread_mutex_lock(&indexerLock);
+    DLL_PUSH_TAIL(b_, &bulkQ, bulk);
+    if (indexerWaiting)
+        pthread_cond_signal(&recordRoomCond);
+
+    uint64_t one = 1;
+    if (write(bulkEventFd, &one, sizeof(one)) != sizeof(one))
+        LOG("ERROR - db indexer eventfd write failed with %s", strerror(errno));
+
+    while (DLL_COUNT(b_, &bulkQ) >= (int)config.maxESRequests && !indexerQuit)
+        pthread_cond_wait(&bulkRoomCond, &indexerLock);
+    pthread_mutex_unlock(&indexerLock);
+}
+/******************************************************************************/
+/* Send what has been encoded so far */
+static void moloch_db_bulk_flush()
+{
+    if (sJson) {
+        if (BSB_LENGTH(jbsb) > 0)
+            moloch_db_bulk_send(sJson, BSB_LENGTH(jbsb));
+        else
+            MOLOCH_SIZE_FREE(buffer, sJson);
         sJson = 0;
+    }
 
-        struct timeval currentTime;
-        gettimeofday(&currentTime, NULL);
-        dbLastSave = currentTime.tv_sec;
+    struct timeval currentTime;
+    gettimeofday(&currentTime, NULL);
+    dbLastSave = currentTime.tv_sec;
+}
+/******************************************************************************/
+/* "key":number, where key is a literal with its quotes and colon */
+#define MOLOCH_DB_EXPORT_UINT(b, key, x)          \
+do {                                              \
+    BSB_EXPORT_cstr(b, key);                      \
+    BSB_EXPORT_uint(b, x);                        \
+    BSB_EXPORT_u08(b, ',');                       \
+} while (0)
+
+/* pre, the dbField of a field, then post */
+#define MOLOCH_DB_EXPORT_FIELD(b, pre, info, post) \
+do {                                              \
+    BSB_EXPORT_cstr(b, pre);                      \
+    BSB_EXPORT_ptr(b, (info)->dbField, (info)->dbFieldLen); \
+    BSB_EXPORT_cstr(b, post);                     \
+} while (0)
+
+/* A string that never needs escaping, node names, ids and country codes */
+#define MOLOCH_DB_EXPORT_RAW(b, str)              \
+do {                                              \
+    const char *_s = str;                         \
+    const int   _l = strlen(_s);                  \
+    BSB_EXPORT_ptr(b, _s, _l);                    \
+} while (0)
+
+static void moloch_db_record_json(MolochDbRecord_t *rec)
+{
+    uint32_t               i;
+    MolochString_t        *hstring;
+    MolochInt_t           *hint;
+    MolochStringHashStd_t *shash;
+    MolochIntHashStd_t    *ihash;
+    unsigned char         *startPtr;
+    unsigned char         *dataPtr;
+    const uint32_t         jsonSize = rec->jsonSize;
+    int                    pos;
+
+    /* If no room left to add, send the buffer */
+    if (sJson && (uint32_t)BSB_REMAINING(jbsb) < jsonSize) {
+        moloch_db_bulk_flush();
     }
 
     /* Allocate a new buffer using the max of the bulk size or estimated size. */
@@ -297,48 +609,44 @@ void moloch_db_save_session(MolochSession_t *session, int final)
         BSB_INIT(jbsb, sJson, size);
     }
 
-    uint32_t timediff = (session->lastPacket.tv_sec - session->firstPacket.tv_sec)*1000 +
-                        (session->lastPacket.tv_usec - session->firstPacket.tv_usec)/1000;
+    uint32_t timediff = (rec->lastPacket.tv_sec - rec->firstPacket.tv_sec)*1000 +
+                        (rec->lastPacket.tv_usec - rec->firstPacket.tv_usec)/1000;
 
     startPtr = BSB_WORK_PTR(jbsb);
-    BSB_EXPORT_sprintf(jbsb, "{\"index\": {\"_index\": \"%ssessions-%s\", \"_type\": \"session\", \"_id\": \"%s\"}}\n", config.prefix, prefix, id);
+    BSB_EXPORT_cstr(jbsb, "{\"index\": {\"_index\": \"");
+    MOLOCH_DB_EXPORT_RAW(jbsb, config.prefix);
+    BSB_EXPORT_cstr(jbsb, "sessions-");
+    MOLOCH_DB_EXPORT_RAW(jbsb, rec->prefix);
+    BSB_EXPORT_cstr(jbsb, "\", \"_type\": \"session\", \"_id\": \"");
+    MOLOCH_DB_EXPORT_RAW(jbsb, rec->id);
+    BSB_EXPORT_cstr(jbsb, "\"}}\n");
 
     dataPtr = BSB_WORK_PTR(jbsb);
-    BSB_EXPORT_sprintf(jbsb,
-                      "{\"fp\":%u,"
-                      "\"lp\":%u,"
-                      "\"fpd\":%" PRIu64 ","
-                      "\"lpd\":%" PRIu64 ","
-                      "\"sl\":%u,"
-                      "\"a1\":%u,"
-                      "\"p1\":%u,"
-                      "\"a2\":%u,"
-                      "\"p2\":%u,"
-                      "\"pr\":%u,",
-                      (uint32_t)session->firstPacket.tv_sec,
-                      (uint32_t)session->lastPacket.tv_sec,
-                      ((uint64_t)session->firstPacket.tv_sec)*1000 + ((uint64_t)session->firstPacket.tv_usec)/1000,
-                      ((uint64_t)session->lastPacket.tv_sec)*1000 + ((uint64_t)session->lastPacket.tv_usec)/1000,
-                      timediff,
-                      htonl(session->addr1),
-                      session->port1,
-                      htonl(session->addr2),
-                      session->port2,
-                      session->protocol);
-
-    if (session->firstBytesLen[0] > 0) {
+    BSB_EXPORT_u08(jbsb, '{');
+    MOLOCH_DB_EXPORT_UINT(jbsb, "\"fp\":", (uint32_t)rec->firstPacket.tv_sec);
+    MOLOCH_DB_EXPORT_UINT(jbsb, "\"lp\":", (uint32_t)rec->lastPacket.tv_sec);
+    MOLOCH_DB_EXPORT_UINT(jbsb, "\"fpd\":", ((uint64_t)rec->firstPacket.tv_sec)*1000 + ((uint64_t)rec->firstPacket.tv_usec)/1000);
+    MOLOCH_DB_EXPORT_UINT(jbsb, "\"lpd\":", ((uint64_t)rec->lastPacket.tv_sec)*1000 + ((uint64_t)rec->lastPacket.tv_usec)/1000);
+    MOLOCH_DB_EXPORT_UINT(jbsb, "\"sl\":", timediff);
+    MOLOCH_DB_EXPORT_UINT(jbsb, "\"a1\":", htonl(rec->addr1));
+    MOLOCH_DB_EXPORT_UINT(jbsb, "\"p1\":", rec->port1);
+    MOLOCH_DB_EXPORT_UINT(jbsb, "\"a2\":", htonl(rec->addr2));
+    MOLOCH_DB_EXPORT_UINT(jbsb, "\"p2\":", rec->port2);
+    MOLOCH_DB_EXPORT_UINT(jbsb, "\"pr\":", rec->protocol);
+
+    if (rec->firstBytesLen[0] > 0) {
         int i;
         BSB_EXPORT_cstr(jbsb, "\"fb1\":\"");
-        for (i = 0; i < session->firstBytesLen[0]; i++) {
-            BSB_EXPORT_ptr(jbsb, moloch_char_to_hexstr[(unsigned char)session->firstBytes[0][i]], 2);
+        for (i = 0; i < rec->firstBytesLen[0]; i++) {
+            BSB_EXPORT_ptr(jbsb, moloch_char_to_hexstr[(unsigned char)rec->firstBytes[0][i]], 2);
         }
         BSB_EXPORT_cstr(jbsb, "\",");
     }
 
-    if (session->firstBytesLen[1] > 0) {
+    if (rec->firstBytesLen[1] > 0) {
         BSB_EXPORT_cstr(jbsb, "\"fb2\":\"");
-        for (i = 0; i < session->firstBytesLen[1]; i++) {
-            BSB_EXPORT_ptr(jbsb, moloch_char_to_hexstr[(unsigned char)session->firstBytes[1][i]], 2);
+        for (i = 0; i < rec->firstBytesLen[1]; i++) {
+            BSB_EXPORT_ptr(jbsb, moloch_char_to_hexstr[(unsigned char)rec->firstBytes[1][i]], 2);
         }
         BSB_EXPORT_cstr(jbsb, "\",");
     }
@@ -347,13 +655,13 @@ void moloch_db_save_session(MolochSession_t *session, int final)
     char *g1 = 0, *g2 = 0, *as1 = 0, *as2 = 0, *rir1 = 0, *rir2 = 0;
 
     if (ipTree) {
-        if ((ii1 = moloch_db_get_local_ip(session, session->addr1))) {
+        if ((ii1 = moloch_db_local_ip(rec->addr1))) {
             g1 = ii1->country;
             as1 = ii1->asn;
             rir1 = ii1->rir;
         }
 
-        if ((ii2 = moloch_db_get_local_ip(session, session->addr2))) {
+        if ((ii2 = moloch_db_local_ip(rec->addr2))) {
             g2 = ii2->country;
             as2 = ii2->asn;
             rir2 = ii2->rir;
@@ -362,24 +670,30 @@ void moloch_db_save_session(MolochSession_t *session, int final)
 
     if (gi) {
         if (!g1)
-            g1 = (char *)GeoIP_country_code3_by_ipnum(gi, htonl(session->addr1));
+            g1 = (char *)GeoIP_country_code3_by_ipnum(gi, htonl(rec->addr1));
 
         if (!g2)
-            g2 = (char *)GeoIP_country_code3_by_ipnum(gi, htonl(session->addr2));
+            g2 = (char *)GeoIP_country_code3_by_ipnum(gi, htonl(rec->addr2));
     }
 
-    if (g1)
-        BSB_EXPORT_sprintf(jbsb, "\"g1\":\"%s\",", g1);
-    if (g2)
-        BSB_EXPORT_sprintf(jbsb, "\"g2\":\"%s\",", g2);
+    if (g1) {
+        BSB_EXPORT_cstr(jbsb, "\"g1\":\"");
+        MOLOCH_DB_EXPORT_RAW(jbsb, g1);
+        BSB_EXPORT_cstr(jbsb, "\",");
+    }
+    if (g2) {
+        BSB_EXPORT_cstr(jbsb, "\"g2\":\"");
+        MOLOCH_DB_EXPORT_RAW(jbsb, g2);
+        BSB_EXPORT_cstr(jbsb, "\",");
+    }
 
     if (giASN) {
         if (!as1) {
-            as1 = GeoIP_name_by_ipnum(giASN, htonl(session->addr1));
+            as1 = GeoIP_name_by_ipnum(giASN, htonl(rec->addr1));
         }
 
         if (!as2) {
-            as2 = GeoIP_name_by_ipnum(giASN, htonl(session->addr2));
+            as2 = GeoIP_name_by_ipnum(giASN, htonl(rec->addr2));
         }
     }
     if (as1) {
@@ -399,79 +713,50 @@ void moloch_db_save_session(MolochSession_t *session, int final)
     }
 
     if (!rir1)
-        rir1 = rirs[session->addr1 & 0xff];
+        rir1 = rirs[rec->addr1 & 0xff];
 
-    if (rir1)
-        BSB_EXPORT_sprintf(jbsb, "\"rir1\":\"%s\",", rir1);
+    if (rir1) {
+        BSB_EXPORT_cstr(jbsb, "\"rir1\":\"");
+        MOLOCH_DB_EXPORT_RAW(jbsb, rir1);
+        BSB_EXPORT_cstr(jbsb, "\",");
+    }
 
     if (!rir2)
-        rir2 = rirs[session->addr2 & 0xff];
-
-    if (rir2)
-        BSB_EXPORT_sprintf(jbsb, "\"rir2\":\"%s\",", rir2);
-
-    BSB_EXPORT_sprintf(jbsb,
-                      "\"pa\":%u,"
-                      "\"pa1\":%u,"
-                      "\"pa2\":%u,"
-                      "\"by\":%" PRIu64 ","
-                      "\"by1\":%" PRIu64 ","
-                      "\"by2\":%" PRIu64 ","
-                      "\"db\":%" PRIu64 ","
-                      "\"db1\":%" PRIu64 ","
-                      "\"db2\":%" PRIu64 ","
-                      "\"ss\":%u,"
-                      "\"no\":\"%s\",",
-                      session->packets[0] + session->packets[1],
-                      session->packets[0],
-                      session->packets[1],
-                      session->bytes[0] + session->bytes[1],
-                      session->bytes[0],
-                      session->bytes[1],
-                      session->databytes[0] + session->databytes[1],
-                      session->databytes[0],
-                      session->databytes[1],
-                      session->segments,
-                      config.nodeName);
-
-    if (session->rootId) {
-        if (session->rootId[0] == 'R')
-            session->rootId = g_strdup(id);
-        BSB_EXPORT_sprintf(jbsb, "\"ro\":\"%s\",", session->rootId);
-    }
-    BSB_EXPORT_cstr(jbsb, "\"ps\":[");
-    for(i = 0; i < session->filePosArray->len; i++) {
-        if (i != 0)
-            BSB_EXPORT_u08(jbsb, ',');
-        BSB_EXPORT_sprintf(jbsb, "%" PRId64, (uint64_t)g_array_index(session->filePosArray, uint64_t, i));
-    }
-    BSB_EXPORT_cstr(jbsb, "],");
+        rir2 = rirs[rec->addr2 & 0xff];
 
-    BSB_EXPORT_cstr(jbsb, "\"psl\":[");
-    for(i = 0; i < session->fileLenArray->len; i++) {
-        if (i != 0)
-            BSB_EXPORT_u08(jbsb, ',');
-        BSB_EXPORT_sprintf(jbsb, "%u", (uint16_t)g_array_index(session->fileLenArray, uint16_t, i));
+    if (rir2) {
+        BSB_EXPORT_cstr(jbsb, "\"rir2\":\"");
+        MOLOCH_DB_EXPORT_RAW(jbsb, rir2);
+        BSB_EXPORT_cstr(jbsb, "\",");
     }
-    BSB_EXPORT_cstr(jbsb, "],");
 
-    BSB_EXPORT_cstr(jbsb, "\"fs\":[");
-    for(i = 0; i < session->fileNumArray->len; i++) {
-        if (i == 0)
-            BSB_EXPORT_sprintf(jbsb, "%u", (uint32_t)g_array_index(session->fileNumArray, uint32_t, i));
-        else
-            BSB_EXPORT_sprintf(jbsb, ",%u", (uint32_t)g_array_index(session->fileNumArray, uint32_t, i));
+    MOLOCH_DB_EXPORT_UINT(jbsb, "\"pa\":", rec->packets[0] + rec->packets[1]);
+    MOLOCH_DB_EXPORT_UINT(jbsb, "\"pa1\":", rec->packets[0]);
+    MOLOCH_DB_EXPORT_UINT(jbsb, "\"pa2\":", rec->packets[1]);
+    MOLOCH_DB_EXPORT_UINT(jbsb, "\"by\":", rec->bytes[0] + rec->bytes[1]);
+    MOLOCH_DB_EXPORT_UINT(jbsb, "\"by1\":", rec->bytes[0]);
+    MOLOCH_DB_EXPORT_UINT(jbsb, "\"by2\":", rec->bytes[1]);
+    MOLOCH_DB_EXPORT_UINT(jbsb, "\"db\":", rec->databytes[0] + rec->databytes[1]);
+    MOLOCH_DB_EXPORT_UINT(jbsb, "\"db1\":", rec->databytes[0]);
+    MOLOCH_DB_EXPORT_UINT(jbsb, "\"db2\":", rec->databytes[1]);
+    MOLOCH_DB_EXPORT_UINT(jbsb, "\"ss\":", rec->segments);
+    BSB_EXPORT_cstr(jbsb, "\"no\":\"");
+    MOLOCH_DB_EXPORT_RAW(jbsb, config.nodeName);
+    BSB_EXPORT_cstr(jbsb, "\",");
+
+    if (rec->rootId) {
+        BSB_EXPORT_cstr(jbsb, "\"ro\":\"");
+        MOLOCH_DB_EXPORT_RAW(jbsb, rec->rootId);
+        BSB_EXPORT_cstr(jbsb, "\",");
     }
-    BSB_EXPORT_cstr(jbsb, "],");
+    moloch_packet_pos_json(&rec->packetPos, &jbsb);
 
     int inGroupNum = 0;
-    for (pos = 0; pos < session->maxFields; pos++) {
+    for (pos = 0; pos < rec->maxFields; pos++) {
         const int flags = config.fields[pos]->flags;
-        if (!session->fields[pos] || flags & MOLOCH_FIELD_FLAG_DISABLED)
+        if (!rec->fields[pos])
             continue;
 
-        const int freeField = final || ((flags & MOLOCH_FIELD_FLAG_LINKED_SESSIONS) == 0);
-
         if (inGroupNum != config.fields[pos]->dbGroupNum) {
             if (inGroupNum != 0) {
                 BSB_EXPORT_rewind(jbsb, 1); // Remove last comma
@@ -480,90 +765,97 @@ void moloch_db_save_session(MolochSession_t *session, int final)
             inGroupNum = config.fields[pos]->dbGroupNum;
 
             if (inGroupNum) {
-                BSB_EXPORT_sprintf(jbsb, "\"%.*s\": {", config.fields[pos]->dbGroupLen, config.fields[pos]->dbGroup);
+                BSB_EXPORT_u08(jbsb, '"');
+                BSB_EXPORT_ptr(jbsb, config.fields[pos]->dbGroup, config.fields[pos]->dbGroupLen);
+                BSB_EXPORT_cstr(jbsb, "\": {");
             }
         }
 
         switch(config.fields[pos]->type) {
         case MOLOCH_FIELD_TYPE_INT:
-            BSB_EXPORT_sprintf(jbsb, "\"%s\":%d", config.fields[pos]->dbField, session->fields[pos]->i);
+            MOLOCH_DB_EXPORT_FIELD(jbsb, "\"", config.fields[pos], "\":");
+            BSB_EXPORT_int(jbsb, rec->fields[pos]->i);
             BSB_EXPORT_u08(jbsb, ',');
             break;
         case MOLOCH_FIELD_TYPE_STR:
-            BSB_EXPORT_sprintf(jbsb, "\"%s\":", config.fields[pos]->dbField);
+            MOLOCH_DB_EXPORT_FIELD(jbsb, "\"", config.fields[pos], "\":");
             moloch_db_js0n_str(&jbsb,
-                               (unsigned char *)session->fields[pos]->str,
+                               (unsigned char *)rec->fields[pos]->str,
                                flags & MOLOCH_FIELD_FLAG_FORCE_UTF8);
             BSB_EXPORT_u08(jbsb, ',');
-            if (freeField) {
-                g_free(session->fields[pos]->str);
-            }
+            g_free(rec->fields[pos]->str);
             break;
         case MOLOCH_FIELD_TYPE_STR_ARRAY:
             if (flags & MOLOCH_FIELD_FLAG_CNT) {
-                BSB_EXPORT_sprintf(jbsb, "\"%scnt\":%d,", config.fields[pos]->dbField, session->fields[pos]->sarray->len);
+                MOLOCH_DB_EXPORT_FIELD(jbsb, "\"", config.fields[pos], "cnt\":");
+                BSB_EXPORT_uint(jbsb, rec->fields[pos]->sarray->len);
+                BSB_EXPORT_u08(jbsb, ',');
             } else if (flags & MOLOCH_FIELD_FLAG_COUNT) {
-                BSB_EXPORT_sprintf(jbsb, "\"%s-cnt\":%d,", config.fields[pos]->dbField, session->fields[pos]->sarray->len);
+                MOLOCH_DB_EXPORT_FIELD(jbsb, "\"", config.fields[pos], "-cnt\":");
+                BSB_EXPORT_uint(jbsb, rec->fields[pos]->sarray->len);
+                BSB_EXPORT_u08(jbsb, ',');
             }
-            BSB_EXPORT_sprintf(jbsb, "\"%s\":[", config.fields[pos]->dbField);
-            for(i = 0; i < session->fields[pos]->sarray->len; i++) {
+            MOLOCH_DB_EXPORT_FIELD(jbsb, "\"", config.fields[pos], "\":[");
+            for(i = 0; i < rec->fields[pos]->sarray->len; i++) {
                 moloch_db_js0n_str(&jbsb,
-                                   g_ptr_array_index(session->fields[pos]->sarray, i),
+                                   g_ptr_array_index(rec->fields[pos]->sarray, i),
                                    flags & MOLOCH_FIELD_FLAG_FORCE_UTF8);
                 BSB_EXPORT_u08(jbsb, ',');
             }
             BSB_EXPORT_rewind(jbsb, 1); // Remove last comma
             BSB_EXPORT_cstr(jbsb, "],");
-            if (freeField) {
-                g_ptr_array_free(session->fields[pos]->sarray, TRUE);
-            }
+            g_ptr_array_free(rec->fields[pos]->sarray, TRUE);
             break;
         case MOLOCH_FIELD_TYPE_STR_HASH:
-            shash = session->fields[pos]->shash;
+            shash = rec->fields[pos]->shash;
             if (flags & MOLOCH_FIELD_FLAG_CNT) {
-                BSB_EXPORT_sprintf(jbsb, "\"%scnt\":%d,", config.fields[pos]->dbField, HASH_COUNT(s_, *shash));
+                MOLOCH_DB_EXPORT_FIELD(jbsb, "\"", config.fields[pos], "cnt\":");
+                BSB_EXPORT_uint(jbsb, HASH_COUNT(s_, *shash));
+                BSB_EXPORT_u08(jbsb, ',');
             } else if (flags & MOLOCH_FIELD_FLAG_COUNT) {
-                BSB_EXPORT_sprintf(jbsb, "\"%s-cnt\":%d,", config.fields[pos]->dbField, HASH_COUNT(s_, *shash));
+                MOLOCH_DB_EXPORT_FIELD(jbsb, "\"", config.fields[pos], "-cnt\":");
+                BSB_EXPORT_uint(jbsb, HASH_COUNT(s_, *shash));
+                BSB_EXPORT_u08(jbsb, ',');
             }
-            BSB_EXPORT_sprintf(jbsb, "\"%s\":[", config.fields[pos]->dbField);
+            MOLOCH_DB_EXPORT_FIELD(jbsb, "\"", config.fields[pos], "\":[");
             HASH_FORALL(s_, *shash, hstring,
                 moloch_db_js0n_str(&jbsb, (unsigned char *)hstring->str, hstring->utf8 || flags & MOLOCH_FIELD_FLAG_FORCE_UTF8);
                 BSB_EXPORT_u08(jbsb, ',');
             );
-            if (freeField) {
-                HASH_FORALL_POP_HEAD(s_, *shash, hstring,
-                    g_free(hstring->str);
-                    MOLOCH_TYPE_FREE(MolochString_t, hstring);
-                );
-                MOLOCH_TYPE_FREE(MolochStringHashStd_t, shash);
-            }
+            HASH_FORALL_POP_HEAD(s_, *shash, hstring,
+                g_free(hstring->str);
+                MOLOCH_TYPE_FREE(MolochString_t, hstring);
+            );
+            MOLOCH_TYPE_FREE(MolochStringHashStd_t, shash);
             BSB_EXPORT_rewind(jbsb, 1); // Remove last comma
             BSB_EXPORT_cstr(jbsb, "],");
             break;
         case MOLOCH_FIELD_TYPE_INT_HASH:
-            ihash = session->fields[pos]->ihash;
+            ihash = rec->fields[pos]->ihash;
             if (flags & MOLOCH_FIELD_FLAG_CNT) {
-                BSB_EXPORT_sprintf(jbsb, "\"%scnt\": %d,", config.fields[pos]->dbField, HASH_COUNT(i_, *ihash));
+                MOLOCH_DB_EXPORT_FIELD(jbsb, "\"", config.fields[pos], "cnt\": ");
+                BSB_EXPORT_uint(jbsb, HASH_COUNT(i_, *ihash));
+                BSB_EXPORT_u08(jbsb, ',');
             } else if (flags & MOLOCH_FIELD_FLAG_COUNT) {
-                BSB_EXPORT_sprintf(jbsb, "\"%s-cnt\": %d,", config.fields[pos]->dbField, HASH_COUNT(i_, *ihash));
+                MOLOCH_DB_EXPORT_FIELD(jbsb, "\"", config.fields[pos], "-cnt\": ");
+                BSB_EXPORT_uint(jbsb, HASH_COUNT(i_, *ihash));
+                BSB_EXPORT_u08(jbsb, ',');
             }
-            BSB_EXPORT_sprintf(jbsb, "\"%s\":[", config.fields[pos]->dbField);
+            MOLOCH_DB_EXPORT_FIELD(jbsb, "\"", config.fields[pos], "\":[");
             HASH_FORALL(i_, *ihash, hint,
-                BSB_EXPORT_sprintf(jbsb, "%u", hint->i_hash);
+                BSB_EXPORT_uint(jbsb, hint->i_hash);
                 BSB_EXPORT_u08(jbsb, ',');
             );
-            if (freeField) {
-                HASH_FORALL_POP_HEAD(i_, *ihash, hint,
-                    MOLOCH_TYPE_FREE(MolochInt_t, hint);
-                );
-                MOLOCH_TYPE_FREE(MolochIntHashStd_t, ihash);
-            }
+            HASH_FORALL_POP_HEAD(i_, *ihash, hint,
+                MOLOCH_TYPE_FREE(MolochInt_t, hint);
+            );
+            MOLOCH_TYPE_FREE(MolochIntHashStd_t, ihash);
             BSB_EXPORT_rewind(jbsb, 1); // Remove last comma
             BSB_EXPORT_cstr(jbsb, "],");
             break;
         case MOLOCH_FIELD_TYPE_IP: {
-            const int             value = session->fields[pos]->i;
-            const MolochIpInfo_t *ii = ipTree?moloch_db_get_local_ip(session, value):0;
+            const int             value = rec->fields[pos]->i;
+            const MolochIpInfo_t *ii = ipTree?moloch_db_local_ip(value):0;
             char                 *as = NULL;
             const char           *g = NULL;
             const char           *rir = NULL;
@@ -583,9 +875,11 @@ void moloch_db_save_session(MolochSession_t *session, int final)
 
                 if (g) {
                     if (post)
-                        BSB_EXPORT_sprintf(jbsb, "\"%s-geo\":\"%s\",", config.fields[pos]->dbField, g);
+                        MOLOCH_DB_EXPORT_FIELD(jbsb, "\"", config.fields[pos], "-geo\":\"");
                     else
-                        BSB_EXPORT_sprintf(jbsb, "\"g%s\":\"%s\",", config.fields[pos]->dbField, g);
+                        MOLOCH_DB_EXPORT_FIELD(jbsb, "\"g", config.fields[pos], "\":\"");
+                    MOLOCH_DB_EXPORT_RAW(jbsb, g);
+                    BSB_EXPORT_cstr(jbsb, "\",");
                 }
             }
 
@@ -596,9 +890,9 @@ void moloch_db_save_session(MolochSession_t *session, int final)
 
                 if (as) {
                     if (post)
-                        BSB_EXPORT_sprintf(jbsb, "\"%s-asn\":", config.fields[pos]->dbField);
+                        MOLOCH_DB_EXPORT_FIELD(jbsb, "\"", config.fields[pos], "-asn\":");
                     else
-                        BSB_EXPORT_sprintf(jbsb, "\"as%s\":", config.fields[pos]->dbField);
+                        MOLOCH_DB_EXPORT_FIELD(jbsb, "\"as", config.fields[pos], "\":");
                     moloch_db_js0n_str(&jbsb, (unsigned char*)as, TRUE);
                     if (!ii || !ii->asn) {
                         free(as);
@@ -614,36 +908,46 @@ void moloch_db_save_session(MolochSession_t *session, int final)
 
                 if (rir) {
                     if (post)
-                        BSB_EXPORT_sprintf(jbsb, "\"%s-rir\":\"%s\",", config.fields[pos]->dbField, rir);
+                        MOLOCH_DB_EXPORT_FIELD(jbsb, "\"", config.fields[pos], "-rir\":\"");
                     else
-                        BSB_EXPORT_sprintf(jbsb, "\"rir%s\":\"%s\",", config.fields[pos]->dbField, rir);
+                        MOLOCH_DB_EXPORT_FIELD(jbsb, "\"rir", config.fields[pos], "\":\"");
+                    MOLOCH_DB_EXPORT_RAW(jbsb, rir);
+                    BSB_EXPORT_cstr(jbsb, "\",");
                 }
             }
 
-            BSB_EXPORT_sprintf(jbsb, "\"%s\":%u,", config.fields[pos]->dbField, htonl(value));
+            MOLOCH_DB_EXPORT_FIELD(jbsb, "\"", config.fields[pos], "\":");
+            BSB_EXPORT_uint(jbsb, htonl(value));
+            BSB_EXPORT_u08(jbsb, ',');
             }
             break;
         case MOLOCH_FIELD_TYPE_IP_HASH: {
             const int post = (flags & MOLOCH_FIELD_FLAG_IPPRE) == 0;
-            ihash = session->fields[pos]->ihash;
+            ihash = rec->fields[pos]->ihash;
             if (flags & MOLOCH_FIELD_FLAG_CNT) {
-                BSB_EXPORT_sprintf(jbsb, "\"%scnt\":%d,", config.fields[pos]->dbField, HASH_COUNT(i_, *ihash));
+                MOLOCH_DB_EXPORT_FIELD(jbsb, "\"", config.fields[pos], "cnt\":");
+                BSB_EXPORT_uint(jbsb, HASH_COUNT(i_, *ihash));
+                BSB_EXPORT_u08(jbsb, ',');
             } else if (flags & MOLOCH_FIELD_FLAG_COUNT) {
-                BSB_EXPORT_sprintf(jbsb, "\"%s-cnt\":%d,", config.fields[pos]->dbField, HASH_COUNT(i_, *ihash));
+                MOLOCH_DB_EXPORT_FIELD(jbsb, "\"", config.fields[pos], "-cnt\":");
+                BSB_EXPORT_uint(jbsb, HASH_COUNT(i_, *ihash));
+                BSB_EXPORT_u08(jbsb, ',');
             } else if (flags & MOLOCH_FIELD_FLAG_SCNT) {
-                BSB_EXPORT_sprintf(jbsb, "\"%sscnt\":%d,", config.fields[pos]->dbField, HASH_COUNT(i_, *ihash));
+                MOLOCH_DB_EXPORT_FIELD(jbsb, "\"", config.fields[pos], "scnt\":");
+                BSB_EXPORT_uint(jbsb, HASH_COUNT(i_, *ihash));
+                BSB_EXPORT_u08(jbsb, ',');
             }
 
             if (gi || ipTree) {
                 const MolochIpInfo_t *ii;
 
                 if (post)
-                    BSB_EXPORT_sprintf(jbsb, "\"%s-geo\":[", config.fields[pos]->dbField);
+                    MOLOCH_DB_EXPORT_FIELD(jbsb, "\"", config.fields[pos], "-geo\":[");
                 else
-                    BSB_EXPORT_sprintf(jbsb, "\"g%s\":[", config.fields[pos]->dbField);
+                    MOLOCH_DB_EXPORT_FIELD(jbsb, "\"g", config.fields[pos], "\":[");
                 HASH_FORALL(i_, *ihash, hint,
                     const char *g = NULL;
-                    if (ipTree && (ii = moloch_db_get_local_ip(session, hint->i_hash))) {
+                    if (ipTree && (ii = moloch_db_local_ip(hint->i_hash))) {
                         g = ii->country;
                     }
 
@@ -652,7 +956,9 @@ void moloch_db_save_session(MolochSession_t *session, int final)
                     }
 
                     if (g) {
-                        BSB_EXPORT_sprintf(jbsb, "\"%s\"", g);
+                        BSB_EXPORT_u08(jbsb, '"');
+                        MOLOCH_DB_EXPORT_RAW(jbsb, g);
+                        BSB_EXPORT_u08(jbsb, '"');
                     } else {
                         BSB_EXPORT_cstr(jbsb, "\"---\"");
                     }
@@ -666,13 +972,13 @@ void moloch_db_save_session(MolochSession_t *session, int final)
                 const MolochIpInfo_t *ii = 0;
 
                 if (post)
-                    BSB_EXPORT_sprintf(jbsb, "\"%s-asn\":[", config.fields[pos]->dbField);
+                    MOLOCH_DB_EXPORT_FIELD(jbsb, "\"", config.fields[pos], "-asn\":[");
                 else
-                    BSB_EXPORT_sprintf(jbsb, "\"as%s\":[", config.fields[pos]->dbField);
+                    MOLOCH_DB_EXPORT_FIELD(jbsb, "\"as", config.fields[pos], "\":[");
                 HASH_FORALL(i_, *ihash, hint,
                     char *as = NULL;
 
-                    if (ipTree && (ii = moloch_db_get_local_ip(session, hint->i_hash))) {
+                    if (ipTree && (ii = moloch_db_local_ip(hint->i_hash))) {
                         as = ii->asn;
                     }
 
@@ -698,13 +1004,13 @@ void moloch_db_save_session(MolochSession_t *session, int final)
                 const MolochIpInfo_t *ii = 0;
 
                 if (post)
-                    BSB_EXPORT_sprintf(jbsb, "\"%s-rir\":[", config.fields[pos]->dbField);
+                    MOLOCH_DB_EXPORT_FIELD(jbsb, "\"", config.fields[pos], "-rir\":[");
                 else
-                    BSB_EXPORT_sprintf(jbsb, "\"rir%s\":[", config.fields[pos]->dbField);
+                    MOLOCH_DB_EXPORT_FIELD(jbsb, "\"rir", config.fields[pos], "\":[");
                 HASH_FORALL(i_, *ihash, hint,
                     char *rir = NULL;
 
-                    if (ipTree && (ii = moloch_db_get_local_ip(session, hint->i_hash))) {
+                    if (ipTree && (ii = moloch_db_local_ip(hint->i_hash))) {
                         rir = ii->rir;
                     }
 
@@ -713,7 +1019,9 @@ void moloch_db_save_session(MolochSession_t *session, int final)
                     }
 
                     if (rir) {
-                        BSB_EXPORT_sprintf(jbsb, "\"%s\",", rir);
+                        BSB_EXPORT_u08(jbsb, '"');
+                        MOLOCH_DB_EXPORT_RAW(jbsb, rir);
+                        BSB_EXPORT_cstr(jbsb, "\",");
                     } else {
                         BSB_EXPORT_cstr(jbsb, "\"\",");
                     }
@@ -723,26 +1031,24 @@ void moloch_db_save_session(MolochSession_t *session, int final)
             }
 
 
-            BSB_EXPORT_sprintf(jbsb, "\"%s\":[", config.fields[pos]->dbField);
+            MOLOCH_DB_EXPORT_FIELD(jbsb, "\"", config.fields[pos], "\":[");
             HASH_FORALL(i_, *ihash, hint,
-                BSB_EXPORT_sprintf(jbsb, "%u", htonl(hint->i_hash));
+                BSB_EXPORT_uint(jbsb, htonl(hint->i_hash));
                 BSB_EXPORT_u08(jbsb, ',');
             );
-            if (freeField) {
-                HASH_FORALL_POP_HEAD(i_, *ihash, hint,
-                    MOLOCH_TYPE_FREE(MolochInt_t, hint);
-                );
-                MOLOCH_TYPE_FREE(MolochIntHashStd_t, ihash);
-            }
+            HASH_FORALL_POP_HEAD(i_, *ihash, hint,
+                MOLOCH_TYPE_FREE(MolochInt_t, hint);
+            );
+            MOLOCH_TYPE_FREE(MolochIntHashStd_t, ihash);
             BSB_EXPORT_rewind(jbsb, 1); // Remove last comma
 
             BSB_EXPORT_cstr(jbsb, "],");
             break;
         }
         case MOLOCH_FIELD_TYPE_CERTSINFO: {
-            MolochCertsInfoHashStd_t *cihash = session->fields[pos]->cihash;
+            MolochCertsInfoHashStd_t *cihash = rec->fields[pos]->cihash;
 
-            BSB_EXPORT_sprintf(jbsb, "\"tlscnt\":%d,", HASH_COUNT(t_, *cihash));
+            MOLOCH_DB_EXPORT_UINT(jbsb, "\"tlscnt\":", HASH_COUNT(t_, *cihash));
             BSB_EXPORT_cstr(jbsb, "\"tls\":[");
 
             MolochCertsInfo_t *certs;
@@ -765,7 +1071,9 @@ void moloch_db_save_session(MolochSession_t *session, int final)
                     BSB_EXPORT_u08(jbsb, ',');
                 }
 
-                BSB_EXPORT_sprintf(jbsb, "\"hash\":\"%s\",", certs->hash);
+                BSB_EXPORT_cstr(jbsb, "\"hash\":\"");
+                MOLOCH_DB_EXPORT_RAW(jbsb, (char *)certs->hash);
+                BSB_EXPORT_cstr(jbsb, "\",");
 
                 if (certs->issuer.orgName) {
                     BSB_EXPORT_cstr(jbsb, "\"iOn\":");
@@ -797,14 +1105,14 @@ void moloch_db_save_session(MolochSession_t *session, int final)
                     int k;
                     BSB_EXPORT_cstr(jbsb, "\"sn\":\"");
                     for (k = 0; k < certs->serialNumberLen; k++) {
-                        BSB_EXPORT_sprintf(jbsb, "%02x", certs->serialNumber[k]);
+                        BSB_EXPORT_ptr(jbsb, moloch_char_to_hexstr[(unsigned char)certs->serialNumber[k]], 2);
                     }
                     BSB_EXPORT_u08(jbsb, '"');
                     BSB_EXPORT_u08(jbsb, ',');
                 }
 
                 if (certs->alt.s_count) {
-                    BSB_EXPORT_sprintf(jbsb, "\"altcnt\":%d,", certs->alt.s_count);
+                    MOLOCH_DB_EXPORT_UINT(jbsb, "\"altcnt\":", certs->alt.s_count);
                     BSB_EXPORT_cstr(jbsb, "\"alt\":[");
                     while (certs->alt.s_count > 0) {
                         DLL_POP_HEAD(s_, &certs->alt, string);
@@ -818,9 +1126,15 @@ void moloch_db_save_session(MolochSession_t *session, int final)
                     BSB_EXPORT_u08(jbsb, ',');
                 }
 
-                BSB_EXPORT_sprintf(jbsb, "\"notBefore\": %" PRId64 ",", certs->notBefore);
-                BSB_EXPORT_sprintf(jbsb, "\"notAfter\": %" PRId64 ",", certs->notAfter);
-                BSB_EXPORT_sprintf(jbsb, "\"diffDays\": %" PRId64 ",", (certs->notAfter - certs->notBefore)/(60*60*24));
+                BSB_EXPORT_cstr(jbsb, "\"notBefore\": ");
+                BSB_EXPORT_int(jbsb, certs->notBefore);
+                BSB_EXPORT_u08(jbsb, ',');
+                BSB_EXPORT_cstr(jbsb, "\"notAfter\": ");
+                BSB_EXPORT_int(jbsb, certs->notAfter);
+                BSB_EXPORT_u08(jbsb, ',');
+                BSB_EXPORT_cstr(jbsb, "\"diffDays\": ");
+                BSB_EXPORT_int(jbsb, (certs->notAfter - certs->notBefore)/(60*60*24));
+                BSB_EXPORT_u08(jbsb, ',');
 
                 BSB_EXPORT_rewind(jbsb, 1); // Remove last comma
 
@@ -836,10 +1150,8 @@ void moloch_db_save_session(MolochSession_t *session, int final)
             BSB_EXPORT_cstr(jbsb, "],");
         }
         } /* switch */
-        if (freeField) {
-            MOLOCH_TYPE_FREE(MolochField_t, session->fields[pos]);
-            session->fields[pos] = 0;
-        }
+        MOLOCH_TYPE_FREE(MolochField_t, rec->fields[pos]);
+        rec->fields[pos] = 0;
     }
 
     if (inGroupNum) {
@@ -878,6 +1190,249 @@ void moloch_db_save_session(MolochSession_t *session, int final)
     }
 }
 /******************************************************************************/
+/* Wake the moloch-db thread if it is waiting for records, costs nothing when it isn't */
+static void moloch_db_indexer_wake()
+{
+    if (!__atomic_load_n(&indexerSleeping, __ATOMIC_SEQ_CST))
+        return;
+
+    pthread_mutex_lock(&indexerLock);
+    pthread_cond_signal(&indexerCond);
+    pthread_mutex_unlock(&indexerLock);
+}
+/******************************************************************************/
+/* Wait up to a second for records, a flush or quit.  indexerSleeping is set
+ * before the ring is checked, so a record queued after the check sees it and
+ * signals.
+ */
+static void moloch_db_indexer_sleep()
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec++;
+
+    pthread_mutex_lock(&indexerLock);
+    __atomic_store_n(&indexerSleeping, 1, __ATOMIC_SEQ_CST);
+    if (recordHead == __atomic_load_n(&recordTail, __ATOMIC_SEQ_CST) &&
+        !__atomic_load_n(&indexerFlush, __ATOMIC_SEQ_CST) &&
+        !__atomic_load_n(&indexerQuit, __ATOMIC_SEQ_CST)) {
+        pthread_cond_timedwait(&indexerCond, &indexerLock, &deadline);
+    }
+    __atomic_store_n(&indexerSleeping, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&indexerLock);
+}
+/******************************************************************************/
+static void *moloch_db_indexer_thread(void *UNUSED(arg))
+{
+    struct timeval currentTime;
+
+    while (1) {
+        const uint32_t head = recordHead;
+
+        if (head != __atomic_load_n(&recordTail, __ATOMIC_ACQUIRE)) {
+            MolochDbRecord_t *rec = recordRing[head & recordMask];
+            moloch_db_record_json(rec);
+            moloch_db_record_free(rec);
+            __atomic_store_n(&recordHead, head + 1, __ATOMIC_SEQ_CST);
+
+            /* indexerWaiting is only set with the lock held, so the signal can't land before its wait */
+            if (__atomic_load_n(&indexerWaiting, __ATOMIC_SEQ_CST)) {
+                pthread_mutex_lock(&indexerLock);
+                pthread_cond_signal(&recordRoomCond);
+                pthread_mutex_unlock(&indexerLock);
+            }
+            continue;
+        }
+
+        /* Every record queued before quit was set has been encoded once the ring is seen empty after it */
+        if (__atomic_load_n(&indexerQuit, __ATOMIC_ACQUIRE)) {
+            if (head == __atomic_load_n(&recordTail, __ATOMIC_ACQUIRE)) {
+                moloch_db_bulk_flush();
+                break;
+            }
+            continue;
+        }
+
+        int flush = __atomic_exchange_n(&indexerFlush, 0, __ATOMIC_ACQ_REL);
+        gettimeofday(&currentTime, NULL);
+        if (sJson && BSB_LENGTH(jbsb) > 0 &&
+            (flush || currentTime.tv_sec - dbLastSave >= config.dbFlushTimeout)) {
+            moloch_db_bulk_flush();
+        }
+
+        moloch_db_indexer_sleep();
+    }
+
+    return NULL;
+}
+/******************************************************************************/
+/* Send the bulk buffers the moloch-db thread has finished */
+static gboolean moloch_db_bulk_cb(gint UNUSED(fd), GIOCondition UNUSED(cond), gpointer UNUSED(data))
+{
+    MolochDbBulk_t *bulk;
+    uint64_t        count;
+
+    if (read(bulkEventFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        LOG("ERROR - db indexer eventfd read failed with %s", strerror(errno));
+
+    while (1) {
+        pthread_mutex_lock(&indexerLock);
+        DLL_POP_HEAD(b_, &bulkQ, bulk);
+        if (bulk)
+            pthread_cond_signal(&bulkRoomCond);
+        pthread_mutex_unlock(&indexerLock);
+
+        if (!bulk)
+            break;
+
+        moloch_http_send(esServer, "POST", "/_bulk", 6, bulk->json, bulk->len, bulk->deflated?deflateHeaders:NULL, TRUE, NULL, NULL);
+        MOLOCH_TYPE_FREE(MolochDbBulk_t, bulk);
+    }
+
+    return TRUE;
+}
+/******************************************************************************/
+/* Records waiting for the moloch-db thread and bulk buffers waiting to be sent */
+uint32_t moloch_db_indexer_queue_length()
+{
+    uint32_t count;
+
+    if (!indexerThread)
+        return 0;
+
+    pthread_mutex_lock(&indexerLock);
+    count = DLL_COUNT(b_, &bulkQ);
+    pthread_mutex_unlock(&indexerLock);
+
+    return count + (recordTail - __atomic_load_n(&recordHead, __ATOMIC_ACQUIRE));
+}
+/******************************************************************************/
+/* Bulk buffers waiting for the main thread to send them */
+uint32_t moloch_db_indexer_bulk_length()
+{
+    uint32_t count;
+
+    if (!indexerThread)
+        return 0;
+
+    pthread_mutex_lock(&indexerLock);
+    count = DLL_COUNT(b_, &bulkQ);
+    pthread_mutex_unlock(&indexerLock);
+
+    return count;
+}
+/******************************************************************************/
+void moloch_db_save_session(MolochSession_t *session, int final)
+{
+    uint32_t               i;
+    char                   id[100];
+    uuid_t                 uuid;
+    uint32_t               jsonSize;
+    int                    pos;
+
+    /* Let the plugins finish */
+    if (pluginsCbs & MOLOCH_PLUGIN_SAVE)
+        moloch_plugins_cb_save(session, final);
+
+    /* No Packets */
+    if (!config.dryRun && !session->packetPos.count)
+        return;
+
+    if (ipTree)
+        moloch_db_local_ip_tags(session);
+
+    /* jsonSize is an estimate of how much space it will take to encode the session */
+    jsonSize = 1100 + session->packetPos.count*22 + 10*session->packetPos.files;
+    for (pos = 0; pos < session->maxFields; pos++) {
+        if (session->fields[pos]) {
+            jsonSize += session->fields[pos]->jsonSize;
+        }
+    }
+
+    __atomic_add_fetch(&totalSessions, 1, __ATOMIC_RELAXED);
+    session->segments++;
+
+    static __thread char     prefix[32];
+    static __thread time_t   prefix_time = 0;
+
+    if (prefix_time != session->lastPacket.tv_sec) {
+        struct tm tm, *tmp = &tm;
+        prefix_time = session->lastPacket.tv_sec;
+        gmtime_r(&prefix_time, tmp);
+
+        switch(config.rotate) {
+        case MOLOCH_ROTATE_HOURLY:
+            snprintf(prefix, sizeof(prefix), "%02d%02d%02dh%02d", tmp->tm_year%100, tmp->tm_mon+1, tmp->tm_mday, tmp->tm_hour);
+            break;
+        case MOLOCH_ROTATE_DAILY:
+            snprintf(prefix, sizeof(prefix), "%02d%02d%02d", tmp->tm_year%100, tmp->tm_mon+1, tmp->tm_mday);
+            break;
+        case MOLOCH_ROTATE_WEEKLY:
+            snprintf(prefix, sizeof(prefix), "%02dw%02d", tmp->tm_year%100, tmp->tm_yday/7);
+            break;
+        case MOLOCH_ROTATE_MONTHLY:
+            snprintf(prefix, sizeof(prefix), "%02dm%02d", tmp->tm_year%100, tmp->tm_mon+1);
+            break;
+        }
+    }
+    uint32_t id_len = snprintf(id, sizeof(id), "%s-", prefix);
+
+    uuid_generate(uuid);
+    gint state = 0, save = 0;
+    id_len += g_base64_encode_step((guchar*)&myPid, 2, FALSE, id + id_len, &state, &save);
+    id_len += g_base64_encode_step(uuid, sizeof(uuid_t), FALSE, id + id_len, &state, &save);
+    id_len += g_base64_encode_close(FALSE, id + id_len, &state, &save);
+    id[id_len] = 0;
+
+    for (i = 0; i < id_len; i++) {
+        if (id[i] == '+') id[i] = '-';
+        else if (id[i] == '/') id[i] = '_';
+    }
+
+    if (session->rootId && session->rootId[0] == 'R')
+        session->rootId = g_strdup(id);
+
+    MolochDbRecord_t *rec = moloch_db_record_detach(session, final, jsonSize);
+    g_strlcpy(rec->prefix, prefix, sizeof(rec->prefix));
+    g_strlcpy(rec->id, id, sizeof(rec->id));
+
+    /* With packetThreads each one is a producer, they take turns */
+    pthread_mutex_lock(&recordLock);
+    if (!indexerThread) {
+        moloch_db_record_json(rec);
+        moloch_db_record_free(rec);
+        pthread_mutex_unlock(&recordLock);
+        return;
+    }
+
+    const uint32_t tail = recordTail;
+    if (tail - __atomic_load_n(&recordHead, __ATOMIC_ACQUIRE) > recordMask) {
+        if (recordRingFull++ == 0)
+            LOG("WARNING - dbIndexerQueueSize %u is full, waiting for the db indexer", recordMask + 1);
+
+        /* The thread may be stopped on a full bulkQ, which only the main thread
+         * empties, so it does it here.  Packet threads wait for it. */
+        pthread_mutex_lock(&indexerLock);
+        __atomic_store_n(&indexerWaiting, 1, __ATOMIC_SEQ_CST);
+        while (tail - __atomic_load_n(&recordHead, __ATOMIC_SEQ_CST) > recordMask) {
+            if (DLL_COUNT(b_, &bulkQ) > 0 && moloch_main_thread()) {
+                pthread_mutex_unlock(&indexerLock);
+                moloch_db_bulk_cb(0, 0, NULL);
+                pthread_mutex_lock(&indexerLock);
+                continue;
+            }
+            pthread_cond_wait(&recordRoomCond, &indexerLock);
+        }
+        __atomic_store_n(&indexerWaiting, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&indexerLock);
+    }
+    recordRing[tail & recordMask] = rec;
+    __atomic_store_n(&recordTail, tail + 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&recordLock);
+    moloch_db_indexer_wake();
+}
+/******************************************************************************/
 long long zero_atoll(char *v) {
     if (v)
         return atoll(v);
@@ -975,8 +1530,7 @@ void moloch_db_update_stats()
         "\"deltaBytes\": %" PRIu64 ", "
         "\"deltaSessions\": %" PRIu64 ", "
         "\"deltaDropped\": %" PRIu64 ", "
-        "\"deltaMS\": %u"
-        "}",
+        "\"deltaMS\": %u",
         config.hostName,
         (uint32_t)currentTime.tv_sec,
         freeSpaceM,
@@ -998,6 +1552,57 @@ void moloch_db_update_stats()
         (totalDropped - lastDropped),
         diffms);
 
+    /* Per rule counts of sessions that matched a dontSaveBPFs filter */
+    if (config.dontSaveBPFsNum) {
+        json_len += snprintf(json + json_len, MOLOCH_HTTP_BUFFER_SIZE - json_len, ", \"dontSaveBPFsHits\": [");
+        for (i = 0; i < config.dontSaveBPFsNum; i++) {
+            json_len += snprintf(json + json_len, MOLOCH_HTTP_BUFFER_SIZE - json_len, "%s%" PRIu64, (i?",":""), moloch_nids_dont_save_hits(i));
+        }
+        json_len += snprintf(json + json_len, MOLOCH_HTTP_BUFFER_SIZE - json_len, "]");
+    }
+
+    /* Flows the kernel is cutting down to headers for us, and how much of them */
+    if (config.tpacketv3MaxShunts) {
+        MolochTpacketv3Stats_t tstats;
+        moloch_tpacketv3_shunt_stats(&tstats);
+        json_len += snprintf(json + json_len, MOLOCH_HTTP_BUFFER_SIZE - json_len,
+            ", \"shunted\": %" PRIu64 ", \"shuntedActive\": %u, \"shuntedPackets\": %" PRIu64 ", \"shuntedBytes\": %" PRIu64,
+            tstats.shunted, tstats.active, tstats.shuntedPackets, tstats.shuntedBytes);
+    }
+
+    MolochWriterPoolStats_t pstats;
+    writer_disk_pool_stats(&pstats);
+    if (pstats.size > 0) {
+        json_len += snprintf(json + json_len, MOLOCH_HTTP_BUFFER_SIZE - json_len,
+            ", \"writerPoolSize\": %" PRIu64 ", \"writerPoolHighWater\": %" PRIu64 ", \"writerPoolExhausted\": %" PRIu64,
+            pstats.size, pstats.highWater, pstats.exhausted);
+    }
+
+    if (writer_tee_secondaries() > 0) {
+        json_len += snprintf(json + json_len, MOLOCH_HTTP_BUFFER_SIZE - json_len, ", \"teeWriters\": [");
+        for (i = 0; i < writer_tee_secondaries(); i++) {
+            MolochTeeWriterStats_t tstats;
+            writer_tee_stats(i, &tstats);
+            json_len += snprintf(json + json_len, MOLOCH_HTTP_BUFFER_SIZE - json_len,
+                "%s{\"name\": \"%s\", \"queue\": %u, \"dropping\": %s, \"dropped\": %" PRIu64 "}",
+                (i?", ":""), tstats.name, tstats.queueLength, (tstats.dropping?"true":"false"), tstats.dropped);
+        }
+        json_len += snprintf(json + json_len, MOLOCH_HTTP_BUFFER_SIZE - json_len, "]");
+    }
+
+    if (moloch_nids_interfaces() > 0) {
+        json_len += snprintf(json + json_len, MOLOCH_HTTP_BUFFER_SIZE - json_len, ", \"interfaces\": [");
+        for (i = 0; i < moloch_nids_interfaces(); i++) {
+            MolochInterfaceStats_t istats;
+            moloch_nids_interface_stats(i, &istats);
+            json_len += snprintf(json + json_len, MOLOCH_HTTP_BUFFER_SIZE - json_len,
+                "%s{\"name\": \"%s\", \"packets\": %" PRIu64 ", \"bytes\": %" PRIu64 ", \"recv\": %u, \"dropped\": %u}",
+                (i?", ":""), istats.name, istats.packets, istats.bytes, istats.recv, istats.dropped);
+        }
+        json_len += snprintf(json + json_len, MOLOCH_HTTP_BUFFER_SIZE - json_len, "]");
+    }
+    json_len += snprintf(json + json_len, MOLOCH_HTTP_BUFFER_SIZE - json_len, "}");
+
     dbLastTime   = currentTime;
     lastBytes    = totalBytes;
     lastPackets  = totalPackets;
@@ -1109,24 +1714,72 @@ gboolean moloch_db_update_stats_gfunc (gpointer user_data)
     return TRUE;
 }
 /******************************************************************************/
-gboolean moloch_db_flush_gfunc (gpointer user_data )
+/* File documents are batched into their own bulk buffer */
+#define MOLOCH_DB_FILE_BATCH     16
+
+static char            *fJson = 0;
+static BSB              fbsb;
+static int              fJsonNum;
+
+/* With packetThreads files are created from any of them, the file documents
+ * and number lease are shared under filesLock.  Full buffers go on fileQ and
+ * are sent in order by the main thread.
+ */
+static pthread_mutex_t     filesLock = PTHREAD_MUTEX_INITIALIZER;
+static MolochDbBulkHead_t  fileQ;
+static int                 fileQIdle;
+
+/******************************************************************************/
+static gboolean moloch_db_file_send_gfunc(gpointer UNUSED(user_data))
 {
-    char            key[100];
-    int             key_len;
+    MolochDbBulk_t *bulk;
 
-    if (!sJson || BSB_LENGTH(jbsb) == 0)
-        return TRUE;
+    while (1) {
+        pthread_mutex_lock(&filesLock);
+        fileQIdle = 0;
+        DLL_POP_HEAD(b_, &fileQ, bulk);
+        pthread_mutex_unlock(&filesLock);
 
-    struct timeval currentTime;
-    gettimeofday(&currentTime, NULL);
+        if (!bulk)
+            break;
+        moloch_http_set(esServer, "/_bulk", 6, bulk->json, bulk->len, NULL, NULL);
+        MOLOCH_TYPE_FREE(MolochDbBulk_t, bulk);
+    }
+    return FALSE;
+}
+/******************************************************************************/
+/* Called with filesLock held */
+static void moloch_db_file_flush()
+{
+    if (!fJson)
+        return;
 
-    if (user_data == 0 && (currentTime.tv_sec - dbLastSave) < config.dbFlushTimeout)
-        return TRUE;
+    MolochDbBulk_t *bulk = MOLOCH_TYPE_ALLOC0(MolochDbBulk_t);
+    bulk->json = fJson;
+    bulk->len  = BSB_LENGTH(fbsb);
+    DLL_PUSH_TAIL(b_, &fileQ, bulk);
+    fJson = 0;
+    fJsonNum = 0;
 
-    key_len = snprintf(key, sizeof(key), "/_bulk");
-    moloch_http_set(esServer, key, key_len, sJson, BSB_LENGTH(jbsb), NULL, NULL);
-    sJson = 0;
-    dbLastSave = currentTime.tv_sec;
+    if (!fileQIdle && !moloch_main_thread()) {
+        fileQIdle = 1;
+        g_idle_add(moloch_db_file_send_gfunc, 0);
+    }
+}
+/******************************************************************************/
+gboolean moloch_db_flush_gfunc (gpointer user_data )
+{
+    /* File documents never wait, the viewer needs them to find packets */
+    pthread_mutex_lock(&filesLock);
+    moloch_db_file_flush();
+    pthread_mutex_unlock(&filesLock);
+    moloch_db_file_send_gfunc(0);
+
+    /* Sessions are sent by the moloch-db thread once dbFlushTimeout passes, unless asked now */
+    if (user_data && indexerThread) {
+        __atomic_store_n(&indexerFlush, 1, __ATOMIC_SEQ_CST);
+        moloch_db_indexer_wake();
+    }
 
     return TRUE;
 }
@@ -1171,32 +1824,155 @@ void moloch_db_get_sequence_number(char *name, MolochSeqNum_cb func, gpointer uw
     moloch_http_set(esServer, key, key_len, json, json_len, moloch_db_get_sequence_number_cb, r);
 }
 /******************************************************************************/
-uint32_t moloch_db_get_sequence_number_sync(char *name)
+/* File numbers are leased from the fn-<node> sequence a block at a time with
+ * one bulk request that bumps the sequence MOLOCH_DB_FILE_NUM_LEASE times, a
+ * new block is asked for once half of the current one is used.  Rotating a
+ * file only has to wait on ES if the lease hasn't come back by the time every
+ * number is used.  Numbers still leased at exit are never used.
+ *
+ * Numbers are handed out in order.  A lease that comes back after a later one
+ * was fetched sync is merged in, and its numbers below the last one handed
+ * out are dropped, so file numbers never go back in time.
+ *
+ * Only the number is ready ahead of time, not the file.  Its name and first
+ * time come from the packet that starts it, and the disk writer opens it on
+ * its own thread, so creating one is just queueing the file document.
+ */
+#define MOLOCH_DB_FILE_NUM_LEASE 16
+
+static uint32_t         fileNums[MOLOCH_DB_FILE_NUM_LEASE*2];
+static int              fileNumsLen;
+static int              fileNumsLeasing;
+static uint32_t         fileNumsLast;      /* Last number handed out */
+static int              fileNumsRetries;   /* Main thread only */
+
+/******************************************************************************/
+static int moloch_db_file_num_bulk(char *json, int size)
+{
+    int len = 0;
+    int i;
+
+    for (i = 0; i < MOLOCH_DB_FILE_NUM_LEASE; i++) {
+        len += snprintf(json + len, size - len, "{\"index\": {\"_index\": \"%ssequence\", \"_type\": \"sequence\", \"_id\": \"fn-%s\"}}\n{}\n", config.prefix, config.nodeName);
+    }
+    return len;
+}
+/******************************************************************************/
+/* Merge the versions from a lease bulk response into fileNums, returns how
+ * many the response had */
+static int moloch_db_file_num_parse(unsigned char *data, int data_len)
 {
-    char                key[100];
-    int                 key_len;
-    unsigned char      *data;
-    size_t              data_len;
-    unsigned char      *version;
-    uint32_t            version_len;
+    uint32_t       items_len;
+    unsigned char *items = moloch_js0n_get(data, data_len, "items", &items_len);
+    uint32_t       out[2*MOLOCH_DB_FILE_NUM_LEASE+2];
+    int            found = 0;
+    int            i, j;
 
-    key_len = snprintf(key, sizeof(key), "/%ssequence/sequence/%s", config.prefix, name);
+    if (!items)
+        return 0;
 
-    data = moloch_http_send_sync(esServer, "POST", key, key_len, "{}", 2, NULL, &data_len);
-    version = moloch_js0n_get(data, data_len, "_version", &version_len);
+    memset(out, 0, sizeof(out));
+    js0n(items, items_len, out);
+    for (i = 0; out[i] && i < 2*MOLOCH_DB_FILE_NUM_LEASE; i += 2) {
+        uint32_t       index_len;
+        unsigned char *index = moloch_js0n_get(items+out[i], out[i+1], "index", &index_len);
+        uint32_t       version_len = 0;
+        unsigned char *version = index?moloch_js0n_get(index, index_len, "_version", &version_len):0;
+
+        if (!version)
+            continue;
+        found++;
 
-    if (!version_len || !version) {
-        LOG("ERROR - Couldn't fetch sequence: %.*s", (int)data_len, data);
-        return moloch_db_get_sequence_number_sync(name);
-    } else {
-        return atoi((char *)version);
+        uint32_t num = atoi((char *)version);
+        if (num <= fileNumsLast || fileNumsLen >= (int)(sizeof(fileNums)/sizeof(fileNums[0])))
+            continue;
+
+        for (j = fileNumsLen; j > 0 && fileNums[j-1] > num; j--)
+            fileNums[j] = fileNums[j-1];
+        fileNums[j] = num;
+        fileNumsLen++;
     }
+    return found;
 }
 /******************************************************************************/
-uint32_t nextFileNum;
-void moloch_db_fn_seq_cb(uint32_t newSeq, gpointer UNUSED(uw))
+static gboolean moloch_db_file_num_lease_gfunc(gpointer UNUSED(user_data));
+void moloch_db_file_num_lease_cb(int UNUSED(code), unsigned char *data, int data_len, gpointer UNUSED(uw))
 {
-    nextFileNum = newSeq;
+    pthread_mutex_lock(&filesLock);
+    int found = moloch_db_file_num_parse(data, data_len);
+    fileNumsLeasing = (found == 0);
+    pthread_mutex_unlock(&filesLock);
+
+    if (found > 0) {
+        fileNumsRetries = 0;
+        return;
+    }
+
+    /* Still leasing, try again with backoff */
+    LOG("ERROR - Couldn't lease file numbers: %.*s", data_len, data);
+    g_timeout_add_seconds(MIN(1 << fileNumsRetries, 60), moloch_db_file_num_lease_gfunc, 0);
+    if (fileNumsRetries < 6)
+        fileNumsRetries++;
+}
+/******************************************************************************/
+static gboolean moloch_db_file_num_lease_gfunc(gpointer UNUSED(user_data))
+{
+    char *json = moloch_http_get_buffer(MOLOCH_HTTP_BUFFER_SIZE);
+    int   json_len = moloch_db_file_num_bulk(json, MOLOCH_HTTP_BUFFER_SIZE);
+
+    moloch_http_set(esServer, "/_bulk", 6, json, json_len, moloch_db_file_num_lease_cb, 0);
+    return FALSE;
+}
+/******************************************************************************/
+/* Called with filesLock held, the request itself is sent from the main thread */
+void moloch_db_file_num_lease()
+{
+    if (fileNumsLeasing)
+        return;
+
+    fileNumsLeasing = 1;
+    if (moloch_main_thread())
+        moloch_db_file_num_lease_gfunc(0);
+    else
+        g_idle_add(moloch_db_file_num_lease_gfunc, 0);
+}
+/******************************************************************************/
+/* Only used when the async lease is late, or at startup.  Runtime callers
+ * hold filesLock, which keeps the shared sync request to one at a time. */
+static void moloch_db_file_num_lease_sync()
+{
+    char           json[MOLOCH_DB_FILE_NUM_LEASE*200];
+    int            json_len = moloch_db_file_num_bulk(json, sizeof(json));
+    size_t         data_len;
+    unsigned char *data;
+
+    while (1) {
+        data = moloch_http_send_sync(esServer, "POST", "/_bulk", 6, json, json_len, NULL, &data_len);
+        if (data && moloch_db_file_num_parse(data, data_len) > 0 && fileNumsLen > 0)
+            break;
+        LOG("ERROR - Couldn't lease file numbers: %.*s", (int)data_len, data);
+        sleep(1);
+    }
+}
+/******************************************************************************/
+static uint32_t moloch_db_file_num_next()
+{
+    uint32_t num;
+
+    if (fileNumsLen == 0) {
+        if (config.logFileCreation)
+            LOG("File number lease is late, fetching now");
+        moloch_db_file_num_lease_sync();
+    }
+
+    num = fileNums[0];
+    memmove(fileNums, fileNums + 1, (--fileNumsLen) * sizeof(uint32_t));
+    fileNumsLast = num;
+
+    if (fileNumsLen <= MOLOCH_DB_FILE_NUM_LEASE/2)
+        moloch_db_file_num_lease();
+
+    return num;
 }
 /******************************************************************************/
 void moloch_db_load_file_num()
@@ -1258,35 +2034,22 @@ void moloch_db_load_file_num()
     moloch_http_send_sync(esServer, "POST", key, key_len, "{}", 2, NULL, NULL);
 
 fetch_file_num:
-    if (!config.pcapReadOffline) {
-        /* If doing a live file create a file number now */
-        snprintf(key, sizeof(key), "fn-%s", config.nodeName);
-        nextFileNum = moloch_db_get_sequence_number_sync(key);
-    }
+    moloch_db_file_num_lease_sync();
 }
 /******************************************************************************/
-char *moloch_db_create_file(time_t firstPacket, char *name, uint64_t size, int locked, uint32_t *id)
+/* dirPos is the pcapDir to use when name isn't set, -1 for the next one */
+static char *moloch_db_create_file_internal(time_t firstPacket, char *name, uint64_t size, int locked, uint32_t *id, int dirPos)
 {
     char               key[100];
-    int                key_len;
     uint32_t           num;
-    static char        filename[1024];
-    struct tm         *tmp;
-    char              *json = moloch_http_get_buffer(MOLOCH_HTTP_BUFFER_SIZE);
+    char               filename[1024];
+    struct tm          tm, *tmp = &tm;
+    char               json[3000];
     int                json_len;
     const uint64_t     fp = firstPacket;
 
-
-    snprintf(key, sizeof(key), "fn-%s", config.nodeName);
-    if (nextFileNum == 0) {
-        /* If doing an offline file OR the last async call hasn't returned, just get a sync filenum */
-        num = moloch_db_get_sequence_number_sync(key);
-    } else {
-        /* If doing a live file, use current file num and schedule the next one */
-        num = nextFileNum;
-        nextFileNum = 0; /* Don't reuse number */
-        moloch_db_get_sequence_number(key, moloch_db_fn_seq_cb, 0);
-    }
+    pthread_mutex_lock(&filesLock);
+    num = moloch_db_file_num_next();
 
 
     if (name) {
@@ -1303,27 +2066,43 @@ char *moloch_db_create_file(time_t firstPacket, char *name, uint64_t size, int l
         name = g_regex_replace_literal(numHexRegex, name1, -1, 0, (char *)moloch_char_to_hexstr[num%256], 0, NULL);
         g_free(name1);
 
-        json_len = snprintf(json, MOLOCH_HTTP_BUFFER_SIZE, "{\"num\":%d, \"name\":\"%s\", \"first\":%" PRIu64 ", \"node\":\"%s\", \"filesize\":%" PRIu64 ", \"locked\":%d}", num, name, fp, config.nodeName, size, locked);
-        key_len = snprintf(key, sizeof(key), "/%sfiles/file/%s-%d?refresh=true", config.prefix, config.nodeName,num);
+        json_len = snprintf(json, sizeof(json), "{\"num\":%d, \"name\":\"%s\", \"first\":%" PRIu64 ", \"node\":\"%s\", \"filesize\":%" PRIu64 ", \"locked\":%d}", num, name, fp, config.nodeName, size, locked);
     } else {
-        tmp = localtime(&firstPacket);
+        localtime_r(&firstPacket, tmp);
 
-        strcpy(filename, config.pcapDir[config.pcapDirPos++]);
-        if (!config.pcapDir[config.pcapDirPos])
-            config.pcapDirPos = 0;
+        if (dirPos == -1) {
+            dirPos = config.pcapDirPos++;
+            if (!config.pcapDir[config.pcapDirPos])
+                config.pcapDirPos = 0;
+        }
+        strcpy(filename, config.pcapDir[dirPos]);
 
         if (filename[strlen(filename)-1] != '/')
             strcat(filename, "/");
         snprintf(filename+strlen(filename), sizeof(filename) - strlen(filename), "%s-%02d%02d%02d-%08d.pcap", config.nodeName, tmp->tm_year%100, tmp->tm_mon+1, tmp->tm_mday, num);
 
-        json_len = snprintf(json, MOLOCH_HTTP_BUFFER_SIZE, "{\"num\":%d, \"name\":\"%s\", \"first\":%" PRIu64 ", \"node\":\"%s\", \"locked\":%d}", num, filename, fp, config.nodeName, locked);
-        key_len = snprintf(key, sizeof(key), "/%sfiles/file/%s-%d?refresh=true", config.prefix, config.nodeName,num);
+        json_len = snprintf(json, sizeof(json), "{\"num\":%d, \"name\":\"%s\", \"first\":%" PRIu64 ", \"node\":\"%s\", \"locked\":%d}", num, filename, fp, config.nodeName, locked);
     }
 
-    moloch_http_set(esServer, key, key_len, json, json_len, NULL, NULL);
+    snprintf(key, sizeof(key), "%s-%d", config.nodeName, num);
+
+    if (!fJson) {
+        fJson = moloch_http_get_buffer(MOLOCH_HTTP_BUFFER_SIZE);
+        BSB_INIT(fbsb, fJson, MOLOCH_HTTP_BUFFER_SIZE);
+    }
+    BSB_EXPORT_sprintf(fbsb, "{\"index\": {\"_index\": \"%sfiles\", \"_type\": \"file\", \"_id\": \"%s\"}}\n%.*s\n", config.prefix, key, json_len, json);
+    fJsonNum++;
+
+    /* Flushed when the batch is full or by moloch_db_flush_gfunc, whichever is first */
+    if (fJsonNum >= MOLOCH_DB_FILE_BATCH || BSB_REMAINING(fbsb) < (int)sizeof(json) + 200)
+        moloch_db_file_flush();
+
+    pthread_mutex_unlock(&filesLock);
+    if (moloch_main_thread())
+        moloch_db_file_send_gfunc(0);
 
     if (config.logFileCreation)
-        LOG("Creating file %d with key >%s< using >%s<", num, key, json);
+        LOG("Creating file %d with id >%s< using >%s<", num, key, json);
 
     *id = num;
 
@@ -1333,6 +2112,37 @@ char *moloch_db_create_file(time_t firstPacket, char *name, uint64_t size, int l
     return g_strdup(filename);
 }
 /******************************************************************************/
+char *moloch_db_create_file(time_t firstPacket, char *name, uint64_t size, int locked, uint32_t *id)
+{
+    return moloch_db_create_file_internal(firstPacket, name, size, locked, id, -1);
+}
+/******************************************************************************/
+/* Create a file in a particular pcapDir, used when writing to each at once */
+char *moloch_db_create_file_dir(time_t firstPacket, int dirPos, uint32_t *id)
+{
+    return moloch_db_create_file_internal(firstPacket, NULL, 0, 0, id, dirPos);
+}
+/******************************************************************************/
+/* Record the last packet time of a file once it is closed.  The update goes
+ * in the same bulk batch as the file documents so it can't pass the create.
+ */
+void moloch_db_update_file(uint32_t id, time_t lastPacket)
+{
+    pthread_mutex_lock(&filesLock);
+    if (!fJson) {
+        fJson = moloch_http_get_buffer(MOLOCH_HTTP_BUFFER_SIZE);
+        BSB_INIT(fbsb, fJson, MOLOCH_HTTP_BUFFER_SIZE);
+    }
+    BSB_EXPORT_sprintf(fbsb, "{\"update\": {\"_index\": \"%sfiles\", \"_type\": \"file\", \"_id\": \"%s-%u\"}}\n{\"doc\": {\"last\": %" PRIu64 "}}\n", config.prefix, config.nodeName, id, (uint64_t)lastPacket);
+    fJsonNum++;
+
+    if (fJsonNum >= MOLOCH_DB_FILE_BATCH || BSB_REMAINING(fbsb) < 1000)
+        moloch_db_file_flush();
+    pthread_mutex_unlock(&filesLock);
+    if (moloch_main_thread())
+        moloch_db_file_send_gfunc(0);
+}
+/******************************************************************************/
 void moloch_db_check()
 {
     size_t             data_len;
@@ -1499,7 +2309,9 @@ void moloch_db_tag_create_cb(int UNUSED(code), unsigned char *data, int UNUSED(d
     MolochTag_t *tag = MOLOCH_TYPE_ALLOC(MolochTag_t);
     tag->tagName = g_strdup(r->tag);
     tag->tagValue = r->newSeq;
+    pthread_mutex_lock(&tagsLock);
     HASH_ADD(tag_, tags, tag->tagName, tag);
+    pthread_mutex_unlock(&tagsLock);
 
     if (r->func)
         r->func(r->uw, r->tagtype, r->tag, r->newSeq);
@@ -1547,7 +2359,9 @@ void moloch_db_tag_cb(int UNUSED(code), unsigned char *data, int data_len, gpoin
             tag->tagValue = atol((char*)n+1);
         else
             tag->tagValue = atol((char*)n);
+        pthread_mutex_lock(&tagsLock);
         HASH_ADD(tag_, tags, tag->tagName, tag);
+        pthread_mutex_unlock(&tagsLock);
 
         if (r->func)
             r->func(r->uw, r->tagtype, r->tag, tag->tagValue);
@@ -1558,16 +2372,21 @@ void moloch_db_tag_cb(int UNUSED(code), unsigned char *data, int data_len, gpoin
     moloch_db_get_sequence_number("tags", moloch_db_tag_seq_cb, r) ;
 }
 /******************************************************************************/
+/* Safe from any thread */
 uint32_t moloch_db_peek_tag(const char *tagname)
 {
     MolochTag_t *tag;
-    HASH_FIND(tag_, tags, tagname, tag);
+    uint32_t     tagValue = 0;
 
-    if (!tag)
-        return 0;
-    return tag->tagValue;
+    pthread_mutex_lock(&tagsLock);
+    HASH_FIND(tag_, tags, tagname, tag);
+    if (tag)
+        tagValue = tag->tagValue;
+    pthread_mutex_unlock(&tagsLock);
+    return tagValue;
 }
 /******************************************************************************/
+/* Main thread only, packet threads ask thru moloch_nids_add_tag */
 void moloch_db_get_tag(void *uw, int tagtype, const char *tagname, MolochTag_cb func)
 {
     MolochTag_t *tag;
@@ -1584,7 +2403,9 @@ void moloch_db_get_tag(void *uw, int tagtype, const char *tagname, MolochTag_cb
         MolochTag_t *tag = MOLOCH_TYPE_ALLOC(MolochTag_t);
         tag->tagName = g_strdup(tagname);
         tag->tagValue = tagNum++;
+        pthread_mutex_lock(&tagsLock);
         HASH_ADD(tag_, tags, tag->tagName, tag);
+        pthread_mutex_unlock(&tagsLock);
 
         if (func)
             func(uw, tagtype, tagname, tag->tagValue);
@@ -1817,6 +2638,7 @@ void moloch_db_init()
         esServer = moloch_http_create_server(config.elasticsearch, 9200, config.maxESConns, config.maxESRequests, config.compressES);
     }
     DLL_INIT(t_, &tagRequests);
+    DLL_INIT(b_, &fileQ);
     HASH_INIT(tag_, tags, moloch_db_tag_hash, moloch_db_tag_cmp);
     myPid = getpid();
     gettimeofday(&startTime, NULL);
@@ -1853,6 +2675,28 @@ void moloch_db_init()
         timers[1] = g_timeout_add_seconds( 5, moloch_db_update_stats_gfunc, (gpointer)1);
         timers[2] = g_timeout_add_seconds(60, moloch_db_update_stats_gfunc, (gpointer)2);
         timers[3] = g_timeout_add_seconds( 1, moloch_db_flush_gfunc, 0);
+
+        uint32_t size = 1;
+        while (size < config.dbIndexerQueueSize)
+            size <<= 1;
+        recordRing = malloc(size * sizeof(MolochDbRecord_t *));
+        recordMask = size - 1;
+
+        if (config.compressES) {
+            z_strm.zalloc = Z_NULL;
+            z_strm.zfree  = Z_NULL;
+            z_strm.opaque = Z_NULL;
+            deflateInit(&z_strm, Z_DEFAULT_COMPRESSION);
+        }
+
+        DLL_INIT(b_, &bulkQ);
+        bulkEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (bulkEventFd < 0) {
+            printf("Couldn't create db indexer eventfd with %s\n", strerror(errno));
+            exit(1);
+        }
+        moloch_watch_fd(bulkEventFd, MOLOCH_GIO_READ_COND, moloch_db_bulk_cb, NULL);
+        indexerThread = g_thread_new("moloch-db", &moloch_db_indexer_thread, NULL);
     }
 }
 /******************************************************************************/
@@ -1866,6 +2710,18 @@ void moloch_db_exit()
         }
 
         moloch_db_flush_gfunc((gpointer)1);
+
+        /* Sessions saved while exiting are all queued by now, let the thread finish them */
+        pthread_mutex_lock(&indexerLock);
+        __atomic_store_n(&indexerQuit, 1, __ATOMIC_SEQ_CST);
+        pthread_cond_broadcast(&indexerCond);
+        pthread_cond_broadcast(&bulkRoomCond);
+        pthread_mutex_unlock(&indexerLock);
+        g_thread_join(indexerThread);
+        moloch_db_bulk_cb(0, 0, NULL);
+        if (recordRingFull)
+            LOG("dbIndexerQueueSize was full %" PRIu64 " times", recordRingFull);
+
         moloch_db_update_stats();
         moloch_http_free_server(esServer);
     }
@@ -36,6 +36,13 @@
      (head)->name##count++ \
     )
 
+#define DLL_ADD_AFTER(name,head,after,element) \
+    ((element)->name##next           = (after)->name##next, \
+     (element)->name##prev           = (void *)(after), \
+     (after)->name##next->name##prev = (element), \
+     (after)->name##next             = (element), \
+     (head)->name##count++ \
+    )
 
 #define DLL_REMOVE(name,head,element) \
     ((element)->name##prev->name##next = (element)->name##next, \
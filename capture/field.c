@@ -28,6 +28,9 @@ extern MolochConfig_t        config;
 HASH_VAR(d_, fieldsByDb, MolochFieldInfo_t, 13);
 HASH_VAR(e_, fieldsByExp, MolochFieldInfo_t, 13);
 
+/* Sessions share this until their first field is added, maxFields is a uint8_t */
+static MolochField_t        *noFields[256];
+
 /******************************************************************************/
 int moloch_field_exp_cmp(const void *keyv, const void *elementv)
 {
@@ -430,6 +433,18 @@ void moloch_field_exit()
     );
 }
 /******************************************************************************/
+void moloch_field_session_init(MolochSession_t *session)
+{
+    session->fields    = noFields;
+    session->maxFields = config.maxField;
+}
+/******************************************************************************/
+static inline void moloch_field_session_alloc(MolochSession_t *session)
+{
+    if (session->fields == noFields)
+        session->fields = MOLOCH_SIZE_ALLOC0(fields, sizeof(MolochField_t *)*session->maxFields);
+}
+/******************************************************************************/
 gboolean moloch_field_string_add(int pos, MolochSession_t *session, const char *string, int len, gboolean copy)
 {
     MolochField_t         *field;
@@ -440,6 +455,7 @@ gboolean moloch_field_string_add(int pos, MolochSession_t *session, const char *
         return FALSE;
 
     if (!session->fields[pos]) {
+        moloch_field_session_alloc(session);
         field = MOLOCH_TYPE_ALLOC(MolochField_t);
         session->fields[pos] = field;
         if (len == -1)
@@ -522,6 +538,7 @@ gboolean moloch_field_int_add(int pos, MolochSession_t *session, int i)
         return FALSE;
 
     if (!session->fields[pos]) {
+        moloch_field_session_alloc(session);
         field = MOLOCH_TYPE_ALLOC(MolochField_t);
         session->fields[pos] = field;
         field->jsonSize = 3 + config.fields[pos]->dbFieldLen + 10;
@@ -633,6 +650,7 @@ gboolean moloch_field_certsinfo_add(int pos, MolochSession_t *session, MolochCer
     MolochCertsInfo_t          *hci;
 
     if (!session->fields[pos]) {
+        moloch_field_session_alloc(session);
         field = MOLOCH_TYPE_ALLOC(MolochField_t);
         session->fields[pos] = field;
         field->jsonSize = 3 + config.fields[pos]->dbFieldLen + len;
@@ -675,6 +693,11 @@ void moloch_field_free(MolochSession_t *session)
     MolochCertsInfo_t        *hci;
     MolochCertsInfoHashStd_t *cihash;
 
+    if (session->fields == noFields) {
+        session->fields = 0;
+        return;
+    }
+
     for (pos = 0; pos < session->maxFields; pos++) {
         if (!(field = session->fields[pos]))
             continue;
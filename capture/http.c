@@ -26,6 +26,7 @@
 #include <unistd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <pthread.h>
 #include <curl/curl.h>
 #include "moloch.h"
 #include "zlib.h"
@@ -69,6 +70,8 @@ typedef struct molochhttpconnhead_t {
 } MolochHttpConnHead_t;
 
 HASH_VAR(s_, connections, MolochHttpConnHead_t, 119);
+/* Connections come and go on the main thread, packet threads check them */
+static pthread_mutex_t connectionsLock = PTHREAD_MUTEX_INITIALIZER;
 
 uint64_t connectionsSet[2048];
 #define BIT_ISSET(bit, bits) ((bits[bit/64] & (1 << (bit % 64))) != 0)
@@ -430,9 +433,11 @@ static gboolean moloch_http_curl_watch_open_callback(int fd, GIOCondition condit
     if (!conn) {
         conn = MOLOCH_TYPE_ALLOC0(MolochHttpConn_t);
 
-        HASH_ADD(h_, connections, sessionId, conn);
         memcpy(&conn->sessionIda, sessionId, 8);
         memcpy(&conn->sessionIdb, sessionId+8, 4);
+        pthread_mutex_lock(&connectionsLock);
+        HASH_ADD(h_, connections, sessionId, conn);
+        pthread_mutex_unlock(&connectionsLock);
         server->connections++;
     } else {
         LOG("ERROR - Already added %x %s", condition, moloch_friendly_session_id(6, localAddress.sin_addr.s_addr, htons(localAddress.sin_port),
@@ -474,7 +479,9 @@ int moloch_http_curl_close_callback(void *serverV, curl_socket_t fd)
     HASH_FIND(h_, connections, sessionId, conn);
     BIT_CLR(fd, connectionsSet);
     if (conn) {
+        pthread_mutex_lock(&connectionsLock);
         HASH_REMOVE(h_, connections, conn);
+        pthread_mutex_unlock(&connectionsLock);
         MOLOCH_TYPE_FREE(MolochHttpConn_t, conn);
     }
 
@@ -500,15 +507,18 @@ gboolean moloch_http_send(void *serverV, char *method, char *key, uint32_t key_l
 
     MolochHttpRequest_t       *request = MOLOCH_TYPE_ALLOC0(MolochHttpRequest_t);
 
+    gboolean encoded = FALSE;
     if (headers) {
         int i;
         for (i = 0; headers[i]; i++) {
             request->headerList = curl_slist_append(request->headerList, headers[i]);
+            if (strncasecmp(headers[i], "Content-Encoding:", 17) == 0)
+                encoded = TRUE;
         }
     }
 
-    // Do we need to compress item
-    if (server->compress && data && data_len > 1000) {
+    // Do we need to compress item, callers that already did pass the header
+    if (server->compress && !encoded && data && data_len > 1000) {
         char            *buf = moloch_http_get_buffer(data_len);
         int              ret;
 
@@ -658,6 +668,8 @@ gboolean moloch_http_is_moloch(uint32_t hash, char *key)
 {
     MolochHttpConn_t *conn;
 
+    pthread_mutex_lock(&connectionsLock);
     HASH_FIND_HASH(h_, connections, hash, key, conn);
+    pthread_mutex_unlock(&connectionsLock);
     return (conn?1:0);
 }
@@ -22,6 +22,7 @@
 #include <grp.h>
 #include <errno.h>
 #include <ctype.h>
+#include <pthread.h>
 #include <sys/resource.h>
 #ifdef _POSIX_MEMLOCK
 #include <sys/mman.h>
@@ -46,6 +47,7 @@ extern MolochWriterQueueLength moloch_writer_queue_length;
 /******************************************************************************/
 static gboolean showVersion    = FALSE;
 static gboolean needNidsExit   = TRUE;
+static pthread_t mainThread;
 
 /******************************************************************************/
 gboolean moloch_debug_flag()
@@ -372,9 +374,28 @@ void moloch_session_id (char *buf, uint32_t addr1, uint16_t port1, uint32_t addr
  */
 uint32_t moloch_session_hash(const void *key)
 {
-    unsigned char *p = (unsigned char *)key;
-    //return ((p[2] << 16 | p[3] << 8 | p[4]) * 59) ^ (p[8] << 16 | p[9] << 8 |  p[10]);
-    return (((p[1]<<24) ^ (p[2]<<18) ^ (p[3]<<12) ^ (p[4]<<6) ^ p[5]) * 13) ^ (p[8]<<24|p[9]<<16 | p[10]<<8 | p[11]);
+    uint32_t a, b, c;
+
+    /* Bob Jenkins lookup3 final mix over all 3 words of the key */
+    memcpy(&a, key, 4);
+    memcpy(&b, (char *)key + 4, 4);
+    memcpy(&c, (char *)key + 8, 4);
+
+    a += 0xdeadbeef + MOLOCH_SESSIONID_LEN;
+    b += 0xdeadbeef + MOLOCH_SESSIONID_LEN;
+    c += 0xdeadbeef + MOLOCH_SESSIONID_LEN;
+
+#define MOLOCH_ROT(x,k) (((x)<<(k)) | ((x)>>(32-(k))))
+    c ^= b; c -= MOLOCH_ROT(b,14);
+    a ^= c; a -= MOLOCH_ROT(c,11);
+    b ^= a; b -= MOLOCH_ROT(a,25);
+    c ^= b; c -= MOLOCH_ROT(b,16);
+    a ^= c; a -= MOLOCH_ROT(c,4);
+    b ^= a; b -= MOLOCH_ROT(a,14);
+    c ^= b; c -= MOLOCH_ROT(b,24);
+#undef MOLOCH_ROT
+
+    return c;
 }
 
 /******************************************************************************/
@@ -467,7 +488,7 @@ gboolean moloch_quit_gfunc (gpointer UNUSED(user_data))
         moloch_nids_exit();
         return TRUE;
     }
-    if (moloch_db_tags_loading() == 0 && moloch_plugins_outstanding() == 0 && moloch_writer_queue_length() == 0 && moloch_http_queue_length(esServer) == 0) {
+    if (moloch_db_tags_loading() == 0 && moloch_plugins_outstanding() == 0 && moloch_writer_queue_length() == 0 && moloch_db_indexer_queue_length() == 0 && moloch_http_queue_length(esServer) == 0) {
         g_main_loop_quit(mainLoop);
         return FALSE;
     }
@@ -479,6 +500,12 @@ void moloch_quit()
     g_timeout_add(100, moloch_quit_gfunc, 0);
 }
 /******************************************************************************/
+/* The glib main loop, libcurl and everything else only it touches run on this thread */
+gboolean moloch_main_thread()
+{
+    return pthread_equal(pthread_self(), mainThread);
+}
+/******************************************************************************/
 /*
  * Don't actually init nids/pcap until all the pre tags are loaded
  */
@@ -555,6 +582,7 @@ void moloch_mlockall_init()
 /******************************************************************************/
 int main(int argc, char **argv)
 {
+    mainThread = pthread_self();
     signal(SIGHUP, reload);
     signal(SIGINT, cleanup);
     signal(SIGUSR1, exit);
@@ -31,7 +31,11 @@
 #define UNUSED(x) x __attribute((unused))
 
 
-#define MOLOCH_API_VERSION 14
+#define MOLOCH_API_VERSION 16
+
+#define MOLOCH_MAX_SESSION_SETS 24
+#define MOLOCH_MAX_INTERFACES     16
+#define MOLOCH_MAX_PACKET_THREADS 16
 
 /******************************************************************************/
 /*
@@ -233,10 +237,14 @@ typedef struct moloch_config {
     char     *prefix;
     char     *nodeClass;
     char     *elasticsearch;
-    char     *interface;
+    char    **interface;
+    char     *pcapReadMethod;
+    char     *pcapCompression;
     int       pcapDirPos;
     char    **pcapDir;
+    char    **pcapTeeWriters;
     char     *bpf;
+    char    **interfaceBpf;
     char     *yara;
     char     *emailYara;
     char     *geoipFile;
@@ -262,17 +270,38 @@ typedef struct moloch_config {
     uint32_t  tcpTimeout;
     uint32_t  tcpSaveTimeout;
     uint32_t  maxStreams;
+    uint32_t  timeoutsPerPacket;
+    uint32_t  timeoutsPerTick;
+    uint32_t  maxTcpOutOfOrderPackets;
+    uint32_t  maxTcpOutOfOrderBytes;
     uint32_t  maxPackets;
     uint32_t  dbBulkSize;
     uint32_t  dbFlushTimeout;
+    uint32_t  dbIndexerQueueSize;
     uint32_t  maxESConns;
     uint32_t  maxESRequests;
     uint32_t  logEveryXPackets;
     uint32_t  packetsPerPoll;
+    uint32_t  offlineParallelFiles;
+    uint32_t  packetThreads;
+    uint32_t  offlineMaxDiskQueue;
+    uint32_t  offlineMaxESQueue;
     uint32_t  pcapBufferSize;
+    uint32_t  tpacketv3BlockSize;
+    uint32_t  tpacketv3NumBlocks;
+    uint32_t  tpacketv3FanoutGroup;
+    uint32_t  tpacketv3MaxShunts;
     uint32_t  pcapWriteSize;
     uint32_t  maxWriteBuffers;
     uint32_t  maxFreeOutputBuffers;
+    uint32_t  pcapWriteUringDepth;
+    uint32_t  pcapWriteBufferPool;
+    uint32_t  pcapCompressionBlockSize;
+    uint32_t  pcapCompressionThreads;
+    uint32_t  pcapCompressionLevel;
+    uint32_t  pcapTimeIndexPackets;
+    uint32_t  pcapTimeIndexMs;
+    uint32_t  pcapTeeMaxQueue;
 
 
     char      logUnknownProtocols;
@@ -284,6 +313,12 @@ typedef struct moloch_config {
     char      parseCookieValue;
     char      compressES;
     char      antiSynDrop;
+    char      sessionHugePages;
+    char      packetPosRanges;
+    char      offlineMmap;
+    char      pcapDirStripe;
+    char      pcapWriteBufferHugePages;
+    char      pcapWriteBufferLock;
 } MolochConfig_t;
 
 typedef struct {
@@ -318,71 +353,124 @@ typedef struct {
  * SPI Data Storage
  */
 #define MOLOCH_SESSIONID_LEN 12
-typedef struct moloch_session {
-    struct moloch_session *tcp_next, *tcp_prev;
-    struct moloch_session *q_next, *q_prev;
-    struct moloch_session *h_next, *h_prev;
-    int                    h_bucket;
-    uint32_t               h_hash;
+/* See packetpos.c */
+#define MOLOCH_PACKET_POS_INLINE     32
+#define MOLOCH_PACKET_POS_CHUNK_SIZE 246
+typedef struct moloch_packet_pos_chunk MolochPacketPosChunk_t;
 
+typedef struct {
+    MolochPacketPosChunk_t *chunks;
+    MolochPacketPosChunk_t *tail;
+    uint64_t                lastPos;
+    uint32_t                count;
+    uint16_t                files;
+    uint8_t                 inlineUsed;
+    uint8_t                 inlineData[MOLOCH_PACKET_POS_INLINE];
+} MolochPacketPos_t;
+
+/* Laid out so looking up a session and the per packet counters are all in
+ * the first 64 byte cache line, tcp/parser state in the second, packet
+ * positions in the third, and everything used only at creation or save time
+ * after that.
+ * Sessions come from a 64 byte aligned slab, see moloch_nids_session_alloc.
+ */
+typedef struct moloch_session {
+    /* Cache line 0 */
     uint64_t               sessionIda;
     uint32_t               sessionIdb;
-    MolochField_t        **fields;
-
-    void                  **pluginData;
-
-    MolochParserInfo_t    *parserInfo;
-
-    GArray                *filePosArray;
-    GArray                *fileLenArray;
-    GArray                *fileNumArray;
-    char                  *rootId;
-
-    struct timeval         firstPacket;
-    struct timeval         lastPacket;
-    char                   firstBytes[2][8];
-
-    uint64_t               bytes[2];
-    uint64_t               databytes[2];
-
-
-    uint32_t               lastFileNum;
-    uint32_t               lastSave;
     uint32_t               addr1;
     uint32_t               addr2;
-    uint32_t               packets[2];
-
     uint16_t               port1;
     uint16_t               port2;
-    uint16_t               offsets[2];
-    uint16_t               outstandingQueries;
-    uint16_t               segments;
-    uint16_t               stopSaving;
+    uint32_t               packets[2];
+    struct timeval         lastPacket;
+    uint64_t               bytes[2];
 
-    uint8_t                consumed[2];
+    /* Cache line 1 */
+    uint64_t               databytes[2];
+    struct moloch_tcp_queue *tcpQueue;
+    uint32_t               tcpSeq[2];
+    uint32_t               lastFileNum;
+    uint16_t               stopSaving;
     uint8_t                protocol;
-    uint8_t                firstBytesLen[2];
-    uint8_t                ip_tos;
     uint8_t                tcp_flags;
+
+    MolochParserInfo_t    *parserInfo;
     uint8_t                parserLen;
     uint8_t                parserNum;
-
+    uint8_t                firstBytesLen[2];
+    uint8_t                set;
     uint8_t                maxFields;
-    uint16_t               haveNidsTcp:1;
+    uint16_t               haveTcpSeq:2;
+    uint16_t               tcpFin:2;
     uint16_t               needSave:1;
     uint16_t               stopSPI:1;
+    uint16_t               shunted:1;
+    uint16_t               dontSaveHit:1;
+    uint32_t               lastSave;
+    uint16_t               outstandingQueries;
+    uint16_t               segments;
+
+    /* Cache line 2 */
+    MolochPacketPos_t      packetPos;
+
+    /* Cold */
+    struct moloch_session *q_next, *q_prev;
+    uint32_t               h_hash;
+    uint32_t               timerDue;
+
+    MolochField_t        **fields;
+    void                  **pluginData;
+    char                  *rootId;
+
+    struct timeval         firstPacket;
+    char                   firstBytes[2][8];
+    uint8_t                ip_tos;
 } MolochSession_t;
 
 typedef struct moloch_session_head {
-    struct moloch_session *tcp_next, *tcp_prev;
     struct moloch_session *q_next, *q_prev;
-    struct moloch_session *h_next, *h_prev;
-    int                    h_bucket;
-    int                    tcp_count;
     int                    q_count;
-    int                    h_count;
 } MolochSessionHead_t;
 
+/* See sessiontable.c */
+#define MOLOCH_SESSION_TABLE_SLOTS 8
+typedef struct {
+    uint32_t               hash[MOLOCH_SESSION_TABLE_SLOTS];
+    MolochSession_t       *session[MOLOCH_SESSION_TABLE_SLOTS];
+} MolochSessionBucket_t;
+
+typedef struct {
+    MolochSessionBucket_t *buckets;
+    uint32_t               mask;
+    uint32_t               count;
+    uint32_t               deleted;
+} MolochSessionBuckets_t;
+
+typedef struct {
+    MolochSessionBuckets_t cur;
+    MolochSessionBuckets_t old;
+    uint32_t               rehashPos;
+    uint32_t               minBuckets;
+    uint32_t               maxProbe;
+    uint32_t               resizes;
+    uint64_t               lookups;
+    uint64_t               probes;
+} MolochSessionTable_t;
+
+typedef struct {
+    uint64_t               count;
+    uint64_t               slots;
+    uint64_t               deleted;
+    uint64_t               lookups;
+    uint64_t               probes;
+    uint32_t               maxProbe;
+    uint32_t               resizes;
+    uint32_t               rehashing;
+} MolochSessionTableStats_t;
+
+typedef void (* MolochSessionTableFunc) (MolochSession_t *session);
+
 
 #define MOLOCH_TYPE_ALLOC(type) (type *)(g_slice_alloc(sizeof(type)))
 #define MOLOCH_TYPE_ALLOC0(type) (type *)(g_slice_alloc0(sizeof(type)))
@@ -449,6 +537,7 @@ const char *moloch_memstr(const char *haystack, int haysize, const char *needle,
 const char *moloch_memcasestr(const char *haystack, int haysize, const char *needle, int needlesize);
 
 void moloch_quit();
+gboolean moloch_main_thread();
 
 
 /******************************************************************************/
@@ -476,7 +565,11 @@ char moloch_config_boolean(GKeyFile *keyfile, char *key, char d);
 void     moloch_db_init();
 int      moloch_db_tags_loading();
 char    *moloch_db_create_file(time_t firstPacket, char *name, uint64_t size, int locked, uint32_t *id);
+char    *moloch_db_create_file_dir(time_t firstPacket, int dirPos, uint32_t *id);
+void     moloch_db_update_file(uint32_t id, time_t lastPacket);
 void     moloch_db_save_session(MolochSession_t *session, int final);
+uint32_t moloch_db_indexer_queue_length();
+uint32_t moloch_db_indexer_bulk_length();
 void     moloch_db_get_tag(void *uw, int tagtype, const char *tag, MolochTag_cb func);
 uint32_t moloch_db_peek_tag(const char *tagname);
 void     moloch_db_add_local_ip(char *str, MolochIpInfo_t *ii);
@@ -557,6 +650,20 @@ void     moloch_nids_add_tag_type(MolochSession_t *session, int field, const cha
 gboolean moloch_nids_has_tag(MolochSession_t *session, const char *tag);
 uint32_t moloch_nids_dropped_packets();
 uint32_t moloch_nids_monitoring_sessions();
+uint64_t moloch_nids_dont_save_hits(int i);
+
+typedef struct {
+    char     *name;
+    uint64_t  packets;
+    uint64_t  bytes;
+    uint32_t  recv;
+    uint32_t  dropped;
+} MolochInterfaceStats_t;
+
+int      moloch_nids_input();
+uint64_t moloch_nids_input_pos();
+int      moloch_nids_interfaces();
+void     moloch_nids_interface_stats(int num, MolochInterfaceStats_t *stats);
 uint32_t moloch_nids_disk_queue();
 void     moloch_nids_exit();
 
@@ -565,6 +672,113 @@ void     moloch_nids_decr_outstanding(MolochSession_t *session);
 
 char    *moloch_friendly_session_id (int protocol, uint32_t addr1, int port1, uint32_t addr2, int port2);
 
+/******************************************************************************/
+/*
+ * tcp.c
+ */
+
+gboolean moloch_tcp_packet(MolochSession_t *session, struct tcphdr *tcphdr, int len, int which);
+void     moloch_tcp_free(MolochSession_t *session);
+
+/******************************************************************************/
+/*
+ * sessiontable.c
+ */
+
+void             moloch_session_table_init(MolochSessionTable_t *table, uint32_t minBuckets);
+MolochSession_t *moloch_session_table_find(MolochSessionTable_t *table, uint32_t hash, const void *key);
+void             moloch_session_table_add(MolochSessionTable_t *table, uint32_t hash, MolochSession_t *session);
+void             moloch_session_table_remove(MolochSessionTable_t *table, MolochSession_t *session);
+uint32_t         moloch_session_table_count(MolochSessionTable_t *table);
+void             moloch_session_table_pop_all(MolochSessionTable_t *table, MolochSessionTableFunc func);
+void             moloch_session_table_stats(MolochSessionTable_t *table, MolochSessionTableStats_t *stats);
+
+/******************************************************************************/
+/*
+ * packetpos.c
+ */
+
+void     moloch_packet_pos_add_file(MolochPacketPos_t *pp, uint32_t fileNum);
+void     moloch_packet_pos_add(MolochPacketPos_t *pp, uint64_t pos, uint16_t len);
+void     moloch_packet_pos_json(MolochPacketPos_t *pp, BSB *jbsb);
+void     moloch_packet_pos_free(MolochPacketPos_t *pp);
+
+/******************************************************************************/
+/*
+ * readers.c
+ */
+
+typedef struct moloch_reader MolochReader_t;
+
+/* Batches a reader can have waiting on the main thread */
+#define MOLOCH_READER_BATCHES     8
+
+typedef int  (*MolochReaderRead)(MolochReader_t *reader, void *uw);
+typedef void (*MolochReaderPacket)(int num, const struct pcap_pkthdr *h, const u_char *data, uint64_t pos);
+typedef void (*MolochReaderBlock)(int num, void *block, MolochReaderPacket packet);
+typedef int  (*MolochReaderBusy)(int num);
+typedef void (*MolochReaderDone)(int num, int status);
+
+MolochReader_t *moloch_reader_start(const char *name, int num, int live, MolochReaderRead read, MolochReaderPacket packet, MolochReaderBlock block, MolochReaderBusy busy, MolochReaderDone done, void *uw);
+void     moloch_reader_packet(MolochReader_t *reader, const struct pcap_pkthdr *h, const u_char *data, uint64_t pos);
+int      moloch_reader_block(MolochReader_t *reader, void *block);
+void     moloch_reader_stop(MolochReader_t *reader);
+
+/******************************************************************************/
+/*
+ * reader-tpacketv3.c
+ */
+
+void     moloch_tpacketv3_init(char **interfaces, char **bpfs, uint32_t snaplen);
+int      moloch_tpacketv3_read(MolochReader_t *reader, void *uw);
+void     moloch_tpacketv3_block(int num, void *block, MolochReaderPacket packet);
+int      moloch_tpacketv3_datalink_type();
+int      moloch_tpacketv3_stats(int num, struct pcap_stat *ps);
+void     moloch_tpacketv3_exit();
+
+typedef struct {
+    uint64_t shunted;
+    uint64_t shuntedPackets;
+    uint64_t shuntedBytes;
+    uint64_t shuntsFull;
+    uint32_t active;
+} MolochTpacketv3Stats_t;
+
+gboolean moloch_tpacketv3_shunt_add(MolochSession_t *session);
+void     moloch_tpacketv3_shunt_fold(MolochSession_t *session);
+void     moloch_tpacketv3_shunt_remove(MolochSession_t *session);
+void     moloch_tpacketv3_shunt_stats(MolochTpacketv3Stats_t *stats);
+
+/******************************************************************************/
+/*
+ * reader-mmap.c
+ */
+
+typedef struct moloch_mmap MolochMmap_t;
+
+MolochMmap_t *moloch_mmap_open(const char *filename, char *errbuf);
+void     moloch_mmap_setfilter(MolochMmap_t *mm, struct bpf_program *bpf);
+int      moloch_mmap_datalink(MolochMmap_t *mm);
+int      moloch_mmap_snapshot(MolochMmap_t *mm);
+uint64_t moloch_mmap_size(MolochMmap_t *mm);
+uint64_t moloch_mmap_pos(MolochMmap_t *mm);
+int      moloch_mmap_dispatch(MolochMmap_t *mm, int cnt, pcap_handler cb, u_char *user);
+void     moloch_mmap_close(MolochMmap_t *mm);
+
+/******************************************************************************/
+/*
+ * timeindex.c
+ */
+
+typedef struct moloch_time_index MolochTimeIndex_t;
+
+MolochTimeIndex_t *moloch_time_index_alloc();
+void     moloch_time_index_add(MolochTimeIndex_t *ti, const struct timeval *ts, uint64_t pos);
+char    *moloch_time_index_encode(MolochTimeIndex_t *ti, int *len);
+void     moloch_time_index_save(MolochTimeIndex_t *ti, const char *pcapName);
+void     moloch_time_index_free(MolochTimeIndex_t *ti);
+void     moloch_time_index_exit();
+
 /******************************************************************************/
 /*
  * plugins.c
@@ -572,7 +786,7 @@ char    *moloch_friendly_session_id (int protocol, uint32_t addr1, int port1, ui
 typedef void (* MolochPluginInitFunc) ();
 typedef void (* MolochPluginIpFunc) (MolochSession_t *session, struct ip *packet, int len);
 typedef void (* MolochPluginUdpFunc) (MolochSession_t *session, struct udphdr *udphdr, unsigned char *data, int len);
-typedef void (* MolochPluginTcpFunc) (MolochSession_t *session, struct tcp_stream *a_tcp);
+typedef void (* MolochPluginTcpFunc) (MolochSession_t *session, const unsigned char *data, int len, int which);
 typedef void (* MolochPluginSaveFunc) (MolochSession_t *session, int final);
 typedef void (* MolochPluginNewFunc) (MolochSession_t *session);
 typedef void (* MolochPluginExitFunc) ();
@@ -644,7 +858,7 @@ void moloch_plugins_cb_save(MolochSession_t *session, int final);
 void moloch_plugins_cb_new(MolochSession_t *session);
 void moloch_plugins_cb_ip(MolochSession_t *session, struct ip *packet, int len);
 void moloch_plugins_cb_udp(MolochSession_t *session, struct udphdr *udphdr, unsigned char *data, int len);
-void moloch_plugins_cb_tcp(MolochSession_t *session, struct tcp_stream *a_tcp);
+void moloch_plugins_cb_tcp(MolochSession_t *session, const unsigned char *data, int len, int which);
 
 void moloch_plugins_cb_hp_omb(MolochSession_t *session, http_parser *parser);
 void moloch_plugins_cb_hp_ou(MolochSession_t *session, http_parser *parser, const char *at, size_t length);
@@ -684,6 +898,7 @@ gboolean moloch_field_int_add(int pos, MolochSession_t *session, int i);
 gboolean moloch_field_certsinfo_add(int pos, MolochSession_t *session, MolochCertsInfo_t *info, int len);
 int  moloch_field_count(int pos, MolochSession_t *session);
 void moloch_field_certsinfo_free (MolochCertsInfo_t *certs);
+void moloch_field_session_init(MolochSession_t *session);
 void moloch_field_free(MolochSession_t *session);
 void moloch_field_exit();
 
@@ -694,9 +909,9 @@ void moloch_field_exit();
 
 typedef void (*MolochWriterInit)(char *name);
 typedef uint32_t (*MolochWriterQueueLength)();
-typedef void (*MolochWriterWrite)(const struct pcap_pkthdr *h, const u_char *sp, uint32_t *fileNum, uint64_t *filePos);
+typedef void (*MolochWriterWrite)(const MolochSession_t *session, const struct pcap_pkthdr *h, const u_char *sp, uint32_t *fileNum, uint64_t *filePos);
 typedef void (*MolochWriterFlush)(gboolean all);
-typedef void (*MolochWriterNextInput)(FILE *file, char *filename);
+typedef void (*MolochWriterNextInput)(FILE *file, MolochMmap_t *mm, char *filename);
 typedef void (*MolochWriterExit)();
 typedef char * (*MolochWriterName)();
 
@@ -711,6 +926,27 @@ extern MolochWriterName moloch_writer_name;
 void moloch_writers_init();
 void moloch_writers_start(char *name);
 void moloch_writers_add(char *name, MolochWriterInit func);
+MolochWriterInit moloch_writers_get(char *name);
+void moloch_writer_lock();
+void moloch_writer_unlock();
+
+typedef struct {
+    uint64_t  size;
+    uint64_t  highWater;
+    uint64_t  exhausted;
+} MolochWriterPoolStats_t;
+
+void writer_disk_pool_stats(MolochWriterPoolStats_t *stats);
+
+typedef struct {
+    char     *name;
+    uint32_t  queueLength;
+    int       dropping;
+    uint64_t  dropped;
+} MolochTeeWriterStats_t;
+
+int  writer_tee_secondaries();
+void writer_tee_stats(int num, MolochTeeWriterStats_t *stats);
 
 /******************************************************************************/
 /*
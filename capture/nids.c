@@ -34,6 +34,7 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <pthread.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include "pcap.h"
@@ -46,17 +47,13 @@ extern GMainLoop            *mainLoop;
 extern uint32_t              pluginsCbs;
 extern void                 *esServer;
 
-static MolochSessionHead_t   tcpSessionQ;
-static MolochSessionHead_t   udpSessionQ;
-static MolochSessionHead_t   icmpSessionQ;
-static MolochSessionHead_t   tcpWriteQ;
-
 static MolochStringHead_t    monitorQ;
 
 static uint32_t              initialDropped = 0;
 struct timeval               initialPacket;
 
 static FILE                 *offlineFile = 0;
+static MolochMmap_t         *offlineMmap = 0;
 static char                  offlinePcapFilename[PATH_MAX+1];
 
 static int                   tagsField;
@@ -64,12 +61,63 @@ static int                   protocolField;
 static int                   mac1Field;
 static int                   mac2Field;
 static int                   vlanField;
+static int                   interfaceField;
 
 uint64_t                     totalPackets = 0;
 uint64_t                     totalBytes = 0;
 uint64_t                     totalSessions = 0;
 
+/* Live capture interfaces, each has its own kernel buffer, filter and
+ * reader thread.  libpcap handles aren't thread safe, so the reader thread
+ * also gathers the libpcap stats, under interfacesLock.
+ */
+typedef struct {
+    pcap_t                  *pcap;
+    MolochReader_t          *reader;
+    uint64_t                 packets;
+    uint64_t                 bytes;
+    struct pcap_stat         stats;
+    time_t                   statsTime;
+} MolochInterface_t;
+
+static MolochInterface_t     interfaces[MOLOCH_MAX_INTERFACES];
+static int                   interfacesNum;
+static __thread int          currentInterface;
+static pthread_mutex_t       interfacesLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Offline files read at the same time with offlineParallelFiles, each one
+ * is read by its own reader thread and uses its own session set so its
+ * sessions never mix with another file's.  A file with a different link type
+ * waits for the others to finish.
+ */
+#define MOLOCH_INPUT_FREE     0
+#define MOLOCH_INPUT_ACTIVE   1
+#define MOLOCH_INPUT_WAITING  2
+
+typedef struct {
+    pcap_t                  *pcap;
+    FILE                    *file;
+    MolochMmap_t            *mmap;
+    MolochReader_t          *reader;
+    char                     filename[PATH_MAX+1];
+    int                      linktype;
+    int                      state;
+    int                      status;
+    int                      acks;      /* Packet threads still to save the file's sessions */
+} MolochOfflineInput_t;
+
+static MolochOfflineInput_t  offlineInputs[MOLOCH_MAX_SESSION_SETS];
+static int                   offlineParallel;
+static int                   offlineLinktype = -1;
+static pcap_t               *offlineDead;
+static __thread int          currentInput;
+static __thread uint64_t     currentPos;
+static pcap_t               *closeNextOpen = 0;
+
 static struct bpf_program   *bpf_programs = 0;
+static struct bpf_program    dontSaveBPF;
+static uint64_t             *dontSaveBPFHits = 0;
+static int                   useTpacketv3 = 0;
 
 extern MolochWriterQueueLength moloch_writer_queue_length;
 extern MolochWriterWrite moloch_writer_write;
@@ -80,13 +128,140 @@ extern MolochWriterName moloch_writer_name;
 
 /******************************************************************************/
 
-typedef HASH_VAR(h_, MolochSessionHash_t, MolochSessionHead_t, 199337);
-
 #define SESSION_TCP  0
 #define SESSION_UDP  1
 #define SESSION_ICMP 2
 #define SESSION_MAX  3
-static MolochSessionHash_t sessions[SESSION_MAX];
+
+/* Seconds covered by the timer wheel, must be a power of 2.  Longer timeouts
+ * just go around the wheel again.
+ */
+#define MOLOCH_WHEEL_SLOTS 1024
+#define MOLOCH_WHEEL_MASK  (MOLOCH_WHEEL_SLOTS - 1)
+
+/* A session set is a group of session tables with its own timer wheel and
+ * free list.  Live capture uses one set per packet thread, each parallel
+ * offline file gets its own per packet thread so sessions never span files.
+ * A set is only ever touched by the thread that owns it.
+ *
+ * Every session sits in one timer wheel slot, the second its idle timeout or
+ * mid save might be due.  Packets only update lastPacket, a session that
+ * isn't due yet when its slot comes around is moved to the right slot.
+ */
+typedef struct {
+    MolochSessionTable_t sessions[SESSION_MAX];
+    MolochSessionHead_t  wheel[MOLOCH_WHEEL_SLOTS];
+    uint32_t             wheelTime;
+    MolochSession_t     *freeSessions;
+    uint64_t             slabBytes;
+} MolochSessionSet_t;
+
+static MolochSessionSet_t  **sessionSets;
+static int                   sessionSetsNum = 1;
+
+/* Packet time of the last packet and wall clock ticks since it changed */
+static uint32_t              lastPacketSecs;
+static uint32_t              tickPacketSecs;
+static uint32_t              idleTicks;
+
+/* With packetThreads the main thread still reads and decodes, libnids is all
+ * global state, then copies each packet into a batch for the thread that owns
+ * its session by hash.  Like the reader batches, a batch is handed over once
+ * it is full or the main loop goes idle.  The main thread never waits on a
+ * packet thread: live packets for one that is out of batches are dropped and
+ * counted, offline reading is held back instead.
+ *
+ * Control messages (timer ticks, a finished offline file, quit) go on their
+ * own queue and run once the batches handed over before them have been.  Tag
+ * numbers not cached yet are looked up on the main thread and come back on the
+ * tag queue.
+ */
+#define MOLOCH_PACKET_BATCHES     16
+#define MOLOCH_PACKET_BATCH_SIZE  (1024*1024)
+
+/* Each packet is this header, the frame and, when libnids reassembled the
+ * datagram, the datagram, padded to 8 bytes */
+typedef struct {
+    struct pcap_pkthdr       hdr;
+    uint64_t                 pos;
+    uint32_t                 hash;
+    uint32_t                 ipLen;
+    int32_t                  ipOff;     /* Where the datagram starts in the frame, -1 if it follows it */
+    uint16_t                 input;
+    uint16_t                 interface;
+} MolochPacket_t;
+
+#define MOLOCH_PACKET_SIZE(caplen, extra) ((sizeof(MolochPacket_t) + (caplen) + (extra) + 7) & ~7)
+
+typedef struct moloch_packet_batch {
+    struct moloch_packet_batch *b_next, *b_prev;
+    uint8_t                    *buf;
+    uint32_t                    len;
+    uint32_t                    packets;
+} MolochPacketBatch_t;
+
+typedef struct {
+    struct moloch_packet_batch *b_next, *b_prev;
+    int                         b_count;
+} MolochPacketBatchHead_t;
+
+#define MOLOCH_PACKET_CTL_TICK  0
+#define MOLOCH_PACKET_CTL_INPUT 1
+#define MOLOCH_PACKET_CTL_QUIT  2
+
+typedef struct moloch_packet_ctl {
+    struct moloch_packet_ctl *c_next, *c_prev;
+    uint32_t                  after;    /* Batches that must be processed first */
+    uint32_t                  value;
+    int                       type;
+} MolochPacketCtl_t;
+
+typedef struct {
+    struct moloch_packet_ctl *c_next, *c_prev;
+    int                       c_count;
+} MolochPacketCtlHead_t;
+
+typedef struct moloch_packet_tag {
+    struct moloch_packet_tag *t_next, *t_prev;
+    MolochSession_t          *session;
+    char                     *tag;
+    int                       tagType;
+    uint32_t                  tagValue;
+    int                       thread;
+} MolochPacketTag_t;
+
+typedef struct {
+    struct moloch_packet_tag *t_next, *t_prev;
+    int                       t_count;
+} MolochPacketTagHead_t;
+
+typedef struct {
+    MolochPacketBatch_t     *batch;     /* Being filled by the main thread */
+    int                      batches;   /* Allocated by the main thread */
+    MolochPacketBatchHead_t  batchQ;
+    MolochPacketBatchHead_t  freeQ;
+    uint32_t                 head;      /* Batches handed over, only the main thread moves it */
+    uint32_t                 tail;      /* Batches processed, only the packet thread moves it */
+    MolochPacketCtlHead_t    ctlQ;
+    MolochPacketTagHead_t    tagQ;
+    pthread_mutex_t          lock;      /* The queues */
+    pthread_cond_t           cond;
+    uint64_t                 dropped;
+    GThread                 *thread;
+} MolochPacketThread_t;
+
+static MolochPacketThread_t  packetThreads[MOLOCH_MAX_PACKET_THREADS];
+static int                   packetThreadsNum;       /* 0 when sessions are on the main thread */
+static int                   packetThreadsSets = 1;  /* Session sets per offline input */
+static gint                  packetThreadsIdle;
+static int                   packetThreadsQuit;
+static int                   packetThreadsDone;
+
+/* What the running thread is working on, libnids' nids_last_pcap_* are only
+ * for the main thread */
+static __thread const struct pcap_pkthdr *packetHeader;
+static __thread const u_char *packetData;
+static __thread int          packetThread;
 
 /******************************************************************************/
 void moloch_nids_session_free (MolochSession_t *session);
@@ -94,13 +269,185 @@ void moloch_nids_process_udp(MolochSession_t *session, struct udphdr   *udphdr,
 int  moloch_nids_next_file();
 void moloch_nids_init_nids();
 
+/******************************************************************************/
+static inline int moloch_nids_ses(int protocol)
+{
+    switch (protocol) {
+    case IPPROTO_TCP:
+        return SESSION_TCP;
+    case IPPROTO_UDP:
+        return SESSION_UDP;
+    default:
+        return SESSION_ICMP;
+    }
+}
+/******************************************************************************/
+static inline uint32_t moloch_nids_timeout(MolochSession_t *session)
+{
+    switch (session->protocol) {
+    case IPPROTO_TCP:
+        return config.tcpTimeout;
+    case IPPROTO_UDP:
+        return config.udpTimeout;
+    default:
+        return config.icmpTimeout;
+    }
+}
+/******************************************************************************/
+/* When the session next needs looking at, the idle timeout or for tcp the mid save */
+static inline uint32_t moloch_nids_timer_due(MolochSession_t *session)
+{
+    uint32_t due = session->lastPacket.tv_sec + moloch_nids_timeout(session);
+
+    if (session->protocol == IPPROTO_TCP)
+        return MIN(due, session->lastSave + config.tcpSaveTimeout);
+    return due;
+}
+/******************************************************************************/
+static void moloch_nids_timer_add(MolochSessionSet_t *sset, MolochSession_t *session)
+{
+    uint32_t due = moloch_nids_timer_due(session);
+
+    if (sset->wheelTime == 0)
+        sset->wheelTime = session->lastPacket.tv_sec;
+
+    if (due <= sset->wheelTime)
+        due = sset->wheelTime + 1;
+    else if (due >= sset->wheelTime + MOLOCH_WHEEL_SLOTS)
+        due = sset->wheelTime + MOLOCH_WHEEL_SLOTS - 1;
+
+    session->timerDue = due;
+    DLL_PUSH_TAIL(q_, &sset->wheel[due & MOLOCH_WHEEL_MASK], session);
+}
+/******************************************************************************/
+static inline void moloch_nids_timer_remove(MolochSession_t *session)
+{
+    if (session->q_next)
+        DLL_REMOVE(q_, &sessionSets[session->set]->wheel[session->timerDue & MOLOCH_WHEEL_MASK], session);
+}
+/******************************************************************************/
+/* The session that will time out soonest, or close to it */
+static MolochSession_t *moloch_nids_timer_first(MolochSessionSet_t *sset)
+{
+    MolochSession_t *session;
+    int              i;
+
+    for (i = 0; i < MOLOCH_WHEEL_SLOTS; i++) {
+        if ((session = DLL_PEEK_HEAD(q_, &sset->wheel[(sset->wheelTime + i) & MOLOCH_WHEEL_MASK])))
+            return session;
+    }
+    return NULL;
+}
+/******************************************************************************/
+/* Sessions are carved out of 2M slabs, a hugepage when they are enabled, and
+ * kept on a per set free list linked through q_next.  Slabs are never
+ * given back, like g_slice.
+ */
+#define MOLOCH_SESSION_SLAB_SIZE (2*1024*1024)
+
+static void moloch_nids_session_slab(MolochSessionSet_t *sset)
+{
+    static int warned = 0;
+    uint8_t   *mem = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (config.sessionHugePages) {
+        mem = mmap(NULL, MOLOCH_SESSION_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mem == MAP_FAILED && !warned) {
+            warned = 1;
+            LOG("WARNING - Couldn't get hugepages for sessions, using normal pages %d: %s", errno, strerror(errno));
+        }
+    }
+#endif
+
+    if (mem == MAP_FAILED) {
+        mem = mmap(NULL, MOLOCH_SESSION_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            LOG("ERROR - Couldn't allocate session slab %d: %s", errno, strerror(errno));
+            exit(1);
+        }
+#ifdef MADV_HUGEPAGE
+        if (config.sessionHugePages)
+            madvise(mem, MOLOCH_SESSION_SLAB_SIZE, MADV_HUGEPAGE);
+#endif
+    }
+
+    /* Round up so every session starts on a cache line */
+    const int size = (sizeof(MolochSession_t) + 63) & ~63;
+    int       i;
+
+    for (i = MOLOCH_SESSION_SLAB_SIZE/size - 1; i >= 0; i--) {
+        MolochSession_t *session = (MolochSession_t *)(mem + i*size);
+        session->q_next = sset->freeSessions;
+        sset->freeSessions = session;
+    }
+    sset->slabBytes += MOLOCH_SESSION_SLAB_SIZE;
+}
+/******************************************************************************/
+static MolochSession_t *moloch_nids_session_alloc(MolochSessionSet_t *sset)
+{
+    if (!sset->freeSessions)
+        moloch_nids_session_slab(sset);
+
+    MolochSession_t *session = sset->freeSessions;
+    sset->freeSessions = session->q_next;
+    memset(session, 0, sizeof(MolochSession_t));
+    return session;
+}
+/******************************************************************************/
+/* Which session set the current packet belongs in */
+static inline int moloch_nids_session_set()
+{
+    if (offlineParallel)
+        return currentInput * packetThreadsSets + packetThread;
+    return packetThread;
+}
+/******************************************************************************/
+/* Which offline input the current packet came from */
+int moloch_nids_input()
+{
+    return currentInput;
+}
+/******************************************************************************/
+/* Where the packet being processed starts in its parallel offline file, the
+ * reader thread has moved on so the file can't be asked.  0 otherwise.
+ */
+uint64_t moloch_nids_input_pos()
+{
+    return currentPos;
+}
+/******************************************************************************/
+static void moloch_nids_table_stats_log()
+{
+    MolochSessionTableStats_t stats;
+    uint64_t                  slabBytes = 0;
+    int                       t, i;
+
+    memset(&stats, 0, sizeof(stats));
+    for (t = 0; t < sessionSetsNum; t++) {
+        for (i = 0; i < SESSION_MAX; i++) {
+            moloch_session_table_stats(&sessionSets[t]->sessions[i], &stats);
+        }
+        slabBytes += sessionSets[t]->slabBytes;
+    }
+
+    LOG("session tables: %" PRIu64 "/%" PRIu64 " load: %0.2f deleted: %" PRIu64 " avg probe: %0.2f max probe: %u resizes: %u rehashing: %u slabs: %" PRIu64 "M",
+        stats.count, stats.slots,
+        stats.slots?(double)stats.count/stats.slots:0.0,
+        stats.deleted,
+        stats.lookups?(double)stats.probes/stats.lookups:0.0,
+        stats.maxProbe,
+        stats.resizes,
+        stats.rehashing,
+        slabBytes/(1024*1024));
+}
 /******************************************************************************/
 #pragma GCC diagnostic ignored "-Wstrict-aliasing"
 #define int_ntoa(x)     inet_ntoa(*((struct in_addr *)(int*)&x))
 
 char *moloch_friendly_session_id (int protocol, uint32_t addr1, int port1, uint32_t addr2, int port2)
 {
-    static char buf[1000];
+    static __thread char buf[1000];
     int         len;
 
     if (addr1 < addr2) {
@@ -120,8 +467,11 @@ char *moloch_friendly_session_id (int protocol, uint32_t addr1, int port1, uint3
     return buf;
 }
 /******************************************************************************/
-void moloch_nids_save_session(MolochSession_t *session)
+static void moloch_nids_save_session_internal(MolochSession_t *session, gboolean inTable)
 {
+    if (session->shunted)
+        moloch_tpacketv3_shunt_fold(session);
+
     if (session->parserInfo) {
         int i;
         for (i = 0; i < session->parserNum; i++) {
@@ -133,49 +483,45 @@ void moloch_nids_save_session(MolochSession_t *session)
     if (pluginsCbs & MOLOCH_PLUGIN_PRE_SAVE)
         moloch_plugins_cb_pre_save(session, TRUE);
 
+    MolochSessionSet_t *sset = sessionSets[session->set];
+    const int           ses = moloch_nids_ses(session->protocol);
+
     if (session->outstandingQueries > 0) {
         session->needSave = 1;
 
-        if (session->tcp_next) {
-            DLL_REMOVE(tcp_, &tcpWriteQ, session);
-        }
-
-        switch (session->protocol) {
-        case IPPROTO_TCP:
-            DLL_REMOVE(q_, &tcpSessionQ, session);
-            HASH_REMOVE(h_, sessions[SESSION_TCP], session);
-            break;
-        case IPPROTO_UDP:
-            DLL_REMOVE(q_, &udpSessionQ, session);
-            HASH_REMOVE(h_, sessions[SESSION_UDP], session);
-            break;
-        case IPPROTO_ICMP:
-            DLL_REMOVE(q_, &icmpSessionQ, session);
-            HASH_REMOVE(h_, sessions[SESSION_ICMP], session);
-            break;
-        }
-
+        moloch_nids_timer_remove(session);
+        if (inTable)
+            moloch_session_table_remove(&sset->sessions[ses], session);
         return;
     }
 
     moloch_db_save_session(session, TRUE);
 
-    switch (session->protocol) {
-    case IPPROTO_TCP:
-        HASH_REMOVE(h_, sessions[SESSION_TCP], session);
-        break;
-    case IPPROTO_UDP:
-        HASH_REMOVE(h_, sessions[SESSION_UDP], session);
-        break;
-    case IPPROTO_ICMP:
-        HASH_REMOVE(h_, sessions[SESSION_ICMP], session);
-        break;
-    }
+    if (inTable)
+        moloch_session_table_remove(&sset->sessions[ses], session);
     moloch_nids_session_free(session);
 }
 /******************************************************************************/
+void moloch_nids_save_session(MolochSession_t *session)
+{
+    moloch_nids_save_session_internal(session, TRUE);
+}
+/******************************************************************************/
+/* Save a session that has already been taken out of its table */
+static void moloch_nids_flush_session(MolochSession_t *session)
+{
+    moloch_nids_save_session_internal(session, FALSE);
+}
+
+/******************************************************************************/
+static void moloch_nids_packet_thread_tag_wait();
+static void moloch_nids_packet_thread_ctl(MolochPacketThread_t *pt, int type, uint32_t value);
+
 void moloch_nids_mid_save_session(MolochSession_t *session)
 {
+    if (session->shunted)
+        moloch_tpacketv3_shunt_fold(session);
+
     if (session->parserInfo) {
         int i;
         for (i = 0; i < session->parserNum; i++) {
@@ -189,7 +535,10 @@ void moloch_nids_mid_save_session(MolochSession_t *session)
 
     /* If we are parsing pcap its ok to pause and make sure all tags are loaded */
     while (session->outstandingQueries > 0 && config.pcapReadOffline) {
-        g_main_context_iteration (g_main_context_default(), TRUE);
+        if (packetThreadsNum && !moloch_main_thread())
+            moloch_nids_packet_thread_tag_wait();
+        else
+            g_main_context_iteration (g_main_context_default(), TRUE);
     }
 
     if (!session->rootId) {
@@ -197,16 +546,10 @@ void moloch_nids_mid_save_session(MolochSession_t *session)
     }
 
     moloch_db_save_session(session, FALSE);
-    g_array_set_size(session->filePosArray, 0);
-    g_array_set_size(session->fileLenArray, 0);
-    g_array_set_size(session->fileNumArray, 0);
+    moloch_packet_pos_free(&session->packetPos);
     session->lastFileNum = 0;
 
-    if (session->tcp_next) {
-        DLL_MOVE_TAIL(tcp_, &tcpWriteQ, session);
-    }
-
-    session->lastSave = nids_last_pcap_header->ts.tv_sec;
+    session->lastSave = packetHeader->ts.tv_sec;
     session->bytes[0] = 0;
     session->bytes[1] = 0;
     session->databytes[0] = 0;
@@ -215,114 +558,228 @@ void moloch_nids_mid_save_session(MolochSession_t *session)
     session->packets[1] = 0;
 }
 /******************************************************************************/
+/* Move the wheel up to now, expiring and mid saving sessions as their slots
+ * come around.  At most budget sessions are looked at, whatever is left is
+ * picked up on the next call.
+ */
+static void moloch_nids_timer_run(MolochSessionSet_t *sset, uint32_t now, uint32_t budget)
+{
+    MolochSession_t *session;
+
+    /* Nothing has been scheduled yet */
+    if (sset->wheelTime == 0)
+        return;
+
+    /* Fell behind by more than a full turn, each slot only needs one look */
+    if (now > sset->wheelTime + MOLOCH_WHEEL_SLOTS)
+        sset->wheelTime = now - MOLOCH_WHEEL_SLOTS;
+
+    while (sset->wheelTime <= now) {
+        MolochSessionHead_t *slot = &sset->wheel[sset->wheelTime & MOLOCH_WHEEL_MASK];
+
+        while ((session = DLL_PEEK_HEAD(q_, slot))) {
+            if (budget == 0)
+                return;
+            budget--;
+
+            DLL_REMOVE(q_, slot, session);
+
+            if (session->shunted)
+                moloch_tpacketv3_shunt_fold(session);
+
+            if ((uint32_t)session->lastPacket.tv_sec + moloch_nids_timeout(session) < now) {
+                moloch_nids_save_session(session);
+                continue;
+            }
+
+            if (session->protocol == IPPROTO_TCP && session->lastSave + config.tcpSaveTimeout < now) {
+                //LOG("Saving because of timeout %s", moloch_friendly_session_id(session->protocol, session->addr1, session->port1, session->addr2, session->port2));
+                moloch_nids_mid_save_session(session);
+            }
+
+            moloch_nids_timer_add(sset, session);
+        }
+        sset->wheelTime++;
+    }
+}
+/******************************************************************************/
+/* Save everything in a set and rewind its wheel, the next file to use the set
+ * may start at any time */
+static void moloch_nids_session_set_flush(MolochSessionSet_t *sset)
+{
+    int s;
+
+    for (s = 0; s < SESSION_MAX; s++) {
+        moloch_session_table_pop_all(&sset->sessions[s], moloch_nids_flush_session);
+    }
+
+    sset->wheelTime = 0;
+    for (s = 0; s < MOLOCH_WHEEL_SLOTS; s++) {
+        DLL_INIT(q_, &sset->wheel[s]);
+    }
+}
+/******************************************************************************/
+/* Wall clock tick so sessions still time out when packets stop arriving */
+static gboolean moloch_nids_timer_gfunc(gpointer UNUSED(user_data))
+{
+    int t;
+
+    if (lastPacketSecs == 0)
+        return TRUE;
+
+    if (lastPacketSecs != tickPacketSecs) {
+        tickPacketSecs = lastPacketSecs;
+        idleTicks = 0;
+    } else {
+        idleTicks++;
+    }
+
+    /* Each packet thread runs the wheels of the sets it owns */
+    if (packetThreadsNum) {
+        for (t = 0; t < packetThreadsNum && !packetThreadsQuit; t++) {
+            moloch_nids_packet_thread_ctl(&packetThreads[t], MOLOCH_PACKET_CTL_TICK, lastPacketSecs + idleTicks);
+        }
+        return TRUE;
+    }
+
+    for (t = 0; t < sessionSetsNum; t++) {
+        moloch_nids_timer_run(sessionSets[t], lastPacketSecs + idleTicks, config.timeoutsPerTick);
+    }
+
+    return TRUE;
+}
+/******************************************************************************/
 struct pcap_file_header pcapFileHeader;
 int dlt_to_linktype(int dlt);
 /******************************************************************************/
-void moloch_nids_cb_ip(struct ip *packet, int len)
+static int moloch_nids_interface_pcap_stats(int num, struct pcap_stat *ps)
 {
-    char             sessionId[MOLOCH_SESSIONID_LEN];
-    MolochSession_t *headSession;
-    struct tcphdr   *tcphdr = 0;
-    struct udphdr   *udphdr = 0;
-    MolochSessionHead_t *sessionsQ;
-    uint32_t         sessionTimeout;
-    int              ses;
+    if (useTpacketv3)
+        return moloch_tpacketv3_stats(num, ps);
 
-    switch (packet->ip_p) {
-    case IPPROTO_TCP:
-        sessionsQ = &tcpSessionQ;
-        sessionTimeout = config.tcpTimeout;
+    pthread_mutex_lock(&interfacesLock);
+    *ps = interfaces[num].stats;
+    pthread_mutex_unlock(&interfacesLock);
+    return 0;
+}
+/******************************************************************************/
+/* Totals across all the interfaces */
+static int moloch_nids_stats(struct pcap_stat *ps)
+{
+    struct pcap_stat ips;
+    int              i;
+
+    if (interfacesNum == 0)
+        return pcap_stats(nids_params.pcap_desc, ps);
+
+    memset(ps, 0, sizeof(*ps));
+    for (i = 0; i < interfacesNum; i++) {
+        if (moloch_nids_interface_pcap_stats(i, &ips))
+            return -1;
+        ps->ps_recv   += ips.ps_recv;
+        ps->ps_drop   += ips.ps_drop;
+        ps->ps_ifdrop += ips.ps_ifdrop;
+    }
+    return 0;
+}
+/******************************************************************************/
+int moloch_nids_interfaces()
+{
+    return interfacesNum;
+}
+/******************************************************************************/
+void moloch_nids_interface_stats(int num, MolochInterfaceStats_t *stats)
+{
+    struct pcap_stat ps;
 
-        tcphdr = (struct tcphdr *)((char*)packet + 4 * packet->ip_hl);
+    memset(stats, 0, sizeof(*stats));
+    if (num >= interfacesNum)
+        return;
 
-        //LOG("ip (%d) %x %d", len, tcphdr->th_flags, tcphdr->th_flags & TH_RST);
-        //fflush(stdout);
+    stats->name    = config.interface[num];
+    stats->packets = interfaces[num].packets;
+    stats->bytes   = interfaces[num].bytes;
+    if (moloch_nids_interface_pcap_stats(num, &ps) == 0) {
+        stats->recv    = ps.ps_recv;
+        stats->dropped = ps.ps_drop;
+    }
+}
+/******************************************************************************/
+/* Every live packet comes thru here from its interface's reader thread so it
+ * can be counted against and tagged with the interface
+ */
+static void moloch_nids_interface_packet(int num, const struct pcap_pkthdr *h, const u_char *bytes, uint64_t UNUSED(pos))
+{
+    interfaces[num].packets++;
+    interfaces[num].bytes += h->caplen;
+    currentInterface = num;
+    nids_pcap_handler(NULL, (struct pcap_pkthdr *)h, (u_char *)bytes);
+}
+/******************************************************************************/
+/* The session id and table of a decoded datagram, -1 if it isn't one we track */
+static int moloch_nids_session_id(struct ip *packet, char *sessionId)
+{
+    struct tcphdr   *tcphdr;
+    struct udphdr   *udphdr;
 
+    switch (packet->ip_p) {
+    case IPPROTO_TCP:
+        tcphdr = (struct tcphdr *)((char*)packet + 4 * packet->ip_hl);
         moloch_session_id(sessionId, packet->ip_src.s_addr, tcphdr->th_sport,
                           packet->ip_dst.s_addr, tcphdr->th_dport);
-        ses = SESSION_TCP;
-        break;
+        return SESSION_TCP;
     case IPPROTO_UDP:
-        sessionsQ = &udpSessionQ;
-        sessionTimeout = config.udpTimeout;
-
         udphdr = (struct udphdr *)((char*)packet + 4 * packet->ip_hl);
-
         moloch_session_id(sessionId, packet->ip_src.s_addr, udphdr->uh_sport,
                           packet->ip_dst.s_addr, udphdr->uh_dport);
-        ses = SESSION_UDP;
-        break;
+        return SESSION_UDP;
     case IPPROTO_ICMP:
-        sessionsQ = &icmpSessionQ;
-        sessionTimeout = config.icmpTimeout;
-
         moloch_session_id(sessionId, packet->ip_src.s_addr, 0,
                           packet->ip_dst.s_addr, 0);
-        ses = SESSION_ICMP;
-        break;
-    case IPPROTO_IPV6:
-        return;
-    default:
-        if (pluginsCbs & MOLOCH_PLUGIN_IP)
-            moloch_plugins_cb_ip(NULL, packet, len);
-        if (config.logUnknownProtocols)
-            LOG("Unknown protocol %d", packet->ip_p);
-        return;
-    }
-
-    totalBytes += nids_last_pcap_header->caplen;
-
-    if (totalPackets == 0) {
-        struct pcap_stat ps;
-        if (!pcap_stats(nids_params.pcap_desc, &ps)) {
-            initialDropped = ps.ps_drop;
-        }
-        initialPacket = nids_last_pcap_header->ts;
-        LOG("Initial Packet = %ld", initialPacket.tv_sec);
-        LOG("%" PRIu64 " Initial Dropped = %d", totalPackets, initialDropped);
+        return SESSION_ICMP;
     }
+    return -1;
+}
+/******************************************************************************/
+/* Everything done to a datagram once it is known which session it is in, on
+ * the thread that owns the session.  packetHeader and packetData are the frame
+ * it came in.
+ */
+static void moloch_nids_process_ip(struct ip *packet, int len, char *sessionId, int ses, uint32_t hash)
+{
+    MolochSession_t *headSession;
+    struct tcphdr   *tcphdr = 0;
+    struct udphdr   *udphdr = 0;
 
-    if ((++totalPackets) % config.logEveryXPackets == 0) {
-        struct pcap_stat ps;
-        if (pcap_stats(nids_params.pcap_desc, &ps)) {
-            ps.ps_drop = 0;
-            ps.ps_recv = totalPackets;
-            ps.ps_ifdrop = 0;
-        }
-        headSession = DLL_PEEK_HEAD(q_, sessionsQ);
+    if (packet->ip_p == IPPROTO_TCP)
+        tcphdr = (struct tcphdr *)((char*)packet + 4 * packet->ip_hl);
+    else if (packet->ip_p == IPPROTO_UDP)
+        udphdr = (struct udphdr *)((char*)packet + 4 * packet->ip_hl);
 
-        LOG("packets: %" PRIu64 " current sessions: %u/%u oldest: %d - recv: %u drop: %u (%0.2f) ifdrop: %u queue: %d disk: %d",
-          totalPackets,
-          sessionsQ->q_count,
-          moloch_nids_monitoring_sessions(),
-          (headSession?(int)(nids_last_pcap_header->ts.tv_sec - (headSession->lastPacket.tv_sec + sessionTimeout)):0),
-          ps.ps_recv,
-          ps.ps_drop - initialDropped, (ps.ps_drop - initialDropped)*(double)100.0/ps.ps_recv,
-          ps.ps_ifdrop,
-          moloch_http_queue_length(esServer),
-          moloch_writer_queue_length());
-    }
+    MolochSessionSet_t *sset = sessionSets[moloch_nids_session_set()];
 
     /* Get or Create Session */
     MolochSession_t *session;
-    uint32_t hash = HASH_HASH(sessions[ses], sessionId);
 
-    HASH_FIND_HASH(h_, sessions[ses], hash, sessionId, session);
+    session = moloch_session_table_find(&sset->sessions[ses], hash, sessionId);
 
     if (!session) {
-        session = MOLOCH_TYPE_ALLOC0(MolochSession_t);
+        /* Too many tcp sessions, make room by saving the oldest */
+        if (ses == SESSION_TCP && (uint32_t)moloch_session_table_count(&sset->sessions[ses]) >= config.maxStreams / sessionSetsNum &&
+            (headSession = moloch_nids_timer_first(sset))) {
+            moloch_nids_save_session(headSession);
+        }
+
+        session = moloch_nids_session_alloc(sset);
         session->protocol = packet->ip_p;
-        session->filePosArray = g_array_sized_new(FALSE, FALSE, sizeof(uint64_t), 100);
-        session->fileLenArray = g_array_sized_new(FALSE, FALSE, sizeof(uint16_t), 100);
-        session->fileNumArray = g_array_new(FALSE, FALSE, 4);
-        HASH_ADD_HASH(h_, sessions[ses], hash, sessionId, session);
-        session->lastSave = nids_last_pcap_header->ts.tv_sec;
-        session->firstPacket = nids_last_pcap_header->ts;
+        session->set = moloch_nids_session_set();
+        moloch_session_table_add(&sset->sessions[ses], hash, session);
+        session->lastSave = packetHeader->ts.tv_sec;
+        session->firstPacket = packetHeader->ts;
         session->addr1 = packet->ip_src.s_addr;
         session->addr2 = packet->ip_dst.s_addr;
         session->ip_tos = packet->ip_tos;
-        session->fields = MOLOCH_SIZE_ALLOC0(fields, sizeof(MolochField_t *)*config.maxField);
-        session->maxFields = config.maxField;
+        moloch_field_session_init(session);
         if (config.numPlugins > 0)
             session->pluginData = MOLOCH_SIZE_ALLOC0(pluginData, sizeof(void *)*config.numPlugins);
 
@@ -360,11 +817,10 @@ void moloch_nids_cb_ip(struct ip *packet, int len)
             break;
         }
 
-        DLL_PUSH_TAIL(q_, sessionsQ, session);
+        session->lastPacket = packetHeader->ts;
+        moloch_nids_timer_add(sset, session);
         if (pluginsCbs & MOLOCH_PLUGIN_NEW)
             moloch_plugins_cb_new(session);
-    } else {
-        DLL_MOVE_TAIL(q_, sessionsQ, session);
     }
 
     int which = 0;
@@ -374,8 +830,8 @@ void moloch_nids_cb_ip(struct ip *packet, int len)
                  session->addr2 == packet->ip_dst.s_addr &&
                  session->port1 == ntohs(udphdr->uh_sport) &&
                  session->port2 == ntohs(udphdr->uh_dport))?0:1;
-        session->databytes[which] += (nids_last_pcap_header->caplen - 8);
-        moloch_nids_process_udp(session, udphdr, (unsigned char*)udphdr+8, nids_last_pcap_header->caplen - 8 - 4 * packet->ip_hl, which);
+        session->databytes[which] += (packetHeader->caplen - 8);
+        moloch_nids_process_udp(session, udphdr, (unsigned char*)udphdr+8, packetHeader->caplen - 8 - 4 * packet->ip_hl, which);
         break;
     case IPPROTO_TCP:
         which = (session->addr1 == packet->ip_src.s_addr &&
@@ -395,21 +851,21 @@ void moloch_nids_cb_ip(struct ip *packet, int len)
         char str1[20];
         char str2[20];
         snprintf(str1, sizeof(str1), "%02x:%02x:%02x:%02x:%02x:%02x",
-                nids_last_pcap_data[0],
-                nids_last_pcap_data[1],
-                nids_last_pcap_data[2],
-                nids_last_pcap_data[3],
-                nids_last_pcap_data[4],
-                nids_last_pcap_data[5]);
+                packetData[0],
+                packetData[1],
+                packetData[2],
+                packetData[3],
+                packetData[4],
+                packetData[5]);
 
 
         snprintf(str2, sizeof(str2), "%02x:%02x:%02x:%02x:%02x:%02x",
-                nids_last_pcap_data[6],
-                nids_last_pcap_data[7],
-                nids_last_pcap_data[8],
-                nids_last_pcap_data[9],
-                nids_last_pcap_data[10],
-                nids_last_pcap_data[11]);
+                packetData[6],
+                packetData[7],
+                packetData[8],
+                packetData[9],
+                packetData[10],
+                packetData[11]);
 
         if (which == 1) {
             moloch_field_string_add(mac1Field, session, str1, 17, TRUE);
@@ -420,26 +876,38 @@ void moloch_nids_cb_ip(struct ip *packet, int len)
         }
 
         int n = 12;
-        while (nids_last_pcap_data[n] == 0x81 && nids_last_pcap_data[n+1] == 0x00) {
-            uint16_t vlan = ((uint16_t)(nids_last_pcap_data[n+2] << 8 | nids_last_pcap_data[n+3])) & 0xfff;
+        while (packetData[n] == 0x81 && packetData[n+1] == 0x00) {
+            uint16_t vlan = ((uint16_t)(packetData[n+2] << 8 | packetData[n+3])) & 0xfff;
             moloch_field_int_add(vlanField, session, vlan);
             n += 4;
         }
     }
 
-    /* Check if the stop saving bpf filters match */
-    if (bpf_programs && session->packets[which] == 0 && session->stopSaving == 0) {
+    if (interfacesNum && session->packets[which] <= 1) {
+        moloch_field_string_add(interfaceField, session, config.interface[currentInterface], -1, TRUE);
+    }
+
+    /* Check if the stop saving bpf filters match, each direction's first packet
+     * is checked but a session only counts as one hit */
+    if (bpf_programs && session->packets[which] == 0 && session->stopSaving == 0 && !session->dontSaveHit) {
         int i;
-        for (i = 0; i < config.dontSaveBPFsNum; i++) {
-            if (bpf_filter(bpf_programs[i].bf_insns, nids_last_pcap_data, nids_last_pcap_header->len, nids_last_pcap_header->caplen)) {
-                session->stopSaving = config.dontSaveBPFsStop[i];
-                break;
+        if (dontSaveBPF.bf_insns) {
+            i = (int)bpf_filter(dontSaveBPF.bf_insns, packetData, packetHeader->len, packetHeader->caplen) - 1;
+        } else {
+            for (i = 0; i < config.dontSaveBPFsNum; i++) {
+                if (bpf_filter(bpf_programs[i].bf_insns, packetData, packetHeader->len, packetHeader->caplen))
+                    break;
             }
         }
+        if (i >= 0 && i < config.dontSaveBPFsNum) {
+            session->stopSaving = config.dontSaveBPFsStop[i];
+            session->dontSaveHit = 1;
+            __atomic_add_fetch(&dontSaveBPFHits[i], 1, __ATOMIC_RELAXED);
+        }
     }
 
-    session->bytes[which] += nids_last_pcap_header->caplen;
-    session->lastPacket = nids_last_pcap_header->ts;
+    session->bytes[which] += packetHeader->caplen;
+    session->lastPacket = packetHeader->ts;
 
     if (pluginsCbs & MOLOCH_PLUGIN_IP)
         moloch_plugins_cb_ip(session, packet, len);
@@ -450,49 +918,143 @@ void moloch_nids_cb_ip(struct ip *packet, int len)
     if (session->stopSaving == 0 || packets < session->stopSaving) {
         uint32_t fileNum;
         uint64_t filePos;
-        uint16_t fileLen = 16 + nids_last_pcap_header->caplen;
+        uint16_t fileLen = 16 + packetHeader->caplen;
 
-        moloch_writer_write(nids_last_pcap_header, nids_last_pcap_data, &fileNum, &filePos);
+        if (packetThreadsNum)
+            moloch_writer_lock();
+        moloch_writer_write(session, packetHeader, packetData, &fileNum, &filePos);
+        if (packetThreadsNum)
+            moloch_writer_unlock();
 
         if (session->lastFileNum != fileNum) {
             session->lastFileNum = fileNum;
-            g_array_append_val(session->fileNumArray, fileNum);
-            int64_t pos = -1LL * fileNum;
-            g_array_append_val(session->filePosArray, pos);
-            int16_t len = 0;
-            g_array_append_val(session->fileLenArray, len);
+            moloch_packet_pos_add_file(&session->packetPos, fileNum);
         }
 
-        g_array_append_val(session->filePosArray, filePos);
-        g_array_append_val(session->fileLenArray, fileLen);
+        moloch_packet_pos_add(&session->packetPos, filePos, fileLen);
 
         if (packets >= config.maxPackets) {
             moloch_nids_mid_save_session(session);
         }
     }
 
-    /* Clean up the Q, only 1 per incoming packet so we don't fall behind */
-    if ((headSession = DLL_PEEK_HEAD(q_, sessionsQ)) &&
-           ((uint64_t)headSession->lastPacket.tv_sec + sessionTimeout < (uint64_t)nids_last_pcap_header->ts.tv_sec)) {
-
-        if (packet->ip_p == IPPROTO_TCP && headSession->haveNidsTcp) {
-            //LOG("Saving because of at head %s", moloch_friendly_session_id(headSession->protocol, headSession->addr1, headSession->port1, headSession->addr2, headSession->port2));
-            headSession->lastPacket.tv_sec = nids_last_pcap_header->ts.tv_sec;
+    if (packet->ip_p == IPPROTO_TCP) {
+        /* libcurl requires we check on first data also since no connect callback */
+        if (!session->stopSPI && session->databytes[0] == 0 && session->databytes[1] == 0 &&
+            moloch_http_is_moloch(hash, sessionId)) {
+            if (config.debug)
+                LOG("Ignoring connection %s", moloch_friendly_session_id(session->protocol, session->addr1, session->port1, session->addr2, session->port2));
+            session->stopSPI = 1;
+            session->stopSaving = 1;
+        }
 
-            DLL_MOVE_TAIL(q_, sessionsQ, headSession);
+        if (moloch_tcp_packet(session, tcphdr, len - 4 * packet->ip_hl, which)) {
+            moloch_nids_save_session(session);
+            session = 0;
+        }
+    }
 
-            moloch_nids_mid_save_session(headSession);
-        } else {
-            moloch_nids_save_session(headSession);
+    /* Nothing more will be saved or parsed, have the kernel cut the rest of the
+     * flow down to headers.  Packets small enough to get thru whole still end
+     * up here, they must not be parsed or saved either. */
+    if (useTpacketv3 && config.tpacketv3MaxShunts && session && !session->shunted &&
+        (session->stopSPI || (session->stopSaving && packets >= session->stopSaving))) {
+        session->shunted = moloch_tpacketv3_shunt_add(session);
+        if (session->shunted) {
+            session->stopSPI = 1;
+            if (session->stopSaving == 0 || packets < session->stopSaving)
+                session->stopSaving = MIN(packets, 0xffff);
         }
     }
 
-    if ((headSession = DLL_PEEK_HEAD(tcp_, &tcpWriteQ)) &&
-           (headSession->lastSave + config.tcpSaveTimeout < (uint64_t)nids_last_pcap_header->ts.tv_sec)) {
+    /* Expire and mid save a bounded number of sessions per packet */
+    moloch_nids_timer_run(sset, packetHeader->ts.tv_sec, config.timeoutsPerPacket);
+}
+/******************************************************************************/
+static void moloch_nids_packet_thread_add(uint32_t hash, struct ip *packet, int len);
 
-            //LOG("Saving because of timeout %s", moloch_friendly_session_id(headSession->protocol, headSession->addr1, headSession->port1, headSession->addr2, headSession->port2));
-            moloch_nids_mid_save_session(headSession);
+void moloch_nids_cb_ip(struct ip *packet, int len)
+{
+    char             sessionId[MOLOCH_SESSIONID_LEN];
+    MolochSession_t *headSession = 0;
+    int              ses;
+
+    if (packet->ip_p == IPPROTO_IPV6)
+        return;
+
+    if ((ses = moloch_nids_session_id(packet, sessionId)) == -1) {
+        if (pluginsCbs & MOLOCH_PLUGIN_IP)
+            moloch_plugins_cb_ip(NULL, packet, len);
+        if (config.logUnknownProtocols)
+            LOG("Unknown protocol %d", packet->ip_p);
+        return;
+    }
+
+    uint32_t hash = moloch_session_hash(sessionId);
+
+    totalBytes += nids_last_pcap_header->caplen;
+
+    if (totalPackets == 0) {
+        struct pcap_stat ps;
+        if (!moloch_nids_stats(&ps)) {
+            initialDropped = ps.ps_drop;
+        }
+        initialPacket = nids_last_pcap_header->ts;
+        LOG("Initial Packet = %ld", initialPacket.tv_sec);
+        LOG("%" PRIu64 " Initial Dropped = %d", totalPackets, initialDropped);
     }
+
+    if ((++totalPackets) % config.logEveryXPackets == 0) {
+        struct pcap_stat ps;
+        if (moloch_nids_stats(&ps)) {
+            ps.ps_drop = 0;
+            ps.ps_recv = totalPackets;
+            ps.ps_ifdrop = 0;
+        }
+        /* The packet threads' timer wheels are theirs alone */
+        if (!packetThreadsNum)
+            headSession = moloch_nids_timer_first(sessionSets[moloch_nids_session_set()]);
+
+        uint32_t sessionsCount = 0;
+        int      t;
+        for (t = 0; t < sessionSetsNum; t++) {
+            sessionsCount += moloch_session_table_count(&sessionSets[t]->sessions[ses]);
+        }
+
+        LOG("packets: %" PRIu64 " current sessions: %u/%u oldest: %d - recv: %u drop: %u (%0.2f) ifdrop: %u queue: %d disk: %d",
+          totalPackets,
+          sessionsCount,
+          moloch_nids_monitoring_sessions(),
+          (headSession?(int)(nids_last_pcap_header->ts.tv_sec - moloch_nids_timer_due(headSession)):0),
+          ps.ps_recv,
+          ps.ps_drop - initialDropped, (ps.ps_drop - initialDropped)*(double)100.0/ps.ps_recv,
+          ps.ps_ifdrop,
+          moloch_http_queue_length(esServer),
+          moloch_writer_queue_length());
+
+        if (interfacesNum > 1) {
+            int i;
+            for (i = 0; i < interfacesNum; i++) {
+                MolochInterfaceStats_t istats;
+                moloch_nids_interface_stats(i, &istats);
+                LOG("interface: %s packets: %" PRIu64 " recv: %u drop: %u", istats.name, istats.packets, istats.recv, istats.dropped);
+            }
+        }
+
+        if (config.debug && !packetThreadsNum)
+            moloch_nids_table_stats_log();
+    }
+
+    lastPacketSecs = nids_last_pcap_header->ts.tv_sec;
+
+    if (packetThreadsNum) {
+        moloch_nids_packet_thread_add(hash, packet, len);
+        return;
+    }
+
+    packetHeader = nids_last_pcap_header;
+    packetData   = nids_last_pcap_data;
+    moloch_nids_process_ip(packet, len, sessionId, ses, hash);
 }
 
 /******************************************************************************/
@@ -516,275 +1078,425 @@ void moloch_nids_get_tag_cb(void *session, int tagType, const char *tagName, uin
     moloch_nids_decr_outstanding(session);
 }
 /******************************************************************************/
-gboolean moloch_nids_has_tag(MolochSession_t *session, const char *tagName)
+/* Packet threads can't reach ES, a tag that isn't cached yet is looked up on
+ * the main thread and handed back on the thread's tagQ */
+static void moloch_nids_packet_thread_tag_cb(void *tagv, int UNUSED(tagType), const char *UNUSED(tagName), uint32_t tagValue)
+{
+    MolochPacketTag_t    *tag = tagv;
+    MolochPacketThread_t *pt = &packetThreads[tag->thread];
+
+    tag->tagValue = tagValue;
+
+    pthread_mutex_lock(&pt->lock);
+    DLL_PUSH_TAIL(t_, &pt->tagQ, tag);
+    pthread_cond_signal(&pt->cond);
+    pthread_mutex_unlock(&pt->lock);
+}
+/******************************************************************************/
+static gboolean moloch_nids_packet_thread_tag_gfunc(gpointer tagv)
+{
+    MolochPacketTag_t *tag = tagv;
+
+    moloch_db_get_tag(tag, tag->tagType, tag->tag, moloch_nids_packet_thread_tag_cb);
+    return FALSE;
+}
+/******************************************************************************/
+static void moloch_nids_get_tag(MolochSession_t *session, int tagType, const char *tagName)
 {
     uint32_t tagValue;
 
-    if (!session->fields[tagsField])
-        return FALSE;
+    moloch_nids_incr_outstanding(session);
 
-    if ((tagValue = moloch_db_peek_tag(tagName)) == 0)
-        return FALSE;
+    if (!packetThreadsNum || moloch_main_thread()) {
+        moloch_db_get_tag(session, tagType, tagName, moloch_nids_get_tag_cb);
+        return;
+    }
 
-    MolochInt_t          *hint;
-    HASH_FIND_INT(i_, *(session->fields[tagsField]->ihash), tagValue, hint);
-    return hint != 0;
+    if ((tagValue = moloch_db_peek_tag(tagName))) {
+        moloch_nids_get_tag_cb(session, tagType, tagName, tagValue);
+        return;
+    }
+
+    MolochPacketTag_t *tag = MOLOCH_TYPE_ALLOC0(MolochPacketTag_t);
+    tag->session = session;
+    tag->tag     = g_strdup(tagName);
+    tag->tagType = tagType;
+    tag->thread  = packetThread;
+    g_idle_add(moloch_nids_packet_thread_tag_gfunc, tag);
 }
 /******************************************************************************/
-void moloch_nids_add_protocol(MolochSession_t *session, const char *protocol)
+static void moloch_nids_packet_thread_tag(MolochPacketTag_t *tag)
 {
-    moloch_field_string_add(protocolField, session, protocol, -1, TRUE);
+    moloch_nids_get_tag_cb(tag->session, tag->tagType, tag->tag, tag->tagValue);
+    g_free(tag->tag);
+    MOLOCH_TYPE_FREE(MolochPacketTag_t, tag);
 }
 /******************************************************************************/
-gboolean moloch_nids_has_protocol(MolochSession_t *session, const char *protocol)
+/* Wait for and apply one looked up tag, how a packet thread pauses for tags */
+static void moloch_nids_packet_thread_tag_wait()
 {
-    if (!session->fields[protocolField])
-        return FALSE;
+    MolochPacketThread_t *pt = &packetThreads[packetThread];
+    MolochPacketTag_t    *tag;
 
-    MolochString_t          *hstring;
-    HASH_FIND(s_, *(session->fields[protocolField]->shash), protocol, hstring);
-    return hstring != 0;
+    pthread_mutex_lock(&pt->lock);
+    while (!DLL_POP_HEAD(t_, &pt->tagQ, tag))
+        pthread_cond_wait(&pt->cond, &pt->lock);
+    pthread_mutex_unlock(&pt->lock);
+
+    moloch_nids_packet_thread_tag(tag);
 }
 /******************************************************************************/
-void moloch_nids_add_tag(MolochSession_t *session, const char *tag) {
-    moloch_nids_incr_outstanding(session);
-    moloch_db_get_tag(session, tagsField, tag, moloch_nids_get_tag_cb);
+/* Hand the batch being filled over to its thread */
+static void moloch_nids_packet_thread_flush(MolochPacketThread_t *pt)
+{
+    if (!pt->batch)
+        return;
 
-    if (session->stopSaving == 0 && HASH_COUNT(s_, config.dontSaveTags)) {
-        MolochString_t *tstring;
+    pthread_mutex_lock(&pt->lock);
+    DLL_PUSH_TAIL(b_, &pt->batchQ, pt->batch);
+    __atomic_store_n(&pt->head, pt->head + 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&pt->cond);
+    pthread_mutex_unlock(&pt->lock);
+    pt->batch = 0;
+}
+/******************************************************************************/
+static gboolean moloch_nids_packet_thread_idle_gfunc(gpointer UNUSED(user_data))
+{
+    int t;
 
-        HASH_FIND(s_, config.dontSaveTags, tag, tstring);
-        if (tstring) {
-            session->stopSaving = (int)(long)tstring->uw;
-        }
+    packetThreadsIdle = 0;
+    for (t = 0; t < packetThreadsNum; t++) {
+        moloch_nids_packet_thread_flush(&packetThreads[t]);
     }
+    return FALSE;
 }
+/******************************************************************************/
+/* A processed batch or a new one.  Live capture stops at MOLOCH_PACKET_BATCHES
+ * and drops, offline reading is held back by moloch_nids_offline_busy instead.
+ */
+static MolochPacketBatch_t *moloch_nids_packet_thread_batch(MolochPacketThread_t *pt)
+{
+    MolochPacketBatch_t *batch;
+
+    pthread_mutex_lock(&pt->lock);
+    DLL_POP_HEAD(b_, &pt->freeQ, batch);
+    pthread_mutex_unlock(&pt->lock);
+
+    if (batch)
+        return batch;
 
+    if (pt->batches >= MOLOCH_PACKET_BATCHES && !config.pcapReadOffline)
+        return NULL;
+
+    pt->batches++;
+    batch = malloc(sizeof(MolochPacketBatch_t) + MOLOCH_PACKET_BATCH_SIZE);
+    batch->buf     = (uint8_t *)(batch + 1);
+    batch->len     = 0;
+    batch->packets = 0;
+    return batch;
+}
 /******************************************************************************/
-void moloch_nids_add_tag_type(MolochSession_t *session, int tagtype, const char *tag) {
-    moloch_nids_incr_outstanding(session);
-    moloch_db_get_tag(session, tagtype, tag, moloch_nids_get_tag_cb);
+/* Copy the current packet into the batch of the thread that owns its session */
+static void moloch_nids_packet_thread_add(uint32_t hash, struct ip *packet, int len)
+{
+    MolochPacketThread_t     *pt = &packetThreads[hash % packetThreadsNum];
+    const struct pcap_pkthdr *h = nids_last_pcap_header;
+    int32_t                   ipOff = -1;
+    uint32_t                  extra = len;
 
-    if (session->stopSaving == 0 && HASH_COUNT(s_, config.dontSaveTags)) {
-        MolochString_t *tstring;
+    if (packetThreadsQuit)
+        return;
 
-        HASH_FIND(s_, config.dontSaveTags, tag, tstring);
-        if (tstring) {
-            session->stopSaving = (long)tstring->uw;
-        }
+    /* Reassembled datagrams live in libnids, everything else is in the frame */
+    if ((u_char *)packet >= nids_last_pcap_data && (u_char *)packet + len <= nids_last_pcap_data + h->caplen) {
+        ipOff = (u_char *)packet - nids_last_pcap_data;
+        extra = 0;
+    }
+
+    const uint32_t size = MOLOCH_PACKET_SIZE(h->caplen, extra);
+
+    if (pt->batch && pt->batch->len + size > MOLOCH_PACKET_BATCH_SIZE)
+        moloch_nids_packet_thread_flush(pt);
+
+    if (!pt->batch && !(pt->batch = moloch_nids_packet_thread_batch(pt))) {
+        pt->dropped++;
+        return;
     }
-}
 
+    MolochPacketBatch_t *batch = pt->batch;
+    MolochPacket_t      *p = (MolochPacket_t *)(batch->buf + batch->len);
+
+    p->hdr       = *h;
+    p->pos       = currentPos;
+    p->hash      = hash;
+    p->ipLen     = len;
+    p->ipOff     = ipOff;
+    p->input     = currentInput;
+    p->interface = currentInterface;
+    memcpy(p + 1, nids_last_pcap_data, h->caplen);
+    if (ipOff == -1)
+        memcpy((u_char *)(p + 1) + h->caplen, packet, len);
+
+    batch->len += size;
+    batch->packets++;
+
+    if (!packetThreadsIdle) {
+        packetThreadsIdle = 1;
+        g_idle_add(moloch_nids_packet_thread_idle_gfunc, 0);
+    }
+}
 /******************************************************************************/
-void moloch_nids_cb_tcp(struct tcp_stream *a_tcp, void *UNUSED(params))
+/* Queue a control message, it runs once everything handed over before it has */
+static void moloch_nids_packet_thread_ctl(MolochPacketThread_t *pt, int type, uint32_t value)
 {
-    MolochSession_t *session;
-    char             sessionId[1024];
+    MolochPacketCtl_t *ctl = MOLOCH_TYPE_ALLOC0(MolochPacketCtl_t);
 
-    //LOG("TCP (%d) - %s", a_tcp->nids_state, moloch_friendly_session_id(IPPROTO_TCP, a_tcp->addr.saddr, a_tcp->addr.source, a_tcp->addr.daddr, a_tcp->addr.dest));
-    //fflush(stdout);
+    moloch_nids_packet_thread_flush(pt);
 
-    switch (a_tcp->nids_state) {
-    case NIDS_JUST_EST:
+    ctl->type  = type;
+    ctl->value = value;
 
-        moloch_session_id(sessionId, a_tcp->addr.saddr, htons(a_tcp->addr.source), a_tcp->addr.daddr, htons(a_tcp->addr.dest));
+    pthread_mutex_lock(&pt->lock);
+    ctl->after = pt->head;
+    DLL_PUSH_TAIL(c_, &pt->ctlQ, ctl);
+    pthread_cond_signal(&pt->cond);
+    pthread_mutex_unlock(&pt->lock);
+}
+/******************************************************************************/
+static gboolean moloch_nids_offline_ack_gfunc(gpointer inputv);
 
-        HASH_FIND(h_, sessions[SESSION_TCP], sessionId, session);
+/* Returns TRUE when the thread should stop */
+static int moloch_nids_packet_thread_run_ctl(MolochPacketCtl_t *ctl)
+{
+    int t;
 
-        if (session) {
-            if (session->stopSPI) {
-                a_tcp->client.collect = 0;
-                a_tcp->server.collect = 0;
-                return;
-            }
-            session->haveNidsTcp = 1;
-            DLL_PUSH_TAIL(tcp_, &tcpWriteQ, session);
-            a_tcp->user = session;
-            a_tcp->client.collect++;
-            a_tcp->server.collect++;
+    switch (ctl->type) {
+    case MOLOCH_PACKET_CTL_TICK:
+        for (t = packetThread; t < sessionSetsNum; t += packetThreadsNum) {
+            moloch_nids_timer_run(sessionSets[t], ctl->value, config.timeoutsPerTick);
+        }
+        break;
+    case MOLOCH_PACKET_CTL_INPUT:
+        moloch_nids_session_set_flush(sessionSets[ctl->value * packetThreadsSets + packetThread]);
+        g_idle_add(moloch_nids_offline_ack_gfunc, &offlineInputs[ctl->value]);
+        break;
+    case MOLOCH_PACKET_CTL_QUIT:
+        MOLOCH_TYPE_FREE(MolochPacketCtl_t, ctl);
+        return TRUE;
+    }
+
+    MOLOCH_TYPE_FREE(MolochPacketCtl_t, ctl);
+    return FALSE;
+}
+/******************************************************************************/
+static void moloch_nids_packet_thread_batch_run(MolochPacketBatch_t *batch)
+{
+    static __thread struct pcap_pkthdr lastHeader;
+    char                               sessionId[MOLOCH_SESSIONID_LEN];
+    uint8_t                           *buf = batch->buf;
+    uint8_t                           *end = batch->buf + batch->len;
+
+    while (buf < end) {
+        MolochPacket_t *p = (MolochPacket_t *)buf;
+        const u_char   *data = (u_char *)(p + 1);
+        struct ip      *packet;
+
+        if (p->ipOff == -1) {
+            packet = (struct ip *)(data + p->hdr.caplen);
+            buf += MOLOCH_PACKET_SIZE(p->hdr.caplen, p->ipLen);
         } else {
-            LOG("ERROR - no session for %s", moloch_friendly_session_id(IPPROTO_TCP, a_tcp->addr.saddr, a_tcp->addr.source, a_tcp->addr.daddr, a_tcp->addr.dest));
+            packet = (struct ip *)(data + p->ipOff);
+            buf += MOLOCH_PACKET_SIZE(p->hdr.caplen, 0);
         }
-        if (pluginsCbs & MOLOCH_PLUGIN_TCP)
-            moloch_plugins_cb_tcp(session, a_tcp);
-        return;
-    case NIDS_DATA: {
 
-        // libcurl requires we check on first data also since no connect callback
-        if (a_tcp->client.offset == 0 || a_tcp->server.offset == 0) {
-            moloch_session_id(sessionId, a_tcp->addr.saddr, htons(a_tcp->addr.source), a_tcp->addr.daddr, htons(a_tcp->addr.dest));
-            uint32_t hash = HASH_HASH(sessions[SESSION_TCP], sessionId);
-            HASH_FIND_HASH(h_, sessions[SESSION_TCP], hash, sessionId, session);
+        packetHeader     = &p->hdr;
+        packetData       = data;
+        currentInput     = p->input;
+        currentPos       = p->pos;
+        currentInterface = p->interface;
 
-            if (moloch_http_is_moloch(hash, sessionId)) {
-                if (config.debug)
-                    LOG("Ignoring connection %s", moloch_friendly_session_id(session->protocol, session->addr1, session->port1, session->addr2, session->port2));
-                session->stopSPI = 1;
-                session->stopSaving = 1;
-                a_tcp->client.collect = 0;
-                a_tcp->server.collect = 0;
-            }
-        }
-            
-        session = a_tcp->user;
-        if (!session) {
-            LOG("ERROR - data - a_tcp->user not set for %s", moloch_friendly_session_id(IPPROTO_TCP, a_tcp->addr.saddr, a_tcp->addr.source, a_tcp->addr.daddr, a_tcp->addr.dest));
-            a_tcp->client.collect = 0;
-            a_tcp->server.collect = 0;
-            return;
-        }
+        moloch_nids_process_ip(packet, p->ipLen, sessionId, moloch_nids_session_id(packet, sessionId), p->hash);
+    }
 
-        if (a_tcp->client.count > 0x7fff0000 || a_tcp->server.count > 0x7fff0000) {
-            LOG("ERROR - Almost 2G in tcp session, preventing libnids crash for %s", moloch_friendly_session_id(IPPROTO_TCP, a_tcp->addr.saddr, a_tcp->addr.source, a_tcp->addr.daddr, a_tcp->addr.dest));
-            a_tcp->client.collect = 0;
-            a_tcp->server.collect = 0;
-            return;
-        }
+    /* Timer ticks mid save with the time of the last packet, the batch is
+     * about to be reused */
+    if (batch->packets) {
+        lastHeader   = *packetHeader;
+        packetHeader = &lastHeader;
+        packetData   = 0;
+    }
 
-        if (a_tcp->client.count_new) {
-            int countNew      = a_tcp->client.count_new;
-            int count         = a_tcp->client.count - a_tcp->client.offset;
-            unsigned char *dataNew = (unsigned char*)(a_tcp->client.data + (a_tcp->client.count - a_tcp->client.offset - countNew));
-            unsigned char *data    = (unsigned char*)a_tcp->client.data;
+    batch->len     = 0;
+    batch->packets = 0;
+}
+/******************************************************************************/
+static void *moloch_nids_packet_thread(gpointer ptv)
+{
+    MolochPacketThread_t *pt = ptv;
 
-            if (a_tcp->client.offset == session->consumed[1])
-                moloch_parsers_classify_tcp(session, data, count, 1);
+    packetThread = pt - packetThreads;
 
-            int i;
-            int totConsumed = 0;
-            int consumed = 0;
-
-            for (i = 0; i < session->parserNum; i++) {
-                if (session->parserInfo[i].parserFunc) {
-                    consumed = session->parserInfo[i].parserFunc(session, session->parserInfo[i].uw, dataNew + totConsumed, countNew - totConsumed, 1);
-                    if (consumed) {
-                        totConsumed += consumed;
-                        session->consumed[1] += consumed;
-                    }
-
-                    if (consumed >= countNew)
-                        break;
-                }
-            }
+    while (1) {
+        MolochPacketBatch_t *batch;
+        MolochPacketTag_t   *tag;
+        MolochPacketCtl_t   *ctl;
 
-            if (config.yara) {
-                moloch_yara_execute(session, data, count, a_tcp->client.count-countNew == session->consumed[1]);
+        pthread_mutex_lock(&pt->lock);
+        while (1) {
+            if (DLL_POP_HEAD(t_, &pt->tagQ, tag))
+                break;
 
-                nids_discard(a_tcp, session->offsets[1]);
-                session->offsets[1] = countNew;
-            } else if (session->offsets[1] == 0) {
-                session->offsets[1] = countNew;
-                nids_discard(a_tcp, 0);
+            ctl = DLL_PEEK_HEAD(c_, &pt->ctlQ);
+            if (ctl && ctl->after == pt->tail) {
+                DLL_REMOVE(c_, &pt->ctlQ, ctl);
+                break;
             }
+            ctl = 0;
 
-            if (a_tcp->client.offset == 0) {
-                session->firstBytesLen[1] = MIN(8, count);
-                memcpy(session->firstBytes[1], data, session->firstBytesLen[1]);
-            }
+            if (DLL_POP_HEAD(b_, &pt->batchQ, batch))
+                break;
 
-            session->databytes[1] += countNew;
+            pthread_cond_wait(&pt->cond, &pt->lock);
         }
+        pthread_mutex_unlock(&pt->lock);
 
-        if (a_tcp->server.count_new) {
-            int countNew      = a_tcp->server.count_new;
-            int count         = a_tcp->server.count - a_tcp->server.offset;
-            unsigned char *dataNew = (unsigned char*)(a_tcp->server.data + (a_tcp->server.count - a_tcp->server.offset - countNew));
-            unsigned char *data    = (unsigned char*)a_tcp->server.data;
+        if (tag) {
+            moloch_nids_packet_thread_tag(tag);
+            continue;
+        }
 
-            if (a_tcp->server.offset == session->consumed[0])
-                moloch_parsers_classify_tcp(session, data, count, 0);
+        if (ctl) {
+            if (moloch_nids_packet_thread_run_ctl(ctl))
+                break;
+            continue;
+        }
 
-            int i;
-            int totConsumed = 0;
-            int consumed = 0;
-            for (i = 0; i < session->parserNum; i++) {
-                if (session->parserInfo[i].parserFunc) {
-                    consumed = session->parserInfo[i].parserFunc(session, session->parserInfo[i].uw, dataNew + totConsumed, countNew - totConsumed, 0);
-
-                    if (consumed) {
-                        totConsumed += consumed;
-                        session->consumed[0] += consumed;
-                    }
-
-                    if (consumed >= countNew)
-                        break;
-                }
-            }
+        moloch_nids_packet_thread_batch_run(batch);
 
-            if (config.yara) {
-                moloch_yara_execute(session, data, count, a_tcp->server.count-countNew == session->consumed[0]);
+        pthread_mutex_lock(&pt->lock);
+        DLL_PUSH_TAIL(b_, &pt->freeQ, batch);
+        __atomic_store_n(&pt->tail, pt->tail + 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&pt->lock);
+    }
 
-                nids_discard(a_tcp, session->offsets[0]);
-                session->offsets[0] = countNew;
-            } else if (session->offsets[0] == 0) {
-                session->offsets[0] = countNew;
-                nids_discard(a_tcp, 0);
-            }
+    /* The main thread keeps its loop going until every thread is out */
+    __atomic_add_fetch(&packetThreadsDone, 1, __ATOMIC_SEQ_CST);
+    g_main_context_wakeup(NULL);
+    return NULL;
+}
+/******************************************************************************/
+static void moloch_nids_packet_threads_start()
+{
+    char name[20];
+    int  t;
 
-            if (a_tcp->server.offset == 0) {
-                session->firstBytesLen[0] = MIN(8, count);
-                memcpy(session->firstBytes[0], data, session->firstBytesLen[0]);
-            }
+    for (t = 0; t < packetThreadsNum; t++) {
+        MolochPacketThread_t *pt = &packetThreads[t];
 
-            session->databytes[0] += countNew;
-        }
+        DLL_INIT(b_, &pt->batchQ);
+        DLL_INIT(b_, &pt->freeQ);
+        DLL_INIT(c_, &pt->ctlQ);
+        DLL_INIT(t_, &pt->tagQ);
+        pthread_mutex_init(&pt->lock, NULL);
+        pthread_cond_init(&pt->cond, NULL);
 
+        snprintf(name, sizeof(name), "moloch-pkt%d", t);
+        pt->thread = g_thread_new(name, moloch_nids_packet_thread, pt);
+    }
+}
+/******************************************************************************/
+/* Let the threads finish what they were handed, they may still need the main
+ * thread for tags and ES while doing it */
+static void moloch_nids_packet_threads_exit()
+{
+    int t;
 
-        if (pluginsCbs & MOLOCH_PLUGIN_TCP)
-            moloch_plugins_cb_tcp(session, a_tcp);
+    if (!packetThreadsNum)
         return;
+
+    for (t = 0; t < packetThreadsNum; t++) {
+        moloch_nids_packet_thread_ctl(&packetThreads[t], MOLOCH_PACKET_CTL_QUIT, 0);
     }
-    default:
-        session = a_tcp->user;
+    packetThreadsQuit = 1;
 
-        if (!session) {
-            LOG("ERROR - default (%d) - a_tcp->user not set for %s", a_tcp->nids_state, moloch_friendly_session_id(IPPROTO_TCP, a_tcp->addr.saddr, a_tcp->addr.source, a_tcp->addr.daddr, a_tcp->addr.dest));
-            return;
-        }
+    while (__atomic_load_n(&packetThreadsDone, __ATOMIC_SEQ_CST) < packetThreadsNum) {
+        g_main_context_iteration(NULL, TRUE);
+    }
 
-        if (config.yara) {
-            if (a_tcp->client.count != a_tcp->client.offset) {
-                moloch_yara_execute(session, (unsigned char*)a_tcp->client.data, a_tcp->client.count - a_tcp->client.offset, a_tcp->client.offset == 0);
-            }
+    for (t = 0; t < packetThreadsNum; t++) {
+        g_thread_join(packetThreads[t].thread);
+        packetThreads[t].thread = 0;
+    }
+}
+/******************************************************************************/
+gboolean moloch_nids_has_tag(MolochSession_t *session, const char *tagName)
+{
+    uint32_t tagValue;
 
-            if (a_tcp->server.count != a_tcp->server.offset) {
-                moloch_yara_execute(session, (unsigned char*)a_tcp->server.data, a_tcp->server.count - a_tcp->server.offset, a_tcp->server.offset == 0);
-            }
+    if (!session->fields[tagsField])
+        return FALSE;
+
+    if ((tagValue = moloch_db_peek_tag(tagName)) == 0)
+        return FALSE;
+
+    MolochInt_t          *hint;
+    HASH_FIND_INT(i_, *(session->fields[tagsField]->ihash), tagValue, hint);
+    return hint != 0;
+}
+/******************************************************************************/
+void moloch_nids_add_protocol(MolochSession_t *session, const char *protocol)
+{
+    moloch_field_string_add(protocolField, session, protocol, -1, TRUE);
+}
+/******************************************************************************/
+gboolean moloch_nids_has_protocol(MolochSession_t *session, const char *protocol)
+{
+    if (!session->fields[protocolField])
+        return FALSE;
+
+    MolochString_t          *hstring;
+    HASH_FIND(s_, *(session->fields[protocolField]->shash), protocol, hstring);
+    return hstring != 0;
+}
+/******************************************************************************/
+void moloch_nids_add_tag(MolochSession_t *session, const char *tag) {
+    moloch_nids_get_tag(session, tagsField, tag);
+
+    if (session->stopSaving == 0 && HASH_COUNT(s_, config.dontSaveTags)) {
+        MolochString_t *tstring;
+
+        HASH_FIND(s_, config.dontSaveTags, tag, tstring);
+        if (tstring) {
+            session->stopSaving = (int)(long)tstring->uw;
         }
+    }
+}
 
-        if (pluginsCbs & MOLOCH_PLUGIN_TCP)
-            moloch_plugins_cb_tcp(session, a_tcp);
-        //LOG("TCP %d ", a_tcp->nids_state);
-        moloch_nids_save_session(session);
-        a_tcp->user = 0;
-        return;
+/******************************************************************************/
+void moloch_nids_add_tag_type(MolochSession_t *session, int tagtype, const char *tag) {
+    moloch_nids_get_tag(session, tagtype, tag);
+
+    if (session->stopSaving == 0 && HASH_COUNT(s_, config.dontSaveTags)) {
+        MolochString_t *tstring;
+
+        HASH_FIND(s_, config.dontSaveTags, tag, tstring);
+        if (tstring) {
+            session->stopSaving = (long)tstring->uw;
+        }
     }
 }
 
 /******************************************************************************/
 void moloch_nids_session_free (MolochSession_t *session)
 {
-    if (session->q_next) {
-        switch (session->protocol) {
-        case IPPROTO_TCP:
-            DLL_REMOVE(q_, &tcpSessionQ, session);
-            break;
-        case IPPROTO_UDP:
-            DLL_REMOVE(q_, &udpSessionQ, session);
-            break;
-        case IPPROTO_ICMP:
-            DLL_REMOVE(q_, &icmpSessionQ, session);
-            break;
-        }
-    }
+    moloch_nids_timer_remove(session);
 
-    if (session->tcp_next) {
-        DLL_REMOVE(tcp_, &tcpWriteQ, session);
-    }
+    if (session->shunted)
+        moloch_tpacketv3_shunt_remove(session);
+
+    moloch_tcp_free(session);
 
-    g_array_free(session->filePosArray, TRUE);
-    g_array_free(session->fileLenArray, TRUE);
-    g_array_free(session->fileNumArray, TRUE);
+    moloch_packet_pos_free(&session->packetPos);
 
     if (session->rootId)
         g_free(session->rootId);
@@ -801,7 +1513,10 @@ void moloch_nids_session_free (MolochSession_t *session)
     if (session->pluginData)
         MOLOCH_SIZE_FREE(pluginData, session->pluginData);
     moloch_field_free(session);
-    MOLOCH_TYPE_FREE(MolochSession_t, session);
+
+    MolochSessionSet_t *sset = sessionSets[session->set];
+    session->q_next = sset->freeSessions;
+    sset->freeSessions = session;
 }
 /******************************************************************************/
 void moloch_nids_syslog(int type, int errnum, struct ip *iph, void *data)
@@ -883,30 +1598,96 @@ gboolean moloch_nids_monitor_gfunc (gpointer UNUSED(user_data))
     return TRUE;
 }
 /******************************************************************************/
-/* Used when reading packets from an interface thru libnids/libpcap */
-gboolean moloch_nids_interface_dispatch()
+static void moloch_nids_pcap_cb(u_char *user, const struct pcap_pkthdr *h, const u_char *bytes)
 {
-    nids_dispatch(config.packetsPerPoll);
-    return TRUE;
+    moloch_reader_packet((MolochReader_t *)user, h, bytes, 0);
 }
 /******************************************************************************/
-/* Used when reading packets from a file thru libnids/libpcap */
-gboolean moloch_nids_file_dispatch()
+/* Reader thread for an interface read thru libpcap */
+static int moloch_nids_interface_read(MolochReader_t *reader, void *uw)
+{
+    const long         num = (long)uw;
+    MolochInterface_t *iface = &interfaces[num];
+    int                fd = pcap_get_selectable_fd(iface->pcap);
+
+    /* Handles without a fd to watch were left blocking with a timeout */
+    if (fd != -1) {
+        struct pollfd pfd;
+        pfd.fd      = fd;
+        pfd.events  = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 500) < 0 && errno != EINTR) {
+            LOG("ERROR - Couldn't poll '%s' %d: %s", config.interface[num], errno, strerror(errno));
+            return -1;
+        }
+    }
+
+    if (pcap_dispatch(iface->pcap, config.packetsPerPoll, moloch_nids_pcap_cb, (u_char *)reader) < 0) {
+        LOG("ERROR - Couldn't read from '%s': %s", config.interface[num], pcap_geterr(iface->pcap));
+        return -1;
+    }
+
+    time_t now = time(NULL);
+    if (now != iface->statsTime) {
+        struct pcap_stat ps;
+        iface->statsTime = now;
+        if (pcap_stats(iface->pcap, &ps) == 0) {
+            pthread_mutex_lock(&interfacesLock);
+            iface->stats = ps;
+            pthread_mutex_unlock(&interfacesLock);
+        }
+    }
+    return 1;
+}
+/******************************************************************************/
+/* An interface's reader thread only stops on an error, nothing left to capture from */
+static void moloch_nids_interface_done(int num, int UNUSED(status))
+{
+    LOG("ERROR - Stopped capturing on '%s'", config.interface[num]);
+    interfaces[num].reader = 0;
+    moloch_quit();
+}
+/******************************************************************************/
+/* Reading files goes as fast as the disk and ES let it, this is how much
+ * either can have outstanding before reading pauses.
+ */
+static int moloch_nids_offline_over_budget()
 {
     // pause reading if too many waiting disk operations
-    if (moloch_writer_queue_length() > 10) {
+    if (moloch_writer_queue_length() > config.offlineMaxDiskQueue)
         return TRUE;
-    }
 
-    // pause reading if too many waiting ES operations
-    if (moloch_http_queue_length(esServer) > 100) {
+    // pause reading if too many waiting ES operations, including bulk buffers not handed to http yet
+    if (moloch_http_queue_length(esServer) + (int)moloch_db_indexer_bulk_length() > (int)config.offlineMaxESQueue)
+        return TRUE;
+
+    return FALSE;
+}
+/******************************************************************************/
+static void moloch_nids_offline_cb(u_char *UNUSED(user), const struct pcap_pkthdr *h, const u_char *bytes)
+{
+    nids_pcap_handler(NULL, (struct pcap_pkthdr *)h, (u_char *)bytes);
+}
+/******************************************************************************/
+/* Used when reading packets from a file thru libnids/libpcap or the mmap reader */
+gboolean moloch_nids_file_dispatch()
+{
+    int r;
+
+    if (moloch_nids_offline_over_budget())
         return TRUE;
-    }
 
-    int r = nids_dispatch(config.packetsPerPoll);
+    if (offlineMmap)
+        r = moloch_mmap_dispatch(offlineMmap, config.packetsPerPoll, moloch_nids_offline_cb, 0);
+    else
+        r = nids_dispatch(config.packetsPerPoll);
 
     // Some kind of failure, move to the next file or quit
     if (r <= 0) {
+        if (offlineMmap) {
+            moloch_mmap_close(offlineMmap);
+            offlineMmap = 0;
+        }
         if (config.pcapDelete && r == 0) {
             if (config.debug)
                 LOG("Deleting %s", offlinePcapFilename);
@@ -928,7 +1709,247 @@ gboolean moloch_nids_file_dispatch()
 
     return TRUE;
 }
+/******************************************************************************/
+/* libnids is only given packets directly, so all it needs is a dead handle with
+ * the right link type.  The old one is closed once libnids has let go of it.
+ */
+static void moloch_nids_linktype_opened(pcap_t *pcap);
+
+static void moloch_nids_offline_linktype(int linktype, int snaplen)
+{
+    closeNextOpen = offlineDead;
+    offlineDead = pcap_open_dead(linktype, snaplen);
+    offlineLinktype = linktype;
+    nids_params.pcap_desc = offlineDead;
+    moloch_nids_linktype_opened(offlineDead);
+    moloch_nids_init_nids();
+}
+/******************************************************************************/
+/* Called from the reader threads */
+static int moloch_nids_offline_busy(int UNUSED(num))
+{
+    int t;
+
+    for (t = 0; t < packetThreadsNum; t++) {
+        MolochPacketThread_t *pt = &packetThreads[t];
+        if (__atomic_load_n(&pt->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&pt->tail, __ATOMIC_ACQUIRE) >= MOLOCH_PACKET_BATCHES/2)
+            return TRUE;
+    }
+
+    return moloch_nids_offline_over_budget();
+}
+/******************************************************************************/
+static void moloch_nids_offline_reader_cb(u_char *user, const struct pcap_pkthdr *h, const u_char *bytes)
+{
+    MolochOfflineInput_t *input = (MolochOfflineInput_t *)user;
+    uint64_t              pos;
+
+    if (input->mmap)
+        pos = moloch_mmap_pos(input->mmap);
+    else
+        pos = ftell(input->file) - 16 - h->caplen;
+
+    moloch_reader_packet(input->reader, h, bytes, pos);
+}
+/******************************************************************************/
+/* Reader thread for a parallel offline file */
+static int moloch_nids_offline_read(MolochReader_t *UNUSED(reader), void *uw)
+{
+    MolochOfflineInput_t *input = uw;
+    int                   r;
+
+    if (input->mmap)
+        r = moloch_mmap_dispatch(input->mmap, config.packetsPerPoll, moloch_nids_offline_reader_cb, (u_char *)input);
+    else
+        r = pcap_dispatch(input->pcap, config.packetsPerPoll, moloch_nids_offline_reader_cb, (u_char *)input);
+
+    if (r < 0 && !input->mmap)
+        LOG("ERROR - Couldn't read '%s': %s", input->filename, pcap_geterr(input->pcap));
+
+    return (r > 0)?1:r;
+}
+/******************************************************************************/
+static void moloch_nids_offline_packet(int num, const struct pcap_pkthdr *h, const u_char *bytes, uint64_t pos)
+{
+    currentInput = num;
+    currentPos   = pos;
+    nids_pcap_handler(NULL, (struct pcap_pkthdr *)h, (u_char *)bytes);
+}
+/******************************************************************************/
+static void moloch_nids_offline_reader_done(int num, int status);
+
+static void moloch_nids_offline_start(MolochOfflineInput_t *input)
+{
+    input->state  = MOLOCH_INPUT_ACTIVE;
+    input->reader = moloch_reader_start("moloch-file", input - offlineInputs, FALSE,
+                                        moloch_nids_offline_read, moloch_nids_offline_packet, NULL,
+                                        moloch_nids_offline_busy, moloch_nids_offline_reader_done, input);
+}
+/******************************************************************************/
+static int moloch_nids_offline_count(int state)
+{
+    int i, count = 0;
+
+    for (i = 0; i < (int)config.offlineParallelFiles; i++) {
+        if (offlineInputs[i].state == state)
+            count++;
+    }
+    return count;
+}
+/******************************************************************************/
+/* Open files into the free slots and start their reader threads */
+static void moloch_nids_offline_fill()
+{
+    int i;
+
+    for (i = 0; i < (int)config.offlineParallelFiles; i++) {
+        MolochOfflineInput_t *input = &offlineInputs[i];
+
+        if (input->state != MOLOCH_INPUT_FREE)
+            continue;
+
+        /* Let the files of the old link type drain first */
+        if (moloch_nids_offline_count(MOLOCH_INPUT_WAITING) > 0)
+            return;
+
+        currentInput = i;
+        nids_params.pcap_desc = 0;
+        if (!moloch_nids_next_file()) {
+            nids_params.pcap_desc = offlineDead;
+            return;
+        }
+
+        input->pcap = nids_params.pcap_desc;
+        input->file = offlineFile;
+        input->mmap = offlineMmap;
+        offlineMmap = 0;
+        input->linktype = pcap_datalink(input->pcap);
+        strcpy(input->filename, offlinePcapFilename);
+        nids_params.pcap_desc = offlineDead;
+
+        if (config.bpf && !input->mmap) {
+            struct bpf_program bpf;
+            if (pcap_compile(input->pcap, &bpf, config.bpf, 1, PCAP_NETMASK_UNKNOWN) == -1 ||
+                pcap_setfilter(input->pcap, &bpf) == -1) {
+                LOG("ERROR - Couldn't set filter '%s' on '%s' with %s", config.bpf, input->filename, pcap_geterr(input->pcap));
+                exit(1);
+            }
+            pcap_freecode(&bpf);
+        }
+
+        if (offlineLinktype == -1)
+            moloch_nids_offline_linktype(input->linktype, pcap_snapshot(input->pcap));
+
+        if (input->linktype == offlineLinktype) {
+            moloch_nids_offline_start(input);
+        } else {
+            input->state = MOLOCH_INPUT_WAITING;
+        }
+    }
+}
+/******************************************************************************/
+/* Sessions never span files, so save everything the file still has open */
+static void moloch_nids_offline_done(MolochOfflineInput_t *input, int r)
+{
+    /* Packet threads have already saved theirs */
+    if (!packetThreadsNum)
+        moloch_nids_session_set_flush(sessionSets[input - offlineInputs]);
+
+    pcap_close(input->pcap);
+    input->pcap = 0;
+    input->file = 0;
+    if (input->mmap) {
+        moloch_mmap_close(input->mmap);
+        input->mmap = 0;
+    }
+    input->state = MOLOCH_INPUT_FREE;
+
+    if (config.pcapDelete && r == 0) {
+        if (config.debug)
+            LOG("Deleting %s", input->filename);
+        int rc = unlink(input->filename);
+        if (rc != 0)
+            LOG("Failed to delete file %s %s (%d)", input->filename, strerror(errno), errno);
+    }
+}
+/******************************************************************************/
+static void moloch_nids_offline_next();
+gboolean moloch_nids_offline_monitor_gfunc(gpointer UNUSED(user_data))
+{
+    if (DLL_COUNT(s_, &monitorQ) == 0)
+        return TRUE;
+
+    moloch_nids_offline_next();
+    return FALSE;
+}
+/******************************************************************************/
+/* Start whatever can be read next, once nothing is left monitor or quit */
+static void moloch_nids_offline_next()
+{
+    int i;
+
+    if (config.exiting)
+        return;
+
+    /* Every file of the old link type is done, switch libnids to the new one */
+    if (moloch_nids_offline_count(MOLOCH_INPUT_ACTIVE) == 0 && moloch_nids_offline_count(MOLOCH_INPUT_WAITING) > 0) {
+        for (i = 0; i < (int)config.offlineParallelFiles; i++) {
+            MolochOfflineInput_t *input = &offlineInputs[i];
+
+            if (input->state != MOLOCH_INPUT_WAITING)
+                continue;
+
+            if (offlineLinktype != input->linktype)
+                moloch_nids_offline_linktype(input->linktype, pcap_snapshot(input->pcap));
+            if (offlineLinktype == input->linktype)
+                moloch_nids_offline_start(input);
+        }
+    }
+
+    moloch_nids_offline_fill();
+
+    if (moloch_nids_offline_count(MOLOCH_INPUT_FREE) < (int)config.offlineParallelFiles)
+        return;
+
+    if (config.pcapMonitor)
+        g_timeout_add(100, moloch_nids_offline_monitor_gfunc, 0);
+    else
+        moloch_quit();
+}
+/******************************************************************************/
+/* Everything a file's reader thread read has been processed */
+static void moloch_nids_offline_reader_done(int num, int status)
+{
+    MolochOfflineInput_t *input = &offlineInputs[num];
+    int                   t;
+
+    input->reader = 0;
+
+    /* The input stays active until every packet thread has saved its sessions */
+    if (packetThreadsNum) {
+        input->status = status;
+        input->acks   = packetThreadsNum;
+        for (t = 0; t < packetThreadsNum; t++) {
+            moloch_nids_packet_thread_ctl(&packetThreads[t], MOLOCH_PACKET_CTL_INPUT, num);
+        }
+        return;
+    }
+
+    moloch_nids_offline_done(input, status);
+    moloch_nids_offline_next();
+}
+/******************************************************************************/
+static gboolean moloch_nids_offline_ack_gfunc(gpointer inputv)
+{
+    MolochOfflineInput_t *input = inputv;
+
+    if (config.exiting || --input->acks > 0)
+        return FALSE;
 
+    moloch_nids_offline_done(input, input->status);
+    moloch_nids_offline_next();
+    return FALSE;
+}
 /******************************************************************************/
 pcap_t *
 moloch_pcap_open_live(const char *source, int snaplen, int promisc, int to_ms, char *errbuf)
@@ -979,19 +2000,35 @@ fail:
 uint32_t moloch_nids_dropped_packets()
 {
     struct pcap_stat ps;
+    uint32_t         dropped = 0;
+    int              t;
+
+    /* Only counted by the main thread */
+    for (t = 0; t < packetThreadsNum; t++) {
+        dropped += packetThreads[t].dropped;
+    }
+
     if (nids_params.pcap_desc) {
-        if (pcap_stats(nids_params.pcap_desc, &ps))
-            return 0;
+        if (moloch_nids_stats(&ps))
+            return dropped;
 
-        return ps.ps_drop - initialDropped;
+        return dropped + ps.ps_drop - initialDropped;
     }
 
-    return 0;
+    return dropped;
 }
 /******************************************************************************/
 uint32_t moloch_nids_monitoring_sessions()
 {
-    return HASH_COUNT(h_, sessions[SESSION_TCP]) + HASH_COUNT(h_, sessions[SESSION_UDP]) + HASH_COUNT(h_, sessions[SESSION_ICMP]);
+    uint32_t count = 0;
+    int      t;
+
+    for (t = 0; t < sessionSetsNum; t++) {
+        count += moloch_session_table_count(&sessionSets[t]->sessions[SESSION_TCP]) +
+                 moloch_session_table_count(&sessionSets[t]->sessions[SESSION_UDP]) +
+                 moloch_session_table_count(&sessionSets[t]->sessions[SESSION_ICMP]);
+    }
+    return count;
 }
 /******************************************************************************/
 void moloch_nids_process_udp(MolochSession_t *session, struct udphdr *udphdr, unsigned char *data, int len, int which)
@@ -1006,10 +2043,66 @@ void moloch_nids_process_udp(MolochSession_t *session, struct udphdr *udphdr, un
     }
 }
 /******************************************************************************/
-void moloch_nids_pcap_opened() 
+/* Chain the dontSaveBPFs programs into one that returns the 1 based number of
+ * the first rule that matches, or 0 if none do.  A rule's reject becomes a
+ * jump to the start of the next rule and its accept returns the rule number,
+ * so a new flow runs through a single program instead of one per rule.
+ * Returns FALSE if a program returns something other than a constant.
+ */
+static int moloch_nids_dont_save_merge()
+{
+    struct bpf_insn *insns;
+    u_int            total = 0, pc = 0, n;
+    int              i;
+
+    for (i = 0; i < config.dontSaveBPFsNum; i++)
+        total += bpf_programs[i].bf_len;
+
+    insns = malloc(total*sizeof(struct bpf_insn));
+
+    for (i = 0; i < config.dontSaveBPFsNum; i++) {
+        u_int next = pc + bpf_programs[i].bf_len;
+
+        for (n = 0; n < bpf_programs[i].bf_len; n++, pc++) {
+            insns[pc] = bpf_programs[i].bf_insns[n];
+            if (BPF_CLASS(insns[pc].code) != BPF_RET)
+                continue;
+
+            if (BPF_RVAL(insns[pc].code) != BPF_K) {
+                free(insns);
+                return FALSE;
+            }
+
+            if (insns[pc].k != 0) {
+                insns[pc].k = i + 1;
+            } else if (i + 1 < config.dontSaveBPFsNum) {
+                insns[pc].code = BPF_JMP | BPF_JA;
+                insns[pc].jt   = insns[pc].jf = 0;
+                insns[pc].k    = next - (pc + 1);
+            }
+        }
+    }
+
+    dontSaveBPF.bf_len   = total;
+    dontSaveBPF.bf_insns = insns;
+    return TRUE;
+}
+/******************************************************************************/
+uint64_t moloch_nids_dont_save_hits(int i)
+{
+    if (!dontSaveBPFHits || i >= config.dontSaveBPFsNum)
+        return 0;
+    return dontSaveBPFHits[i];
+}
+/******************************************************************************/
+/* The header written to new files and the dontSaveBPFs follow the link type.
+ * Parallel offline files only change it thru moloch_nids_offline_linktype,
+ * once nothing of the old one is still being processed.
+ */
+static void moloch_nids_linktype_opened(pcap_t *pcap)
 {
-    pcapFileHeader.snaplen = pcap_snapshot(nids_params.pcap_desc);
-    pcapFileHeader.linktype = dlt_to_linktype(pcap_datalink(nids_params.pcap_desc)) | pcap_datalink_ext(nids_params.pcap_desc);
+    pcapFileHeader.snaplen = pcap_snapshot(pcap);
+    pcapFileHeader.linktype = dlt_to_linktype(pcap_datalink(pcap)) | pcap_datalink_ext(pcap);
     if (config.debug)
         LOG("linktype %x", pcapFileHeader.linktype);
 
@@ -1019,23 +2112,79 @@ void moloch_nids_pcap_opened()
             for (i = 0; i < config.dontSaveBPFsNum; i++) {
                 pcap_freecode(&bpf_programs[i]);
             }
+            free(dontSaveBPF.bf_insns);
+            dontSaveBPF.bf_insns = 0;
         } else {
             bpf_programs= malloc(config.dontSaveBPFsNum*sizeof(struct bpf_program));
+            dontSaveBPFHits = calloc(config.dontSaveBPFsNum, sizeof(uint64_t));
         }
         for (i = 0; i < config.dontSaveBPFsNum; i++) {
-            if (pcap_compile(nids_params.pcap_desc, &bpf_programs[i], config.dontSaveBPFs[i], 0, PCAP_NETMASK_UNKNOWN) == -1) {
-                LOG("ERROR - Couldn't compile filter: '%s' with %s", config.dontSaveBPFs[i], pcap_geterr(nids_params.pcap_desc));
+            if (pcap_compile(pcap, &bpf_programs[i], config.dontSaveBPFs[i], 0, PCAP_NETMASK_UNKNOWN) == -1) {
+                LOG("ERROR - Couldn't compile filter: '%s' with %s", config.dontSaveBPFs[i], pcap_geterr(pcap));
                 exit(1);
             }
         }
+        if (!moloch_nids_dont_save_merge())
+            LOG("WARNING - Couldn't combine dontSaveBPFs, checking them one at a time");
+        else if (config.debug)
+            LOG("dontSaveBPFs combined into %u instructions", dontSaveBPF.bf_len);
+    }
+}
+/******************************************************************************/
+void moloch_nids_pcap_opened() 
+{
+    if (!offlineParallel)
+        moloch_nids_linktype_opened(nids_params.pcap_desc);
+
+    if ((offlineFile || offlineMmap) && moloch_writer_next_input) {
+        moloch_writer_lock();
+        moloch_writer_next_input(offlineFile, offlineMmap, offlinePcapFilename);
+        moloch_writer_unlock();
+    }
+}
+/******************************************************************************/
+/* Open an offline file with the mmap reader if it can, libnids then only gets
+ * a dead handle with the file's link type.  Otherwise thru libpcap.
+ */
+static pcap_t *moloch_nids_offline_open(const char *filename, char *errbuf)
+{
+    pcap_t *pcap;
+
+    offlineFile = 0;
+    offlineMmap = 0;
+
+    if (config.offlineMmap) {
+        offlineMmap = moloch_mmap_open(filename, errbuf);
+        if (offlineMmap) {
+            pcap = pcap_open_dead(moloch_mmap_datalink(offlineMmap), moloch_mmap_snapshot(offlineMmap));
+            if (config.bpf) {
+                struct bpf_program bpf;
+                if (pcap_compile(pcap, &bpf, config.bpf, 1, PCAP_NETMASK_UNKNOWN) == -1) {
+                    LOG("ERROR - Couldn't compile filter '%s' with %s", config.bpf, pcap_geterr(pcap));
+                    exit(1);
+                }
+                moloch_mmap_setfilter(offlineMmap, &bpf);
+            }
+            /* libnids would try to set it on the dead handle */
+            nids_params.pcap_filter = NULL;
+            return pcap;
+        }
+        if (config.debug)
+            LOG("Not using mmap reader %s", errbuf);
+        errbuf[0] = 0;
     }
 
-    if (offlineFile && moloch_writer_next_input)
-        moloch_writer_next_input(offlineFile, offlinePcapFilename);
+    pcap = pcap_open_offline(filename, errbuf);
+    if (pcap)
+        offlineFile = pcap_file(pcap);
+
+    /* Parallel files set their own, libnids only has the dead handle */
+    if (config.bpf && !offlineParallel)
+        nids_params.pcap_filter = config.bpf;
+    return pcap;
 }
 
 /******************************************************************************/
-static pcap_t *closeNextOpen = 0;
 int moloch_nids_next_file()
 {
     char         errbuf[1024];
@@ -1054,13 +2203,12 @@ int moloch_nids_next_file()
         pcapFilePos++;
 
         LOG ("Processing %s", fullfilename);
-        nids_params.pcap_desc = pcap_open_offline(fullfilename, errbuf);
+        nids_params.pcap_desc = moloch_nids_offline_open(fullfilename, errbuf);
 
         if (!nids_params.pcap_desc) {
             LOG("Couldn't process '%s' error '%s'", fullfilename, errbuf);
             return moloch_nids_next_file();
         }
-        offlineFile = pcap_file(nids_params.pcap_desc);
 
         if (!realpath(fullfilename, offlinePcapFilename)) {
             LOG("ERROR - pcap open failed - Couldn't realpath file: '%s' with %d", fullfilename, errno);
@@ -1144,13 +2292,12 @@ filesDone:
             LOG ("Processing %s", fullfilename);
             errbuf[0] = 0;
             closeNextOpen = nids_params.pcap_desc;
-            nids_params.pcap_desc = pcap_open_offline(fullfilename, errbuf);
+            nids_params.pcap_desc = moloch_nids_offline_open(fullfilename, errbuf);
             if (!nids_params.pcap_desc) {
                 LOG("Couldn't process '%s' error '%s'", fullfilename, errbuf);
                 g_free(fullfilename);
                 continue;
             }
-            offlineFile = pcap_file(nids_params.pcap_desc);
             moloch_nids_pcap_opened();
             g_free(fullfilename);
             return 1;
@@ -1192,13 +2339,12 @@ dirsDone:
         LOG ("Processing %s", fullfilename);
         errbuf[0] = 0;
         closeNextOpen = nids_params.pcap_desc;
-        nids_params.pcap_desc = pcap_open_offline(fullfilename, errbuf);
+        nids_params.pcap_desc = moloch_nids_offline_open(fullfilename, errbuf);
         if (!nids_params.pcap_desc) {
             LOG("Couldn't process '%s' error '%s'", fullfilename, errbuf);
             g_free(fullfilename);
             continue;
         }
-        offlineFile = pcap_file(nids_params.pcap_desc);
         moloch_nids_pcap_opened();
         g_free(fullfilename);
         return 1;
@@ -1209,25 +2355,65 @@ dirsDone:
 void moloch_nids_root_init()
 {
     char errbuf[1024];
-    if (!config.pcapReadOffline) {
+    int  i;
+
+    if (config.pcapReadOffline)
+        return;
+
+    interfacesNum = g_strv_length(config.interface);
+
+    if (strcmp(config.pcapReadMethod, "tpacketv3") == 0) {
+        useTpacketv3 = 1;
+        moloch_tpacketv3_init(config.interface, config.interfaceBpf, 8096);
+
+        /* libnids still wants a pcap handle for the link type, packets come from the ring */
+        nids_params.pcap_desc = pcap_open_dead(moloch_tpacketv3_datalink_type(), 8096);
+        moloch_nids_pcap_opened();
+        return;
+    }
+
+    for (i = 0; i < interfacesNum; i++) {
 #ifdef SNF
-        nids_params.pcap_desc = pcap_open_live(config.interface, 8096, 1, 500, errbuf);
+        interfaces[i].pcap = pcap_open_live(config.interface[i], 8096, 1, 500, errbuf);
 #else
-        nids_params.pcap_desc = moloch_pcap_open_live(config.interface, 8096, 1, 500, errbuf);
+        interfaces[i].pcap = moloch_pcap_open_live(config.interface[i], 8096, 1, 500, errbuf);
 #endif
 
+        if (!interfaces[i].pcap) {
+            LOG("pcap open live failed on '%s'! %s", config.interface[i], errbuf);
+            exit(1);
+        }
 
-        if (!nids_params.pcap_desc) {
-            LOG("pcap open live failed! %s", errbuf);
+        /* libnids decodes every packet using the first interface's link type */
+        if (pcap_datalink(interfaces[i].pcap) != pcap_datalink(interfaces[0].pcap)) {
+            LOG("ERROR - Interface '%s' link type %d doesn't match '%s' link type %d", config.interface[i], pcap_datalink(interfaces[i].pcap), config.interface[0], pcap_datalink(interfaces[0].pcap));
+            exit(1);
+        }
+
+        if (config.interfaceBpf[i]) {
+            struct bpf_program bpf;
+            if (pcap_compile(interfaces[i].pcap, &bpf, config.interfaceBpf[i], 1, PCAP_NETMASK_UNKNOWN) == -1 ||
+                pcap_setfilter(interfaces[i].pcap, &bpf) == -1) {
+                LOG("ERROR - Couldn't set filter '%s' on '%s' with %s", config.interfaceBpf[i], config.interface[i], pcap_geterr(interfaces[i].pcap));
+                exit(1);
+            }
+            pcap_freecode(&bpf);
+        }
+
+        /* Nothing to poll, the reader thread blocks in libpcap instead */
+        if (pcap_get_selectable_fd(interfaces[i].pcap) == -1 && pcap_setnonblock(interfaces[i].pcap, FALSE, errbuf) < 0) {
+            LOG("ERROR - Couldn't set '%s' to blocking: %s", config.interface[i], errbuf);
             exit(1);
         }
-        moloch_nids_pcap_opened();
     }
+
+    /* The reader threads own the live handles, libnids is only given packets */
+    nids_params.pcap_desc = pcap_open_dead(pcap_datalink(interfaces[0].pcap), pcap_snapshot(interfaces[0].pcap));
+    moloch_nids_pcap_opened();
 }
 /******************************************************************************/
 void moloch_nids_init_nids()
 {
-    nids_unregister_tcp(moloch_nids_cb_tcp);
     nids_unregister_ip(moloch_nids_cb_ip);
     int rc = nids_init();
     if (rc == 0) {
@@ -1244,16 +2430,25 @@ void moloch_nids_init_nids()
         closeNextOpen = 0;
     }
 
-    GVoidFunc dispatch;
-    if (config.pcapReadOffline)
-        dispatch = (GVoidFunc)&moloch_nids_file_dispatch;
-    else
-        dispatch = (GVoidFunc)&moloch_nids_interface_dispatch;
-
-    if (nids_getfd() == -1) {
-        g_timeout_add(0, (GSourceFunc)dispatch, NULL);
+    if (offlineParallel) {
+        /* The offline reader threads feed libnids */
+    } else if (config.pcapReadOffline) {
+        /* The mmap reader's dead handle has no fd worth watching */
+        if (offlineMmap || nids_getfd() == -1) {
+            g_timeout_add(0, (GSourceFunc)moloch_nids_file_dispatch, NULL);
+        } else {
+            moloch_watch_fd(nids_getfd(), MOLOCH_GIO_READ_COND, (MolochWatchFd_func)moloch_nids_file_dispatch, NULL);
+        }
     } else {
-        moloch_watch_fd(nids_getfd(), MOLOCH_GIO_READ_COND, (MolochWatchFd_func)dispatch, NULL);
+        long i;
+        for (i = 0; i < interfacesNum; i++) {
+            if (interfaces[i].reader)
+                continue;
+            interfaces[i].reader = moloch_reader_start("moloch-reader", i, TRUE,
+                                                       useTpacketv3?moloch_tpacketv3_read:moloch_nids_interface_read,
+                                                       moloch_nids_interface_packet, useTpacketv3?moloch_tpacketv3_block:NULL,
+                                                       NULL, moloch_nids_interface_done, (void *)i);
+        }
     }
 
 
@@ -1263,7 +2458,6 @@ void moloch_nids_init_nids()
     ctl.action = NIDS_DONT_CHKSUM;
     nids_register_chksum_ctl(&ctl, 1);
 
-    nids_register_tcp(moloch_nids_cb_tcp);
     nids_register_ip(moloch_nids_cb_ip);
 }
 /******************************************************************************/
@@ -1400,24 +2594,50 @@ void moloch_nids_init()
         MOLOCH_FIELD_TYPE_INT_HASH,  MOLOCH_FIELD_FLAG_COUNT | MOLOCH_FIELD_FLAG_LINKED_SESSIONS,
         NULL);
 
+    interfaceField = moloch_field_define("general", "termfield",
+        "interface", "Interface", "iface-term",
+        "Interfaces the session was captured on",
+        MOLOCH_FIELD_TYPE_STR_HASH,  MOLOCH_FIELD_FLAG_COUNT | MOLOCH_FIELD_FLAG_LINKED_SESSIONS,
+        NULL);
+
     tagsField = moloch_field_by_db("ta");
 
-    HASH_INIT(h_, sessions[SESSION_UDP], moloch_session_hash, moloch_session_cmp);
-    HASH_INIT(h_, sessions[SESSION_TCP], moloch_session_hash, moloch_session_cmp);
-    HASH_INIT(h_, sessions[SESSION_ICMP], moloch_session_hash, moloch_session_cmp);
-    DLL_INIT(tcp_, &tcpWriteQ);
-    DLL_INIT(q_, &tcpSessionQ);
-    DLL_INIT(q_, &udpSessionQ);
-    DLL_INIT(q_, &icmpSessionQ);
+    if (config.packetThreads > 1)
+        packetThreadsNum = config.packetThreads;
+
+    /* Each parallel offline file gets its own session set per packet thread,
+     * packet threads always read files thru the parallel readers */
+    if (config.pcapReadOffline && (config.offlineParallelFiles > 1 || packetThreadsNum)) {
+        offlineParallel = 1;
+        packetThreadsSets = MAX(packetThreadsNum, 1);
+        sessionSetsNum = config.offlineParallelFiles * packetThreadsSets;
+    } else if (packetThreadsNum) {
+        sessionSetsNum = packetThreadsNum;
+    }
+
+    int t, s;
+    sessionSets = g_malloc0(sessionSetsNum * sizeof(MolochSessionSet_t *));
+    for (t = 0; t < sessionSetsNum; t++) {
+        sessionSets[t] = g_malloc0(sizeof(MolochSessionSet_t));
+        for (s = 0; s < SESSION_MAX; s++) {
+            moloch_session_table_init(&sessionSets[t]->sessions[s], 1024);
+        }
+        for (s = 0; s < MOLOCH_WHEEL_SLOTS; s++) {
+            DLL_INIT(q_, &sessionSets[t]->wheel[s]);
+        }
+    }
     DLL_INIT(s_, &monitorQ);
 
+    moloch_nids_packet_threads_start();
+
     nids_params.n_hosts = 1024;
     nids_params.tcp_workarounds = 1;
     nids_params.one_loop_less = 0;
     nids_params.scan_num_hosts = 0;
     nids_params.scan_num_ports = 0;
     nids_params.syslog = moloch_nids_syslog;
-    nids_params.n_tcp_streams = config.maxStreams;
+    /* tcp.c does the stream reassembly, libnids only decodes and defrags */
+    nids_params.n_tcp_streams = 0;
 
     if (config.pcapReadOffline) {
         if (config.dryRun || !config.copyPcap) {
@@ -1434,10 +2654,17 @@ void moloch_nids_init()
         }
     }
 
-    if (config.bpf)
-        nids_params.pcap_filter = config.bpf;
-
-    if (config.pcapReadOffline) {
+    if (offlineParallel) {
+        moloch_nids_offline_fill();
+        if (moloch_nids_offline_count(MOLOCH_INPUT_FREE) < (int)config.offlineParallelFiles) {
+            /* The reader threads take it from here */
+        } else if (config.pcapMonitor) {
+            g_timeout_add(100, moloch_nids_offline_monitor_gfunc, 0);
+        } else {
+            LOG("No files to process.");
+            exit(0);
+        }
+    } else if (config.pcapReadOffline) {
         moloch_nids_next_file();
         if (!nids_params.pcap_desc) {
             if (config.pcapMonitor) {
@@ -1449,56 +2676,80 @@ void moloch_nids_init()
         }
     }
 
-    if (nids_params.pcap_desc)
+    if (nids_params.pcap_desc && !offlineParallel)
         moloch_nids_init_nids();
 
+    /* Reading files, time only moves with the packets */
+    if (!config.pcapReadOffline)
+        g_timeout_add_seconds(1, moloch_nids_timer_gfunc, 0);
+
     if (config.pcapMonitor)
         moloch_nids_init_monitor();
 }
 /******************************************************************************/
+static void moloch_nids_exit_save(MolochSession_t *session)
+{
+    if (session->shunted)
+        moloch_tpacketv3_shunt_fold(session);
+    moloch_db_save_session(session, TRUE);
+}
+/******************************************************************************/
 void moloch_nids_exit() {
 
     config.exiting = 1;
+
+    int t, i;
+
+    for (i = 0; i < interfacesNum; i++) {
+        if (interfaces[i].reader) {
+            moloch_reader_stop(interfaces[i].reader);
+            interfaces[i].reader = 0;
+        }
+    }
+
+    for (i = 0; offlineParallel && i < (int)config.offlineParallelFiles; i++) {
+        if (offlineInputs[i].reader) {
+            moloch_reader_stop(offlineInputs[i].reader);
+            offlineInputs[i].reader = 0;
+        }
+    }
+
+    /* Every session set is the main thread's again after this */
+    moloch_nids_packet_threads_exit();
+
+    int counts[SESSION_MAX] = {0, 0, 0};
+    for (t = 0; t < sessionSetsNum; t++) {
+        for (i = 0; i < SESSION_MAX; i++) {
+            counts[i] += moloch_session_table_count(&sessionSets[t]->sessions[i]);
+        }
+    }
+
     LOG("sessions: %d tcp: %d udp: %d icmp: %d",
             moloch_nids_monitoring_sessions(),
-            tcpSessionQ.q_count,
-            udpSessionQ.q_count,
-            icmpSessionQ.q_count);
+            counts[SESSION_TCP],
+            counts[SESSION_UDP],
+            counts[SESSION_ICMP]);
+
+    if (config.debug) {
+        moloch_nids_table_stats_log();
+        for (i = 0; i < config.dontSaveBPFsNum; i++) {
+            LOG("dontSaveBPFs: %s hits: %" PRIu64, config.dontSaveBPFs[i], moloch_nids_dont_save_hits(i));
+        }
+    }
 
-    nids_unregister_tcp(moloch_nids_cb_tcp);
     nids_unregister_ip(moloch_nids_cb_ip);
     nids_exit();
 
-    int i;
-    for (i = 0; i < SESSION_MAX; i++) {
-
-#ifdef PRINT_BUCKETS
-        // Print out the histogram for buckets, see how we are doing
-        printf("\nBuckets for %d:\n", i);
-        int buckets[51];
-        int total[51];
-        memset(buckets, 0, sizeof(buckets));
-        memset(total, 0, sizeof(total));
-        int b;
-        for ( b = 0;  b < sessions[i].size;  b++) {
-            if (sessions[i].buckets[b].h_count >= 50) {
-                buckets[50]++;
-                total[50] += sessions[i].buckets[b].h_count;
-            } else {
-                buckets[(sessions[i].buckets[b].h_count)]++;
-                total[(sessions[i].buckets[b].h_count)] += sessions[i].buckets[b].h_count;
-            }
-        }
-        for ( b = 0;  b <= 50;  b++) {
-            if (buckets[b])
-                printf(" %2d: %7d %7d\n", b, buckets[b], total[b]);
-        }
-#endif
+    if (useTpacketv3)
+        moloch_tpacketv3_exit();
+
+    for (t = 0; t < sessionSetsNum; t++) {
+        MolochSessionSet_t *sset = sessionSets[t];
 
-        MolochSession_t *hsession;
-        HASH_FORALL_POP_HEAD(h_, sessions[i], hsession,
-            moloch_db_save_session(hsession, TRUE);
-        );
+        for (i = 0; i < SESSION_MAX; i++) {
+
+            moloch_session_table_pop_all(&sset->sessions[i], moloch_nids_exit_save);
+        }
     }
 
     if (!config.dryRun && config.copyPcap) {
@@ -0,0 +1,269 @@
+/******************************************************************************/
+/* packetpos.c  -- Compact per session packet position store
+ *
+ * Each saved packet adds one entry, its length and its offset in the pcap
+ * file, and each time the session moves to a new pcap file a file entry is
+ * added.  Entries are varint encoded, offsets as a zigzag delta from the
+ * previous packet in the same file, so most packets take 3 or 4 bytes.
+ *
+ * The first few entries fit in the buffer inside the session itself, only
+ * longer sessions spill into chunks.
+ *
+ * Entry encoding:
+ *   len  varint   0 means a file entry
+ *   file varint   file number, only for file entries
+ *   pos  varint   zigzag delta from the previous position, only for packets
+ *
+ * With packetPosRanges set the session gets "psr" instead of "ps".  Packets
+ * written back to back are stored as a start,count pair, file changes are
+ * still a negative file number, and psl still has every packet length.
+ *
+ * Copyright 2012-2015 AOL Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "moloch.h"
+
+extern MolochConfig_t        config;
+
+/* Largest possible entry, 3 byte len and 10 byte pos */
+#define MOLOCH_PACKET_POS_MAX_ENTRY 13
+
+struct moloch_packet_pos_chunk {
+    struct moloch_packet_pos_chunk *next;
+    uint16_t                        used;
+    uint8_t                         data[MOLOCH_PACKET_POS_CHUNK_SIZE];
+};
+
+typedef struct {
+    int64_t    pos;
+    uint32_t   file;
+    uint16_t   len;
+} MolochPacketPosEntry_t;
+
+/******************************************************************************/
+static inline int moloch_packet_pos_varint(uint8_t *buf, uint64_t v)
+{
+    int len = 0;
+
+    while (v >= 0x80) {
+        buf[len++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    buf[len++] = v;
+    return len;
+}
+/******************************************************************************/
+static void moloch_packet_pos_append(MolochPacketPos_t *pp, const uint8_t *entry, int len)
+{
+    if (!pp->tail && pp->inlineUsed + len <= MOLOCH_PACKET_POS_INLINE) {
+        memcpy(pp->inlineData + pp->inlineUsed, entry, len);
+        pp->inlineUsed += len;
+    } else {
+        if (!pp->tail || pp->tail->used + len > MOLOCH_PACKET_POS_CHUNK_SIZE) {
+            MolochPacketPosChunk_t *chunk = MOLOCH_TYPE_ALLOC(MolochPacketPosChunk_t);
+            chunk->next = 0;
+            chunk->used = 0;
+            if (pp->tail)
+                pp->tail->next = chunk;
+            else
+                pp->chunks = chunk;
+            pp->tail = chunk;
+        }
+        memcpy(pp->tail->data + pp->tail->used, entry, len);
+        pp->tail->used += len;
+    }
+    pp->count++;
+}
+/******************************************************************************/
+void moloch_packet_pos_add_file(MolochPacketPos_t *pp, uint32_t fileNum)
+{
+    uint8_t entry[MOLOCH_PACKET_POS_MAX_ENTRY];
+
+    entry[0] = 0;
+    moloch_packet_pos_append(pp, entry, 1 + moloch_packet_pos_varint(entry + 1, fileNum));
+    pp->lastPos = 0;
+    pp->files++;
+}
+/******************************************************************************/
+void moloch_packet_pos_add(MolochPacketPos_t *pp, uint64_t pos, uint16_t len)
+{
+    uint8_t entry[MOLOCH_PACKET_POS_MAX_ENTRY];
+    int64_t delta = (int64_t)(pos - pp->lastPos);
+    int     elen;
+
+    elen  = moloch_packet_pos_varint(entry, len);
+    elen += moloch_packet_pos_varint(entry + elen, (uint64_t)((delta << 1) ^ (delta >> 63)));
+    moloch_packet_pos_append(pp, entry, elen);
+    pp->lastPos = pos;
+}
+/******************************************************************************/
+/* Decode one entry, returns the number of bytes used */
+static inline int moloch_packet_pos_decode(const uint8_t *data, int64_t *lastPos, MolochPacketPosEntry_t *entry)
+{
+    uint64_t v;
+    int      len = 0;
+    int      shift;
+
+    for (v = 0, shift = 0; ; shift += 7) {
+        v |= (uint64_t)(data[len] & 0x7f) << shift;
+        if ((data[len++] & 0x80) == 0)
+            break;
+    }
+    entry->len = v;
+
+    for (v = 0, shift = 0; ; shift += 7) {
+        v |= (uint64_t)(data[len] & 0x7f) << shift;
+        if ((data[len++] & 0x80) == 0)
+            break;
+    }
+
+    if (entry->len == 0) {
+        entry->file = v;
+        entry->pos  = -1LL * (int64_t)v;
+        *lastPos    = 0;
+    } else {
+        *lastPos   += (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+        entry->pos  = *lastPos;
+    }
+
+    return len;
+}
+/******************************************************************************/
+/* Call func for every entry in order */
+#define MOLOCH_PACKET_POS_FORALL(pp, entry, code) \
+    do { \
+        const MolochPacketPosChunk_t *_chunk = 0; \
+        const uint8_t *_data = (pp)->inlineData; \
+        int _used = (pp)->inlineUsed; \
+        int64_t _lastPos = 0; \
+        while (1) { \
+            int _i; \
+            for (_i = 0; _i < _used; ) { \
+                _i += moloch_packet_pos_decode(_data + _i, &_lastPos, &entry); \
+                code \
+            } \
+            _chunk = _chunk?_chunk->next:(pp)->chunks; \
+            if (!_chunk) \
+                break; \
+            _data = _chunk->data; \
+            _used = _chunk->used; \
+        } \
+    } while (0)
+
+/******************************************************************************/
+static void moloch_packet_pos_json_ranges(MolochPacketPos_t *pp, BSB *jbsb)
+{
+    MolochPacketPosEntry_t entry;
+    int64_t                start = -1;
+    int64_t                end = 0;
+    uint32_t               count = 0;
+    int                    first = 1;
+
+    BSB_EXPORT_cstr(*jbsb, "\"psr\":[");
+    MOLOCH_PACKET_POS_FORALL(pp, entry,
+        if (entry.len != 0 && start != -1 && entry.pos == end) {
+            end += entry.len;
+            count++;
+            continue;
+        }
+
+        /* Range is broken, write it out */
+        if (start != -1) {
+            if (!first)
+                BSB_EXPORT_u08(*jbsb, ',');
+            BSB_EXPORT_int(*jbsb, start);
+            BSB_EXPORT_u08(*jbsb, ',');
+            BSB_EXPORT_uint(*jbsb, count);
+            first = 0;
+            start = -1;
+        }
+
+        if (entry.len == 0) {
+            if (!first)
+                BSB_EXPORT_u08(*jbsb, ',');
+            BSB_EXPORT_int(*jbsb, entry.pos);
+            first = 0;
+        } else {
+            start = entry.pos;
+            end   = entry.pos + entry.len;
+            count = 1;
+        }
+    );
+    if (start != -1) {
+        if (!first)
+            BSB_EXPORT_u08(*jbsb, ',');
+        BSB_EXPORT_int(*jbsb, start);
+        BSB_EXPORT_u08(*jbsb, ',');
+        BSB_EXPORT_uint(*jbsb, count);
+    }
+    BSB_EXPORT_cstr(*jbsb, "],");
+}
+/******************************************************************************/
+/* Write the ps (or psr), psl and fs arrays the viewer expects */
+void moloch_packet_pos_json(MolochPacketPos_t *pp, BSB *jbsb)
+{
+    MolochPacketPosEntry_t entry;
+    int                    first;
+
+    if (config.packetPosRanges) {
+        moloch_packet_pos_json_ranges(pp, jbsb);
+    } else {
+        BSB_EXPORT_cstr(*jbsb, "\"ps\":[");
+        first = 1;
+        MOLOCH_PACKET_POS_FORALL(pp, entry,
+            if (!first)
+                BSB_EXPORT_u08(*jbsb, ',');
+            first = 0;
+            BSB_EXPORT_int(*jbsb, entry.pos);
+        );
+        BSB_EXPORT_cstr(*jbsb, "],");
+    }
+
+    BSB_EXPORT_cstr(*jbsb, "\"psl\":[");
+    first = 1;
+    MOLOCH_PACKET_POS_FORALL(pp, entry,
+        if (!first)
+            BSB_EXPORT_u08(*jbsb, ',');
+        first = 0;
+        BSB_EXPORT_uint(*jbsb, entry.len);
+    );
+    BSB_EXPORT_cstr(*jbsb, "],");
+
+    BSB_EXPORT_cstr(*jbsb, "\"fs\":[");
+    first = 1;
+    MOLOCH_PACKET_POS_FORALL(pp, entry,
+        if (entry.len != 0)
+            continue;
+        if (!first)
+            BSB_EXPORT_u08(*jbsb, ',');
+        first = 0;
+        BSB_EXPORT_uint(*jbsb, entry.file);
+    );
+    BSB_EXPORT_cstr(*jbsb, "],");
+}
+/******************************************************************************/
+void moloch_packet_pos_free(MolochPacketPos_t *pp)
+{
+    MolochPacketPosChunk_t *chunk;
+
+    while ((chunk = pp->chunks)) {
+        pp->chunks = chunk->next;
+        MOLOCH_TYPE_FREE(MolochPacketPosChunk_t, chunk);
+    }
+    memset(pp, 0, sizeof(*pp));
+}
@@ -30,7 +30,9 @@
 extern MolochConfig_t        config;
 static gchar                 classTag[100];
 
-static magic_t               cookie;
+/* libmagic handles aren't thread safe, each packet thread opens its own */
+static int                   magicFlags;
+static __thread magic_t      cookie;
 
 /******************************************************************************/
 void moloch_parsers_magic(MolochSession_t *session, int field, const char *data, int len)
@@ -38,6 +40,12 @@ void moloch_parsers_magic(MolochSession_t *session, int field, const char *data,
     if (len < 3)
         return;
 
+    if (!cookie) {
+        if (!(cookie = magic_open(magicFlags)))
+            return;
+        magic_load(cookie, NULL);
+    }
+
     const char *m = magic_buffer(cookie, data, MIN(len,50));
     if (m) {
         int len;
@@ -204,6 +212,7 @@ void moloch_parsers_init()
 #ifdef MAGIC_NO_CHECK_CDF
     flags |= MAGIC_NO_CHECK_CDF;
 #endif
+    magicFlags = flags;
     cookie = magic_open(flags);
     if (!cookie) {
         LOG("Error with libmagic %s", magic_error(cookie));
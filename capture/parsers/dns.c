@@ -59,7 +59,7 @@ int dns_name_element(BSB *nbsb, BSB *bsb)
 /******************************************************************************/
 unsigned char *dns_name(const unsigned char *full, int fulllen, BSB *inbsb, int *namelen)
 {
-    static unsigned char  name[8000];
+    static __thread unsigned char  name[8000];
     BSB  nbsb;
     int  didPointer = 0;
     BSB  tmpbsb;
@@ -34,7 +34,7 @@ typedef struct {
 
 extern unsigned char    moloch_char_to_hexstr[256][3];
 
-static GChecksum       *checksum;
+static __thread GChecksum *checksum;
 
 /******************************************************************************/
 void
@@ -286,6 +286,8 @@ void tls_process_server_certificate(MolochSession_t *session, const unsigned cha
         guchar digest[20];
         gsize  len = sizeof(digest);
 
+        if (!checksum)
+            checksum = g_checksum_new(G_CHECKSUM_SHA1);
         g_checksum_update(checksum, cdata+3, clen);
         g_checksum_get_digest(checksum, digest, &len);
         if (len > 0) {
@@ -714,7 +716,5 @@ void moloch_parser_init()
         NULL);
 
     moloch_parsers_classifier_register_tcp("tls", 0, (unsigned char*)"\x16\x03", 2, tls_classify);
-
-    checksum = g_checksum_new(G_CHECKSUM_SHA1);
 }
 
@@ -318,13 +318,13 @@ void moloch_plugins_cb_new(MolochSession_t *session)
     );
 }
 /******************************************************************************/
-void moloch_plugins_cb_tcp(MolochSession_t *session, struct tcp_stream *a_tcp)
+void moloch_plugins_cb_tcp(MolochSession_t *session, const unsigned char *data, int len, int which)
 {
     MolochPlugin_t *plugin;
 
     HASH_FORALL(p_, plugins, plugin,
         if (plugin->tcpFunc)
-            plugin->tcpFunc(session, a_tcp);
+            plugin->tcpFunc(session, data, len, which);
     );
 }
 /******************************************************************************/
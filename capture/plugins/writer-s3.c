@@ -1,5 +1,26 @@
 /******************************************************************************/
 /* writer-s3.c  -- S3 Writer Plugin
+ *
+ * Each pcapWriteSize buffer becomes one part of a multipart upload.  Up to
+ * s3PartUploads parts per file are sent at once, the rest wait in the file's
+ * queue.  Once the queued and in flight parts use more than s3MaxMemoryMB,
+ * the newest queued parts are written to a spill file in s3SpillDir and read
+ * back when their turn comes.  Failed parts are retried with backoff up to
+ * s3MaxRetries times, after that the upload is aborted.
+ *
+ * Filled buffers go through a worker thread before becoming parts, it
+ * works out the SHA-256 the request signature needs and with s3Compress
+ * gzips each buffer.  Compressed buffers are collected until they make a
+ * part of at least 5MB, the smallest S3 takes, and since gzip members can
+ * be concatenated the object is a plain .pcap.gz.
+ *
+ * A compressed packet's position is, like pcapCompression's, its member
+ * number shifted up MOLOCH_S3_MEMBER_SHIFT bits plus its offset in the
+ * uncompressed member, so a reader only inflates one member to get it.
+ * Where each member starts in the object goes up as its own .gzi object,
+ * all little endian:
+ *   header   magic, version, member shift, number of members   4 x uint32
+ *   index    object offset of every member                     uint64 each
  *
  * Copyright 2012-2015 AOL Inc. All rights reserved.
  *
@@ -20,9 +41,15 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/eventfd.h>
 #include "moloch.h"
+#include "zlib.h"
 
 extern MolochConfig_t        config;
 
@@ -30,8 +57,17 @@ typedef struct writer_s3_output {
     struct writer_s3_output *os3_next, *os3_prev;
     uint16_t                   os3_count;
 
-    unsigned char             *buf;
+    struct writer_s3_file     *file;
+    unsigned char             *buf;        /* NULL while spilled */
     int                        len;
+    int                        partNumber;
+    int                        retries;
+    off_t                      spillPos;
+    int                        rawLen;     /* buffer size handed to the worker */
+    unsigned char             *index;      /* .gzi made by the worker for the last buffer */
+    int                        indexLen;
+    char                       last;
+    char                       hash[65];
 } SavepcapS3Output_t;
 
 typedef struct writer_s3_file {
@@ -43,15 +79,40 @@ typedef struct writer_s3_file {
     SavepcapS3Output_t         outputQ;
     char                      *uploadId;
     int                        partNumber;
-    int                        partNumberResponses;
+    int                        partsDone;
+    int                        inflight;
     char                       doClose;
+    char                       failed;
     char                      *partNumbers[2001];
+    MolochTimeIndex_t         *timeIndex;
+    uint32_t                   id;
+    int                        spillFd;
+    char                      *spillName;
+    off_t                      spillEnd;
+
+    /* Only touched by the worker thread */
+    unsigned char             *zbuf;
+    int                        zlen;
+    int                        zsize;
+    uint64_t                   zpos;       /* compressed bytes already in parts */
+    uint64_t                  *members;
+    uint32_t                   membersNum;
+    uint32_t                   membersMax;
 } SavepcapS3File_t;
 
+/* Smallest part S3 accepts other than the last */
+#define MOLOCH_S3_MIN_PART    5242880
+
+/* A member is at most pcapWriteSize, 8MB, plus one packet */
+#define MOLOCH_S3_MEMBER_SHIFT     24
+#define MOLOCH_S3_INDEX_MAGIC      0x6933736d   /* "ms3i" */
+#define MOLOCH_S3_INDEX_VERSION    1
+
 static char                 *outputBuffer;
 static uint32_t              outputPos;
 static uint32_t              outputId;
 static uint64_t              outputFilePos = 0;
+static uint64_t              outputMember;
 
 SavepcapS3File_t            *currentFile;
 static SavepcapS3File_t      fileQ;
@@ -64,30 +125,63 @@ static char                  *s3Bucket;
 static char                  *s3AccessKeyId;
 static char                  *s3SecretAccessKey;
 static char                   s3Compress;
+static uint32_t               s3CompressionLevel;
 static uint32_t               s3MaxConns;
 static uint32_t               s3MaxRequests;
+static uint32_t               s3PartUploads;
+static uint64_t               s3MaxMemory;
+static char                  *s3SpillDir;
+static uint32_t               s3MaxRetries;
 
 static int                    inprogress;
+static int                    retrying;
+static uint64_t               memoryUsed;
+static uint64_t               spilled;
+static uint64_t               retried;
 
-void writer_s3_request(char *method, char *path, char *qs, unsigned char *data, int len, gboolean reduce, MolochHttpResponse_cb cb, gpointer uw);
+static SavepcapS3Output_t     workQ;
+static SavepcapS3Output_t     doneQ;
+static pthread_mutex_t        workQMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t         workQCond = PTHREAD_COND_INITIALIZER;
+static int                    workEventFd;
+static int                    working;
+
+static char                   signingDate[9];
+static char                   signingKey[100];
+static gsize                  signingKeyLen;
+
+void writer_s3_request(char *method, char *path, char *qs, unsigned char *data, int len, const char *hash, gboolean reduce, MolochHttpResponse_cb cb, gpointer uw);
 
 /******************************************************************************/
 uint32_t writer_s3_queue_length()
 {
     int q = 0;
 
+    int spill = 0;
+
     SavepcapS3File_t *file;
+    SavepcapS3Output_t *output;
     DLL_FOREACH(fs3_, &fileQ, file) 
     {
         if (config.debug && DLL_COUNT(os3_, &file->outputQ) > 0)
             LOG("Waiting: %s - %d", file->outputFileName, DLL_COUNT(os3_, &file->outputQ));
-        q += DLL_COUNT(os3_, &file->outputQ);
+        DLL_FOREACH(os3_, &file->outputQ, output) {
+            if (output->buf)
+                q++;
+            else
+                spill++;
+        }
     }
 
     if (config.debug)
-        LOG("queue length: http Q:%d in progress: %d waiting:%d", moloch_http_queue_length(s3Server), inprogress, q);
+        LOG("queue length: http Q:%d in progress: %d waiting:%d spilled:%d retrying:%d memory:%" PRIu64 " total spilled:%" PRIu64 " total retried:%" PRIu64,
+            moloch_http_queue_length(s3Server), inprogress, q, spill, retrying, memoryUsed, spilled, retried);
 
-    return q + moloch_http_queue_length(s3Server) + inprogress;
+    // Spilled parts don't cost memory so they don't pause reading, but we can't exit with them
+    if (config.exiting)
+        q += spill;
+
+    return q + moloch_http_queue_length(s3Server) + inprogress + retrying + working;
 }
 /******************************************************************************/
 void writer_s3_complete_cb (int code, unsigned char *data, int len, gpointer uw)
@@ -103,47 +197,226 @@ void writer_s3_complete_cb (int code, unsigned char *data, int len, gpointer uw)
         LOG("Complete-Response: %s %d %.*s", file->outputFileName, len, len, data);
 
     DLL_REMOVE(fs3_, &fileQ, file);
+    if (file->spillFd >= 0) {
+        close(file->spillFd);
+        unlink(file->spillName);
+        g_free(file->spillName);
+    }
     if (file->uploadId)
         g_free(file->uploadId);
     g_free(file->outputFileName);
     MOLOCH_TYPE_FREE(SavepcapS3File_t, file);
 }
 /******************************************************************************/
+/* Append a part to the file's spill file, on success the part no longer holds
+ * a buffer and the caller still owns buf.
+ */
+static gboolean writer_s3_spill(SavepcapS3File_t *file, SavepcapS3Output_t *output, unsigned char *buf)
+{
+    if (file->spillFd < 0) {
+        file->spillName = g_strdup_printf("%s/%s-%u.s3spill", s3SpillDir, config.nodeName, file->id);
+        file->spillFd = open(file->spillName, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (file->spillFd < 0) {
+            LOG("ERROR - Couldn't open s3 spill file %s: %s", file->spillName, strerror(errno));
+            g_free(file->spillName);
+            file->spillName = 0;
+            return FALSE;
+        }
+    }
+
+    if (pwrite(file->spillFd, buf, output->len, file->spillEnd) != output->len) {
+        LOG("ERROR - Couldn't write s3 spill file %s: %s", file->spillName, strerror(errno));
+        return FALSE;
+    }
+
+    output->buf      = 0;
+    output->spillPos = file->spillEnd;
+    file->spillEnd  += output->len;
+    spilled++;
+    return TRUE;
+}
+/******************************************************************************/
+/* Over the memory budget spill queued parts, newest first since they go last */
+static void writer_s3_check_memory(SavepcapS3File_t *file)
+{
+    SavepcapS3Output_t *output;
+
+    for (output = file->outputQ.os3_prev;
+         memoryUsed > s3MaxMemory && output != (SavepcapS3Output_t *)&file->outputQ;
+         output = output->os3_prev) {
+
+        unsigned char *buf = output->buf;
+        if (!buf)
+            continue;
+
+        if (!writer_s3_spill(file, output, buf))
+            return;
+
+        moloch_http_free_buffer(buf);
+        memoryUsed -= output->len;
+    }
+}
+/******************************************************************************/
+void writer_s3_part_cb (int code, unsigned char *data, int len, gpointer uw);
+/* Start queued parts until the file has s3PartUploads going, spilled parts are
+ * only read back while there is room in the memory budget.
+ */
+static void writer_s3_send_parts(SavepcapS3File_t *file)
+{
+    SavepcapS3Output_t *output;
+    char                qs[1000];
+
+    if (!file->uploadId)
+        return;
+
+    while (file->inflight < (int)s3PartUploads && (output = DLL_PEEK_HEAD(os3_, &file->outputQ))) {
+        if (!output->buf) {
+            if (file->inflight > 0 && memoryUsed + output->len > s3MaxMemory)
+                return;
+
+            output->buf = (unsigned char *)moloch_http_get_buffer(output->len);
+            if (pread(file->spillFd, output->buf, output->len, output->spillPos) != output->len) {
+                LOG("ERROR - Couldn't read part %d of %s from %s: %s", output->partNumber, file->outputFileName, file->spillName, strerror(errno));
+                exit(1);
+            }
+            memoryUsed += output->len;
+        }
+        DLL_REMOVE(os3_, &file->outputQ, output);
+
+        snprintf(qs, sizeof(qs), "partNumber=%d&uploadId=%s", output->partNumber, file->uploadId);
+        if (config.debug)
+            LOG("Part-Request: %s %s", file->outputFileName, qs);
+        file->inflight++;
+        writer_s3_request("PUT", file->outputPath, qs, output->buf, output->len, output->hash, FALSE, writer_s3_part_cb, output);
+    }
+}
+/******************************************************************************/
+/* Queue what the worker made as the file's next part */
+static void writer_s3_add_part(SavepcapS3File_t *file, SavepcapS3Output_t *output)
+{
+    output->partNumber = file->partNumber++;
+    memoryUsed        += output->len;
+
+    DLL_PUSH_TAIL(os3_, &file->outputQ, output);
+    writer_s3_send_parts(file);
+    writer_s3_check_memory(file);
+}
+/******************************************************************************/
+/* Every part is done, finish the upload or throw it away if a part failed */
+static void writer_s3_complete(SavepcapS3File_t *file)
+{
+    char qs[1000];
+
+    snprintf(qs, sizeof(qs), "uploadId=%s", file->uploadId);
+
+    if (file->failed) {
+        LOG("ERROR - Aborting upload of %s", file->outputFileName);
+        writer_s3_request("DELETE", file->outputPath, qs, 0, 0, NULL, FALSE, writer_s3_complete_cb, file);
+        return;
+    }
+
+    char *buf = moloch_http_get_buffer(1000000);
+    BSB bsb;
+
+    BSB_INIT(bsb, buf, 1000000);
+    BSB_EXPORT_cstr(bsb, "<CompleteMultipartUpload>\n");
+    int i;
+    for (i = 1; i < file->partNumber; i++) {
+        BSB_EXPORT_sprintf(bsb, "<Part><PartNumber>%d</PartNumber><ETag>%s</ETag></Part>\n", i, file->partNumbers[i]);
+        g_free(file->partNumbers[i]);
+    }
+    BSB_EXPORT_cstr(bsb, "</CompleteMultipartUpload>\n");
+
+    writer_s3_request("POST", file->outputPath, qs, (unsigned char*)buf, BSB_LENGTH(bsb), NULL, FALSE, writer_s3_complete_cb, file);
+    if (config.debug > 1)
+        LOG("Complete-Request: %s %.*s", file->outputFileName, (int)BSB_LENGTH(bsb), buf);
+}
+/******************************************************************************/
+gboolean writer_s3_retry_gfunc (gpointer uw)
+{
+    SavepcapS3Output_t *output = uw;
+
+    retrying--;
+    DLL_PUSH_HEAD(os3_, &output->file->outputQ, output);
+    writer_s3_send_parts(output->file);
+    return FALSE;
+}
+/******************************************************************************/
 void writer_s3_part_cb (int code, unsigned char *UNUSED(data), int UNUSED(len), gpointer uw)
 {
-    SavepcapS3File_t  *file = uw;
+    SavepcapS3Output_t *output = uw;
+    SavepcapS3File_t   *file = output->file;
 
     inprogress--;
+    file->inflight--;
+    memoryUsed -= output->len;
+
+    if (config.debug)
+        LOG("Part-Response: %s %d %d", file->outputFileName, output->partNumber, code);
 
     if (code != 200) {
-        LOG("Bad Response: %d %s", code, file->outputFileName);
+        if (output->retries < (int)s3MaxRetries) {
+            output->retries++;
+            retried++;
+            LOG("ERROR - Bad Response: %d %s part %d, retry %d", code, file->outputFileName, output->partNumber, output->retries);
+
+            // The http code frees the buffer after we return, so keep the part on disk or in a copy
+            if (!writer_s3_spill(file, output, output->buf)) {
+                unsigned char *buf = (unsigned char *)moloch_http_get_buffer(output->len);
+                memcpy(buf, output->buf, output->len);
+                output->buf = buf;
+                memoryUsed += output->len;
+            }
+            retrying++;
+            g_timeout_add_seconds(MIN(1 << output->retries, 60), writer_s3_retry_gfunc, output);
+            return;
+        }
+        LOG("ERROR - Bad Response: %d %s part %d, giving up", code, file->outputFileName, output->partNumber);
+        file->failed = TRUE;
     }
 
-    if (config.debug)
-        LOG("Part-Response: %s %d", file->outputFileName, len);
+    MOLOCH_TYPE_FREE(SavepcapS3Output_t, output);
+    file->partsDone++;
+
+    if (file->doClose && file->partsDone == file->partNumber - 1) {
+        writer_s3_complete(file);
+    }
 
-    file->partNumberResponses++;
+    // Memory was freed, any file may have spilled parts waiting for it
+    DLL_FOREACH(fs3_, &fileQ, file) {
+        writer_s3_send_parts(file);
+    }
+}
+/******************************************************************************/
+/* The .tidx and .gzi objects */
+void writer_s3_index_cb (int code, unsigned char *UNUSED(data), int UNUSED(len), gpointer uw)
+{
+    char *path = uw;
 
-    char qs[1000];
-    if (file->doClose && file->partNumber == file->partNumberResponses) {
-        snprintf(qs, sizeof(qs), "uploadId=%s", file->uploadId);
-        char *buf = moloch_http_get_buffer(1000000);
-        BSB bsb;
-
-        BSB_INIT(bsb, buf, 1000000);
-        BSB_EXPORT_cstr(bsb, "<CompleteMultipartUpload>\n");
-        int i;
-        for (i = 1; i < file->partNumber; i++) {
-            BSB_EXPORT_sprintf(bsb, "<Part><PartNumber>%d</PartNumber><ETag>%s</ETag></Part>\n", i, file->partNumbers[i]);
-            g_free(file->partNumbers[i]);
-        }
-        BSB_EXPORT_cstr(bsb, "</CompleteMultipartUpload>\n");
+    inprogress--;
 
-        writer_s3_request("POST", file->outputPath, qs, (unsigned char*)buf, BSB_LENGTH(bsb), FALSE, writer_s3_complete_cb, file);
-        if (config.debug > 1)
-            LOG("Complete-Request: %s %.*s", file->outputFileName, (int)BSB_LENGTH(bsb), buf);
+    if (code != 200) {
+        LOG("Bad Response: %d %s", code, path);
     }
+    g_free(path);
+}
+/******************************************************************************/
+/* The time index goes up as its own object next to the pcap */
+void writer_s3_time_index(SavepcapS3File_t *file)
+{
+    char *path;
+    char *buf;
+    int   len;
+
+    if (!file->timeIndex)
+        return;
+
+    buf = moloch_time_index_encode(file->timeIndex, &len);
+    moloch_time_index_free(file->timeIndex);
+    file->timeIndex = 0;
 
+    path = g_strdup_printf("%s.tidx", file->outputPath);
+    writer_s3_request("PUT", path, "", (unsigned char *)buf, len, NULL, TRUE, writer_s3_index_cb, path);
 }
 /******************************************************************************/
 void writer_s3_init_cb (int UNUSED(code), unsigned char *data, int len, gpointer uw)
@@ -156,12 +429,11 @@ void writer_s3_init_cb (int UNUSED(code), unsigned char *data, int len, gpointer
         LOG("Init-Response: %s %d", file->outputFileName, len);
 
     if (len == 0) {
-        writer_s3_request("POST", file->outputPath, "uploads=", 0, 0, TRUE, writer_s3_init_cb, file);
+        writer_s3_request("POST", file->outputPath, "uploads=", 0, 0, NULL, TRUE, writer_s3_init_cb, file);
         return;
     }
 
     static GRegex      *regex = 0;
-    SavepcapS3Output_t *output;
 
     if (!regex) {
         regex = g_regex_new("<UploadId>(.*)</UploadId>", 0, 0, 0);
@@ -170,23 +442,13 @@ void writer_s3_init_cb (int UNUSED(code), unsigned char *data, int len, gpointer
     g_regex_match_full(regex, (char *)data, len, 0, 0, &match_info, NULL);
     if (g_match_info_matches(match_info)) {
         file->uploadId = g_match_info_fetch(match_info, 1);
-        file->partNumber = 1;
-        file->partNumberResponses = 1;
     } else {
         LOG("Unknown s3 response: %.*s", len, data);
         exit(1);
     }
     g_match_info_free(match_info);
 
-    char qs[1000];
-    while (DLL_POP_HEAD(os3_, &file->outputQ, output)) {
-        snprintf(qs, sizeof(qs), "partNumber=%d&uploadId=%s", file->partNumber, file->uploadId);
-        if (config.debug)
-            LOG("Part-Request: %s %s", file->outputFileName, qs);
-        file->partNumber++;
-        writer_s3_request("PUT", file->outputPath, qs, output->buf, output->len, FALSE, writer_s3_part_cb, file);
-        MOLOCH_TYPE_FREE(SavepcapS3Output_t, output);
-    }
+    writer_s3_send_parts(file);
 }
 /******************************************************************************/
 void writer_s3_header_cb (char *url, const char *field, const char *value, int valueLen, gpointer uw)
@@ -199,9 +461,14 @@ void writer_s3_header_cb (char *url, const char *field, const char *value, int v
     if (!pnstr)
         return;
 
-    SavepcapS3File_t   *file = uw;
+    SavepcapS3Output_t *output = uw;
+    SavepcapS3File_t   *file = output->file;
     int pn = atoi(pnstr + 11);
 
+    if (pn < 1 || pn > 2000)
+        return;
+
+    g_free(file->partNumbers[pn]);
     if (*value == '"')
         file->partNumbers[pn] = g_strndup(value+1, valueLen-2);
     else
@@ -212,7 +479,8 @@ void writer_s3_header_cb (char *url, const char *field, const char *value, int v
 }
 /******************************************************************************/
 GChecksum *checksum;
-void writer_s3_request(char *method, char *path, char *qs, unsigned char *data, int len, gboolean reduce, MolochHttpResponse_cb cb, gpointer uw)
+/* hash is the hex SHA-256 of data if the caller already has it */
+void writer_s3_request(char *method, char *path, char *qs, unsigned char *data, int len, const char *hash, gboolean reduce, MolochHttpResponse_cb cb, gpointer uw)
 {
     char           canonicalRequest[1000];
     char           datetime[17];
@@ -233,9 +501,13 @@ void writer_s3_request(char *method, char *path, char *qs, unsigned char *data,
 
 
 
-    g_checksum_reset(checksum);
-    g_checksum_update(checksum, data, len);
-    strcpy(bodyHash, g_checksum_get_string(checksum));
+    if (hash) {
+        strcpy(bodyHash, hash);
+    } else {
+        g_checksum_reset(checksum);
+        g_checksum_update(checksum, data, len);
+        strcpy(bodyHash, g_checksum_get_string(checksum));
+    }
     snprintf(canonicalRequest, sizeof(canonicalRequest),
              "%s\n"       // HTTPRequestMethod
              "/%s%s\n"    // CanonicalURI
@@ -277,39 +549,46 @@ void writer_s3_request(char *method, char *path, char *qs, unsigned char *data,
              g_checksum_get_string(checksum));
     //LOG("stringToSign: %s", stringToSign);
 
-    char kSecret[1000];
-    snprintf(kSecret, sizeof(kSecret), "AWS4%s", s3SecretAccessKey);
-
-    char  kDate[1000];
-    gsize kDateLen = sizeof(kDate);
-    GHmac *hmac = g_hmac_new(G_CHECKSUM_SHA256, (guchar*)kSecret, strlen(kSecret));
-    g_hmac_update(hmac, (guchar*)datetime, 8);
-    g_hmac_get_digest(hmac, (guchar*)kDate, &kDateLen);
-    g_hmac_unref(hmac);
-
-    char  kRegion[1000];
-    gsize kRegionLen = sizeof(kRegion);
-    hmac = g_hmac_new(G_CHECKSUM_SHA256, (guchar*)kDate, kDateLen);
-    g_hmac_update(hmac, (guchar*)s3Region, -1);
-    g_hmac_get_digest(hmac, (guchar*)kRegion, &kRegionLen);
-    g_hmac_unref(hmac);
-
-    char  kService[1000];
-    gsize kServiceLen = sizeof(kService);
-    hmac = g_hmac_new(G_CHECKSUM_SHA256, (guchar*)kRegion, kRegionLen);
-    g_hmac_update(hmac, (guchar*)"s3", 2);
-    g_hmac_get_digest(hmac, (guchar*)kService, &kServiceLen);
-    g_hmac_unref(hmac);
-
-    char kSigning[1000];
-    gsize kSigningLen = sizeof(kSigning);
-    hmac = g_hmac_new(G_CHECKSUM_SHA256, (guchar*)kService, kServiceLen);
-    g_hmac_update(hmac, (guchar*)"aws4_request", 12);
-    g_hmac_get_digest(hmac, (guchar*)kSigning, &kSigningLen);
-    g_hmac_unref(hmac);
+    // The signing key only depends on the day and region, so only redo it when the day changes
+    if (memcmp(signingDate, datetime, 8) != 0) {
+        char kSecret[1000];
+        snprintf(kSecret, sizeof(kSecret), "AWS4%s", s3SecretAccessKey);
+
+        char  kDate[1000];
+        gsize kDateLen = sizeof(kDate);
+        GHmac *hmac = g_hmac_new(G_CHECKSUM_SHA256, (guchar*)kSecret, strlen(kSecret));
+        g_hmac_update(hmac, (guchar*)datetime, 8);
+        g_hmac_get_digest(hmac, (guchar*)kDate, &kDateLen);
+        g_hmac_unref(hmac);
+
+        char  kRegion[1000];
+        gsize kRegionLen = sizeof(kRegion);
+        hmac = g_hmac_new(G_CHECKSUM_SHA256, (guchar*)kDate, kDateLen);
+        g_hmac_update(hmac, (guchar*)s3Region, -1);
+        g_hmac_get_digest(hmac, (guchar*)kRegion, &kRegionLen);
+        g_hmac_unref(hmac);
+
+        char  kService[1000];
+        gsize kServiceLen = sizeof(kService);
+        hmac = g_hmac_new(G_CHECKSUM_SHA256, (guchar*)kRegion, kRegionLen);
+        g_hmac_update(hmac, (guchar*)"s3", 2);
+        g_hmac_get_digest(hmac, (guchar*)kService, &kServiceLen);
+        g_hmac_unref(hmac);
+
+        char kSigning[100];
+        gsize kSigningLen = sizeof(kSigning);
+        hmac = g_hmac_new(G_CHECKSUM_SHA256, (guchar*)kService, kServiceLen);
+        g_hmac_update(hmac, (guchar*)"aws4_request", 12);
+        g_hmac_get_digest(hmac, (guchar*)kSigning, &kSigningLen);
+        g_hmac_unref(hmac);
+
+        memcpy(signingKey, kSigning, kSigningLen);
+        signingKeyLen = kSigningLen;
+        memcpy(signingDate, datetime, 8);
+    }
 
     char signature[1000];
-    hmac = g_hmac_new(G_CHECKSUM_SHA256, (guchar*)kSigning, kSigningLen);
+    GHmac *hmac = g_hmac_new(G_CHECKSUM_SHA256, (guchar*)signingKey, signingKeyLen);
     g_hmac_update(hmac, (guchar*)stringToSign, -1);
     strcpy(signature, g_hmac_get_string(hmac));
     g_hmac_unref(hmac);
@@ -347,32 +626,167 @@ void writer_s3_request(char *method, char *path, char *qs, unsigned char *data,
     moloch_http_send(s3Server, method, fullpath, strlen(fullpath), (char*)data, len, headers, FALSE, cb, uw);
 }
 /******************************************************************************/
-void writer_s3_flush(gboolean all)
+/* Add the buffer as a gzip member to the file's pending part, the job only
+ * leaves with a buffer once the part is big enough or it is the last one.
+ */
+static void writer_s3_compress(z_stream *strm, SavepcapS3Output_t *job)
 {
-    char qs[1000];
+    SavepcapS3File_t *file = job->file;
 
-    if (!currentFile)
-        return;
+    if (!file->zbuf) {
+        file->zsize = MOLOCH_S3_MIN_PART + deflateBound(strm, config.pcapWriteSize + 8192);
+        file->zbuf  = (unsigned char *)moloch_http_get_buffer(file->zsize);
+        file->zlen  = 0;
+    }
 
-    if (currentFile->uploadId) {
-        snprintf(qs, sizeof(qs), "partNumber=%d&uploadId=%s", currentFile->partNumber, currentFile->uploadId);
-        writer_s3_request("PUT", currentFile->outputPath, qs, (unsigned char *)outputBuffer, outputPos, FALSE, writer_s3_part_cb, currentFile);
-        if (config.debug)
-            LOG("Part-Request: %s %s", currentFile->outputFileName, qs);
-        currentFile->partNumber++;
+    if (file->membersNum == file->membersMax) {
+        file->membersMax = MAX(64, file->membersMax * 2);
+        file->members = realloc(file->members, file->membersMax * sizeof(uint64_t));
+    }
+    file->members[file->membersNum++] = file->zpos + file->zlen;
+
+    strm->next_in   = job->buf;
+    strm->avail_in  = job->len;
+    strm->next_out  = file->zbuf + file->zlen;
+    strm->avail_out = file->zsize - file->zlen;
+
+    if (deflate(strm, Z_FINISH) != Z_STREAM_END) {
+        LOG("ERROR - Couldn't compress part for %s", file->outputFileName);
+        exit(1);
+    }
+    file->zlen = file->zsize - strm->avail_out;
+    deflateReset(strm);
+    moloch_http_free_buffer(job->buf);
+
+    if (file->zlen >= MOLOCH_S3_MIN_PART || job->last) {
+        job->buf   = file->zbuf;
+        job->len   = file->zlen;
+        file->zpos += file->zlen;
+        file->zbuf = 0;
     } else {
-        SavepcapS3Output_t *output = MOLOCH_TYPE_ALLOC0(SavepcapS3Output_t);
-        output->buf = (unsigned char *)outputBuffer;
-        output->len = outputPos;
-        DLL_PUSH_TAIL(os3_, &currentFile->outputQ, output);
+        job->buf   = 0;
+        job->len   = 0;
+    }
+
+    if (job->last) {
+        uint32_t hdr[4] = {MOLOCH_S3_INDEX_MAGIC, MOLOCH_S3_INDEX_VERSION, MOLOCH_S3_MEMBER_SHIFT, file->membersNum};
+
+        job->indexLen = sizeof(hdr) + file->membersNum * sizeof(uint64_t);
+        job->index    = (unsigned char *)moloch_http_get_buffer(job->indexLen);
+        memcpy(job->index, hdr, sizeof(hdr));
+        memcpy(job->index + sizeof(hdr), file->members, file->membersNum * sizeof(uint64_t));
+        free(file->members);
+        file->members = 0;
     }
+}
+/******************************************************************************/
+static void *writer_s3_worker_thread(void *UNUSED(arg))
+{
+    GChecksum          *hashsum = g_checksum_new(G_CHECKSUM_SHA256);
+    SavepcapS3Output_t *job;
+    z_stream            strm;
+    uint64_t            one = 1;
+
+    memset(&strm, 0, sizeof(strm));
+    if (s3Compress && deflateInit2(&strm, s3CompressionLevel, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        LOG("ERROR - Couldn't init s3 compression");
+        exit(1);
+    }
+
+    while (1) {
+        pthread_mutex_lock(&workQMutex);
+        while (DLL_COUNT(os3_, &workQ) == 0) {
+            pthread_cond_wait(&workQCond, &workQMutex);
+        }
+        DLL_POP_HEAD(os3_, &workQ, job);
+        pthread_mutex_unlock(&workQMutex);
+
+        if (s3Compress)
+            writer_s3_compress(&strm, job);
+
+        if (job->buf) {
+            g_checksum_reset(hashsum);
+            g_checksum_update(hashsum, job->buf, job->len);
+            strcpy(job->hash, g_checksum_get_string(hashsum));
+        }
+
+        pthread_mutex_lock(&workQMutex);
+        DLL_PUSH_TAIL(os3_, &doneQ, job);
+        pthread_mutex_unlock(&workQMutex);
+
+        if (write(workEventFd, &one, sizeof(one)) != sizeof(one))
+            LOG("ERROR - s3 worker eventfd write failed with %s", strerror(errno));
+    }
+    return NULL;
+}
+/******************************************************************************/
+/* Back on the main thread, turn what the worker finished into parts */
+gboolean writer_s3_done_cb(gint UNUSED(fd), GIOCondition UNUSED(cond), gpointer UNUSED(data))
+{
+    SavepcapS3Output_t *job;
+    uint64_t            count;
+
+    if (read(workEventFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        LOG("ERROR - s3 worker eventfd read failed with %s", strerror(errno));
+
+    while (1) {
+        pthread_mutex_lock(&workQMutex);
+        DLL_POP_HEAD(os3_, &doneQ, job);
+        pthread_mutex_unlock(&workQMutex);
+
+        if (!job)
+            break;
+
+        SavepcapS3File_t *file = job->file;
+        char              last = job->last;
+
+        working--;
+        memoryUsed -= job->rawLen;
+
+        if (job->index) {
+            char *path = g_strdup_printf("%s.gzi", file->outputPath);
+            writer_s3_request("PUT", path, "", job->index, job->indexLen, NULL, TRUE, writer_s3_index_cb, path);
+            job->index = 0;
+        }
+
+        if (job->buf)
+            writer_s3_add_part(file, job);
+        else
+            MOLOCH_TYPE_FREE(SavepcapS3Output_t, job);
+
+        // Only now is the part count final
+        if (last)
+            file->doClose = TRUE;
+    }
+    return TRUE;
+}
+/******************************************************************************/
+void writer_s3_flush(gboolean all)
+{
+    if (!currentFile)
+        return;
+
+    SavepcapS3Output_t *job = MOLOCH_TYPE_ALLOC0(SavepcapS3Output_t);
+    job->file   = currentFile;
+    job->buf    = (unsigned char *)outputBuffer;
+    job->len    = outputPos;
+    job->rawLen = outputPos;
+    job->last   = all;
+    memoryUsed += outputPos;
+    working++;
+
+    pthread_mutex_lock(&workQMutex);
+    DLL_PUSH_TAIL(os3_, &workQ, job);
+    pthread_mutex_unlock(&workQMutex);
+    pthread_cond_signal(&workQCond);
 
     if (all) {
-        currentFile->doClose = TRUE;
+        writer_s3_time_index(currentFile);
         currentFile = NULL;
     } else {
         outputBuffer = moloch_http_get_buffer(config.pcapWriteSize + 8192);
         outputPos = 0;
+        outputMember++;
     }
 }
 /******************************************************************************/
@@ -388,17 +802,22 @@ void writer_s3_create(const struct pcap_pkthdr *h)
     struct tm         *tmp = localtime(&h->ts.tv_sec);
     int                offset = 0;
 
-    snprintf(filename, sizeof(filename), "s3://%s/%s/%s/#NUMHEX#-%02d%02d%02d-#NUM#.pcap", s3Region, s3Bucket, config.nodeName, tmp->tm_year%100, tmp->tm_mon+1, tmp->tm_mday);
+    snprintf(filename, sizeof(filename), "s3://%s/%s/%s/#NUMHEX#-%02d%02d%02d-#NUM#.pcap%s", s3Region, s3Bucket, config.nodeName, tmp->tm_year%100, tmp->tm_mon+1, tmp->tm_mday, (s3Compress?".gz":""));
     if (offset == 0)
         offset = 6 + strlen(s3Region) + strlen(s3Bucket);
     
     currentFile = MOLOCH_TYPE_ALLOC0(SavepcapS3File_t);
     DLL_INIT(os3_, &currentFile->outputQ);
+    currentFile->partNumber = 1;
+    currentFile->spillFd = -1;
     DLL_PUSH_TAIL(fs3_, &fileQ, currentFile);
 
     currentFile->outputFileName = moloch_db_create_file(nids_last_pcap_header->ts.tv_sec, filename, 0, 0, &outputId);
+    currentFile->id = outputId;
     currentFile->outputPath = currentFile->outputFileName + offset;
+    currentFile->timeIndex = moloch_time_index_alloc();
     outputFilePos = 24;
+    outputMember = 0;
 
     outputBuffer = moloch_http_get_buffer(config.pcapWriteSize + 8192);
     outputPos = 24;
@@ -407,7 +826,7 @@ void writer_s3_create(const struct pcap_pkthdr *h)
     if (config.debug)
         LOG("Init-Request: %s", currentFile->outputFileName);
 
-    writer_s3_request("POST", currentFile->outputPath, "uploads=", 0, 0, TRUE, writer_s3_init_cb, currentFile);
+    writer_s3_request("POST", currentFile->outputPath, "uploads=", 0, 0, NULL, TRUE, writer_s3_init_cb, currentFile);
 }
 
 /******************************************************************************/
@@ -421,9 +840,10 @@ struct pcap_sf_pkthdr {
     uint32_t len;		/* length this packet (off wire) */
 };
 void
-writer_s3_write(const struct pcap_pkthdr *h, const u_char *sp, uint32_t *fileNum, uint64_t *filePos)
+writer_s3_write(const MolochSession_t *UNUSED(session), const struct pcap_pkthdr *h, const u_char *sp, uint32_t *fileNum, uint64_t *filePos)
 {
     struct pcap_sf_pkthdr hdr;
+    uint64_t              pos;
 
     hdr.ts.tv_sec  = h->ts.tv_sec;
     hdr.ts.tv_usec = h->ts.tv_usec;
@@ -434,6 +854,11 @@ writer_s3_write(const struct pcap_pkthdr *h, const u_char *sp, uint32_t *fileNum
         writer_s3_create(h);
     }
 
+    if (s3Compress)
+        pos = (outputMember << MOLOCH_S3_MEMBER_SHIFT) | outputPos;
+    else
+        pos = outputFilePos;
+
     memcpy(outputBuffer + outputPos, (char *)&hdr, sizeof(hdr));
     outputPos += sizeof(hdr);
 
@@ -445,7 +870,8 @@ writer_s3_write(const struct pcap_pkthdr *h, const u_char *sp, uint32_t *fileNum
     }
 
     *fileNum = outputId;
-    *filePos = outputFilePos;
+    *filePos = pos;
+    moloch_time_index_add(currentFile->timeIndex, &h->ts, pos);
     outputFilePos += 16 + h->caplen;
 
     if (outputFilePos >= config.maxFileSizeB) {
@@ -473,8 +899,13 @@ void writer_s3_init(char *UNUSED(name))
     s3AccessKeyId         = moloch_config_str(NULL, "s3AccessKeyId", NULL);
     s3SecretAccessKey     = moloch_config_str(NULL, "s3SecretAccessKey", NULL);
     s3Compress            = moloch_config_boolean(NULL, "s3Compress", FALSE);
+    s3CompressionLevel    = moloch_config_int(NULL, "s3CompressionLevel", 1, 1, 9);
     s3MaxConns            = moloch_config_int(NULL, "s3MaxConns", 20, 5, 1000);
     s3MaxRequests         = moloch_config_int(NULL, "s3MaxRequests", 500, 10, 5000);
+    s3PartUploads         = moloch_config_int(NULL, "s3PartUploads", 4, 1, 100);
+    s3MaxMemory           = moloch_config_int(NULL, "s3MaxMemoryMB", 500, 20, 100000) * 1024LL * 1024LL;
+    s3SpillDir            = moloch_config_str(NULL, "s3SpillDir", config.pcapDir[0]);
+    s3MaxRetries          = moloch_config_int(NULL, "s3MaxRetries", 5, 0, 100);
 
     if (!s3Bucket) {
         printf("Must set s3Bucket to save to s3\n");
@@ -503,6 +934,9 @@ void writer_s3_init(char *UNUSED(name))
 
     config.maxFileSizeB = MIN(config.maxFileSizeB, config.pcapWriteSize*2000);
 
+    // Always room for a part being sent and one being read back
+    s3MaxMemory = MAX(s3MaxMemory, 2ULL*config.pcapWriteSize);
+
     if (config.debug) {
         LOG("s3Region: %s", s3Region);
         LOG("s3Host: %s", s3Host);
@@ -510,17 +944,33 @@ void writer_s3_init(char *UNUSED(name))
         LOG("s3AccessKeyId: %s", s3AccessKeyId);
         LOG("s3SecretAccessKey: %s", s3SecretAccessKey);
         LOG("s3Compress: %s", (s3Compress?"true":"false"));
+        LOG("s3CompressionLevel: %u", s3CompressionLevel);
         LOG("s3MaxConns: %u", s3MaxConns);
         LOG("s3MaxRequests: %u", s3MaxRequests);
+        LOG("s3PartUploads: %u", s3PartUploads);
+        LOG("s3MaxMemoryMB: %" PRIu64, s3MaxMemory/(1024*1024));
+        LOG("s3SpillDir: %s", s3SpillDir);
+        LOG("s3MaxRetries: %u", s3MaxRetries);
     }
 
     char host[200];
     snprintf(host, sizeof(host), "https://%s", s3Host);
-    s3Server = moloch_http_create_server(host, 443, s3MaxConns, s3MaxRequests, s3Compress);
+    // Parts are compressed by the worker, the http layer compressing them would break the signature
+    s3Server = moloch_http_create_server(host, 443, s3MaxConns, s3MaxRequests, FALSE);
     moloch_http_set_header_cb(s3Server, writer_s3_header_cb);
 
     checksum = g_checksum_new(G_CHECKSUM_SHA256);
     DLL_INIT(fs3_, &fileQ);
+    DLL_INIT(os3_, &workQ);
+    DLL_INIT(os3_, &doneQ);
+
+    workEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (workEventFd < 0) {
+        printf("Couldn't create s3 worker eventfd with %s\n", strerror(errno));
+        exit(1);
+    }
+    moloch_watch_fd(workEventFd, MOLOCH_GIO_READ_COND, writer_s3_done_cb, NULL);
+    g_thread_new("moloch-s3", &writer_s3_worker_thread, NULL);
 }
 /******************************************************************************/
 void moloch_plugin_init()
@@ -0,0 +1,283 @@
+/******************************************************************************/
+/* reader-mmap.c  -- Offline pcap reader that mmaps the whole file
+ *
+ * Packets are handed to libnids straight out of the mapping, there is no
+ * stdio buffer in between, and the offset of each packet in the file is
+ * just its distance from the start of the mapping.
+ *
+ * The kernel is told the file is read sequentially and the next window is
+ * asked for ahead of time, windows already read are dropped from the
+ * mapping so a large file doesn't pin its pages in our RSS.
+ *
+ * Only the classic pcap format is understood, either byte order and either
+ * micro or nanosecond timestamps.  Anything else fails to open and the
+ * caller falls back to libpcap.
+ *
+ * Copyright 2012-2015 AOL Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <byteswap.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "pcap.h"
+#include "moloch.h"
+
+extern MolochConfig_t        config;
+
+#define MOLOCH_MMAP_MAGIC         0xa1b2c3d4
+#define MOLOCH_MMAP_MAGIC_NSEC    0xa1b23c4d
+#define MOLOCH_MMAP_SWAPPED       0xd4c3b2a1
+#define MOLOCH_MMAP_SWAPPED_NSEC  0x4d3cb2a1
+
+/* Readahead and release window, in bytes */
+#define MOLOCH_MMAP_WINDOW        (32*1024*1024)
+
+/* Record header as it sits in the file */
+typedef struct {
+    uint32_t tv_sec;
+    uint32_t tv_usec;
+    uint32_t caplen;
+    uint32_t len;
+} MolochMmapRecord_t;
+
+struct moloch_mmap {
+    uint8_t                 *map;
+    uint64_t                 size;
+    uint64_t                 pos;
+    uint64_t                 packetPos;
+    uint64_t                 window;
+    struct pcap_pkthdr       hdr;
+    struct bpf_program       bpf;
+    uint32_t                 snaplen;
+    int                      linktype;
+    char                     swapped;
+    char                     nsec;
+};
+
+/******************************************************************************/
+static inline uint32_t moloch_mmap_u32(MolochMmap_t *mm, uint32_t v)
+{
+    return mm->swapped?bswap_32(v):v;
+}
+/******************************************************************************/
+/* Link types in a file's header are the same numbers as the DLT values except
+ * for a few whose DLT value differs by platform.  libpcap has this mapping
+ * but doesn't export it.
+ */
+static int moloch_mmap_linktype_to_dlt(int linktype)
+{
+    switch (linktype) {
+#ifdef DLT_ATM_RFC1483
+    case 100:
+        return DLT_ATM_RFC1483;
+#endif
+    case 101:
+        return DLT_RAW;
+#ifdef DLT_SLIP_BSDOS
+    case 102:
+        return DLT_SLIP_BSDOS;
+#endif
+#ifdef DLT_PPP_BSDOS
+    case 103:
+        return DLT_PPP_BSDOS;
+#endif
+#ifdef DLT_ATM_CLIP
+    case 106:
+        return DLT_ATM_CLIP;
+#endif
+#ifdef DLT_PFSYNC
+    case 246:
+        return DLT_PFSYNC;
+#endif
+#ifdef DLT_PKTAP
+    case 258:
+        return DLT_PKTAP;
+#endif
+    }
+    return linktype;
+}
+/******************************************************************************/
+/* Returns NULL with errbuf filled in if the file can't be mapped or isn't a
+ * classic pcap file.
+ */
+MolochMmap_t *moloch_mmap_open(const char *filename, char *errbuf)
+{
+    struct pcap_file_header hdr;
+    struct stat             st;
+    MolochMmap_t           *mm;
+    int                     fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s: %s", filename, strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < (off_t)sizeof(hdr)) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s: not a regular pcap file", filename);
+        close(fd);
+        return NULL;
+    }
+
+    mm = MOLOCH_TYPE_ALLOC0(MolochMmap_t);
+    mm->size = st.st_size;
+
+    /* Private and writable so anything that touches packet data in place gets its own copy */
+    mm->map = mmap(NULL, mm->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mm->map == MAP_FAILED) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s: mmap failed %s", filename, strerror(errno));
+        MOLOCH_TYPE_FREE(MolochMmap_t, mm);
+        return NULL;
+    }
+
+    memcpy(&hdr, mm->map, sizeof(hdr));
+    switch (hdr.magic) {
+    case MOLOCH_MMAP_MAGIC:
+        break;
+    case MOLOCH_MMAP_MAGIC_NSEC:
+        mm->nsec = 1;
+        break;
+    case MOLOCH_MMAP_SWAPPED:
+        mm->swapped = 1;
+        break;
+    case MOLOCH_MMAP_SWAPPED_NSEC:
+        mm->swapped = 1;
+        mm->nsec = 1;
+        break;
+    default:
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s: unknown magic %08x", filename, hdr.magic);
+        moloch_mmap_close(mm);
+        return NULL;
+    }
+
+    mm->snaplen  = moloch_mmap_u32(mm, hdr.snaplen);
+    mm->linktype = moloch_mmap_linktype_to_dlt(moloch_mmap_u32(mm, hdr.linktype) & 0x03ffffff);
+    mm->pos      = sizeof(hdr);
+
+    madvise(mm->map, mm->size, MADV_SEQUENTIAL);
+    madvise(mm->map, MIN(mm->size, MOLOCH_MMAP_WINDOW), MADV_WILLNEED);
+
+    return mm;
+}
+/******************************************************************************/
+/* Take over a compiled filter, packets it rejects are skipped */
+void moloch_mmap_setfilter(MolochMmap_t *mm, struct bpf_program *bpf)
+{
+    pcap_freecode(&mm->bpf);
+    mm->bpf = *bpf;
+}
+/******************************************************************************/
+int moloch_mmap_datalink(MolochMmap_t *mm)
+{
+    return mm->linktype;
+}
+/******************************************************************************/
+int moloch_mmap_snapshot(MolochMmap_t *mm)
+{
+    return mm->snaplen;
+}
+/******************************************************************************/
+uint64_t moloch_mmap_size(MolochMmap_t *mm)
+{
+    return mm->size;
+}
+/******************************************************************************/
+/* File offset of the record header of the packet being dispatched */
+uint64_t moloch_mmap_pos(MolochMmap_t *mm)
+{
+    return mm->packetPos;
+}
+/******************************************************************************/
+/* Ask for the next window and drop the one before the current from the mapping */
+static void moloch_mmap_advise(MolochMmap_t *mm)
+{
+    uint64_t window = mm->pos / MOLOCH_MMAP_WINDOW;
+
+    if (window == mm->window)
+        return;
+
+    mm->window = window;
+
+    uint64_t ahead = (window + 1) * MOLOCH_MMAP_WINDOW;
+    if (ahead < mm->size)
+        madvise(mm->map + ahead, MIN(mm->size - ahead, MOLOCH_MMAP_WINDOW), MADV_WILLNEED);
+
+    if (window >= 2)
+        madvise(mm->map + (window - 2) * MOLOCH_MMAP_WINDOW, MOLOCH_MMAP_WINDOW, MADV_DONTNEED);
+}
+/******************************************************************************/
+/* Same contract as pcap_dispatch on a savefile, returns the number of packets
+ * given to cb, 0 at the end of the file and -1 if a record is truncated.
+ */
+int moloch_mmap_dispatch(MolochMmap_t *mm, int cnt, pcap_handler cb, u_char *user)
+{
+    int n = 0;
+
+    while (n < cnt) {
+        MolochMmapRecord_t rec;
+
+        if (mm->pos == mm->size)
+            break;
+
+        if (mm->pos + sizeof(rec) > mm->size) {
+            LOG("ERROR - Truncated pcap record header at %" PRIu64, mm->pos);
+            return n?n:-1;
+        }
+
+        memcpy(&rec, mm->map + mm->pos, sizeof(rec));
+        mm->hdr.ts.tv_sec  = moloch_mmap_u32(mm, rec.tv_sec);
+        mm->hdr.ts.tv_usec = moloch_mmap_u32(mm, rec.tv_usec);
+        mm->hdr.caplen     = moloch_mmap_u32(mm, rec.caplen);
+        mm->hdr.len        = moloch_mmap_u32(mm, rec.len);
+
+        if (mm->nsec)
+            mm->hdr.ts.tv_usec /= 1000;
+
+        if (mm->hdr.caplen > MAX(mm->snaplen, 262144) || mm->pos + sizeof(rec) + mm->hdr.caplen > mm->size) {
+            LOG("ERROR - Bad or truncated pcap record at %" PRIu64 " caplen %u", mm->pos, mm->hdr.caplen);
+            return n?n:-1;
+        }
+
+        const u_char *data = mm->map + mm->pos + sizeof(rec);
+        mm->packetPos = mm->pos;
+        mm->pos += sizeof(rec) + mm->hdr.caplen;
+        moloch_mmap_advise(mm);
+
+        if (mm->bpf.bf_insns && !pcap_offline_filter(&mm->bpf, &mm->hdr, data))
+            continue;
+
+        cb(user, &mm->hdr, data);
+        n++;
+    }
+
+    return n;
+}
+/******************************************************************************/
+void moloch_mmap_close(MolochMmap_t *mm)
+{
+    if (mm->map != MAP_FAILED)
+        munmap(mm->map, mm->size);
+    pcap_freecode(&mm->bpf);
+    MOLOCH_TYPE_FREE(MolochMmap_t, mm);
+}
@@ -0,0 +1,675 @@
+/******************************************************************************/
+/* reader-tpacketv3.c  -- Linux AF_PACKET TPACKET_V3 ring reader
+ *
+ * Each interface gets its own socket, ring and filter, and is read by its
+ * own reader thread (see readers.c).  The thread walks the ring, releases
+ * each block back to the kernel as soon as its packets are copied out, and
+ * the main thread processes them tagged with the interface they came in on.
+ *
+ * Sessions that will never be saved or parsed again can be shunted, their
+ * 5-tuple is added to the socket filters so the kernel cuts the rest of the
+ * flow down to its headers.  Those are counted against the shunt by the
+ * reader threads and folded back into the session later by the main thread,
+ * libnids never sees them.
+ *
+ * Copyright 2012-2015 AOL Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#include "pcap.h"
+#include "moloch.h"
+
+extern MolochConfig_t        config;
+
+typedef struct {
+    int                      fd;
+    uint8_t                 *map;
+    struct tpacket_req3      req;
+    uint32_t                 block;
+    struct pcap_stat         stats;
+    struct bpf_program       bpf;
+    char                    *interface;
+} MolochTpacketv3_t;
+
+static MolochTpacketv3_t     tpacketv3[MOLOCH_MAX_INTERFACES];
+static int                   tpacketv3Num;
+static int                   tpacketv3Dlt;
+static uint32_t              tpacketv3Snaplen;
+
+typedef struct {
+    uint32_t addr1, addr2;
+    uint16_t port1, port2;
+    uint8_t  protocol;
+    uint64_t packets[2];
+    uint64_t bytes[2];
+    struct timeval lastPacket;
+} MolochTpacketv3Shunt_t;
+
+/* Bytes of a shunted packet the filter keeps, enough for the ip and tcp headers */
+#define SHUNT_SNAPLEN 128
+
+/* The reader threads count shunted packets while the main thread adds,
+ * removes and folds shunts, everything below is protected by shuntsLock */
+static MolochTpacketv3Shunt_t *shunts;
+static uint32_t              shuntsNum;
+static int                   shuntsChanged;
+static MolochTpacketv3Stats_t shuntStats;
+static pthread_mutex_t       shuntsLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Scratch memory slots the shunt program loads the packet fields into */
+#define SHUNT_M_PROTO 0
+#define SHUNT_M_SRC   1
+#define SHUNT_M_DST   2
+#define SHUNT_M_SPORT 3
+#define SHUNT_M_DPORT 4
+
+#define SHUNT_INSN(c, t, f, v) do { insns[pc].code = (c); insns[pc].jt = (t); insns[pc].jf = (f); insns[pc].k = (v); pc++; } while (0)
+
+/******************************************************************************/
+/* Instructions that drop one direction of a shunted flow, jumps over the rest
+ * of itself to the next direction if it doesn't match.
+ */
+static int moloch_tpacketv3_shunt_dir(struct sock_filter *insns, int pc, uint8_t protocol, uint32_t src, uint16_t sport, uint32_t dst, uint16_t dport)
+{
+    const int ports = (protocol != IPPROTO_ICMP);
+    const int left  = ports?8:4;
+
+    SHUNT_INSN(BPF_LD|BPF_MEM, 0, 0, SHUNT_M_SRC);
+    SHUNT_INSN(BPF_JMP|BPF_JEQ|BPF_K, 0, left - 1, ntohl(src));
+    SHUNT_INSN(BPF_LD|BPF_MEM, 0, 0, SHUNT_M_DST);
+    SHUNT_INSN(BPF_JMP|BPF_JEQ|BPF_K, 0, left - 3, ntohl(dst));
+    if (ports) {
+        SHUNT_INSN(BPF_LD|BPF_MEM, 0, 0, SHUNT_M_SPORT);
+        SHUNT_INSN(BPF_JMP|BPF_JEQ|BPF_K, 0, 3, sport);
+        SHUNT_INSN(BPF_LD|BPF_MEM, 0, 0, SHUNT_M_DPORT);
+        SHUNT_INSN(BPF_JMP|BPF_JEQ|BPF_K, 0, 1, dport);
+    }
+    SHUNT_INSN(BPF_RET|BPF_K, 0, 0, SHUNT_SNAPLEN);
+
+    return pc;
+}
+/******************************************************************************/
+/* Build the shunt part of the socket filters, the shunted flows are checked
+ * first and truncated, everything else falls through to the end of what is
+ * returned.  Shunting only looks at untagged IPv4, first fragments or
+ * unfragmented packets.  Called with shuntsLock held.
+ */
+static int moloch_tpacketv3_shunt_insns(struct sock_filter *insns)
+{
+    int                  pc = 0;
+    uint32_t             i;
+
+    /* Raw IP interfaces have no link header in front of the IP header */
+    const int            off = (tpacketv3Dlt == DLT_EN10MB)?14:0;
+
+    if (shuntsNum == 0)
+        return 0;
+
+    if (off) {
+        SHUNT_INSN(BPF_LD|BPF_H|BPF_ABS, 0, 0, 12);
+        SHUNT_INSN(BPF_JMP|BPF_JEQ|BPF_K, 1, 0, ETH_P_IP);
+    } else {
+        SHUNT_INSN(BPF_LD|BPF_B|BPF_ABS, 0, 0, 0);
+        SHUNT_INSN(BPF_ALU|BPF_AND|BPF_K, 0, 0, 0xf0);
+        SHUNT_INSN(BPF_JMP|BPF_JEQ|BPF_K, 1, 0, 0x40);
+    }
+    SHUNT_INSN(BPF_JMP|BPF_JA, 0, 0, 0);
+    int skip1 = pc - 1;
+    SHUNT_INSN(BPF_LD|BPF_H|BPF_ABS, 0, 0, off + 6);
+    SHUNT_INSN(BPF_JMP|BPF_JSET|BPF_K, 0, 1, 0x1fff);
+    SHUNT_INSN(BPF_JMP|BPF_JA, 0, 0, 0);
+    int skip2 = pc - 1;
+
+    SHUNT_INSN(BPF_LD|BPF_B|BPF_ABS, 0, 0, off + 9);
+    SHUNT_INSN(BPF_ST, 0, 0, SHUNT_M_PROTO);
+    SHUNT_INSN(BPF_LD|BPF_W|BPF_ABS, 0, 0, off + 12);
+    SHUNT_INSN(BPF_ST, 0, 0, SHUNT_M_SRC);
+    SHUNT_INSN(BPF_LD|BPF_W|BPF_ABS, 0, 0, off + 16);
+    SHUNT_INSN(BPF_ST, 0, 0, SHUNT_M_DST);
+    SHUNT_INSN(BPF_LDX|BPF_B|BPF_MSH, 0, 0, off);
+    SHUNT_INSN(BPF_LD|BPF_H|BPF_IND, 0, 0, off);
+    SHUNT_INSN(BPF_ST, 0, 0, SHUNT_M_SPORT);
+    SHUNT_INSN(BPF_LD|BPF_H|BPF_IND, 0, 0, off + 2);
+    SHUNT_INSN(BPF_ST, 0, 0, SHUNT_M_DPORT);
+
+    for (i = 0; i < shuntsNum; i++) {
+        MolochTpacketv3Shunt_t *shunt = &shunts[i];
+        int dirLen = (shunt->protocol != IPPROTO_ICMP)?9:5;
+
+        SHUNT_INSN(BPF_LD|BPF_MEM, 0, 0, SHUNT_M_PROTO);
+        SHUNT_INSN(BPF_JMP|BPF_JEQ|BPF_K, 0, dirLen * 2, shunt->protocol);
+        pc = moloch_tpacketv3_shunt_dir(insns, pc, shunt->protocol, shunt->addr1, shunt->port1, shunt->addr2, shunt->port2);
+        pc = moloch_tpacketv3_shunt_dir(insns, pc, shunt->protocol, shunt->addr2, shunt->port2, shunt->addr1, shunt->port1);
+    }
+
+    insns[skip1].k = pc - (skip1 + 1);
+    insns[skip2].k = pc - (skip2 + 1);
+
+    return pc;
+}
+/******************************************************************************/
+/* Attach the shunts followed by each interface's own bpf to its socket, only
+ * the first num interfaces are done.
+ */
+static void moloch_tpacketv3_attach_filters(int num)
+{
+    struct sock_filter  *insns;
+    struct sock_fprog    fcode;
+    uint32_t             maxBpf = 0;
+    int                  t;
+
+    for (t = 0; t < num; t++) {
+        maxBpf = MAX(maxBpf, tpacketv3[t].bpf.bf_len);
+    }
+
+    pthread_mutex_lock(&shuntsLock);
+    insns = malloc((20 + shuntsNum * 20 + maxBpf + 1) * sizeof(struct sock_filter));
+    const int shuntLen = moloch_tpacketv3_shunt_insns(insns);
+
+    for (t = 0; t < num; t++) {
+        MolochTpacketv3_t *tp = &tpacketv3[t];
+        int                pc = shuntLen;
+
+        if (tp->bpf.bf_len) {
+            memcpy(insns + pc, tp->bpf.bf_insns, tp->bpf.bf_len * sizeof(struct sock_filter));
+            pc += tp->bpf.bf_len;
+        } else {
+            SHUNT_INSN(BPF_RET|BPF_K, 0, 0, 0x40000);
+        }
+
+        fcode.len    = pc;
+        fcode.filter = insns;
+
+        if (setsockopt(tp->fd, SOL_SOCKET, SO_ATTACH_FILTER, &fcode, sizeof(fcode)) < 0) {
+            LOG("ERROR - Couldn't attach filter with %u shunts to '%s' %d: %s", shuntsNum, tp->interface, errno, strerror(errno));
+            exit(1);
+        }
+    }
+
+    shuntsChanged = 0;
+    pthread_mutex_unlock(&shuntsLock);
+    free(insns);
+}
+/******************************************************************************/
+static void moloch_tpacketv3_compile_filter(MolochTpacketv3_t *tp, char *bpf)
+{
+    pcap_t *dead = pcap_open_dead(tpacketv3Dlt, tpacketv3Snaplen);
+    if (pcap_compile(dead, &tp->bpf, bpf, 1, PCAP_NETMASK_UNKNOWN) == -1) {
+        LOG("ERROR - Couldn't compile filter for '%s': '%s' with %s", tp->interface, bpf, pcap_geterr(dead));
+        exit(1);
+    }
+    pcap_close(dead);
+}
+/******************************************************************************/
+/* Filter updates are batched, once a second is plenty for flows we've given up on */
+static gboolean moloch_tpacketv3_shunt_gfunc (gpointer UNUSED(user_data))
+{
+    if (shuntsChanged)
+        moloch_tpacketv3_attach_filters(tpacketv3Num);
+    return TRUE;
+}
+/******************************************************************************/
+/* Returns TRUE if the session will be dropped by the kernel from now on */
+gboolean moloch_tpacketv3_shunt_add(MolochSession_t *session)
+{
+    pthread_mutex_lock(&shuntsLock);
+    if (shuntsNum >= config.tpacketv3MaxShunts) {
+        shuntStats.shuntsFull++;
+        pthread_mutex_unlock(&shuntsLock);
+        return FALSE;
+    }
+
+    MolochTpacketv3Shunt_t *shunt = &shunts[shuntsNum++];
+    memset(shunt, 0, sizeof(*shunt));
+    shunt->protocol = session->protocol;
+    shunt->addr1    = session->addr1;
+    shunt->addr2    = session->addr2;
+    shunt->port1    = session->port1;
+    shunt->port2    = session->port2;
+    shuntsChanged   = 1;
+
+    shuntStats.shunted++;
+    pthread_mutex_unlock(&shuntsLock);
+    return TRUE;
+}
+/******************************************************************************/
+/* Called with shuntsLock held */
+static MolochTpacketv3Shunt_t *moloch_tpacketv3_shunt_find(MolochSession_t *session)
+{
+    uint32_t i;
+
+    for (i = 0; i < shuntsNum; i++) {
+        MolochTpacketv3Shunt_t *shunt = &shunts[i];
+        if (shunt->protocol == session->protocol &&
+            shunt->addr1 == session->addr1 && shunt->addr2 == session->addr2 &&
+            shunt->port1 == session->port1 && shunt->port2 == session->port2) {
+            return shunt;
+        }
+    }
+    return NULL;
+}
+/******************************************************************************/
+/* Add what the kernel truncated since the last call to the session, keeps a
+ * busy shunted session from idling out while its packets never reach it.
+ */
+void moloch_tpacketv3_shunt_fold(MolochSession_t *session)
+{
+    pthread_mutex_lock(&shuntsLock);
+    MolochTpacketv3Shunt_t *shunt = moloch_tpacketv3_shunt_find(session);
+    int                     which;
+
+    if (!shunt) {
+        pthread_mutex_unlock(&shuntsLock);
+        return;
+    }
+
+    for (which = 0; which < 2; which++) {
+        session->packets[which] += shunt->packets[which];
+        session->bytes[which]   += shunt->bytes[which];
+        shunt->packets[which] = 0;
+        shunt->bytes[which]   = 0;
+    }
+
+    if (timercmp(&shunt->lastPacket, &session->lastPacket, >))
+        session->lastPacket = shunt->lastPacket;
+    pthread_mutex_unlock(&shuntsLock);
+}
+/******************************************************************************/
+void moloch_tpacketv3_shunt_remove(MolochSession_t *session)
+{
+    pthread_mutex_lock(&shuntsLock);
+    MolochTpacketv3Shunt_t *shunt = moloch_tpacketv3_shunt_find(session);
+
+    if (shunt) {
+        *shunt = shunts[--shuntsNum];
+        shuntsChanged = 1;
+    }
+    pthread_mutex_unlock(&shuntsLock);
+}
+/******************************************************************************/
+/* A truncated packet might be from a shunted flow, if so count it against the
+ * shunt.  Returns TRUE if it was.  Called on the reader threads.
+ */
+static int moloch_tpacketv3_shunt_count(const uint8_t *pkt, uint32_t caplen, uint32_t len, const struct timeval *ts)
+{
+    const int      off = (tpacketv3Dlt == DLT_EN10MB)?14:0;
+    const uint8_t *ip = pkt + off;
+    uint32_t       src, dst;
+    uint16_t       sport = 0, dport = 0;
+    uint32_t       i;
+
+    if (caplen < (uint32_t)off + 20)
+        return FALSE;
+
+    if (off && (pkt[12] != 0x08 || pkt[13] != 0x00))
+        return FALSE;
+
+    if ((ip[0] >> 4) != 4)
+        return FALSE;
+
+    const int     hl = (ip[0] & 0xf) * 4;
+    const uint8_t protocol = ip[9];
+
+    memcpy(&src, ip + 12, 4);
+    memcpy(&dst, ip + 16, 4);
+
+    if (protocol != IPPROTO_ICMP) {
+        if (caplen < (uint32_t)(off + hl + 4))
+            return FALSE;
+        sport = (ip[hl] << 8) | ip[hl + 1];
+        dport = (ip[hl + 2] << 8) | ip[hl + 3];
+    }
+
+    pthread_mutex_lock(&shuntsLock);
+    for (i = 0; i < shuntsNum; i++) {
+        MolochTpacketv3Shunt_t *shunt = &shunts[i];
+        int                     which;
+
+        if (shunt->protocol != protocol)
+            continue;
+
+        if (shunt->addr1 == src && shunt->addr2 == dst && shunt->port1 == sport && shunt->port2 == dport)
+            which = 0;
+        else if (shunt->addr1 == dst && shunt->addr2 == src && shunt->port1 == dport && shunt->port2 == sport)
+            which = 1;
+        else
+            continue;
+
+        shunt->packets[which]++;
+        shunt->bytes[which] += len;
+        shunt->lastPacket = *ts;
+
+        shuntStats.shuntedPackets++;
+        shuntStats.shuntedBytes += len;
+        pthread_mutex_unlock(&shuntsLock);
+        return TRUE;
+    }
+    pthread_mutex_unlock(&shuntsLock);
+    return FALSE;
+}
+/******************************************************************************/
+void moloch_tpacketv3_shunt_stats(MolochTpacketv3Stats_t *stats)
+{
+    pthread_mutex_lock(&shuntsLock);
+    *stats = shuntStats;
+    stats->active = shuntsNum;
+    pthread_mutex_unlock(&shuntsLock);
+}
+/******************************************************************************/
+/* Link type of the frames in the ring, mapped from the interface's ARPHRD
+ * type the same way libpcap does it.  Interfaces libpcap can only read in
+ * cooked mode aren't supported.
+ */
+static int moloch_tpacketv3_datalink(char *interface)
+{
+    struct ifreq ifr;
+    int          fd;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        LOG("ERROR - Couldn't create socket %d: %s", errno, strerror(errno));
+        exit(1);
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    g_strlcpy(ifr.ifr_name, interface, sizeof(ifr.ifr_name));
+    if (ioctl(fd, SIOCGIFHWADDR, &ifr) < 0) {
+        LOG("ERROR - Couldn't get hardware type of '%s' %d: %s", interface, errno, strerror(errno));
+        exit(1);
+    }
+    close(fd);
+
+    switch (ifr.ifr_hwaddr.sa_family) {
+    case ARPHRD_ETHER:
+    case ARPHRD_LOOPBACK:
+        return DLT_EN10MB;
+    case ARPHRD_NONE:
+#ifdef ARPHRD_RAWIP
+    case ARPHRD_RAWIP:
+#endif
+        return DLT_RAW;
+    }
+
+    LOG("ERROR - tpacketv3 doesn't support '%s' hardware type %d, use pcapReadMethod=libpcap", interface, ifr.ifr_hwaddr.sa_family);
+    exit(1);
+}
+/******************************************************************************/
+static void moloch_tpacketv3_open(MolochTpacketv3_t *tp, char *interface, char *bpf, int num)
+{
+    int ifindex = if_nametoindex(interface);
+    if (!ifindex) {
+        LOG("ERROR - Couldn't find interface '%s'", interface);
+        exit(1);
+    }
+
+    tp->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (tp->fd < 0) {
+        LOG("ERROR - Couldn't create AF_PACKET socket %d: %s", errno, strerror(errno));
+        exit(1);
+    }
+
+    int version = TPACKET_V3;
+    if (setsockopt(tp->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        LOG("ERROR - Couldn't set TPACKET_V3 %d: %s", errno, strerror(errno));
+        exit(1);
+    }
+
+    /* Leave room in front of each frame so a stripped vlan tag can be put back in place */
+    int reserve = 4;
+    if (setsockopt(tp->fd, SOL_PACKET, PACKET_RESERVE, &reserve, sizeof(reserve)) < 0) {
+        LOG("ERROR - Couldn't set PACKET_RESERVE %d: %s", errno, strerror(errno));
+        exit(1);
+    }
+
+    tp->interface = interface;
+    tpacketv3Num  = num + 1;
+
+    /* Attach the filter before binding so nothing unwanted lands in the ring */
+    if (bpf) {
+        moloch_tpacketv3_compile_filter(tp, bpf);
+        moloch_tpacketv3_attach_filters(tpacketv3Num);
+    }
+
+    memset(&tp->req, 0, sizeof(tp->req));
+    tp->req.tp_block_size       = config.tpacketv3BlockSize;
+    tp->req.tp_block_nr         = config.tpacketv3NumBlocks;
+    tp->req.tp_frame_size       = 2048;
+    tp->req.tp_frame_nr         = (tp->req.tp_block_size / tp->req.tp_frame_size) * tp->req.tp_block_nr;
+    tp->req.tp_retire_blk_tov   = 100;
+    tp->req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+
+    if (setsockopt(tp->fd, SOL_PACKET, PACKET_RX_RING, &tp->req, sizeof(tp->req)) < 0) {
+        LOG("ERROR - Couldn't create ring of %u blocks of %u bytes %d: %s", tp->req.tp_block_nr, tp->req.tp_block_size, errno, strerror(errno));
+        exit(1);
+    }
+
+    tp->map = mmap(NULL, (size_t)tp->req.tp_block_size * tp->req.tp_block_nr,
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, tp->fd, 0);
+    if (tp->map == MAP_FAILED) {
+        LOG("ERROR - Couldn't mmap ring %d: %s", errno, strerror(errno));
+        exit(1);
+    }
+
+    struct sockaddr_ll ll;
+    memset(&ll, 0, sizeof(ll));
+    ll.sll_family   = PF_PACKET;
+    ll.sll_protocol = htons(ETH_P_ALL);
+    ll.sll_ifindex  = ifindex;
+
+    if (bind(tp->fd, (struct sockaddr *)&ll, sizeof(ll)) < 0) {
+        LOG("ERROR - Couldn't bind to '%s' %d: %s", interface, errno, strerror(errno));
+        exit(1);
+    }
+
+    struct packet_mreq mreq;
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = ifindex;
+    mreq.mr_type    = PACKET_MR_PROMISC;
+    if (setsockopt(tp->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        LOG("ERROR - Couldn't set promisc on '%s' %d: %s", interface, errno, strerror(errno));
+        exit(1);
+    }
+
+    /* Flow hash fanout lets several capture processes split one interface,
+     * each interface gets its own group starting at tpacketv3FanoutGroup */
+    uint32_t group = 0;
+    if (config.tpacketv3FanoutGroup) {
+        group = config.tpacketv3FanoutGroup + num;
+        int fanout = (group & 0xffff) | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+        if (setsockopt(tp->fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) < 0) {
+            LOG("ERROR - Couldn't join fanout group %u on '%s' %d: %s", group, interface, errno, strerror(errno));
+            exit(1);
+        }
+    }
+
+    if (config.debug)
+        LOG("tpacketv3 %s ring %u blocks of %u bytes fanout %u", interface, tp->req.tp_block_nr, tp->req.tp_block_size, group);
+}
+/******************************************************************************/
+void moloch_tpacketv3_init(char **interfaces, char **bpfs, uint32_t snaplen)
+{
+    int i;
+
+    tpacketv3Snaplen = snaplen;
+
+    /* libnids decodes every packet with one link type */
+    for (i = 0; interfaces[i]; i++) {
+        int dlt = moloch_tpacketv3_datalink(interfaces[i]);
+        if (i == 0) {
+            tpacketv3Dlt = dlt;
+        } else if (dlt != tpacketv3Dlt) {
+            LOG("ERROR - Interface '%s' link type %d doesn't match '%s' link type %d", interfaces[i], dlt, interfaces[0], tpacketv3Dlt);
+            exit(1);
+        }
+    }
+
+    for (i = 0; interfaces[i]; i++) {
+        moloch_tpacketv3_open(&tpacketv3[i], interfaces[i], bpfs[i], i);
+    }
+
+    if (config.tpacketv3MaxShunts) {
+        shunts = malloc(config.tpacketv3MaxShunts * sizeof(MolochTpacketv3Shunt_t));
+        g_timeout_add_seconds(1, moloch_tpacketv3_shunt_gfunc, 0);
+    }
+}
+/******************************************************************************/
+/* Reader thread for interface uw, waits for the kernel to hand over a block
+ * and then passes the ready blocks, without copying, to the main thread.
+ * A block stays ours until moloch_tpacketv3_block gives it back, there are
+ * more blocks in the ring than can be waiting so the next one is never one
+ * still out.
+ */
+int moloch_tpacketv3_read(MolochReader_t *reader, void *uw)
+{
+    const int          num = (long)uw;
+    MolochTpacketv3_t *tp = &tpacketv3[num];
+    uint32_t           blocks;
+
+    for (blocks = 0; blocks < tp->req.tp_block_nr; blocks++) {
+        struct tpacket_block_desc *bd = (struct tpacket_block_desc *)(tp->map + (size_t)tp->block * tp->req.tp_block_size);
+
+        if ((__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0) {
+            if (blocks > 0)
+                break;
+
+            struct pollfd pfd;
+            pfd.fd      = tp->fd;
+            pfd.events  = POLLIN | POLLERR;
+            pfd.revents = 0;
+            if (poll(&pfd, 1, 1000) < 0 && errno != EINTR) {
+                LOG("ERROR - Couldn't poll '%s' %d: %s", tp->interface, errno, strerror(errno));
+                return -1;
+            }
+            return 1;
+        }
+
+        tp->block = (tp->block + 1) % tp->req.tp_block_nr;
+        if (!moloch_reader_block(reader, bd))
+            break;
+    }
+
+    return 1;
+}
+/******************************************************************************/
+/* Walk a block the reader thread handed over on the main thread, then give
+ * it back to the kernel.
+ */
+void moloch_tpacketv3_block(int num, void *block, MolochReaderPacket packet)
+{
+    struct tpacket_block_desc *bd = block;
+    struct tpacket3_hdr       *th = (struct tpacket3_hdr *)((uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt);
+    uint32_t                   p;
+
+    for (p = 0; p < bd->hdr.bh1.num_pkts; p++) {
+        struct pcap_pkthdr  hdr;
+        u_char             *pkt = (u_char *)th + th->tp_mac;
+
+        hdr.ts.tv_sec  = th->tp_sec;
+        hdr.ts.tv_usec = th->tp_nsec/1000;
+        hdr.caplen     = th->tp_snaplen;
+        hdr.len        = th->tp_len;
+
+        /* Cut down by a shunt, libnids would just reject it as truncated */
+        if (hdr.caplen < hdr.len && moloch_tpacketv3_shunt_count(pkt, hdr.caplen, hdr.len, &hdr.ts)) {
+            th = (struct tpacket3_hdr *)((uint8_t *)th + th->tp_next_offset);
+            continue;
+        }
+
+        /* The nic stripped the vlan tag, put it back using the reserved room */
+        if ((th->tp_status & TP_STATUS_VLAN_VALID) && tpacketv3Dlt == DLT_EN10MB) {
+            uint16_t tpid = (th->tp_status & TP_STATUS_VLAN_TPID_VALID)?th->hv1.tp_vlan_tpid:ETH_P_8021Q;
+            memmove(pkt - 4, pkt, 12);
+            pkt -= 4;
+            pkt[12] = tpid >> 8;
+            pkt[13] = tpid & 0xff;
+            pkt[14] = th->hv1.tp_vlan_tci >> 8;
+            pkt[15] = th->hv1.tp_vlan_tci & 0xff;
+            hdr.caplen += 4;
+            hdr.len += 4;
+        }
+
+        if (hdr.caplen > tpacketv3Snaplen)
+            hdr.caplen = tpacketv3Snaplen;
+
+        packet(num, &hdr, pkt, 0);
+
+        th = (struct tpacket3_hdr *)((uint8_t *)th + th->tp_next_offset);
+    }
+
+    __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+}
+/******************************************************************************/
+int moloch_tpacketv3_datalink_type()
+{
+    return tpacketv3Dlt;
+}
+/******************************************************************************/
+/* The kernel resets its counters on every read, so keep running totals */
+int moloch_tpacketv3_stats(int num, struct pcap_stat *ps)
+{
+    MolochTpacketv3_t      *tp = &tpacketv3[num];
+    struct tpacket_stats_v3 tpstats;
+    socklen_t               len = sizeof(tpstats);
+
+    if (num >= tpacketv3Num || tp->fd < 0)
+        return -1;
+
+    if (getsockopt(tp->fd, SOL_PACKET, PACKET_STATISTICS, &tpstats, &len) < 0)
+        return -1;
+
+    tp->stats.ps_recv += tpstats.tp_packets;
+    tp->stats.ps_drop += tpstats.tp_drops;
+
+    *ps = tp->stats;
+    return 0;
+}
+/******************************************************************************/
+void moloch_tpacketv3_exit()
+{
+    int t;
+
+    if (tpacketv3Num == 0)
+        return;
+
+    if (config.tpacketv3MaxShunts)
+        LOG("tpacketv3 shunted: %" PRIu64 " active: %u full: %" PRIu64, shuntStats.shunted, shuntsNum, shuntStats.shuntsFull);
+
+    /* The reader threads have already been stopped */
+    for (t = 0; t < tpacketv3Num; t++) {
+        MolochTpacketv3_t *tp = &tpacketv3[t];
+        munmap(tp->map, (size_t)tp->req.tp_block_size * tp->req.tp_block_nr);
+        close(tp->fd);
+        tp->fd = -1;
+        if (tp->bpf.bf_len)
+            pcap_freecode(&tp->bpf);
+    }
+    tpacketv3Num = 0;
+}
@@ -0,0 +1,347 @@
+/******************************************************************************/
+/* readers.c  -- Reader threads and the batches they hand to the main thread
+ *
+ * Each live interface and each parallel offline file is read on its own
+ * thread.  The thread copies packets into batches, hands full batches to the
+ * main thread over an eventfd, and the main thread runs them through the
+ * normal packet path.  Sessions, parsers and writers stay single threaded.
+ *
+ * A reader has MOLOCH_READER_BATCHES batches, once all of them are waiting
+ * on the main thread it stops reading until one comes back.  For an
+ * interface the backlog then builds up in the kernel buffer, where drops are
+ * counted, instead of in our memory.
+ *
+ * Readers whose packets already sit in memory that stays put, like a
+ * TPACKET_V3 ring block, hand over a pointer to it with moloch_reader_block
+ * instead of copying.  The batch then carries only the pointer, and the
+ * reader's block function walks it on the main thread and gives it back.
+ *
+ * Copyright 2012-2015 AOL Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "moloch.h"
+
+extern MolochConfig_t        config;
+
+#define MOLOCH_READER_BATCH_SIZE  (1024*1024)
+
+/* Each packet in a batch is this header followed by the data, padded to 8 bytes */
+typedef struct {
+    struct pcap_pkthdr       hdr;
+    uint64_t                 pos;
+} MolochReaderPacket_t;
+
+#define MOLOCH_READER_PACKET_SIZE(caplen) ((sizeof(MolochReaderPacket_t) + (caplen) + 7) & ~7)
+
+typedef struct {
+    uint8_t                 *buf;
+    void                    *block;
+    uint32_t                 len;
+    uint32_t                 packets;
+    int                      last;
+    int                      status;
+} MolochReaderBatch_t;
+
+struct moloch_reader {
+    MolochReaderBatch_t      batches[MOLOCH_READER_BATCHES];
+    uint32_t                 head;      /* Batch being filled, only the reader thread moves it */
+    uint32_t                 tail;      /* Next batch to process, only the main thread moves it */
+    pthread_mutex_t          lock;
+    pthread_cond_t           cond;
+    int                      quit;
+    int                      efd;
+    gint                     watch;
+    gint                     retry;
+    int                      num;
+    int                      live;
+    MolochReaderRead         read;
+    MolochReaderPacket       packet;
+    MolochReaderBlock        block;
+    MolochReaderBusy         busy;
+    MolochReaderDone         done;
+    void                    *uw;
+    GThread                 *thread;
+};
+
+/* Packets can run the main loop (mid saves when reading files), don't let
+ * a reader callback start processing another batch underneath one */
+static int                   readerProcessing;
+
+#define MOLOCH_READER_EMPTY  0
+#define MOLOCH_READER_MORE   1
+#define MOLOCH_READER_WAIT   2
+
+/******************************************************************************/
+/* Hand the batch being filled to the main thread and wait for a free one.
+ * Returns FALSE if the reader is being stopped.
+ */
+static int moloch_reader_flush(MolochReader_t *reader)
+{
+    MolochReaderBatch_t *batch = &reader->batches[reader->head % MOLOCH_READER_BATCHES];
+    uint64_t             one = 1;
+
+    if (batch->packets == 0 && !batch->last && !batch->block)
+        return TRUE;
+
+    __atomic_store_n(&reader->head, reader->head + 1, __ATOMIC_RELEASE);
+    if (write(reader->efd, &one, sizeof(one)) != sizeof(one))
+        LOG("ERROR - Reader %d couldn't signal main thread %d: %s", reader->num, errno, strerror(errno));
+
+    if (batch->last)
+        return TRUE;
+
+    pthread_mutex_lock(&reader->lock);
+    while (reader->head - reader->tail >= MOLOCH_READER_BATCHES && !reader->quit)
+        pthread_cond_wait(&reader->cond, &reader->lock);
+    int quit = reader->quit;
+    pthread_mutex_unlock(&reader->lock);
+
+    if (quit)
+        return FALSE;
+
+    batch = &reader->batches[reader->head % MOLOCH_READER_BATCHES];
+    batch->block   = NULL;
+    batch->len     = 0;
+    batch->packets = 0;
+    return TRUE;
+}
+/******************************************************************************/
+/* Called by a reader's read function, on its thread, for every packet */
+void moloch_reader_packet(MolochReader_t *reader, const struct pcap_pkthdr *h, const u_char *data, uint64_t pos)
+{
+    MolochReaderBatch_t *batch = &reader->batches[reader->head % MOLOCH_READER_BATCHES];
+    uint32_t             caplen = MIN(h->caplen, MOLOCH_READER_BATCH_SIZE - sizeof(MolochReaderPacket_t));
+    uint32_t             size = MOLOCH_READER_PACKET_SIZE(caplen);
+
+    if (batch->len + size > MOLOCH_READER_BATCH_SIZE) {
+        if (!moloch_reader_flush(reader))
+            return;
+        batch = &reader->batches[reader->head % MOLOCH_READER_BATCHES];
+    }
+
+    MolochReaderPacket_t *packet = (MolochReaderPacket_t *)(batch->buf + batch->len);
+    packet->hdr        = *h;
+    packet->hdr.caplen = caplen;
+    packet->pos        = pos;
+    memcpy(packet + 1, data, caplen);
+
+    batch->len += size;
+    batch->packets++;
+}
+/******************************************************************************/
+/* Called by a reader's read function, on its thread, to hand over memory the
+ * packets already sit in.  At most MOLOCH_READER_BATCHES blocks are out at
+ * once.  Returns FALSE if the reader is being stopped.
+ */
+int moloch_reader_block(MolochReader_t *reader, void *block)
+{
+    /* Packets copied before it go first */
+    if (!moloch_reader_flush(reader))
+        return FALSE;
+
+    reader->batches[reader->head % MOLOCH_READER_BATCHES].block = block;
+    return moloch_reader_flush(reader);
+}
+/******************************************************************************/
+static void *moloch_reader_thread(gpointer rv)
+{
+    MolochReader_t *reader = rv;
+    int             status = 1;
+
+    while (!__atomic_load_n(&reader->quit, __ATOMIC_ACQUIRE)) {
+        status = reader->read(reader, reader->uw);
+        if (status <= 0)
+            break;
+
+        /* Interfaces don't hold packets back waiting for a batch to fill */
+        if (reader->live && !moloch_reader_flush(reader))
+            break;
+    }
+
+    /* The last batch tells the main thread this reader is finished */
+    if (status <= 0 && !__atomic_load_n(&reader->quit, __ATOMIC_ACQUIRE)) {
+        MolochReaderBatch_t *batch = &reader->batches[reader->head % MOLOCH_READER_BATCHES];
+        batch->last   = 1;
+        batch->status = status;
+        moloch_reader_flush(reader);
+    }
+
+    return NULL;
+}
+/******************************************************************************/
+static void moloch_reader_free(MolochReader_t *reader)
+{
+    int i;
+
+    g_thread_join(reader->thread);
+
+    if (reader->watch)
+        g_source_remove(reader->watch);
+    if (reader->retry)
+        g_source_remove(reader->retry);
+    close(reader->efd);
+
+    for (i = 0; i < MOLOCH_READER_BATCHES; i++) {
+        free(reader->batches[i].buf);
+    }
+    pthread_mutex_destroy(&reader->lock);
+    pthread_cond_destroy(&reader->cond);
+    MOLOCH_TYPE_FREE(MolochReader_t, reader);
+}
+/******************************************************************************/
+/* Run the batches the reader has handed over through the packet path.  When
+ * the reader's last batch is reached it is freed and done is called.
+ */
+static int moloch_reader_process(MolochReader_t *reader)
+{
+    int n;
+
+    for (n = 0; n < MOLOCH_READER_BATCHES; n++) {
+        if (reader->tail == __atomic_load_n(&reader->head, __ATOMIC_ACQUIRE))
+            return MOLOCH_READER_EMPTY;
+
+        if (readerProcessing || (reader->busy && reader->busy(reader->num)))
+            return MOLOCH_READER_WAIT;
+
+        MolochReaderBatch_t *batch = &reader->batches[reader->tail % MOLOCH_READER_BATCHES];
+        uint32_t             off = 0;
+        uint32_t             p;
+
+        readerProcessing = 1;
+        if (batch->block) {
+            reader->block(reader->num, batch->block, reader->packet);
+        } else {
+            for (p = 0; p < batch->packets; p++) {
+                MolochReaderPacket_t *packet = (MolochReaderPacket_t *)(batch->buf + off);
+                reader->packet(reader->num, &packet->hdr, (u_char *)(packet + 1), packet->pos);
+                off += MOLOCH_READER_PACKET_SIZE(packet->hdr.caplen);
+            }
+        }
+        readerProcessing = 0;
+
+        if (batch->last) {
+            int num    = reader->num;
+            int status = batch->status;
+            MolochReaderDone done = reader->done;
+
+            moloch_reader_free(reader);
+            done(num, status);
+            return MOLOCH_READER_EMPTY;
+        }
+
+        pthread_mutex_lock(&reader->lock);
+        reader->tail++;
+        pthread_cond_signal(&reader->cond);
+        pthread_mutex_unlock(&reader->lock);
+    }
+
+    return MOLOCH_READER_MORE;
+}
+/******************************************************************************/
+static gboolean moloch_reader_retry_gfunc(gpointer rv);
+
+static void moloch_reader_schedule(MolochReader_t *reader, int rc)
+{
+    if (rc == MOLOCH_READER_EMPTY || reader->retry)
+        return;
+
+    reader->retry = g_timeout_add((rc == MOLOCH_READER_MORE)?0:10, moloch_reader_retry_gfunc, reader);
+}
+/******************************************************************************/
+/* Batches were left over, the main loop got a turn before doing more */
+static gboolean moloch_reader_retry_gfunc(gpointer rv)
+{
+    MolochReader_t *reader = rv;
+
+    reader->retry = 0;
+    int rc = moloch_reader_process(reader);
+    if (rc != MOLOCH_READER_EMPTY)
+        moloch_reader_schedule(reader, rc);
+    return FALSE;
+}
+/******************************************************************************/
+static gboolean moloch_reader_cb(gint fd, GIOCondition UNUSED(cond), gpointer rv)
+{
+    MolochReader_t *reader = rv;
+    uint64_t        count;
+
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        LOG("ERROR - Reader %d eventfd read failed %d: %s", reader->num, errno, strerror(errno));
+
+    /* If the reader was processing the retry is already scheduled */
+    if (reader->retry)
+        return TRUE;
+
+    int rc = moloch_reader_process(reader);
+    if (rc != MOLOCH_READER_EMPTY)
+        moloch_reader_schedule(reader, rc);
+    return TRUE;
+}
+/******************************************************************************/
+/* Start a thread that calls read until it returns 0 (end of input) or -1
+ * (error).  Every packet read is handed to packet on the main thread, and
+ * every block to block, which can be NULL if the reader only copies.  busy
+ * is checked before each batch and can hold it back, and done is called on
+ * the main thread once everything read has been processed.  Live readers
+ * hand over what they have after every read.
+ */
+MolochReader_t *moloch_reader_start(const char *name, int num, int live, MolochReaderRead read, MolochReaderPacket packet, MolochReaderBlock block, MolochReaderBusy busy, MolochReaderDone done, void *uw)
+{
+    MolochReader_t *reader = MOLOCH_TYPE_ALLOC0(MolochReader_t);
+    int             i;
+
+    for (i = 0; i < MOLOCH_READER_BATCHES; i++) {
+        reader->batches[i].buf = malloc(MOLOCH_READER_BATCH_SIZE);
+    }
+
+    reader->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reader->efd < 0) {
+        LOG("ERROR - Couldn't create reader eventfd %d: %s", errno, strerror(errno));
+        exit(1);
+    }
+
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->cond, NULL);
+    reader->num    = num;
+    reader->live   = live;
+    reader->read   = read;
+    reader->packet = packet;
+    reader->block  = block;
+    reader->busy   = busy;
+    reader->done   = done;
+    reader->uw     = uw;
+    reader->watch  = moloch_watch_fd(reader->efd, MOLOCH_GIO_READ_COND, moloch_reader_cb, reader);
+    reader->thread = g_thread_new(name, moloch_reader_thread, reader);
+
+    return reader;
+}
+/******************************************************************************/
+/* Stop a reader early, anything it read that hasn't been processed is dropped
+ * and blocks it handed over aren't given back */
+void moloch_reader_stop(MolochReader_t *reader)
+{
+    pthread_mutex_lock(&reader->lock);
+    __atomic_store_n(&reader->quit, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&reader->cond);
+    pthread_mutex_unlock(&reader->lock);
+
+    moloch_reader_free(reader);
+}
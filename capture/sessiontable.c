@@ -0,0 +1,305 @@
+/******************************************************************************/
+/* sessiontable.c  -- Self resizing session hash table
+ *
+ * Open addressing over buckets of MOLOCH_SESSION_TABLE_SLOTS slots.  Each
+ * bucket keeps the 32 bit session hashes next to the session pointers so a
+ * lookup only touches a session when its full hash matches.  Buckets are
+ * probed linearly, a bucket with an empty slot ends the probe.
+ *
+ * Growing and shrinking is incremental, a new bucket array is allocated and
+ * every find/add/remove moves a few buckets from the old array until it is
+ * empty, so packet processing never pauses for a full rehash.
+ *
+ * Copyright 2012-2015 AOL Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "moloch.h"
+
+/* Slot that held a session which has since been removed, probes continue past it */
+#define MOLOCH_SESSION_TABLE_DELETED ((MolochSession_t *)1)
+
+/* Number of old buckets moved to the new array per table operation */
+#define MOLOCH_SESSION_TABLE_STEP    4
+
+/******************************************************************************/
+static void moloch_session_table_alloc(MolochSessionBuckets_t *array, uint32_t num)
+{
+    array->buckets = g_malloc0((size_t)num * sizeof(MolochSessionBucket_t));
+    array->mask    = num - 1;
+    array->count   = 0;
+    array->deleted = 0;
+}
+/******************************************************************************/
+/* Smallest power of 2 number of buckets that keeps count entries at half load */
+static uint32_t moloch_session_table_size(MolochSessionTable_t *table, uint32_t count)
+{
+    uint32_t num = table->minBuckets;
+
+    while ((uint64_t)num * MOLOCH_SESSION_TABLE_SLOTS < (uint64_t)count * 2)
+        num <<= 1;
+
+    return num;
+}
+/******************************************************************************/
+static void moloch_session_table_insert(MolochSessionTable_t *table, MolochSessionBuckets_t *array, uint32_t hash, MolochSession_t *session)
+{
+    uint32_t b = hash & array->mask;
+    uint32_t probes = 1;
+    int      s;
+
+    while (1) {
+        MolochSessionBucket_t *bucket = &array->buckets[b];
+        for (s = 0; s < MOLOCH_SESSION_TABLE_SLOTS; s++) {
+            if (bucket->session[s] == NULL || bucket->session[s] == MOLOCH_SESSION_TABLE_DELETED) {
+                if (bucket->session[s] == MOLOCH_SESSION_TABLE_DELETED)
+                    array->deleted--;
+                bucket->hash[s]    = hash;
+                bucket->session[s] = session;
+                array->count++;
+                if (probes > table->maxProbe)
+                    table->maxProbe = probes;
+                return;
+            }
+        }
+        b = (b + 1) & array->mask;
+        probes++;
+    }
+}
+/******************************************************************************/
+static MolochSession_t *moloch_session_table_lookup(MolochSessionTable_t *table, MolochSessionBuckets_t *array, uint32_t hash, const void *key)
+{
+    uint32_t b = hash & array->mask;
+    uint32_t probes = 1;
+    int      s;
+
+    while (1) {
+        MolochSessionBucket_t *bucket = &array->buckets[b];
+        int                    empty = 0;
+
+        for (s = 0; s < MOLOCH_SESSION_TABLE_SLOTS; s++) {
+            if (bucket->session[s] == NULL) {
+                empty = 1;
+            } else if (bucket->hash[s] == hash &&
+                       bucket->session[s] != MOLOCH_SESSION_TABLE_DELETED &&
+                       moloch_session_cmp(key, bucket->session[s])) {
+                table->probes += probes;
+                return bucket->session[s];
+            }
+        }
+
+        if (empty || probes > array->mask) {
+            table->probes += probes;
+            return NULL;
+        }
+
+        b = (b + 1) & array->mask;
+        probes++;
+    }
+}
+/******************************************************************************/
+static int moloch_session_table_delete(MolochSessionBuckets_t *array, MolochSession_t *session)
+{
+    uint32_t b = session->h_hash & array->mask;
+    uint32_t probes = 1;
+    int      s;
+
+    while (1) {
+        MolochSessionBucket_t *bucket = &array->buckets[b];
+        int                    empty = 0;
+        int                    found = -1;
+
+        for (s = 0; s < MOLOCH_SESSION_TABLE_SLOTS; s++) {
+            if (bucket->session[s] == NULL)
+                empty = 1;
+            else if (bucket->session[s] == session)
+                found = s;
+        }
+
+        if (found != -1) {
+            /* If the bucket was never full no probe went past it, so the slot can be reused as empty */
+            if (empty) {
+                bucket->session[found] = NULL;
+            } else {
+                bucket->session[found] = MOLOCH_SESSION_TABLE_DELETED;
+                array->deleted++;
+            }
+            array->count--;
+            return 1;
+        }
+
+        if (empty || probes > array->mask)
+            return 0;
+
+        b = (b + 1) & array->mask;
+        probes++;
+    }
+}
+/******************************************************************************/
+/* Move a few buckets from the old array to the current one.  Moved slots are
+ * marked deleted, not empty, so probes of sessions not moved yet still work.
+ */
+static void moloch_session_table_migrate(MolochSessionTable_t *table, uint32_t steps)
+{
+    MolochSessionBuckets_t *old = &table->old;
+    int                     s;
+
+    while (old->buckets && steps--) {
+        MolochSessionBucket_t *bucket = &old->buckets[table->rehashPos];
+
+        for (s = 0; s < MOLOCH_SESSION_TABLE_SLOTS; s++) {
+            if (bucket->session[s] && bucket->session[s] != MOLOCH_SESSION_TABLE_DELETED) {
+                moloch_session_table_insert(table, &table->cur, bucket->hash[s], bucket->session[s]);
+                bucket->session[s] = MOLOCH_SESSION_TABLE_DELETED;
+                old->count--;
+            }
+        }
+
+        table->rehashPos++;
+        if (table->rehashPos > old->mask) {
+            g_free(old->buckets);
+            memset(old, 0, sizeof(*old));
+            table->rehashPos = 0;
+        }
+    }
+}
+/******************************************************************************/
+static void moloch_session_table_resize(MolochSessionTable_t *table)
+{
+    /* Still moving the last resize, finish it first */
+    if (table->old.buckets)
+        moloch_session_table_migrate(table, table->old.mask + 1);
+
+    uint32_t num = moloch_session_table_size(table, table->cur.count);
+
+    table->old = table->cur;
+    table->rehashPos = 0;
+    table->resizes++;
+    moloch_session_table_alloc(&table->cur, num);
+}
+/******************************************************************************/
+void moloch_session_table_init(MolochSessionTable_t *table, uint32_t minBuckets)
+{
+    memset(table, 0, sizeof(*table));
+
+    table->minBuckets = 1;
+    while (table->minBuckets < minBuckets)
+        table->minBuckets <<= 1;
+
+    moloch_session_table_alloc(&table->cur, table->minBuckets);
+}
+/******************************************************************************/
+MolochSession_t *moloch_session_table_find(MolochSessionTable_t *table, uint32_t hash, const void *key)
+{
+    MolochSession_t *session;
+
+    table->lookups++;
+
+    if (table->old.buckets)
+        moloch_session_table_migrate(table, MOLOCH_SESSION_TABLE_STEP);
+
+    session = moloch_session_table_lookup(table, &table->cur, hash, key);
+    if (!session && table->old.buckets)
+        session = moloch_session_table_lookup(table, &table->old, hash, key);
+
+    return session;
+}
+/******************************************************************************/
+/* Caller must have already checked the session isn't in the table */
+void moloch_session_table_add(MolochSessionTable_t *table, uint32_t hash, MolochSession_t *session)
+{
+    const uint64_t slots = ((uint64_t)table->cur.mask + 1) * MOLOCH_SESSION_TABLE_SLOTS;
+
+    /* Grow, or just clean out deleted slots, once 3/4 of the slots are used */
+    if ((uint64_t)(table->cur.count + table->cur.deleted) * 4 >= slots * 3)
+        moloch_session_table_resize(table);
+
+    session->h_hash = hash;
+    moloch_session_table_insert(table, &table->cur, hash, session);
+
+    if (table->old.buckets)
+        moloch_session_table_migrate(table, MOLOCH_SESSION_TABLE_STEP);
+}
+/******************************************************************************/
+void moloch_session_table_remove(MolochSessionTable_t *table, MolochSession_t *session)
+{
+    if (!moloch_session_table_delete(&table->cur, session) &&
+        (!table->old.buckets || !moloch_session_table_delete(&table->old, session))) {
+        LOG("ERROR - session not in table %s", moloch_friendly_session_id(session->protocol, session->addr1, session->port1, session->addr2, session->port2));
+        return;
+    }
+
+    if (table->old.buckets) {
+        moloch_session_table_migrate(table, MOLOCH_SESSION_TABLE_STEP);
+        return;
+    }
+
+    /* Shrink once below 1/8 full */
+    const uint64_t slots = ((uint64_t)table->cur.mask + 1) * MOLOCH_SESSION_TABLE_SLOTS;
+    if (table->cur.mask + 1 > table->minBuckets && (uint64_t)table->cur.count * 8 < slots)
+        moloch_session_table_resize(table);
+}
+/******************************************************************************/
+uint32_t moloch_session_table_count(MolochSessionTable_t *table)
+{
+    return table->cur.count + table->old.count;
+}
+/******************************************************************************/
+/* Remove every session from the table calling func on each */
+void moloch_session_table_pop_all(MolochSessionTable_t *table, MolochSessionTableFunc func)
+{
+    MolochSessionBuckets_t *arrays[2] = {&table->old, &table->cur};
+    uint32_t                a, b;
+    int                     s;
+
+    for (a = 0; a < 2; a++) {
+        if (!arrays[a]->buckets)
+            continue;
+
+        for (b = 0; b <= arrays[a]->mask; b++) {
+            MolochSessionBucket_t *bucket = &arrays[a]->buckets[b];
+            for (s = 0; s < MOLOCH_SESSION_TABLE_SLOTS; s++) {
+                MolochSession_t *session = bucket->session[s];
+                if (!session || session == MOLOCH_SESSION_TABLE_DELETED)
+                    continue;
+                bucket->session[s] = MOLOCH_SESSION_TABLE_DELETED;
+                arrays[a]->count--;
+                func(session);
+            }
+        }
+    }
+
+    g_free(table->old.buckets);
+    memset(&table->old, 0, sizeof(table->old));
+    g_free(table->cur.buckets);
+    moloch_session_table_alloc(&table->cur, table->minBuckets);
+    table->rehashPos = 0;
+}
+/******************************************************************************/
+/* Add this table's numbers to stats, so several tables can be summed */
+void moloch_session_table_stats(MolochSessionTable_t *table, MolochSessionTableStats_t *stats)
+{
+    stats->count   += moloch_session_table_count(table);
+    stats->slots   += ((uint64_t)table->cur.mask + 1) * MOLOCH_SESSION_TABLE_SLOTS;
+    stats->deleted += table->cur.deleted;
+    stats->lookups += table->lookups;
+    stats->probes  += table->probes;
+    stats->resizes += table->resizes;
+    if (table->old.buckets)
+        stats->rehashing++;
+    if (table->maxProbe > stats->maxProbe)
+        stats->maxProbe = table->maxProbe;
+}
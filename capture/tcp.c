@@ -0,0 +1,237 @@
+/******************************************************************************/
+/* tcp.c  -- TCP stream reassembly
+ *
+ * Each direction of a session tracks the next sequence number it expects.
+ * In order data is handed to the parsers straight out of the packet, only
+ * segments that arrive ahead of a gap are copied and queued until the gap
+ * is filled.  The queue is bounded by maxTcpOutOfOrderPackets and
+ * maxTcpOutOfOrderBytes, once either is hit the gap is given up on and the
+ * queued data is delivered.
+ *
+ * Copyright 2012-2015 AOL Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#define __FAVOR_BSD
+#include <netinet/tcp.h>
+#include "moloch.h"
+
+extern MolochConfig_t        config;
+extern uint32_t              pluginsCbs;
+
+/******************************************************************************/
+typedef struct moloch_tcp_data {
+    struct moloch_tcp_data *td_next, *td_prev;
+    uint32_t                seq;
+    uint32_t                len;
+    unsigned char           data[];
+} MolochTcpData_t;
+
+typedef struct {
+    struct moloch_tcp_data *td_next, *td_prev;
+    int                     td_count;
+    uint32_t                td_bytes;
+} MolochTcpDataHead_t;
+
+struct moloch_tcp_queue {
+    MolochTcpDataHead_t     data[2];
+};
+
+/******************************************************************************/
+static void moloch_tcp_deliver(MolochSession_t *session, const unsigned char *data, int len, int which)
+{
+    int first = 0;
+
+    if (session->firstBytesLen[which] == 0) {
+        first = 1;
+        moloch_parsers_classify_tcp(session, data, len, which);
+        session->firstBytesLen[which] = MIN(8, len);
+        memcpy(session->firstBytes[which], data, session->firstBytesLen[which]);
+    }
+
+    int i;
+    int totConsumed = 0;
+    int consumed = 0;
+
+    for (i = 0; i < session->parserNum; i++) {
+        if (session->parserInfo[i].parserFunc) {
+            consumed = session->parserInfo[i].parserFunc(session, session->parserInfo[i].uw, data + totConsumed, len - totConsumed, which);
+            if (consumed) {
+                totConsumed += consumed;
+            }
+
+            if (consumed >= len)
+                break;
+        }
+    }
+
+    if (config.yara)
+        moloch_yara_execute(session, (unsigned char *)data, len, first);
+
+    session->databytes[which] += len;
+
+    if (pluginsCbs & MOLOCH_PLUGIN_TCP)
+        moloch_plugins_cb_tcp(session, data, len, which);
+}
+/******************************************************************************/
+/* Deliver everything at the head of the queue that is now in order */
+static void moloch_tcp_drain(MolochSession_t *session, int which)
+{
+    MolochTcpDataHead_t *head = &session->tcpQueue->data[which];
+    MolochTcpData_t     *td;
+
+    while ((td = DLL_PEEK_HEAD(td_, head))) {
+        int32_t diff = (int32_t)(td->seq - session->tcpSeq[which]);
+        if (diff > 0)
+            break;
+
+        DLL_REMOVE(td_, head, td);
+        head->td_bytes -= td->len;
+
+        /* Only the part past what we already delivered is new */
+        if ((int64_t)td->len + diff > 0) {
+            moloch_tcp_deliver(session, td->data - diff, td->len + diff, which);
+            session->tcpSeq[which] += td->len + diff;
+        }
+        MOLOCH_SIZE_FREE(tcpData, td);
+    }
+}
+/******************************************************************************/
+static void moloch_tcp_queue(MolochSession_t *session, const unsigned char *data, uint32_t len, uint32_t seq, int which)
+{
+    if (!session->tcpQueue) {
+        session->tcpQueue = MOLOCH_TYPE_ALLOC(struct moloch_tcp_queue);
+        DLL_INIT(td_, &session->tcpQueue->data[0]);
+        DLL_INIT(td_, &session->tcpQueue->data[1]);
+        session->tcpQueue->data[0].td_bytes = 0;
+        session->tcpQueue->data[1].td_bytes = 0;
+    }
+
+    MolochTcpDataHead_t *head = &session->tcpQueue->data[which];
+    MolochTcpData_t     *td;
+
+    /* Out of order segments usually land near the end, so search backwards */
+    for (td = head->td_prev; td != (void *)head; td = td->td_prev) {
+        int32_t diff = (int32_t)(seq - td->seq);
+        if (diff == 0 && td->len >= len)
+            return; /* Retransmission of something already queued */
+        if (diff >= 0)
+            break;
+    }
+
+    MolochTcpData_t *ntd = MOLOCH_SIZE_ALLOC(tcpData, sizeof(MolochTcpData_t) + len);
+    ntd->seq = seq;
+    ntd->len = len;
+    memcpy(ntd->data, data, len);
+    DLL_ADD_AFTER(td_, head, td, ntd);
+    head->td_bytes += len;
+
+    /* Too much waiting on gaps that probably aren't going to be filled, skip
+     * them until the queue is back under both limits */
+    while (DLL_COUNT(td_, head) > (int)config.maxTcpOutOfOrderPackets ||
+           head->td_bytes > config.maxTcpOutOfOrderBytes) {
+        session->tcpSeq[which] = DLL_PEEK_HEAD(td_, head)->seq;
+        moloch_tcp_drain(session, which);
+    }
+}
+/******************************************************************************/
+static void moloch_tcp_data(MolochSession_t *session, const unsigned char *data, uint32_t len, uint32_t seq, int which)
+{
+    /* Picked up the session mid stream, start with the first data we see */
+    if ((session->haveTcpSeq & (1 << which)) == 0) {
+        session->tcpSeq[which] = seq;
+        session->haveTcpSeq |= (1 << which);
+    }
+
+    int32_t diff = (int32_t)(seq - session->tcpSeq[which]);
+
+    if (diff > 0) {
+        moloch_tcp_queue(session, data, len, seq, which);
+        return;
+    }
+
+    if (diff < 0) {
+        /* Retransmission, only deliver the part we haven't seen */
+        if ((int64_t)len + diff <= 0)
+            return;
+        data -= diff;
+        len  += diff;
+    }
+
+    moloch_tcp_deliver(session, data, len, which);
+    session->tcpSeq[which] += len;
+
+    if (session->tcpQueue && DLL_COUNT(td_, &session->tcpQueue->data[which]) > 0)
+        moloch_tcp_drain(session, which);
+}
+/******************************************************************************/
+/* Process one tcp packet for a session, len is the length of the tcp header
+ * plus payload.  Returns TRUE when the connection has been closed and the
+ * session should be saved.
+ */
+gboolean moloch_tcp_packet(MolochSession_t *session, struct tcphdr *tcphdr, int len, int which)
+{
+    int hl = 4 * tcphdr->th_off;
+
+    if (hl < (int)sizeof(struct tcphdr) || hl > len)
+        return FALSE;
+
+    if (tcphdr->th_flags & TH_RST)
+        return TRUE;
+
+    uint32_t seq = ntohl(tcphdr->th_seq);
+
+    if (tcphdr->th_flags & TH_SYN) {
+        seq++;
+        session->tcpSeq[which] = seq;
+        session->haveTcpSeq |= (1 << which);
+    }
+
+    len -= hl;
+    if (len > 0 && !session->stopSPI) {
+        moloch_tcp_data(session, (unsigned char *)tcphdr + hl, len, seq, which);
+    }
+
+    if (tcphdr->th_flags & TH_FIN) {
+        session->tcpFin |= (1 << which);
+        return FALSE;
+    }
+
+    /* Both sides have sent a FIN and this is the final ack */
+    if (session->tcpFin == 3 && len == 0 && (tcphdr->th_flags & TH_ACK))
+        return TRUE;
+
+    return FALSE;
+}
+/******************************************************************************/
+void moloch_tcp_free(MolochSession_t *session)
+{
+    MolochTcpData_t *td;
+    int              which;
+
+    if (!session->tcpQueue)
+        return;
+
+    for (which = 0; which < 2; which++) {
+        while (DLL_POP_HEAD(td_, &session->tcpQueue->data[which], td)) {
+            MOLOCH_SIZE_FREE(tcpData, td);
+        }
+    }
+    MOLOCH_TYPE_FREE(struct moloch_tcp_queue, session->tcpQueue);
+    session->tcpQueue = 0;
+}
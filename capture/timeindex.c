@@ -0,0 +1,211 @@
+/******************************************************************************/
+/* timeindex.c  -- Per pcap file time index
+ *
+ * Writers note the time and position of a packet every pcapTimeIndexPackets
+ * packets or pcapTimeIndexMs of packet time, whichever comes first, and
+ * always the first packet of a file.  When the file is closed the entries
+ * are saved next to it as <file>.tidx, so pulling a time range out of the
+ * pcap only needs a seek instead of a session search.
+ *
+ * Layout, little endian:
+ *   magic, version, number of entries, 0     4 x uint32
+ *   seconds, microseconds, position          2 x uint32, uint64 per entry
+ *
+ * Positions are what the writer hands back for filePos, so they can be fed
+ * straight to the same packet reading code.
+ *
+ * Saving is done on the moloch-tidx thread so the capture thread never waits
+ * on the disk when a file is closed.
+ *
+ * Copyright 2012-2015 AOL Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "moloch.h"
+
+extern MolochConfig_t        config;
+
+#define MOLOCH_TIME_INDEX_MAGIC   0x7874706d   /* "mptx" */
+#define MOLOCH_TIME_INDEX_VERSION 1
+
+typedef struct {
+    uint32_t   sec;
+    uint32_t   usec;
+    uint64_t   pos;
+} MolochTimeIndexEntry_t;
+
+struct moloch_time_index {
+    MolochTimeIndexEntry_t *entries;
+    uint32_t                num;
+    uint32_t                max;
+    uint32_t                packets;
+    uint64_t                lastMs;
+    char                   *name;
+    MolochTimeIndex_t      *next;
+};
+
+static MolochTimeIndex_t    *saveHead;
+static MolochTimeIndex_t    *saveTail;
+static int                   saving;
+static GThread              *saveThread;
+static pthread_mutex_t       saveLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t        saveCond = PTHREAD_COND_INITIALIZER;
+
+/******************************************************************************/
+/* Returns NULL when time indexes are turned off, the other calls accept it */
+MolochTimeIndex_t *moloch_time_index_alloc()
+{
+    if (config.pcapTimeIndexPackets == 0)
+        return NULL;
+
+    return MOLOCH_TYPE_ALLOC0(MolochTimeIndex_t);
+}
+/******************************************************************************/
+void moloch_time_index_add(MolochTimeIndex_t *ti, const struct timeval *ts, uint64_t pos)
+{
+    if (!ti)
+        return;
+
+    uint64_t ms = (uint64_t)ts->tv_sec * 1000 + ts->tv_usec / 1000;
+
+    if (ti->num > 0 &&
+        ++ti->packets < config.pcapTimeIndexPackets &&
+        ms < ti->lastMs + config.pcapTimeIndexMs) {
+        return;
+    }
+
+    if (ti->num == ti->max) {
+        ti->max = MAX(256, ti->max * 2);
+        ti->entries = realloc(ti->entries, ti->max * sizeof(MolochTimeIndexEntry_t));
+    }
+
+    ti->entries[ti->num].sec  = ts->tv_sec;
+    ti->entries[ti->num].usec = ts->tv_usec;
+    ti->entries[ti->num].pos  = pos;
+    ti->num++;
+    ti->packets = 0;
+    ti->lastMs  = ms;
+}
+/******************************************************************************/
+/* Returns a buffer from moloch_http_get_buffer with the whole .tidx file */
+char *moloch_time_index_encode(MolochTimeIndex_t *ti, int *len)
+{
+    uint32_t hdr[4] = {MOLOCH_TIME_INDEX_MAGIC, MOLOCH_TIME_INDEX_VERSION, ti->num, 0};
+    char    *buf;
+
+    *len = sizeof(hdr) + ti->num * sizeof(MolochTimeIndexEntry_t);
+    buf = moloch_http_get_buffer(*len);
+    memcpy(buf, hdr, sizeof(hdr));
+    if (ti->num)
+        memcpy(buf + sizeof(hdr), ti->entries, ti->num * sizeof(MolochTimeIndexEntry_t));
+    return buf;
+}
+/******************************************************************************/
+void moloch_time_index_free(MolochTimeIndex_t *ti)
+{
+    if (!ti)
+        return;
+
+    g_free(ti->name);
+    free(ti->entries);
+    MOLOCH_TYPE_FREE(MolochTimeIndex_t, ti);
+}
+/******************************************************************************/
+/* Runs on the moloch-tidx thread, the http buffers aren't used here since
+ * they belong to the main thread */
+static void moloch_time_index_write(MolochTimeIndex_t *ti)
+{
+    uint32_t hdr[4] = {MOLOCH_TIME_INDEX_MAGIC, MOLOCH_TIME_INDEX_VERSION, ti->num, 0};
+    char     name[1100];
+
+    snprintf(name, sizeof(name), "%s.tidx", ti->name);
+    FILE *fp = fopen(name, "w");
+    if (!fp) {
+        LOG("ERROR - Couldn't open time index '%s' with %s", name, strerror(errno));
+        return;
+    }
+
+    if (fwrite(hdr, sizeof(hdr), 1, fp) != 1 ||
+        fwrite(ti->entries, sizeof(MolochTimeIndexEntry_t), ti->num, fp) != ti->num) {
+        LOG("ERROR - Couldn't write time index '%s' with %s", name, strerror(errno));
+    }
+    if (fclose(fp) != 0)
+        LOG("ERROR - Couldn't close time index '%s' with %s", name, strerror(errno));
+}
+/******************************************************************************/
+static void *moloch_time_index_thread(void *UNUSED(arg))
+{
+    while (1) {
+        pthread_mutex_lock(&saveLock);
+        while (!saveHead)
+            pthread_cond_wait(&saveCond, &saveLock);
+        MolochTimeIndex_t *ti = saveHead;
+        saveHead = ti->next;
+        if (!saveHead)
+            saveTail = NULL;
+        saving = 1;
+        pthread_mutex_unlock(&saveLock);
+
+        moloch_time_index_write(ti);
+        moloch_time_index_free(ti);
+
+        pthread_mutex_lock(&saveLock);
+        saving = 0;
+        pthread_cond_broadcast(&saveCond);
+        pthread_mutex_unlock(&saveLock);
+    }
+    return NULL;
+}
+/******************************************************************************/
+/* Queues ti to be written next to pcapName and freed, the caller must not
+ * use ti after this */
+void moloch_time_index_save(MolochTimeIndex_t *ti, const char *pcapName)
+{
+    if (!ti)
+        return;
+
+    if (!pcapName || ti->num == 0) {
+        moloch_time_index_free(ti);
+        return;
+    }
+
+    if (!saveThread)
+        saveThread = g_thread_new("moloch-tidx", &moloch_time_index_thread, NULL);
+
+    ti->name = g_strdup(pcapName);
+    ti->next = NULL;
+
+    pthread_mutex_lock(&saveLock);
+    if (saveTail)
+        saveTail->next = ti;
+    else
+        saveHead = ti;
+    saveTail = ti;
+    pthread_cond_broadcast(&saveCond);
+    pthread_mutex_unlock(&saveLock);
+}
+/******************************************************************************/
+/* Wait for every queued time index to be written */
+void moloch_time_index_exit()
+{
+    pthread_mutex_lock(&saveLock);
+    while (saveHead || saving)
+        pthread_cond_wait(&saveCond, &saveLock);
+    pthread_mutex_unlock(&saveLock);
+}
@@ -26,108 +26,307 @@
 #include <pthread.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
 #include "moloch.h"
+#include "zlib.h"
 #include <gio/gio.h>
 
+#ifdef __NR_io_uring_setup
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#define MOLOCH_HAVE_URING 1
+#endif
+
 #ifndef O_NOATIME
 #define O_NOATIME 0
 #endif
 
 extern MolochConfig_t        config;
+extern struct pcap_file_header pcapFileHeader;
 
 
 typedef struct moloch_output {
     struct moloch_output *mo_next, *mo_prev;
     uint16_t   mo_count;
+    struct moloch_output *mc_next, *mc_prev;
+    uint16_t   mc_count;
 
     char      *name;
     char      *buf;
     uint64_t   max;
     uint64_t   pos;
     char       close;
+
+    /* uring only */
+    char       submitted;
+    int        file;
+    uint32_t   wlen;
+    uint64_t   offset;
+    struct iovec iov;
+
+    /* mmap only */
+    int        fd;
+    uint64_t   filelen;
+
+    /* pcapCompression only */
+    void      *stripe;
+    char      *cbuf;
+    uint32_t   clen;
+    char       compressed;
 } MolochDiskOutput_t;
 
+/* Everything needed to write one pcap file at a time.  Normally there is a
+ * single stripe, with pcapDirStripe each pcapDir gets its own stripe with
+ * its own writer thread and buffers, and packets are spread over them by
+ * session hash.
+ */
+typedef struct {
+    MolochDiskOutput_t      *output;
+
+    MolochDiskOutput_t       outputQ;
+    pthread_mutex_t          outputQMutex;
+    pthread_cond_t           outputQCond;
+
+    MolochIntHead_t          freeOutputBufs;
+    pthread_mutex_t          freeOutputMutex;
 
-static MolochDiskOutput_t   *output;
+    /* With pcapWriteBufferPool the buffers come from one prefaulted mapping.
+     * Free ones go around a ring that only the capture thread takes from and
+     * only the freeing thread puts on, so neither side locks.
+     */
+    char                    *poolBufs;
+    char                   **poolRing;
+    uint64_t                 poolStride;
+    uint32_t                 poolNum;
+    uint32_t                 poolMask;
+    uint32_t                 poolHead;
+    uint32_t                 poolTail;
+    uint32_t                 poolHighWater;
+    uint64_t                 poolExhausted;
 
-static MolochDiskOutput_t    outputQ;
-static pthread_mutex_t       outputQMutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t        outputQCond = PTHREAD_COND_INITIALIZER;
+    uint32_t                 outputId;
+    char                    *outputFileName;
+    uint64_t                 outputFilePos;
+    struct timeval           outputFileTime;
+    int                      dirPos;
+    uint32_t                 blockNum;
+    MolochTimeIndex_t       *timeIndex;
+    time_t                   lastPacket;
 
-static MolochIntHead_t       freeOutputBufs;
-static pthread_mutex_t       freeOutputMutex = PTHREAD_MUTEX_INITIALIZER;
+    /* mmap only */
+    int                      fd;
+    uint64_t                 fileSize;
+    char                    *window;
+    uint64_t                 windowStart;
+} MolochDiskStripe_t;
 
-static uint32_t              outputId;
-static char                 *outputFileName;
-static uint64_t              outputFilePos = 0;
-static struct timeval        outputFileTime;
+#define MOLOCH_MAX_WRITE_STRIPES 32
+
+static MolochDiskStripe_t    stripes[MOLOCH_MAX_WRITE_STRIPES];
+static int                   stripesNum = 1;
 
 #define MOLOCH_WRITE_NORMAL 0x00
 #define MOLOCH_WRITE_DIRECT 0x01 
 #define MOLOCH_WRITE_MMAP   0x02
 #define MOLOCH_WRITE_THREAD 0x04
+#define MOLOCH_WRITE_URING  0x08
 
 static int                   writeMethod;
 static int                   pageSize;
 
+/* Full blocks waiting for a compression thread, from every stripe */
+static int                   compressBlocks;
+static MolochDiskOutput_t    compressQ;
+static pthread_mutex_t       compressQMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t        compressQCond = PTHREAD_COND_INITIALIZER;
+
+#ifdef MOLOCH_HAVE_URING
+/* Files that still have writes in flight, the one being filled plus any
+ * that are waiting on their last writes before being closed.
+ */
+#define MOLOCH_URING_FILES  64
+
+typedef struct {
+    int                      fd;
+    uint32_t                 inflight;
+    uint64_t                 offset;
+    uint64_t                 filelen;
+    char                    *name;
+    char                     closing;
+} MolochDiskUringFile_t;
+
+static MolochDiskUringFile_t uringFiles[MOLOCH_URING_FILES];
+static int                   uringCurrent = -1;
+static int                   uringFd;
+static int                   uringEventFd;
+static unsigned             *uringSqTail, *uringSqMask, *uringSqArray;
+static unsigned             *uringCqHead, *uringCqTail, *uringCqMask;
+static struct io_uring_sqe  *uringSqes;
+static struct io_uring_cqe  *uringCqes;
+static uint32_t              uringInflight;
+static int                   uringFixedFiles;
+static int                   uringRegistered;
+#endif
+
 /******************************************************************************/
 uint32_t writer_disk_queue_length_thread()
 {
-    pthread_mutex_lock(&outputQMutex);
-    int count = DLL_COUNT(mo_, &outputQ);
-    pthread_mutex_unlock(&outputQMutex);
+    int count = 0;
+    int s;
+
+    for (s = 0; s < stripesNum; s++) {
+        pthread_mutex_lock(&stripes[s].outputQMutex);
+        count += DLL_COUNT(mo_, &stripes[s].outputQ);
+        pthread_mutex_unlock(&stripes[s].outputQMutex);
+    }
     return count;
 }
 /******************************************************************************/
 uint32_t writer_disk_queue_length_nothread()
 {
-    return DLL_COUNT(mo_, &outputQ);
+    return DLL_COUNT(mo_, &stripes[0].outputQ);
 }
 /******************************************************************************/
-void writer_disk_alloc_buf(MolochDiskOutput_t *out)
+static inline int writer_disk_pool_owns(MolochDiskStripe_t *stripe, const char *buf)
 {
+    return stripe->poolBufs && buf >= stripe->poolBufs && buf < stripe->poolBufs + stripe->poolNum * stripe->poolStride;
+}
+/******************************************************************************/
+void writer_disk_alloc_buf(MolochDiskStripe_t *stripe, MolochDiskOutput_t *out)
+{
+    if (stripe->poolBufs) {
+        uint32_t head = stripe->poolHead;
+        uint32_t tail = __atomic_load_n(&stripe->poolTail, __ATOMIC_ACQUIRE);
+
+        if (head == tail) {
+            /* Writer is that far behind, a temporary buffer keeps capture going */
+            stripe->poolExhausted++;
+            out->buf = mmap (0, config.pcapWriteSize + 8192, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE, -1, 0);
+            return;
+        }
+
+        out->buf = stripe->poolRing[head & stripe->poolMask];
+        __atomic_store_n(&stripe->poolHead, head + 1, __ATOMIC_RELEASE);
+
+        uint32_t inUse = stripe->poolNum - (tail - head - 1);
+        if (inUse > stripe->poolHighWater)
+            stripe->poolHighWater = inUse;
+        return;
+    }
+
     if (writeMethod & MOLOCH_WRITE_THREAD)
-        pthread_mutex_lock(&freeOutputMutex);
+        pthread_mutex_lock(&stripe->freeOutputMutex);
 
-    if (freeOutputBufs.i_count > 0) {
+    if (stripe->freeOutputBufs.i_count > 0) {
         MolochInt_t *tmp;
-        DLL_POP_HEAD(i_, &freeOutputBufs, tmp);
+        DLL_POP_HEAD(i_, &stripe->freeOutputBufs, tmp);
         out->buf = (void*)tmp;
     } else {
         out->buf = mmap (0, config.pcapWriteSize + 8192, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE, -1, 0);
     }
 
     if (writeMethod & MOLOCH_WRITE_THREAD)
-        pthread_mutex_unlock(&freeOutputMutex);
+        pthread_mutex_unlock(&stripe->freeOutputMutex);
 }
 /******************************************************************************/
-void writer_disk_free_buf(MolochDiskOutput_t *out)
+void writer_disk_free_buf(MolochDiskStripe_t *stripe, MolochDiskOutput_t *out)
 {
+    if (writer_disk_pool_owns(stripe, out->buf)) {
+        uint32_t tail = stripe->poolTail;
+        stripe->poolRing[tail & stripe->poolMask] = out->buf;
+        __atomic_store_n(&stripe->poolTail, tail + 1, __ATOMIC_RELEASE);
+        out->buf = 0;
+        return;
+    }
+
+    if (stripe->poolBufs) {
+        munmap(out->buf, config.pcapWriteSize + 8192);
+        out->buf = 0;
+        return;
+    }
+
     if (writeMethod & MOLOCH_WRITE_THREAD)
-        pthread_mutex_lock(&freeOutputMutex);
+        pthread_mutex_lock(&stripe->freeOutputMutex);
 
-    if (freeOutputBufs.i_count > (int)config.maxFreeOutputBuffers) {
+    if (stripe->freeOutputBufs.i_count > (int)config.maxFreeOutputBuffers) {
         munmap(out->buf, config.pcapWriteSize + 8192);
     } else {
         MolochInt_t *tmp = (MolochInt_t *)out->buf;
-        DLL_PUSH_HEAD(i_, &freeOutputBufs, tmp);
+        DLL_PUSH_HEAD(i_, &stripe->freeOutputBufs, tmp);
     }
     out->buf = 0;
 
     if (writeMethod & MOLOCH_WRITE_THREAD)
-        pthread_mutex_unlock(&freeOutputMutex);
+        pthread_mutex_unlock(&stripe->freeOutputMutex);
 }
 /******************************************************************************/
-gboolean writer_disk_output_cb(gint fd, GIOCondition UNUSED(cond), gpointer UNUSED(data))
+/* Allocate, prefault and optionally lock num buffers for the stripe */
+static void writer_disk_pool_init(MolochDiskStripe_t *stripe, uint32_t num)
+{
+    const uint64_t hugePageSize = 2*1024*1024;
+    uint64_t       size;
+    uint32_t       i;
+
+    /* Page aligned so direct writes work from any buffer */
+    stripe->poolStride = (config.pcapWriteSize + 8192 + pageSize - 1) & ~((uint64_t)pageSize - 1);
+    stripe->poolNum = num;
+    size = stripe->poolStride * num;
+
+    stripe->poolBufs = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (config.pcapWriteBufferHugePages) {
+        size = (size + hugePageSize - 1) & ~(hugePageSize - 1);
+        stripe->poolBufs = mmap(0, size, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE|MAP_POPULATE|MAP_HUGETLB, -1, 0);
+        if (stripe->poolBufs == MAP_FAILED)
+            LOG("WARNING - Couldn't get hugepages for the write buffer pool with %s, using normal pages", strerror(errno));
+    }
+#endif
+    if (stripe->poolBufs == MAP_FAILED)
+        stripe->poolBufs = mmap(0, size, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE|MAP_POPULATE, -1, 0);
+    if (stripe->poolBufs == MAP_FAILED) {
+        printf("Couldn't allocate write buffer pool of %u buffers with %s\n", num, strerror(errno));
+        exit(1);
+    }
+
+    if (config.pcapWriteBufferLock && mlock(stripe->poolBufs, size) != 0)
+        LOG("WARNING - Couldn't mlock the write buffer pool with %s, check RLIMIT_MEMLOCK", strerror(errno));
+
+    for (stripe->poolMask = 1; stripe->poolMask < num; stripe->poolMask <<= 1);
+    stripe->poolRing = malloc(stripe->poolMask * sizeof(char *));
+    stripe->poolMask--;
+
+    for (i = 0; i < num; i++)
+        stripe->poolRing[i] = stripe->poolBufs + i * stripe->poolStride;
+    stripe->poolHead = 0;
+    stripe->poolTail = num;
+}
+/******************************************************************************/
+/* Add up the buffer pools of all the stripes */
+void writer_disk_pool_stats(MolochWriterPoolStats_t *stats)
+{
+    int s;
+
+    memset(stats, 0, sizeof(*stats));
+    for (s = 0; s < stripesNum; s++) {
+        stats->size       += stripes[s].poolNum;
+        stats->highWater  += stripes[s].poolHighWater;
+        stats->exhausted  += stripes[s].poolExhausted;
+    }
+}
+/******************************************************************************/
+gboolean writer_disk_output_cb(gint fd, GIOCondition UNUSED(cond), gpointer UNUSED(data));
+static gboolean writer_disk_output(gint fd)
 {
     if (config.exiting && fd)
         return FALSE;
 
     static int outputFd = 0;
+    MolochDiskStripe_t *stripe = &stripes[0];
 
-    MolochDiskOutput_t *out = DLL_PEEK_HEAD(mo_, &outputQ);
+    MolochDiskOutput_t *out = DLL_PEEK_HEAD(mo_, &stripe->outputQ);
     if (!out)
-        return DLL_COUNT(mo_, &outputQ) > 0;
+        return DLL_COUNT(mo_, &stripe->outputQ) > 0;
 
     if (!outputFd) {
         LOG("Opening %s", out->name);
@@ -185,32 +384,41 @@ gboolean writer_disk_output_cb(gint fd, GIOCondition UNUSED(cond), gpointer UNUS
     }
 
     // Cleanup buffer
-    writer_disk_free_buf(out);
-    DLL_REMOVE(mo_, &outputQ, out);
+    writer_disk_free_buf(stripe, out);
+    DLL_REMOVE(mo_, &stripe->outputQ, out);
     MOLOCH_TYPE_FREE(MolochDiskOutput_t, out);
 
     // More waiting to write on different fd, setup a new watch
-    if (outputFd && !config.exiting && DLL_COUNT(mo_, &outputQ) > 0) {
+    if (outputFd && !config.exiting && DLL_COUNT(mo_, &stripe->outputQ) > 0) {
         moloch_watch_fd(outputFd, MOLOCH_GIO_WRITE_COND, writer_disk_output_cb, NULL);
         return FALSE;
     }
 
-    return DLL_COUNT(mo_, &outputQ) > 0;
+    return DLL_COUNT(mo_, &stripe->outputQ) > 0;
+}
+/******************************************************************************/
+gboolean writer_disk_output_cb(gint fd, GIOCondition UNUSED(cond), gpointer UNUSED(data))
+{
+    moloch_writer_lock();
+    gboolean rc = writer_disk_output(fd);
+    moloch_writer_unlock();
+    return rc;
 }
 /******************************************************************************/
-void *writer_disk_output_thread(void *UNUSED(arg))
+void *writer_disk_output_thread(void *arg)
 {
+    MolochDiskStripe_t *stripe = arg;
     MolochDiskOutput_t *out;
     int outputFd = 0;
 
     while (1) {
         uint64_t filelen = 0;
-        pthread_mutex_lock(&outputQMutex);
-        while (DLL_COUNT(mo_, &outputQ) == 0) {
-            pthread_cond_wait(&outputQCond, &outputQMutex);
+        pthread_mutex_lock(&stripe->outputQMutex);
+        while (DLL_COUNT(mo_, &stripe->outputQ) == 0) {
+            pthread_cond_wait(&stripe->outputQCond, &stripe->outputQMutex);
         }
-        DLL_POP_HEAD(mo_, &outputQ, out);
-        pthread_mutex_unlock(&outputQMutex);
+        DLL_POP_HEAD(mo_, &stripe->outputQ, out);
+        pthread_mutex_unlock(&stripe->outputQMutex);
 
         if (!outputFd) {
             LOG("Opening %s", out->name);
@@ -250,23 +458,677 @@ void *writer_disk_output_thread(void *UNUSED(arg))
             outputFd = 0;
             free(out->name);
         }
-        writer_disk_free_buf(out);
+        writer_disk_free_buf(stripe, out);
         MOLOCH_TYPE_FREE(MolochDiskOutput_t, out);
     }
 }
 /******************************************************************************/
-void writer_disk_flush(gboolean all)
+/* Compressed output, pcapCompression.  The capture thread cuts the packets
+ * into blocks of about pcapCompressionBlockSize that no packet spans, a pool
+ * of threads deflates them, and the stripe's writer thread writes them out
+ * in order.  A packet's position is its block number shifted up
+ * MOLOCH_COMPRESS_BLOCK_SHIFT bits plus its offset in the uncompressed block,
+ * so the viewer only ever inflates one block to read a packet.
+ *
+ * File layout, all little endian:
+ *   header   magic, version, block shift, 0       4 x uint32
+ *            pcap file header                     24 bytes
+ *   block    compressed len, uncompressed len     2 x uint32, raw deflate
+ *   ...
+ *   index    file offset of every block           uint64 each
+ *   trailer  number of blocks, index magic        2 x uint32
+ *
+ * The first block also starts with the pcap file header so the blocks
+ * inflated back to back are a normal pcap file.  The index is only written
+ * when the file is closed, until then the viewer walks the block headers.
+ */
+#define MOLOCH_COMPRESS_MAGIC        0x7a63706d   /* "mpcz" */
+#define MOLOCH_COMPRESS_INDEX_MAGIC  0x6963706d   /* "mpci" */
+#define MOLOCH_COMPRESS_VERSION      1
+#define MOLOCH_COMPRESS_BLOCK_SHIFT  20
+
+typedef struct {
+    int                      fd;
+    char                    *buf;
+    uint32_t                 bufSize;
+    uint32_t                 len;
+    uint64_t                 filelen;
+    uint64_t                *index;
+    uint32_t                 indexNum;
+    uint32_t                 indexMax;
+} MolochDiskCompressFile_t;
+
+/******************************************************************************/
+static void writer_disk_compress_write(MolochDiskCompressFile_t *cf, uint32_t len)
+{
+    uint32_t pos = 0;
+
+    while (pos < len) {
+        int wlen = write(cf->fd, cf->buf + pos, len - pos);
+        if (wlen < 0) {
+            LOG("ERROR - Write %d failed with %d %d\n", cf->fd, wlen, errno);
+            exit (0);
+        }
+        pos += wlen;
+    }
+}
+/******************************************************************************/
+/* Buffer data for the file, writing whole pcapWriteSize chunks as they fill */
+static void writer_disk_compress_append(MolochDiskCompressFile_t *cf, const void *data, uint32_t len)
+{
+    while (len > 0) {
+        uint32_t clen = MIN(len, cf->bufSize - cf->len);
+        memcpy(cf->buf + cf->len, data, clen);
+        cf->len += clen;
+        cf->filelen += clen;
+        data = (const char *)data + clen;
+        len -= clen;
+
+        if (cf->len == cf->bufSize) {
+            writer_disk_compress_write(cf, cf->len);
+            cf->len = 0;
+        }
+    }
+}
+/******************************************************************************/
+static void writer_disk_compress_close(MolochDiskCompressFile_t *cf, const char *name)
+{
+    uint32_t trailer[2];
+
+    writer_disk_compress_append(cf, cf->index, cf->indexNum * sizeof(uint64_t));
+    trailer[0] = cf->indexNum;
+    trailer[1] = MOLOCH_COMPRESS_INDEX_MAGIC;
+    writer_disk_compress_append(cf, trailer, sizeof(trailer));
+
+    /* Direct writes have to be whole pages, pad and then cut the file back */
+    if (cf->len) {
+        uint32_t wlen = cf->len;
+        if ((writeMethod & MOLOCH_WRITE_DIRECT) && (wlen % pageSize) != 0) {
+            wlen = wlen - (wlen % pageSize) + pageSize;
+            memset(cf->buf + cf->len, 0, wlen - cf->len);
+        }
+        writer_disk_compress_write(cf, wlen);
+        if (wlen != cf->len && ftruncate(cf->fd, cf->filelen) != 0)
+            LOG("ERROR - Couldn't truncate '%s' with %s", name, strerror(errno));
+    }
+
+    close(cf->fd);
+    cf->fd = 0;
+    cf->len = 0;
+    cf->filelen = 0;
+    cf->indexNum = 0;
+}
+/******************************************************************************/
+/* Deflate blocks from any stripe, the block stays on its stripe's outputQ
+ * and is just marked ready for the writer thread.
+ */
+void *writer_disk_compress_thread(void *UNUSED(arg))
+{
+    MolochDiskOutput_t *out;
+    z_stream            strm;
+
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit2(&strm, config.pcapCompressionLevel, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        LOG("ERROR - Couldn't initialize deflate");
+        exit(1);
+    }
+
+    while (1) {
+        pthread_mutex_lock(&compressQMutex);
+        while (DLL_COUNT(mc_, &compressQ) == 0) {
+            pthread_cond_wait(&compressQCond, &compressQMutex);
+        }
+        DLL_POP_HEAD(mc_, &compressQ, out);
+        pthread_mutex_unlock(&compressQMutex);
+
+        uint32_t bound = deflateBound(&strm, out->max);
+        uint32_t hdr[2];
+
+        out->cbuf = malloc(sizeof(hdr) + bound);
+        deflateReset(&strm);
+        strm.next_in   = (Bytef *)out->buf;
+        strm.avail_in  = out->max;
+        strm.next_out  = (Bytef *)out->cbuf + sizeof(hdr);
+        strm.avail_out = bound;
+        if (deflate(&strm, Z_FINISH) != Z_STREAM_END) {
+            LOG("ERROR - Couldn't deflate block of %" PRIu64 " bytes", out->max);
+            exit(1);
+        }
+
+        hdr[0] = strm.total_out;
+        hdr[1] = out->max;
+        memcpy(out->cbuf, hdr, sizeof(hdr));
+        out->clen = sizeof(hdr) + strm.total_out;
+
+        MolochDiskStripe_t *stripe = out->stripe;
+        pthread_mutex_lock(&stripe->outputQMutex);
+        out->compressed = 1;
+        pthread_mutex_unlock(&stripe->outputQMutex);
+        pthread_cond_broadcast(&stripe->outputQCond);
+    }
+}
+/******************************************************************************/
+/* Writer thread for a stripe when compressing, blocks are written in the
+ * order they were queued no matter which finished compressing first.
+ */
+void *writer_disk_compress_output_thread(void *arg)
+{
+    MolochDiskStripe_t      *stripe = arg;
+    MolochDiskOutput_t      *out;
+    MolochDiskCompressFile_t cf;
+
+    memset(&cf, 0, sizeof(cf));
+    cf.bufSize = config.pcapWriteSize - (config.pcapWriteSize % pageSize);
+    if (posix_memalign((void **)&cf.buf, pageSize, cf.bufSize + pageSize) != 0) {
+        LOG("ERROR - Couldn't allocate compressed write buffer");
+        exit(1);
+    }
+
+    while (1) {
+        pthread_mutex_lock(&stripe->outputQMutex);
+        while (DLL_COUNT(mo_, &stripe->outputQ) == 0 || !DLL_PEEK_HEAD(mo_, &stripe->outputQ)->compressed) {
+            pthread_cond_wait(&stripe->outputQCond, &stripe->outputQMutex);
+        }
+        out = DLL_PEEK_HEAD(mo_, &stripe->outputQ);
+        pthread_mutex_unlock(&stripe->outputQMutex);
+
+        if (!cf.fd) {
+            LOG("Opening %s", out->name);
+            int options = O_NOATIME | O_WRONLY | O_NONBLOCK | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+            if (writeMethod & MOLOCH_WRITE_DIRECT)
+                options |= O_DIRECT;
+#endif
+            cf.fd = open(out->name,  options, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+            if (cf.fd < 0) {
+                LOG("ERROR - pcap open failed - Couldn't open file: '%s' with %s  (%d)", out->name, strerror(errno), errno);
+                exit (2);
+            }
+
+            uint32_t hdr[4] = {MOLOCH_COMPRESS_MAGIC, MOLOCH_COMPRESS_VERSION, MOLOCH_COMPRESS_BLOCK_SHIFT, 0};
+            writer_disk_compress_append(&cf, hdr, sizeof(hdr));
+            writer_disk_compress_append(&cf, &pcapFileHeader, 24);
+        }
+
+        if (cf.indexNum == cf.indexMax) {
+            cf.indexMax = MAX(1024, cf.indexMax * 2);
+            cf.index = realloc(cf.index, cf.indexMax * sizeof(uint64_t));
+        }
+        cf.index[cf.indexNum++] = cf.filelen;
+        writer_disk_compress_append(&cf, out->cbuf, out->clen);
+
+        if (out->close) {
+            writer_disk_compress_close(&cf, out->name);
+            free(out->name);
+        }
+
+        free(out->cbuf);
+        writer_disk_free_buf(stripe, out);
+
+        /* Only leave the queue once done so the queue length covers it */
+        pthread_mutex_lock(&stripe->outputQMutex);
+        DLL_REMOVE(mo_, &stripe->outputQ, out);
+        pthread_mutex_unlock(&stripe->outputQMutex);
+        MOLOCH_TYPE_FREE(MolochDiskOutput_t, out);
+    }
+}
+/******************************************************************************/
+/* io_uring writer, each file gets as many buffers in flight as the depth
+ * allows, written at explicit offsets.  Completions are reaped on the main
+ * thread when the ring's eventfd fires, so buffers go back on
+ * freeOutputBufs without any locking.
+ */
+#ifdef MOLOCH_HAVE_URING
+/******************************************************************************/
+static int writer_disk_uring_enter(unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, uringFd, toSubmit, minComplete, flags, NULL, 0);
+}
+/******************************************************************************/
+static int writer_disk_uring_register(unsigned opcode, void *arg, unsigned num)
+{
+    return syscall(__NR_io_uring_register, uringFd, opcode, arg, num);
+}
+/******************************************************************************/
+/* Index of buf in the registered pool, or -1 if it isn't one */
+static int writer_disk_uring_registered(const char *buf)
+{
+    if (!uringRegistered || !writer_disk_pool_owns(&stripes[0], buf))
+        return -1;
+    return (buf - stripes[0].poolBufs) / stripes[0].poolStride;
+}
+/******************************************************************************/
+static int writer_disk_uring_open(char *name)
+{
+    int f;
+
+    for (f = 0; f < MOLOCH_URING_FILES; f++) {
+        if (uringFiles[f].fd == -1)
+            break;
+    }
+
+    if (f == MOLOCH_URING_FILES) {
+        LOG("ERROR - Too many files with writes in flight");
+        exit(2);
+    }
+
+    LOG("Opening %s", name);
+    int options = O_NOATIME | O_WRONLY | O_CREAT | O_TRUNC;
+    if (writeMethod & MOLOCH_WRITE_DIRECT)
+        options |= O_DIRECT;
+
+    MolochDiskUringFile_t *file = &uringFiles[f];
+    file->fd = open(name, options, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (file->fd < 0) {
+        LOG("ERROR - pcap open failed - Couldn't open file: '%s' with %s  (%d)", name, strerror(errno), errno);
+        if (config.dropUser) {
+            LOG("   Verify that user '%s' set by configuration variable dropUser can write and the parent directory exists", config.dropUser);
+        }
+        exit (2);
+    }
+
+    if (uringFixedFiles) {
+        struct io_uring_files_update update;
+        memset(&update, 0, sizeof(update));
+        update.offset = f;
+        update.fds = (uintptr_t)&file->fd;
+        if (writer_disk_uring_register(IORING_REGISTER_FILES_UPDATE, &update, 1) != 1) {
+            LOG("ERROR - Couldn't update uring fixed file %d with %s", f, strerror(errno));
+            exit (2);
+        }
+    }
+
+    return f;
+}
+/******************************************************************************/
+static void writer_disk_uring_close(MolochDiskUringFile_t *file)
+{
+    if (file->filelen)
+        (void)ftruncate(file->fd, file->filelen);
+
+    if (uringFixedFiles) {
+        struct io_uring_files_update update;
+        int                          fd = -1;
+        memset(&update, 0, sizeof(update));
+        update.offset = file - uringFiles;
+        update.fds = (uintptr_t)&fd;
+        writer_disk_uring_register(IORING_REGISTER_FILES_UPDATE, &update, 1);
+    }
+
+    close(file->fd);
+    free(file->name);
+    memset(file, 0, sizeof(*file));
+    file->fd = -1;
+}
+/******************************************************************************/
+static void writer_disk_uring_prep(MolochDiskOutput_t *out)
+{
+    unsigned             tail = *uringSqTail;
+    unsigned             idx = tail & *uringSqMask;
+    struct io_uring_sqe *sqe = &uringSqes[idx];
+    int                  buf = writer_disk_uring_registered(out->buf);
+
+    memset(sqe, 0, sizeof(*sqe));
+    if (uringFixedFiles) {
+        sqe->fd = out->file;
+        sqe->flags = IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = uringFiles[out->file].fd;
+    }
+    sqe->off = out->offset;
+    sqe->user_data = (uintptr_t)out;
+
+    if (buf >= 0) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->addr = (uintptr_t)(out->buf + out->pos);
+        sqe->len = out->wlen;
+        sqe->buf_index = buf;
+    } else {
+        out->iov.iov_base = out->buf + out->pos;
+        out->iov.iov_len = out->wlen;
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->addr = (uintptr_t)&out->iov;
+        sqe->len = 1;
+    }
+
+    uringSqArray[idx] = idx;
+    __atomic_store_n(uringSqTail, tail + 1, __ATOMIC_RELEASE);
+}
+/******************************************************************************/
+/* Hand queued buffers to the kernel until the depth is reached, buffers for
+ * the next file can go out while the last ones of the previous are in flight.
+ */
+static void writer_disk_uring_submit()
+{
+    MolochDiskOutput_t *out;
+    unsigned            toSubmit = 0;
+
+    for (out = stripes[0].outputQ.mo_next; out != &stripes[0].outputQ && uringInflight < config.pcapWriteUringDepth; out = out->mo_next) {
+        if (out->submitted)
+            continue;
+
+        if (uringCurrent == -1)
+            uringCurrent = writer_disk_uring_open(out->name);
+
+        MolochDiskUringFile_t *file = &uringFiles[uringCurrent];
+
+        out->wlen = out->max - out->pos;
+        if (out->close && (writeMethod & MOLOCH_WRITE_DIRECT) && (out->wlen % pageSize) != 0) {
+            file->filelen = file->offset + out->wlen;
+            out->wlen = out->wlen - (out->wlen % pageSize) + pageSize;
+        }
+
+        out->file = uringCurrent;
+        out->offset = file->offset;
+        out->submitted = 1;
+        file->offset += out->wlen;
+        file->inflight++;
+        uringInflight++;
+
+        if (out->close) {
+            file->closing = 1;
+            file->name = out->name;
+            uringCurrent = -1;
+        }
+
+        writer_disk_uring_prep(out);
+        toSubmit++;
+    }
+
+    if (toSubmit && writer_disk_uring_enter(toSubmit, 0, 0) < 0) {
+        LOG("ERROR - io_uring_enter failed with %s", strerror(errno));
+        exit (0);
+    }
+}
+/******************************************************************************/
+static void writer_disk_uring_reap()
+{
+    unsigned head = *uringCqHead;
+    unsigned resubmit = 0;
+
+    while (head != __atomic_load_n(uringCqTail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &uringCqes[head & *uringCqMask];
+        MolochDiskOutput_t  *out = (MolochDiskOutput_t *)(uintptr_t)cqe->user_data;
+        int                  res = cqe->res;
+
+        head++;
+
+        if (res < 0) {
+            LOG("ERROR - Write %d failed with %d %s\n", uringFiles[out->file].fd, res, strerror(-res));
+            exit (0);
+        }
+
+        // Short write, send the rest
+        if ((uint32_t)res < out->wlen) {
+            out->pos += res;
+            out->offset += res;
+            out->wlen -= res;
+            writer_disk_uring_prep(out);
+            resubmit++;
+            continue;
+        }
+
+        MolochDiskUringFile_t *file = &uringFiles[out->file];
+        file->inflight--;
+        uringInflight--;
+
+        if (file->closing && file->inflight == 0)
+            writer_disk_uring_close(file);
+
+        DLL_REMOVE(mo_, &stripes[0].outputQ, out);
+        writer_disk_free_buf(&stripes[0], out);
+        MOLOCH_TYPE_FREE(MolochDiskOutput_t, out);
+    }
+    __atomic_store_n(uringCqHead, head, __ATOMIC_RELEASE);
+
+    if (resubmit && writer_disk_uring_enter(resubmit, 0, 0) < 0) {
+        LOG("ERROR - io_uring_enter failed with %s", strerror(errno));
+        exit (0);
+    }
+
+    writer_disk_uring_submit();
+}
+/******************************************************************************/
+gboolean writer_disk_uring_cb(gint UNUSED(fd), GIOCondition UNUSED(cond), gpointer UNUSED(data))
+{
+    uint64_t count;
+
+    if (read(uringEventFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        LOG("ERROR - uring eventfd read failed with %s", strerror(errno));
+
+    moloch_writer_lock();
+    writer_disk_uring_reap();
+    moloch_writer_unlock();
+    return TRUE;
+}
+/******************************************************************************/
+/* Block until everything queued has been written */
+static void writer_disk_uring_drain()
+{
+    while (DLL_COUNT(mo_, &stripes[0].outputQ) > 0) {
+        writer_disk_uring_submit();
+        if (writer_disk_uring_enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            LOG("ERROR - io_uring_enter failed with %s", strerror(errno));
+            exit (0);
+        }
+        writer_disk_uring_reap();
+    }
+}
+/******************************************************************************/
+static void writer_disk_uring_init()
+{
+    struct io_uring_params params;
+    int                    i;
+
+    memset(&params, 0, sizeof(params));
+    uringFd = syscall(__NR_io_uring_setup, config.pcapWriteUringDepth, &params);
+    if (uringFd < 0) {
+        printf("io_uring_setup failed with %s, kernel too old for uring pcapWriteMethod?\n", strerror(errno));
+        exit(1);
+    }
+
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        sqSize = cqSize = MAX(sqSize, cqSize);
+
+    char *sq = mmap(0, sqSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, uringFd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+        cq = mmap(0, cqSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, uringFd, IORING_OFF_CQ_RING);
+    uringSqes = mmap(0, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, uringFd, IORING_OFF_SQES);
+
+    if (sq == MAP_FAILED || cq == MAP_FAILED || uringSqes == MAP_FAILED) {
+        printf("Couldn't map io_uring rings with %s\n", strerror(errno));
+        exit(1);
+    }
+
+    uringSqTail  = (unsigned *)(sq + params.sq_off.tail);
+    uringSqMask  = (unsigned *)(sq + params.sq_off.ring_mask);
+    uringSqArray = (unsigned *)(sq + params.sq_off.array);
+    uringCqHead  = (unsigned *)(cq + params.cq_off.head);
+    uringCqTail  = (unsigned *)(cq + params.cq_off.tail);
+    uringCqMask  = (unsigned *)(cq + params.cq_off.ring_mask);
+    uringCqes    = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    uringEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (uringEventFd < 0 || writer_disk_uring_register(IORING_REGISTER_EVENTFD, &uringEventFd, 1) < 0) {
+        printf("Couldn't register io_uring eventfd with %s\n", strerror(errno));
+        exit(1);
+    }
+    moloch_watch_fd(uringEventFd, MOLOCH_GIO_READ_COND, writer_disk_uring_cb, NULL);
+
+    /* The buffer pool is what gets registered */
+    MolochDiskStripe_t *stripe = &stripes[0];
+    struct iovec *iovs = malloc(stripe->poolNum * sizeof(struct iovec));
+    for (i = 0; i < (int)stripe->poolNum; i++) {
+        iovs[i].iov_base = stripe->poolBufs + i * stripe->poolStride;
+        iovs[i].iov_len  = stripe->poolStride;
+    }
+    uringRegistered = writer_disk_uring_register(IORING_REGISTER_BUFFERS, iovs, stripe->poolNum) == 0;
+    if (!uringRegistered)
+        LOG("WARNING - Couldn't register uring buffers with %s, check RLIMIT_MEMLOCK", strerror(errno));
+    free(iovs);
+
+    int fds[MOLOCH_URING_FILES];
+    for (i = 0; i < MOLOCH_URING_FILES; i++) {
+        uringFiles[i].fd = -1;
+        fds[i] = -1;
+    }
+    uringFixedFiles = writer_disk_uring_register(IORING_REGISTER_FILES, fds, MOLOCH_URING_FILES) == 0;
+
+    if (config.debug)
+        LOG("uring depth %u entries %u registered buffers %u fixed files %d", config.pcapWriteUringDepth, params.sq_entries, (uringRegistered?stripes[0].poolNum:0), uringFixedFiles);
+}
+#endif
+/******************************************************************************/
+/* mmap writer, output files are fallocated to maxFileSizeB up front and
+ * packets are copied straight into a mapped window of the file.  Finished
+ * windows are msynced and unmapped by the stripe's thread, which also
+ * truncates the file to what was written when it is closed.
+ */
+#define MOLOCH_WRITE_MMAP_WINDOW (16*1024*1024)
+
+/******************************************************************************/
+static void writer_disk_mmap_extend(MolochDiskStripe_t *stripe, uint64_t size)
+{
+    if (size <= stripe->fileSize)
+        return;
+
+    if (fallocate(stripe->fd, 0, stripe->fileSize, size - stripe->fileSize) != 0) {
+        /* Filesystem can't preallocate, a sparse file still works */
+        if (errno != EOPNOTSUPP || ftruncate(stripe->fd, size) != 0) {
+            LOG("ERROR - Couldn't extend '%s' to %" PRIu64 " with %s", stripe->outputFileName, size, strerror(errno));
+            exit (2);
+        }
+    }
+    stripe->fileSize = size;
+}
+/******************************************************************************/
+/* Hand the current window to the thread, with close the file goes too */
+static void writer_disk_mmap_queue(MolochDiskStripe_t *stripe, int close)
 {
+    MolochDiskOutput_t *out = MOLOCH_TYPE_ALLOC0(MolochDiskOutput_t);
+
+    out->buf     = stripe->window;
+    out->max     = MOLOCH_WRITE_MMAP_WINDOW;
+    out->fd      = stripe->fd;
+    out->close   = close;
+    out->filelen = stripe->outputFilePos;
+    if (close)
+        out->name = stripe->outputFileName;
+    stripe->window = 0;
+
+    pthread_mutex_lock(&stripe->outputQMutex);
+    DLL_PUSH_TAIL(mo_, &stripe->outputQ, out);
+    int count = DLL_COUNT(mo_, &stripe->outputQ);
+    pthread_mutex_unlock(&stripe->outputQMutex);
+    pthread_cond_broadcast(&stripe->outputQCond);
+
+    if (count >= 100 && count % 50 == 0) {
+        LOG("WARNING - %d output windows waiting, disk IO system too slow?", count);
+    }
+}
+/******************************************************************************/
+/* Map the window the next packet goes in, starting at the page it begins on */
+static void writer_disk_mmap_window(MolochDiskStripe_t *stripe)
+{
+    if (stripe->window)
+        writer_disk_mmap_queue(stripe, 0);
+
+    stripe->windowStart = stripe->outputFilePos & ~((uint64_t)pageSize - 1);
+    writer_disk_mmap_extend(stripe, stripe->windowStart + MOLOCH_WRITE_MMAP_WINDOW);
+
+    stripe->window = mmap(0, MOLOCH_WRITE_MMAP_WINDOW, PROT_READ|PROT_WRITE, MAP_SHARED, stripe->fd, stripe->windowStart);
+    if (stripe->window == MAP_FAILED) {
+        LOG("ERROR - Couldn't mmap '%s' at %" PRIu64 " with %s", stripe->outputFileName, stripe->windowStart, strerror(errno));
+        exit (2);
+    }
+}
+/******************************************************************************/
+static void writer_disk_mmap_create(MolochDiskStripe_t *stripe)
+{
+    LOG("Opening %s", stripe->outputFileName);
+    stripe->fd = open(stripe->outputFileName, O_NOATIME | O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (stripe->fd < 0) {
+        LOG("ERROR - pcap open failed - Couldn't open file: '%s' with %s  (%d)", stripe->outputFileName, strerror(errno), errno);
+        if (config.dropUser) {
+            LOG("   Verify that user '%s' set by configuration variable dropUser can write and the parent directory exists", config.dropUser);
+        }
+        exit (2);
+    }
+
+    stripe->fileSize = 0;
+    writer_disk_mmap_extend(stripe, config.maxFileSizeB);
+
+    stripe->outputFilePos = 0;
+    writer_disk_mmap_window(stripe);
+    memcpy(stripe->window, &pcapFileHeader, 24);
+    stripe->outputFilePos = 24;
+}
+/******************************************************************************/
+void *writer_disk_mmap_thread(void *arg)
+{
+    MolochDiskStripe_t *stripe = arg;
+    MolochDiskOutput_t *out;
+
+    while (1) {
+        pthread_mutex_lock(&stripe->outputQMutex);
+        while (DLL_COUNT(mo_, &stripe->outputQ) == 0) {
+            pthread_cond_wait(&stripe->outputQCond, &stripe->outputQMutex);
+        }
+        out = DLL_PEEK_HEAD(mo_, &stripe->outputQ);
+        pthread_mutex_unlock(&stripe->outputQMutex);
+
+        if (msync(out->buf, out->max, MS_SYNC) != 0)
+            LOG("ERROR - msync of %d failed with %s", out->fd, strerror(errno));
+        munmap(out->buf, out->max);
+
+        if (out->close) {
+            if (ftruncate(out->fd, out->filelen) != 0)
+                LOG("ERROR - Couldn't truncate '%s' with %s", out->name, strerror(errno));
+            close(out->fd);
+            free(out->name);
+        }
+
+        /* Only leave the queue once done so the queue length covers it */
+        pthread_mutex_lock(&stripe->outputQMutex);
+        DLL_REMOVE(mo_, &stripe->outputQ, out);
+        pthread_mutex_unlock(&stripe->outputQMutex);
+        MOLOCH_TYPE_FREE(MolochDiskOutput_t, out);
+    }
+}
+/******************************************************************************/
+void writer_disk_flush_stripe(MolochDiskStripe_t *stripe, gboolean all)
+{
+    MolochDiskOutput_t *output = stripe->output;
+
+    if (all && stripe->outputFileName) {
+        moloch_db_update_file(stripe->outputId, stripe->lastPacket);
+        moloch_time_index_save(stripe->timeIndex, stripe->outputFileName);
+        stripe->timeIndex = 0;
+    }
+
+    if (writeMethod & MOLOCH_WRITE_MMAP) {
+        if (all && stripe->window)
+            writer_disk_mmap_queue(stripe, 1);
+        return;
+    }
+
     if (config.dryRun || !output) {
         return;
     }
 
+    /* Don't make empty blocks */
+    if (compressBlocks && !all && output->pos == 0)
+        return;
+
     output->close = all;
-    output->name  = outputFileName;
+    output->name  = stripe->outputFileName;
 
     MolochDiskOutput_t *noutput = MOLOCH_TYPE_ALLOC0(MolochDiskOutput_t);
     noutput->max = config.pcapWriteSize;
-    writer_disk_alloc_buf(noutput);
+    writer_disk_alloc_buf(stripe, noutput);
 
 
     all |= (output->pos <= output->max);
@@ -280,16 +1142,33 @@ void writer_disk_flush(gboolean all)
     output->pos = 0;
 
     int count;
-    if (writeMethod & MOLOCH_WRITE_THREAD) {
-        pthread_mutex_lock(&outputQMutex);
-        DLL_PUSH_TAIL(mo_, &outputQ, output);
-        count = DLL_COUNT(mo_, &outputQ);
-        pthread_mutex_unlock(&outputQMutex);
-        pthread_cond_broadcast(&outputQCond);
+    if (compressBlocks) {
+        output->stripe = stripe;
+        pthread_mutex_lock(&stripe->outputQMutex);
+        DLL_PUSH_TAIL(mo_, &stripe->outputQ, output);
+        count = DLL_COUNT(mo_, &stripe->outputQ);
+        pthread_mutex_unlock(&stripe->outputQMutex);
+
+        pthread_mutex_lock(&compressQMutex);
+        DLL_PUSH_TAIL(mc_, &compressQ, output);
+        pthread_mutex_unlock(&compressQMutex);
+        pthread_cond_signal(&compressQCond);
+        stripe->blockNum++;
+    } else if (writeMethod & MOLOCH_WRITE_THREAD) {
+        pthread_mutex_lock(&stripe->outputQMutex);
+        DLL_PUSH_TAIL(mo_, &stripe->outputQ, output);
+        count = DLL_COUNT(mo_, &stripe->outputQ);
+        pthread_mutex_unlock(&stripe->outputQMutex);
+        pthread_cond_broadcast(&stripe->outputQCond);
     } else {
-        DLL_PUSH_TAIL(mo_, &outputQ, output);
-        count = DLL_COUNT(mo_, &outputQ);
+        DLL_PUSH_TAIL(mo_, &stripe->outputQ, output);
+        count = DLL_COUNT(mo_, &stripe->outputQ);
 
+#ifdef MOLOCH_HAVE_URING
+        if (writeMethod & MOLOCH_WRITE_URING)
+            writer_disk_uring_submit();
+        else
+#endif
         if (count == 1) {
             writer_disk_output_cb(0,0,0);
         }
@@ -299,38 +1178,64 @@ void writer_disk_flush(gboolean all)
         LOG("WARNING - %d output buffers waiting, disk IO system too slow?", count);
     }
 
-    output = noutput;
+    stripe->output = noutput;
+}
+/******************************************************************************/
+void writer_disk_flush(gboolean all)
+{
+    int s;
+
+    for (s = 0; s < stripesNum; s++)
+        writer_disk_flush_stripe(&stripes[s], all);
 }
 /******************************************************************************/
 void writer_disk_exit()
 {
+    int s;
+
     moloch_writer_flush(TRUE);
-    outputFileName = 0;
-    if (writeMethod & MOLOCH_WRITE_THREAD) {
+    for (s = 0; s < stripesNum; s++)
+        stripes[s].outputFileName = 0;
+    if (writeMethod & (MOLOCH_WRITE_THREAD | MOLOCH_WRITE_MMAP)) {
         while (writer_disk_queue_length_thread() >0) {
             usleep(10000);
         }
+#ifdef MOLOCH_HAVE_URING
+    } else if (writeMethod & MOLOCH_WRITE_URING) {
+        writer_disk_uring_drain();
+#endif
     } else {
         // Write out all the buffers
-        while (DLL_COUNT(mo_, &outputQ) > 0) {
+        while (DLL_COUNT(mo_, &stripes[0].outputQ) > 0) {
             writer_disk_output_cb(0, 0, 0);
         }
     }
+    moloch_time_index_exit();
 }
 /******************************************************************************/
-extern struct pcap_file_header pcapFileHeader;
-void writer_disk_create(const struct pcap_pkthdr *h)
+void writer_disk_create(MolochDiskStripe_t *stripe, const struct pcap_pkthdr *h)
 {
-    outputFileName = moloch_db_create_file(h->ts.tv_sec, NULL, 0, 0, &outputId);
-    outputFilePos = 24;
+    if (stripesNum > 1)
+        stripe->outputFileName = moloch_db_create_file_dir(h->ts.tv_sec, stripe->dirPos, &stripe->outputId);
+    else
+        stripe->outputFileName = moloch_db_create_file(h->ts.tv_sec, NULL, 0, 0, &stripe->outputId);
+    stripe->timeIndex = moloch_time_index_alloc();
+    gettimeofday(&stripe->outputFileTime, 0);
 
-    output = MOLOCH_TYPE_ALLOC0(MolochDiskOutput_t);
-    output->max = config.pcapWriteSize;
-    writer_disk_alloc_buf(output);
-    output->pos = 24;
-    gettimeofday(&outputFileTime, 0);
+    if (writeMethod & MOLOCH_WRITE_MMAP) {
+        writer_disk_mmap_create(stripe);
+        return;
+    }
+
+    stripe->outputFilePos = 24;
+    stripe->blockNum = 0;
 
-    memcpy(output->buf, &pcapFileHeader, 24);
+    stripe->output = MOLOCH_TYPE_ALLOC0(MolochDiskOutput_t);
+    stripe->output->max = config.pcapWriteSize;
+    writer_disk_alloc_buf(stripe, stripe->output);
+    stripe->output->pos = 24;
+
+    memcpy(stripe->output->buf, &pcapFileHeader, 24);
 }
 /******************************************************************************/
 struct pcap_timeval {
@@ -343,8 +1248,10 @@ struct pcap_sf_pkthdr {
     uint32_t len;		/* length this packet (off wire) */
 };
 void
-writer_disk_write(const struct pcap_pkthdr *h, const u_char *sp, uint32_t *fileNum, uint64_t *filePos)
+writer_disk_write(const MolochSession_t *session, const struct pcap_pkthdr *h, const u_char *sp, uint32_t *fileNum, uint64_t *filePos)
 {
+    MolochDiskStripe_t   *stripe = &stripes[stripesNum == 1?0:session->h_hash % stripesNum];
+    MolochDiskOutput_t   *output;
     struct pcap_sf_pkthdr hdr;
 
     hdr.ts.tv_sec  = h->ts.tv_sec;
@@ -352,26 +1259,49 @@ writer_disk_write(const struct pcap_pkthdr *h, const u_char *sp, uint32_t *fileN
     hdr.caplen     = h->caplen;
     hdr.len        = h->len;
 
-    if (!outputFileName) {
-        writer_disk_create(h);
+    if (!stripe->outputFileName) {
+        writer_disk_create(stripe, h);
     }
 
-    memcpy(output->buf + output->pos, (char *)&hdr, sizeof(hdr));
-    output->pos += sizeof(hdr);
+    if (writeMethod & MOLOCH_WRITE_MMAP) {
+        if (stripe->outputFilePos + sizeof(hdr) + h->caplen > stripe->windowStart + MOLOCH_WRITE_MMAP_WINDOW)
+            writer_disk_mmap_window(stripe);
+
+        char *pos = stripe->window + (stripe->outputFilePos - stripe->windowStart);
+        memcpy(pos, (char *)&hdr, sizeof(hdr));
+        memcpy(pos + sizeof(hdr), sp, h->caplen);
+    } else {
+        output = stripe->output;
+
+        /* Packets never span blocks, a packet bigger than a block gets one to itself */
+        if (compressBlocks) {
+            if (output->pos > (stripe->blockNum?0:24) && output->pos + sizeof(hdr) + h->caplen > config.pcapCompressionBlockSize) {
+                writer_disk_flush_stripe(stripe, FALSE);
+                output = stripe->output;
+            }
+            *filePos = ((uint64_t)stripe->blockNum << MOLOCH_COMPRESS_BLOCK_SHIFT) | output->pos;
+        }
+
+        memcpy(output->buf + output->pos, (char *)&hdr, sizeof(hdr));
+        output->pos += sizeof(hdr);
 
-    memcpy(output->buf + output->pos, sp, h->caplen);
-    output->pos += h->caplen;
+        memcpy(output->buf + output->pos, sp, h->caplen);
+        output->pos += h->caplen;
 
-    if(output->pos > output->max) {
-        writer_disk_flush(FALSE);
+        if(output->pos > output->max) {
+            writer_disk_flush_stripe(stripe, FALSE);
+        }
     }
-    *fileNum = outputId;
-    *filePos = outputFilePos;
-    outputFilePos += 16 + h->caplen;
+    *fileNum = stripe->outputId;
+    if (!compressBlocks)
+        *filePos = stripe->outputFilePos;
+    moloch_time_index_add(stripe->timeIndex, &h->ts, *filePos);
+    stripe->lastPacket = h->ts.tv_sec;
+    stripe->outputFilePos += 16 + h->caplen;
 
-    if (outputFilePos >= config.maxFileSizeB) {
-        writer_disk_flush(TRUE);
-        outputFileName = 0;
+    if (stripe->outputFilePos >= config.maxFileSizeB) {
+        writer_disk_flush_stripe(stripe, TRUE);
+        stripe->outputFileName = 0;
     }
 }
 /******************************************************************************/
@@ -379,12 +1309,19 @@ gboolean
 writer_disk_file_time_gfunc (gpointer UNUSED(user_data))
 {
     static struct timeval tv;
+    int                   s;
+
     gettimeofday(&tv, 0);
 
-    if (outputFileName && outputFilePos > 24 && (tv.tv_sec - outputFileTime.tv_sec) >= config.maxFileTimeM*60) {
-        writer_disk_flush(TRUE);
-        outputFileName = 0;
+    moloch_writer_lock();
+    for (s = 0; s < stripesNum; s++) {
+        MolochDiskStripe_t *stripe = &stripes[s];
+        if (stripe->outputFileName && stripe->outputFilePos > 24 && (tv.tv_sec - stripe->outputFileTime.tv_sec) >= config.maxFileTimeM*60) {
+            writer_disk_flush_stripe(stripe, TRUE);
+            stripe->outputFileName = 0;
+        }
     }
+    moloch_writer_unlock();
 
     return TRUE;
 }
@@ -392,7 +1329,7 @@ writer_disk_file_time_gfunc (gpointer UNUSED(user_data))
 /******************************************************************************/
 char *
 writer_disk_name () {
-    return outputFileName;
+    return stripes[0].outputFileName;
 }
 /******************************************************************************/
 void writer_disk_init(char *name)
@@ -405,6 +1342,12 @@ void writer_disk_init(char *name)
         writeMethod = MOLOCH_WRITE_THREAD | MOLOCH_WRITE_NORMAL;
     else if (strcmp(name, "thread-direct") == 0)
         writeMethod = MOLOCH_WRITE_THREAD | MOLOCH_WRITE_DIRECT;
+    else if (strcmp(name, "uring") == 0)
+        writeMethod = MOLOCH_WRITE_URING | MOLOCH_WRITE_NORMAL;
+    else if (strcmp(name, "uring-direct") == 0)
+        writeMethod = MOLOCH_WRITE_URING | MOLOCH_WRITE_DIRECT;
+    else if (strcmp(name, "mmap") == 0)
+        writeMethod = MOLOCH_WRITE_MMAP;
     else {
         printf("Unknown pcapWriteMethod '%s'\n", name);
         exit(1);
@@ -417,8 +1360,19 @@ void writer_disk_init(char *name)
     }
 #endif
 
-    if (writeMethod & MOLOCH_WRITE_THREAD) {
-        g_thread_new("moloch-output", &writer_disk_output_thread, NULL);
+#ifndef MOLOCH_HAVE_URING
+    if (writeMethod & MOLOCH_WRITE_URING) {
+        printf("OS doesn't support uring write method\n");
+        exit(1);
+    }
+#endif
+
+    if (config.pcapDirStripe) {
+        if (!(writeMethod & (MOLOCH_WRITE_THREAD | MOLOCH_WRITE_MMAP))) {
+            printf("pcapDirStripe requires a pcapWriteMethod of thread, thread-direct or mmap\n");
+            exit(1);
+        }
+        stripesNum = MIN(g_strv_length(config.pcapDir), MOLOCH_MAX_WRITE_STRIPES);
     }
 
     if ((writeMethod & MOLOCH_WRITE_DIRECT) && sizeof(off_t) == 4 && config.maxFileSizeG > 2)
@@ -430,10 +1384,55 @@ void writer_disk_init(char *name)
         exit (1);
     }
 
-    DLL_INIT(mo_, &outputQ);
-    DLL_INIT(i_, &freeOutputBufs);
+    if (strcmp(config.pcapCompression, "deflate") == 0) {
+        if (!(writeMethod & MOLOCH_WRITE_THREAD)) {
+            printf("pcapCompression requires a pcapWriteMethod of thread or thread-direct\n");
+            exit(1);
+        }
+        if (config.pcapCompressionBlockSize > config.pcapWriteSize) {
+            printf("pcapCompressionBlockSize %u can't be larger than pcapWriteSize %u\n", config.pcapCompressionBlockSize, config.pcapWriteSize);
+            exit(1);
+        }
+        compressBlocks = 1;
+        DLL_INIT(mc_, &compressQ);
+    }
+
+    int s;
+    for (s = 0; s < stripesNum; s++) {
+        MolochDiskStripe_t *stripe = &stripes[s];
+
+        DLL_INIT(mo_, &stripe->outputQ);
+        DLL_INIT(i_, &stripe->freeOutputBufs);
+        pthread_mutex_init(&stripe->outputQMutex, NULL);
+        pthread_cond_init(&stripe->outputQCond, NULL);
+        pthread_mutex_init(&stripe->freeOutputMutex, NULL);
+        stripe->dirPos = s;
+
+        /* uring always writes from a pool, enough for the writes in flight plus the ones being filled */
+        if (writeMethod & MOLOCH_WRITE_URING)
+            writer_disk_pool_init(stripe, MAX(config.pcapWriteBufferPool, config.pcapWriteUringDepth * 2 + 2));
+        else if (config.pcapWriteBufferPool && !(writeMethod & MOLOCH_WRITE_MMAP))
+            writer_disk_pool_init(stripe, config.pcapWriteBufferPool);
+
+        if (compressBlocks) {
+            g_thread_new("moloch-output", &writer_disk_compress_output_thread, stripe);
+        } else if (writeMethod & MOLOCH_WRITE_THREAD) {
+            g_thread_new("moloch-output", &writer_disk_output_thread, stripe);
+        } else if (writeMethod & MOLOCH_WRITE_MMAP) {
+            g_thread_new("moloch-output", &writer_disk_mmap_thread, stripe);
+        }
+    }
+
+    for (s = 0; compressBlocks && s < (int)config.pcapCompressionThreads; s++) {
+        g_thread_new("moloch-compress", &writer_disk_compress_thread, NULL);
+    }
+
+#ifdef MOLOCH_HAVE_URING
+    if (writeMethod & MOLOCH_WRITE_URING)
+        writer_disk_uring_init();
+#endif
 
-    if (writeMethod & MOLOCH_WRITE_THREAD) {
+    if (writeMethod & (MOLOCH_WRITE_THREAD | MOLOCH_WRITE_MMAP)) {
         moloch_writer_queue_length = writer_disk_queue_length_thread;
     } else {
         moloch_writer_queue_length = writer_disk_queue_length_nothread;
@@ -27,10 +27,16 @@
 extern MolochConfig_t        config;
 
 
-static char                 *outputFileName;
-static uint32_t              outputId;
-static FILE                 *inputFile;
-static char                  inputFilename[PATH_MAX+1];
+/* One per offline input being read at the same time */
+typedef struct {
+    char                    *outputFileName;
+    uint32_t                 outputId;
+    FILE                    *inputFile;
+    MolochMmap_t            *inputMmap;
+    char                     inputFilename[PATH_MAX+1];
+} MolochInplaceInput_t;
+
+static MolochInplaceInput_t  inputs[MOLOCH_MAX_SESSION_SETS];
 
 /******************************************************************************/
 uint32_t writer_inplace_queue_length()
@@ -46,44 +52,60 @@ void writer_inplace_exit()
 {
 }
 /******************************************************************************/
-void writer_inplace_create(char *filename)
+void writer_inplace_create(MolochInplaceInput_t *input, const struct pcap_pkthdr *h)
 {
     if (config.dryRun) {
-        outputFileName = "dryrun.pcap";
+        input->outputFileName = "dryrun.pcap";
         return;
     }
 
-    struct stat st;
+    uint64_t size;
 
-    fstat(fileno(inputFile), &st);
+    if (input->inputMmap) {
+        size = moloch_mmap_size(input->inputMmap);
+    } else {
+        struct stat st;
+        fstat(fileno(input->inputFile), &st);
+        size = st.st_size;
+    }
 
-    outputFileName = moloch_db_create_file(nids_last_pcap_header->ts.tv_sec, filename, st.st_size, 1, &outputId);
+    input->outputFileName = moloch_db_create_file(h->ts.tv_sec, input->inputFilename, size, 1, &input->outputId);
 }
 
 /******************************************************************************/
 void
-writer_inplace_write(const struct pcap_pkthdr *h, const u_char *UNUSED(sp), uint32_t *fileNum, uint64_t *filePos)
+writer_inplace_write(const MolochSession_t *UNUSED(session), const struct pcap_pkthdr *h, const u_char *UNUSED(sp), uint32_t *fileNum, uint64_t *filePos)
 {
-    if (!outputFileName)
-        writer_inplace_create(inputFilename);
+    MolochInplaceInput_t *input = &inputs[moloch_nids_input()];
 
-    *fileNum = outputId;
-    *filePos = ftell(inputFile) - 16 - h->caplen;
+    if (!input->outputFileName)
+        writer_inplace_create(input, h);
+
+    *fileNum = input->outputId;
+    if (moloch_nids_input_pos())
+        *filePos = moloch_nids_input_pos();
+    else if (input->inputMmap)
+        *filePos = moloch_mmap_pos(input->inputMmap);
+    else
+        *filePos = ftell(input->inputFile) - 16 - h->caplen;
 }
 /******************************************************************************/
 char *
 writer_inplace_name() {
-    return inputFilename;
+    return inputs[moloch_nids_input()].inputFilename;
 }
 /******************************************************************************/
 void
-writer_inplace_next_input(FILE *file, char *filename) {
-    inputFile = file;
-    strcpy(inputFilename, filename);
+writer_inplace_next_input(FILE *file, MolochMmap_t *mm, char *filename) {
+    MolochInplaceInput_t *input = &inputs[moloch_nids_input()];
+
+    input->inputFile = file;
+    input->inputMmap = mm;
+    strcpy(input->inputFilename, filename);
     if (!config.dryRun) {
-        g_free(outputFileName);
+        g_free(input->outputFileName);
     }
-    outputFileName = 0;
+    input->outputFileName = 0;
 }
 /******************************************************************************/
 void writer_inplace_init(char *UNUSED(name))
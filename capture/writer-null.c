@@ -42,7 +42,7 @@ void writer_null_exit()
 }
 /******************************************************************************/
 void
-writer_null_write(const struct pcap_pkthdr *h, const u_char *UNUSED(sp), uint32_t *fileNum, uint64_t *filePos)
+writer_null_write(const MolochSession_t *UNUSED(session), const struct pcap_pkthdr *h, const u_char *UNUSED(sp), uint32_t *fileNum, uint64_t *filePos)
 {
     *fileNum = 0;
     *filePos = outputFilePos;
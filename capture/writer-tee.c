@@ -0,0 +1,241 @@
+/******************************************************************************/
+/* writer-tee.c  -- Writer that hands every packet to several writers
+ *
+ * pcapWriteMethod=tee with pcapTeeWriters listing the real writers, for
+ * example "thread-direct;s3".  The first one is the primary, its file number
+ * and position are what the session gets, the others still create and
+ * register their own files so they can be found by time.
+ *
+ * Each writer keeps its own queue.  Once a second the queue length of every
+ * secondary is checked, while it is over pcapTeeMaxQueue that writer skips
+ * packets so a slow backend can't hold up capture or the primary.
+ *
+ * Packets a secondary skips are counted per writer in the stats document.
+ *
+ * Writers set the global moloch_writer_* functions when initialized, so each
+ * one is initialized in turn and the functions are saved before the next.
+ * Writers keep their state in file globals, so two names with the same
+ * implementation, like thread and uring, can't both be listed.
+ * They are initialized last to first, writers like s3 that raise
+ * pcapWriteSize must do it before the ones that size buffers from it.
+ *
+ * Copyright 2012-2015 AOL Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "moloch.h"
+
+extern MolochConfig_t        config;
+
+#define MOLOCH_TEE_MAX_WRITERS 8
+
+typedef struct {
+    char                    *name;
+    MolochWriterQueueLength  queue_length;
+    MolochWriterWrite        write;
+    MolochWriterFlush        flush;
+    MolochWriterExit         exit;
+    MolochWriterNextInput    next_input;
+    MolochWriterName         writer_name;
+    uint32_t                 queueLength;
+    char                     dropping;
+    uint64_t                 dropped;
+} MolochTeeWriter_t;
+
+static MolochTeeWriter_t     writers[MOLOCH_TEE_MAX_WRITERS];
+static int                   numWriters;
+
+/******************************************************************************/
+uint32_t writer_tee_queue_length()
+{
+    uint32_t q = writers[0].queue_length();
+    int      i;
+
+    // Secondaries that are skipping packets don't hold up reading, but we still wait for them when exiting
+    for (i = 1; i < numWriters; i++) {
+        if (config.exiting || !writers[i].dropping)
+            q += writers[i].queue_length();
+    }
+    return q;
+}
+/******************************************************************************/
+void writer_tee_flush(gboolean all)
+{
+    int i;
+
+    for (i = 0; i < numWriters; i++) {
+        if (writers[i].flush)
+            writers[i].flush(all);
+    }
+}
+/******************************************************************************/
+void writer_tee_exit()
+{
+    int i;
+
+    for (i = 0; i < numWriters; i++) {
+        writers[i].exit();
+        if (writers[i].dropped)
+            LOG("Tee writer %s skipped %" PRIu64 " packets", writers[i].name, writers[i].dropped);
+    }
+}
+/******************************************************************************/
+void writer_tee_next_input(FILE *file, MolochMmap_t *mm, char *filename)
+{
+    int i;
+
+    for (i = 0; i < numWriters; i++) {
+        if (writers[i].next_input)
+            writers[i].next_input(file, mm, filename);
+    }
+}
+/******************************************************************************/
+void
+writer_tee_write(const MolochSession_t *session, const struct pcap_pkthdr *h, const u_char *sp, uint32_t *fileNum, uint64_t *filePos)
+{
+    uint32_t teeFileNum;
+    uint64_t teeFilePos;
+    int      i;
+
+    writers[0].write(session, h, sp, fileNum, filePos);
+
+    for (i = 1; i < numWriters; i++) {
+        if (writers[i].dropping) {
+            writers[i].dropped++;
+            continue;
+        }
+        writers[i].write(session, h, sp, &teeFileNum, &teeFilePos);
+    }
+}
+/******************************************************************************/
+char *
+writer_tee_name() {
+    return writers[0].writer_name();
+}
+/******************************************************************************/
+int writer_tee_secondaries()
+{
+    return MAX(numWriters - 1, 0);
+}
+/******************************************************************************/
+/* num is 0 for the first secondary */
+void writer_tee_stats(int num, MolochTeeWriterStats_t *stats)
+{
+    MolochTeeWriter_t *writer = &writers[num + 1];
+
+    stats->name        = writer->name;
+    stats->queueLength = writer->queueLength;
+    stats->dropping    = writer->dropping;
+    stats->dropped     = writer->dropped;
+}
+/******************************************************************************/
+/* Update which secondaries are over pcapTeeMaxQueue */
+gboolean writer_tee_check_gfunc(gpointer UNUSED(user_data))
+{
+    int i;
+
+    moloch_writer_lock();
+    for (i = 1; i < numWriters; i++) {
+        writers[i].queueLength = writers[i].queue_length();
+
+        if (!writers[i].dropping && writers[i].queueLength > config.pcapTeeMaxQueue) {
+            LOG("WARNING - Tee writer %s queue is %u, skipping packets", writers[i].name, writers[i].queueLength);
+            writers[i].dropping = 1;
+        } else if (writers[i].dropping && writers[i].queueLength <= config.pcapTeeMaxQueue/2) {
+            LOG("Tee writer %s queue is %u, writing again after skipping %" PRIu64 " packets", writers[i].name, writers[i].queueLength, writers[i].dropped);
+            writers[i].dropping = 0;
+        }
+    }
+    moloch_writer_unlock();
+    return TRUE;
+}
+/******************************************************************************/
+void writer_tee_init(char *UNUSED(name))
+{
+    MolochWriterInit inits[MOLOCH_TEE_MAX_WRITERS];
+    int              i, j;
+
+    if (!config.pcapTeeWriters || !config.pcapTeeWriters[0]) {
+        printf("pcapWriteMethod of tee requires pcapTeeWriters\n");
+        exit(1);
+    }
+
+    numWriters = g_strv_length(config.pcapTeeWriters);
+    if (numWriters > MOLOCH_TEE_MAX_WRITERS) {
+        printf("Too many pcapTeeWriters, max is %d\n", MOLOCH_TEE_MAX_WRITERS);
+        exit(1);
+    }
+
+    for (i = 0; i < numWriters; i++) {
+        char *writerName = config.pcapTeeWriters[i];
+
+        if (strcmp(writerName, "tee") == 0) {
+            printf("pcapTeeWriters can't include tee\n");
+            exit(1);
+        }
+
+        inits[i] = moloch_writers_get(writerName);
+        if (!inits[i]) {
+            printf("Couldn't find pcapTeeWriters %s implementation\n", writerName);
+            exit(1);
+        }
+
+        for (j = 0; j < i; j++) {
+            if (inits[j] == inits[i]) {
+                printf("pcapTeeWriters %s and %s share an implementation, only one can be used\n", config.pcapTeeWriters[j], writerName);
+                exit(1);
+            }
+        }
+    }
+
+    uint32_t pcapWriteSize = 0;
+    uint64_t maxFileSizeB = 0;
+
+    for (i = numWriters - 1; i >= 0; i--) {
+        char *writerName = config.pcapTeeWriters[i];
+
+        moloch_writer_next_input = NULL;
+        moloch_writer_flush      = NULL;
+        moloch_writers_start(writerName);
+
+        // A writer initialized earlier already sized its buffers and files
+        if (i != numWriters - 1 && (pcapWriteSize != config.pcapWriteSize || maxFileSizeB != config.maxFileSizeB)) {
+            printf("pcapTeeWriters %s changed pcapWriteSize or maxFileSizeG, list it after the writers it would affect\n", writerName);
+            exit(1);
+        }
+        pcapWriteSize = config.pcapWriteSize;
+        maxFileSizeB  = config.maxFileSizeB;
+
+        writers[i].name         = writerName;
+        writers[i].queue_length = moloch_writer_queue_length;
+        writers[i].write        = moloch_writer_write;
+        writers[i].flush        = moloch_writer_flush;
+        writers[i].exit         = moloch_writer_exit;
+        writers[i].next_input   = moloch_writer_next_input;
+        writers[i].writer_name  = moloch_writer_name;
+    }
+
+    moloch_writer_queue_length = writer_tee_queue_length;
+    moloch_writer_flush        = writer_tee_flush;
+    moloch_writer_exit         = writer_tee_exit;
+    moloch_writer_write        = writer_tee_write;
+    moloch_writer_name         = writer_tee_name;
+    moloch_writer_next_input   = writer_tee_next_input;
+
+    if (numWriters > 1)
+        g_timeout_add_seconds(1, writer_tee_check_gfunc, 0);
+}
@@ -22,6 +22,7 @@
 #include <inttypes.h>
 #include <errno.h>
 #include <ctype.h>
+#include <pthread.h>
 #include "moloch.h"
 
 MolochWriterQueueLength moloch_writer_queue_length;
@@ -36,6 +37,11 @@ extern MolochConfig_t        config;
 
 static MolochStringHashStd_t writersHash;
 
+/* With packetThreads every packet thread writes, the writer and its main loop
+ * callbacks run holding this.  Recursive since writers call their own
+ * callbacks. */
+static pthread_mutex_t       writerLock;
+
 /******************************************************************************/
 void moloch_writers_start(char *name) {
     MolochString_t *str;
@@ -52,16 +58,42 @@ void moloch_writers_start(char *name) {
     func(name);
 }
 /******************************************************************************/
+/* The init function for a pcapWriteMethod, NULL if there isn't one */
+MolochWriterInit moloch_writers_get(char *name) {
+    MolochString_t *str;
+
+    HASH_FIND(s_, writersHash, name, str);
+    return str?str->uw:NULL;
+}
+/******************************************************************************/
 void moloch_writers_add(char *name, MolochWriterInit func) {
     moloch_string_add(&writersHash, name, func, TRUE);
 }
 /******************************************************************************/
+void moloch_writer_lock()
+{
+    pthread_mutex_lock(&writerLock);
+}
+/******************************************************************************/
+void moloch_writer_unlock()
+{
+    pthread_mutex_unlock(&writerLock);
+}
+/******************************************************************************/
 void writer_disk_init(char*);
 void writer_null_init(char*);
 void writer_inplace_init(char*);
+void writer_tee_init(char*);
 
 void moloch_writers_init()
 {
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&writerLock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
     HASH_INIT(s_, writersHash, moloch_string_hash, moloch_string_cmp);
     moloch_writers_add("null", writer_null_init);
     moloch_writers_add("inplace", writer_inplace_init);
@@ -69,4 +101,8 @@ void moloch_writers_init()
     moloch_writers_add("direct", writer_disk_init);
     moloch_writers_add("thread", writer_disk_init);
     moloch_writers_add("thread-direct", writer_disk_init);
+    moloch_writers_add("uring", writer_disk_init);
+    moloch_writers_add("uring-direct", writer_disk_init);
+    moloch_writers_add("mmap", writer_disk_init);
+    moloch_writers_add("tee", writer_tee_init);
 }
@@ -17,6 +17,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "glib.h"
 #include "yara.h"
 #include "moloch.h"
@@ -215,6 +216,9 @@ void moloch_yara_exit()
 static YARA_CONTEXT *yContext = 0;
 static YARA_CONTEXT *yEmailContext = 0;
 
+/* 1.x contexts keep scan state, packet threads take turns */
+static pthread_mutex_t yaraLock = PTHREAD_MUTEX_INITIALIZER;
+
 
 /******************************************************************************/
 void moloch_yara_report_error(const char* file_name, int line_number, const char* error_message)
@@ -303,7 +307,9 @@ void  moloch_yara_execute(MolochSession_t *session, unsigned char *data, int len
     }
     block.next = NULL;
 
+    pthread_mutex_lock(&yaraLock);
     yr_scan_mem_blocks(&block, yContext, (YARACALLBACK)moloch_yara_callback, session);
+    pthread_mutex_unlock(&yaraLock);
     return;
 }
 /******************************************************************************/
@@ -329,7 +335,9 @@ void  moloch_yara_email_execute(MolochSession_t *session, unsigned char *data, i
     }
     block.next = NULL;
 
+    pthread_mutex_lock(&yaraLock);
     yr_scan_mem_blocks(&block, yEmailContext, (YARACALLBACK)moloch_yara_callback, session);
+    pthread_mutex_unlock(&yaraLock);
     return;
 }
 /******************************************************************************/
@@ -32,6 +32,8 @@
 # 23 - packet lengths
 # 24 - field category
 # 25 - cert hash
+# 26 - psr packet ranges; dontSaveBPFsHits, shunted, per interface, writer buffer
+#      pool and tee writer stats
 
 use HTTP::Request::Common;
 use LWP::UserAgent;
@@ -40,7 +42,7 @@ use Data::Dumper;
 use POSIX;
 use strict;
 
-my $VERSION = 25;
+my $VERSION = 26;
 my $verbose = 0;
 my $PREFIX = "";
 
@@ -423,6 +425,82 @@ my $mapping = '
       diskQueue: {
         type: "long",
         index: "no"
+      },
+      dontSaveBPFsHits: {
+        type: "long",
+        index: "no"
+      },
+      shunted: {
+        type: "long",
+        index: "no"
+      },
+      shuntedActive: {
+        type: "long",
+        index: "no"
+      },
+      shuntedPackets: {
+        type: "long",
+        index: "no"
+      },
+      shuntedBytes: {
+        type: "long",
+        index: "no"
+      },
+      writerPoolSize: {
+        type: "long",
+        index: "no"
+      },
+      writerPoolHighWater: {
+        type: "long",
+        index: "no"
+      },
+      writerPoolExhausted: {
+        type: "long",
+        index: "no"
+      },
+      teeWriters: {
+        properties: {
+          name: {
+            type: "string",
+            index: "not_analyzed"
+          },
+          queue: {
+            type: "long",
+            index: "no"
+          },
+          dropping: {
+            type: "boolean",
+            index: "no"
+          },
+          dropped: {
+            type: "long",
+            index: "no"
+          }
+        }
+      },
+      interfaces: {
+        properties: {
+          name: {
+            type: "string",
+            index: "not_analyzed"
+          },
+          packets: {
+            type: "long",
+            index: "no"
+          },
+          bytes: {
+            type: "long",
+            index: "no"
+          },
+          recv: {
+            type: "long",
+            index: "no"
+          },
+          dropped: {
+            type: "long",
+            index: "no"
+          }
+        }
       }
     }
   }
@@ -1017,6 +1095,10 @@ sub sessionsUpdate
         type: "long",
         index: "no"
       },
+      psr: {
+        type: "long",
+        index: "no"
+      },
       psl: {
         type: "integer",
         index: "no"
@@ -2287,7 +2369,7 @@ if ($ARGV[1] =~ /(init|wipe)/) {
     dstatsUpdate();
 
     print "Finished\n";
-} elsif ($main::versionNumber >= 20 && $main::versionNumber <= 25) {
+} elsif ($main::versionNumber >= 20 && $main::versionNumber <= 26) {
     print "Trying to upgrade from version $main::versionNumber to version $VERSION.\n\n";
     waitFor("UPGRADE", "do you want to upgrade?");
     sessionsUpdate();
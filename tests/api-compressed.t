@@ -0,0 +1,91 @@
+use Test::More tests => 19;
+use Cwd;
+use URI::Escape;
+use MolochTest;
+use JSON;
+use strict;
+
+my $pwd = getcwd() . "/pcap";
+
+# Expected psr for each session once socks-https-example.pcap is copied with
+# 16k compressed blocks, without the file number.  Block 1 starts at 1<<20.
+my %psr = (1386004472 => [24, 30],
+           1386004475 => [11424, 12, 1048576, 18],
+           1386004480 => [1055902, 24, 2097152, 9]);
+
+sub cleanup {
+    viewerPost("/delete?date=-1&expression=" . uri_escape("node==testcompress"));
+    my $files = esGet("/tests_files/file/_search?q=node:testcompress&size=100");
+    foreach my $hit (@{$files->{hits}->{hits}}) {
+        esDelete("/tests_files/file/$hit->{_id}");
+        unlink($hit->{_source}->{name}, "$hit->{_source}->{name}.tidx");
+    }
+    esDelete("/tests_stats/stat/testcompress");
+    esGet("/_flush");
+    esGet("/_refresh");
+    viewerPost("/flushCache");
+}
+
+sub readFile {
+my ($filename) = @_;
+    open my $fh, '<', $filename or return "";
+    binmode $fh;
+    my $data = do { local $/; <$fh> };
+    close $fh;
+    return $data;
+}
+
+cleanup();
+system("../capture/moloch-capture -c config.test.ini -n testcompress --copy -r pcap/socks-https-example.pcap 2>&1 1>/dev/null");
+esGet("/_flush");
+esGet("/_refresh");
+
+countTest(3, "date=-1&expression=" . uri_escape("node==testcompress"));
+
+my $files = esGet("/tests_files/file/_search?q=node:testcompress&size=100");
+is (scalar @{$files->{hits}->{hits}}, 1, "One compressed file");
+my $file = $files->{hits}->{hits}->[0]->{_source};
+is (substr(readFile($file->{name}), 0, 4), "mpcz", "File is compressed");
+
+my $orig = viewerGet("/sessions.json?date=-1&expression=" . uri_escape("file=$pwd/socks-https-example.pcap"));
+my $copy = viewerGet("/sessions.json?date=-1&expression=" . uri_escape("node==testcompress"));
+my %origIds = map {$_->{fp} => $_->{id}} @{$orig->{data}};
+my %copyIds = map {$_->{fp} => $_->{id}} @{$copy->{data}};
+
+sub packets {
+my ($node, $id) = @_;
+    return $MolochTest::userAgent->get("http://$MolochTest::host:8123/$node/pcap/$id.pcap?noHeader=true")->content;
+}
+
+sub timeSlice {
+    return $MolochTest::userAgent->get("http://$MolochTest::host:8123/testcompress/timeSlice.pcap?startTime=1386004472&stopTime=1386004481")->content;
+}
+
+# Positions are block number and offset, and every packet reads back the same
+foreach my $fp (sort keys %psr) {
+    my ($date) = $copyIds{$fp} =~ /^([^-]+)-/;
+    my $session = esGet("/tests_sessions-$date/session/$copyIds{$fp}");
+    my @psr = @{$session->{_source}->{psr}};
+    is ($psr[0], -$file->{num}, "$fp psr file num");
+    is_deeply([grep {$_ >= 0} @psr], $psr{$fp}, "$fp psr");
+    ok (packets("testcompress", $copyIds{$fp}) eq packets("test", $origIds{$fp}), "$fp packets");
+}
+
+# The time slice walks the blocks and should give back the original file
+my $original = readFile("$pwd/socks-https-example.pcap");
+ok (substr(timeSlice(), 24) eq substr($original, 24), "timeSlice packets");
+
+# Without the index the blocks are found by walking their headers, like a
+# file that is still being written
+my $data = readFile($file->{name});
+my ($blocks, $magic) = unpack("VV", substr($data, -8));
+is ($magic, 0x6963706d, "Index trailer");
+truncate($file->{name}, length($data) - 8 - 8 * $blocks);
+sleep 1;
+
+foreach my $fp (sort keys %psr) {
+    ok (packets("testcompress", $copyIds{$fp}) eq packets("test", $origIds{$fp}), "$fp packets without index");
+}
+ok (substr(timeSlice(), 24) eq substr($original, 24), "timeSlice packets without index");
+
+cleanup();
@@ -34,9 +34,15 @@ sub doGeo {
     }
 }
 ################################################################################
+# pcap files under psr/ are run with packetPosRanges set
+sub testNode {
+my ($filename) = @_;
+    return ($filename =~ m{(^|/)psr/})?"testpsr":"test";
+}
+################################################################################
 sub doTests {
     my @files = @ARGV;
-    @files = glob ("pcap/*.pcap") if ($#files == -1);
+    @files = (glob ("pcap/*.pcap"), glob ("psr/*.pcap")) if ($#files == -1);
 
     plan tests => scalar @files;
 
@@ -48,7 +54,8 @@ sub doTests {
         my $savedData = do { local $/; <$fh> };
         my $savedJson = from_json($savedData, {relaxed => 1});
 
-        my $cmd = "../capture/moloch-capture --tests -c config.test.ini -n test -r $filename.pcap 2>&1 1>/dev/null | ./tests.pl --fix";
+        my $node = testNode($filename);
+        my $cmd = "../capture/moloch-capture --tests -c config.test.ini -n $node -r $filename.pcap 2>&1 1>/dev/null | ./tests.pl --fix";
 
         if ($main::valgrind) {
             $cmd = "G_SLICE=always-malloc valgrind --leak-check=full --log-file=$filename.val " . $cmd;
@@ -126,10 +133,11 @@ sub fixIp {
 sub doMake {
     foreach my $filename (@ARGV) {
         $filename = substr($filename, 0, -5) if ($filename =~ /\.pcap$/);
+        my $node = testNode($filename);
         if ($main::debug) {
-          print("../capture/moloch-capture --tests -c config.test.ini -n test -r $filename.pcap 2>&1 1>/dev/null | ./tests.pl --fix > $filename.test\n");
+          print("../capture/moloch-capture --tests -c config.test.ini -n $node -r $filename.pcap 2>&1 1>/dev/null | ./tests.pl --fix > $filename.test\n");
         }
-        system("../capture/moloch-capture --tests -c config.test.ini -n test -r $filename.pcap 2>&1 1>/dev/null | ./tests.pl --fix > $filename.test");
+        system("../capture/moloch-capture --tests -c config.test.ini -n $node -r $filename.pcap 2>&1 1>/dev/null | ./tests.pl --fix > $filename.test");
     }
 }
 ################################################################################
@@ -566,6 +566,7 @@ exports.isLocalView = function(node, yesCB, noCB) {
 };
 
 exports.deleteFile = function(node, id, path, cb) {
+  fs.unlink(path + ".tidx", function() {});
   fs.unlink(path, function() {
     exports.deleteDocument('files', 'file', id, function(err, data) {
       cb(null);
@@ -21,6 +21,7 @@
 'use strict';
 
 var fs             = require('fs-ext');
+var zlib           = require('zlib');
 
 var Pcap = module.exports = exports = function Pcap (key) {
   this.key     = key;
@@ -36,7 +37,13 @@ var internals = {
     17: "udp",
     58: "icmpv6"
   },
-  pcaps: {}
+  pcaps: {},
+  // Files written with pcapCompression, see writer-disk.c for the layout
+  compressMagic: 0x7a63706d,
+  compressIndexMagic: 0x6963706d,
+  compressHeaderLen: 40,
+  timeIndexMagic: 0x7874706d,
+  blockCacheSize: 8
 };
 
 //////////////////////////////////////////////////////////////////////////////////
@@ -87,6 +94,7 @@ Pcap.prototype.openReadWrite = function(filename) {
   }
   this.filename = filename;
   this.fd = fs.openSync(filename, "r+");
+  this.readHeader();
 };
 
 Pcap.prototype.unref = function() {
@@ -125,6 +133,18 @@ Pcap.prototype.readHeader = function(cb) {
 
   this.headBuffer = new Buffer(24);
   fs.readSync(this.fd, this.headBuffer, 0, 24, 0);
+
+  // Compressed files have their own header and then the pcap header
+  if (this.headBuffer.readUInt32LE(0) === internals.compressMagic) {
+    this.compressed   = true;
+    this.blockSize    = Math.pow(2, this.headBuffer.readUInt32LE(8));
+    this.blockCache   = {};
+    this.blockCacheKeys = [];
+    this.blockWaiting = {};
+    fs.readSync(this.fd, this.headBuffer, 0, 24, 16);
+    this.loadBlockIndex();
+  }
+
   this.bigEndian  = this.headBuffer.readUInt32LE(0) === 0xd4c3b2a1;
   if (this.bigEndian) {
     this.linkType   = this.headBuffer.readUInt32BE(20);
@@ -138,6 +158,149 @@ Pcap.prototype.readHeader = function(cb) {
   return this.headBuffer;
 };
 
+// Closed compressed files end with the offset of every block, files still
+// being written don't have it yet and blockOffset walks the block headers
+Pcap.prototype.loadBlockIndex = function() {
+  var size = fs.fstatSync(this.fd).size;
+  var trailer = new Buffer(8);
+
+  if (!this.blocks) {
+    this.blocks = [internals.compressHeaderLen];
+  }
+
+  if (size < internals.compressHeaderLen + 8) {
+    return;
+  }
+
+  fs.readSync(this.fd, trailer, 0, 8, size - 8);
+  if (trailer.readUInt32LE(4) !== internals.compressIndexMagic) {
+    return;
+  }
+
+  var count = trailer.readUInt32LE(0);
+  var index = new Buffer(count * 8);
+  fs.readSync(this.fd, index, 0, index.length, size - 8 - index.length);
+  this.blocks = [];
+  for (var i = 0; i < count; i++) {
+    this.blocks.push(index.readUInt32LE(i*8) + index.readUInt32LE(i*8 + 4) * 0x100000000);
+  }
+  this.blocksDone = true;
+};
+
+// File offset of a compressed block or -1 if it isn't on disk yet
+Pcap.prototype.blockOffset = function(num) {
+  if (num < this.blocks.length) {
+    return this.blocks[num];
+  }
+
+  if (this.blocksDone) {
+    return -1;
+  }
+
+  // Might have been closed since we last looked
+  this.loadBlockIndex();
+  if (this.blocksDone) {
+    return this.blockOffset(num);
+  }
+
+  var size = fs.fstatSync(this.fd).size;
+  var header = new Buffer(8);
+  while (this.blocks.length <= num) {
+    var last = this.blocks[this.blocks.length-1];
+    if (last + 8 > size) {
+      return -1;
+    }
+    fs.readSync(this.fd, header, 0, 8, last);
+    var next = last + 8 + header.readUInt32LE(0);
+    if (next + 8 > size) {
+      return -1;
+    }
+    this.blocks.push(next);
+  }
+  return this.blocks[num];
+};
+
+// Inflate a compressed block, the last few are cached since packets of a
+// session are usually near each other
+Pcap.prototype.readBlock = function(num, cb) {
+  var self = this;
+
+  if (self.blockCache[num]) {
+    return cb(self.blockCache[num]);
+  }
+
+  if (self.blockWaiting[num]) {
+    return self.blockWaiting[num].push(cb);
+  }
+
+  var offset = self.blockOffset(num);
+  if (offset === -1) {
+    return cb(null);
+  }
+
+  self.blockWaiting[num] = [cb];
+  function done(data) {
+    var cbs = self.blockWaiting[num];
+    delete self.blockWaiting[num];
+    if (data) {
+      self.blockCache[num] = data;
+      self.blockCacheKeys.push(num);
+      if (self.blockCacheKeys.length > internals.blockCacheSize) {
+        delete self.blockCache[self.blockCacheKeys.shift()];
+      }
+    }
+    for (var i = 0; i < cbs.length; i++) {
+      cbs[i](data);
+    }
+  }
+
+  var header = new Buffer(8);
+  fs.read(self.fd, header, 0, 8, offset, function (err, bytesRead) {
+    if (err || bytesRead < 8) {
+      return done(null);
+    }
+    var compressed = new Buffer(header.readUInt32LE(0));
+    fs.read(self.fd, compressed, 0, compressed.length, offset + 8, function (err, bytesRead) {
+      if (err || bytesRead < compressed.length) {
+        return done(null);
+      }
+      zlib.inflateRaw(compressed, function (err, data) {
+        if (err) {
+          console.log("Error ", err, "inflating block", num, "for file", self.filename);
+          return done(null);
+        }
+        done(data);
+      });
+    });
+  });
+};
+
+// Packets in a compressed file, pos is the block number and offset in it
+Pcap.prototype.readCompressedPackets = function(pos, lens, cb) {
+  var self = this;
+
+  self.readBlock(Math.floor(pos / self.blockSize), function(block) {
+    if (!block) {
+      return cb(null);
+    }
+
+    var packets = [];
+    var offset = pos % self.blockSize;
+    for (var i = 0, ilen = lens.length; i < ilen; i++) {
+      if (offset + 16 > block.length) {
+        return cb(null);
+      }
+      var len = (self.bigEndian?block.readUInt32BE(offset + 8):block.readUInt32LE(offset + 8));
+      if (len > 0xffff || offset + 16 + len > block.length || (lens[i] !== undefined && 16 + len !== lens[i])) {
+        return cb(null);
+      }
+      packets.push(block.slice(offset, offset + 16 + len));
+      offset += 16 + len;
+    }
+    return cb(packets);
+  });
+};
+
 Pcap.prototype.readPacket = function(pos, cb) {
   var self = this;
 
@@ -147,6 +310,12 @@ Pcap.prototype.readPacket = function(pos, cb) {
     return;
   }
 
+  if (self.compressed) {
+    return self.readCompressedPackets(pos, [undefined], function(packets) {
+      return cb(packets?packets[0]:null);
+    });
+  }
+
   var buffer = new Buffer(1550);
   try {
 
@@ -184,39 +353,280 @@ Pcap.prototype.readPacket = function(pos, cb) {
   }
 };
 
-Pcap.prototype.scrubPacket = function(packet, pos, buf, entire) {
+// Read several packets written back to back with one read, lens has the
+// full length of each packet including the 16 byte pcap header
+Pcap.prototype.readPacketRange = function(pos, lens, cb) {
+  var self = this;
+
+  // Hacky!! File isn't actually opened, try again soon
+  if (!self.fd) {
+    setTimeout(function() {self.readPacketRange(pos, lens, cb);}, 10);
+    return;
+  }
 
+  // Ranges never span compressed blocks
+  if (self.compressed) {
+    return self.readCompressedPackets(pos, lens, cb);
+  }
+
+  var total = 0;
+  for (var i = 0, ilen = lens.length; i < ilen; i++) {
+    total += lens[i];
+  }
+
+  var buffer = new Buffer(total);
+  try {
+    fs.read(self.fd, buffer, 0, total, pos, function (err, bytesRead, buffer) {
+      if (err || bytesRead < total) {
+        return cb(null);
+      }
+
+      var packets = [];
+      var offset = 0;
+      for (var i = 0, ilen = lens.length; i < ilen; i++) {
+        var len = (self.bigEndian?buffer.readUInt32BE(offset + 8):buffer.readUInt32LE(offset + 8));
+        if (16 + len !== lens[i]) {
+          return cb(null);
+        }
+        packets.push(buffer.slice(offset, offset + lens[i]));
+        offset += lens[i];
+      }
+      return cb(packets);
+    });
+  } catch (e) {
+    console.log("Error ", e, "for file", self.filename);
+    return cb (null);
+  }
+};
+
+// Read packets in file order starting at pos until the end of what was written,
+// packetCb(packet, pos) returns false to stop.  If given, waitCb(cb) is called
+// before each further read so the caller can hold off until it wants more.
+Pcap.prototype.walkPackets = function(pos, packetCb, endCb, waitCb) {
+  var self = this;
+  if (!waitCb) {
+    waitCb = function(cb) {cb();};
+  }
+
+  if (self.compressed) {
+    var walkBlock = function(num, offset) {
+      self.readBlock(num, function(block) {
+        if (!block) {
+          return endCb(null);
+        }
+        while (offset + 16 <= block.length) {
+          var len = (self.bigEndian?block.readUInt32BE(offset + 8):block.readUInt32LE(offset + 8));
+          if (offset + 16 + len > block.length) {
+            return endCb("Bad packet in block " + num + " of " + self.filename);
+          }
+          if (packetCb(block.slice(offset, offset + 16 + len), num * self.blockSize + offset) === false) {
+            return endCb(null);
+          }
+          offset += 16 + len;
+        }
+        waitCb(function() {walkBlock(num + 1, 0);});
+      });
+    };
+    return walkBlock(Math.floor(pos / self.blockSize), pos % self.blockSize);
+  }
+
+  var buffer = new Buffer(0x100000);
+  var walkChunk = function(pos) {
+    fs.read(self.fd, buffer, 0, buffer.length, pos, function (err, bytesRead) {
+      if (err) {
+        return endCb(err);
+      }
+      var offset = 0;
+      while (offset + 16 <= bytesRead) {
+        var len = (self.bigEndian?buffer.readUInt32BE(offset + 8):buffer.readUInt32LE(offset + 8));
+        // Files capture is still writing with mmap are zero filled past the last packet
+        if (len === 0 && buffer.readUInt32LE(offset) === 0) {
+          return endCb(null);
+        }
+        if (len > 0xffff) {
+          return endCb("Bad packet at " + (pos + offset) + " of " + self.filename);
+        }
+        if (offset + 16 + len > bytesRead) {
+          break;
+        }
+        if (packetCb(buffer.slice(offset, offset + 16 + len), pos + offset) === false) {
+          return endCb(null);
+        }
+        offset += 16 + len;
+      }
+      if (offset === 0) {
+        return endCb(null);
+      }
+      waitCb(function() {walkChunk(pos + offset);});
+    });
+  };
+  walkChunk(pos);
+};
+
+// Part of a packet to scrub, relative to the start of its pcap header
+function scrubRange(packet, entire) {
   var len = packet.pcap.incl_len + 16; // 16 = pcap header length
   if (entire) {
-    pos += 16; // Don't delete pcap header
-    len -= 16;
-  } else {
-    switch(packet.ip.p) {
-    case 1:
-      pos += (packet.icmp._pos + 8);
-      len -= (packet.icmp._pos + 8);
-      break;
-    case 6:
-      pos += (packet.tcp._pos + 4*packet.tcp.off);
-      len -= (packet.tcp._pos + 4*packet.tcp.off);
-      break;
-    case 17:
-      pos += (packet.udp._pos + 8);
-      len -= (packet.udp._pos + 8);
-      break;
-    default:
-      throw "Unknown packet type, can't scrub";
-    }
+    return {offset: 16, len: len - 16}; // Don't delete pcap header
   }
 
-  fs.writeSync(this.fd, buf, 0, len, pos);
+  var offset;
+  switch(packet.ip.p) {
+  case 1:
+    offset = packet.icmp._pos + 8;
+    break;
+  case 6:
+    offset = packet.tcp._pos + 4*packet.tcp.off;
+    break;
+  case 17:
+    offset = packet.udp._pos + 8;
+    break;
+  default:
+    throw "Unknown packet type, can't scrub";
+  }
+  return {offset: offset, len: len - offset};
+}
+
+Pcap.prototype.scrubPacket = function(packet, pos, buf, entire) {
+  if (this.compressed) {
+    throw "Can't scrub compressed pcap, use scrubCompressedPacket";
+  }
+
+  var range = scrubRange(packet, entire);
+  fs.writeSync(this.fd, buf, 0, range.len, pos + range.offset);
   fs.fsyncSync(this.fd);
 };
 
+// A compressed block can't be patched in place, instead it is inflated,
+// scrubbed, deflated and written back over itself padded out to the old
+// length so no other block moves.  Fails if the new block doesn't fit.
+// Scrubs of the same file are run one at a time so two packets in one block
+// don't undo each other.
+Pcap.prototype.scrubCompressedPacket = function(packet, pos, buf, entire, cb) {
+  var self = this;
+
+  if (!self.scrubWaiting) {
+    self.scrubWaiting = [];
+  }
+  self.scrubWaiting.push({packet: packet, pos: pos, buf: buf, entire: entire, cb: cb});
+  if (self.scrubWaiting.length === 1) {
+    self.scrubCompressedNext();
+  }
+};
+
+Pcap.prototype.scrubCompressedNext = function() {
+  var self = this;
+  var item = self.scrubWaiting[0];
+
+  self.scrubCompressedBlock(item.packet, item.pos, item.buf, item.entire, function(err) {
+    self.scrubWaiting.shift();
+    if (self.scrubWaiting.length > 0) {
+      setImmediate(function() {self.scrubCompressedNext();});
+    }
+    item.cb(err);
+  });
+};
+
+Pcap.prototype.scrubCompressedBlock = function(packet, pos, buf, entire, cb) {
+  var self = this;
+  var range;
+
+  try {
+    range = scrubRange(packet, entire);
+  } catch (e) {
+    return cb(e);
+  }
+
+  var num = Math.floor(pos / self.blockSize);
+  var offset = self.blockOffset(num);
+  if (offset === -1) {
+    return cb("Block " + num + " of " + self.filename + " isn't on disk");
+  }
+
+  // Always start from what is on disk, not a cached copy
+  exports.forgetBlock(self.filename, num);
+  self.readBlock(num, function(block) {
+    if (!block) {
+      return cb("Couldn't read block " + num + " of " + self.filename);
+    }
+
+    var start = pos % self.blockSize + range.offset;
+    if (start + range.len > block.length) {
+      return cb("Packet at " + pos + " runs past its block in " + self.filename);
+    }
+
+    var data = new Buffer(block.length);
+    block.copy(data);
+    for (var i = 0; i < range.len; i++) {
+      data[start + i] = buf[i % buf.length];
+    }
+
+    zlib.deflateRaw(data, {level: 9}, function (err, deflated) {
+      if (err) {
+        return cb("Couldn't deflate block " + num + " of " + self.filename + " " + err);
+      }
+
+      var header = new Buffer(8);
+      fs.read(self.fd, header, 0, 8, offset, function (err, bytesRead) {
+        if (err || bytesRead < 8) {
+          return cb("Couldn't read block " + num + " header of " + self.filename);
+        }
+
+        var oldLen = header.readUInt32LE(0);
+        if (deflated.length > oldLen) {
+          return cb("Scrubbed block " + num + " of " + self.filename + " is larger than the original");
+        }
+
+        // inflate stops at the end of the deflate stream, the padding is never read
+        var out = new Buffer(oldLen);
+        out.fill(0);
+        deflated.copy(out);
+        fs.write(self.fd, out, 0, oldLen, offset + 8, function (err) {
+          exports.forgetBlock(self.filename, num);
+          if (err) {
+            return cb("Couldn't write block " + num + " of " + self.filename + " " + err);
+          }
+          fs.fsync(self.fd, cb);
+        });
+      });
+    });
+  });
+};
+
 //////////////////////////////////////////////////////////////////////////////////
 //// Utilities
 //////////////////////////////////////////////////////////////////////////////////
 
+// Load the <file>.tidx capture writes when a pcap file is closed, returns
+// sorted {time, pos} entries with time in microseconds, or null
+exports.readTimeIndex = function(filename, cb) {
+  fs.readFile(filename + ".tidx", function (err, data) {
+    if (err || data.length < 16 || data.readUInt32LE(0) !== internals.timeIndexMagic) {
+      return cb(null);
+    }
+
+    var count = Math.min(data.readUInt32LE(8), Math.floor((data.length - 16) / 16));
+    var entries = [];
+    for (var i = 0; i < count; i++) {
+      var o = 16 + i*16;
+      entries.push({time: data.readUInt32LE(o)*1000000 + data.readUInt32LE(o + 4),
+                    pos: data.readUInt32LE(o + 8) + data.readUInt32LE(o + 12) * 0x100000000});
+    }
+    return cb(entries);
+  });
+};
+
+// Drop a block from every open copy of a compressed file, it was rewritten
+exports.forgetBlock = function(filename, num) {
+  for (var key in internals.pcaps) {
+    var pcap = internals.pcaps[key];
+    if (pcap.filename === filename && pcap.blockCache && pcap.blockCache[num]) {
+      delete pcap.blockCache[num];
+      pcap.blockCacheKeys.splice(pcap.blockCacheKeys.indexOf(num), 1);
+    }
+  }
+};
+
 exports.protocol2Name = function(num) {
   return internals.pr2name[num] || "" + num;
 };
@@ -610,6 +610,15 @@ function checkWebEnabled(req, res, next) {
 
   return next();
 }
+
+// For pcap that isn't looked up through sessions, so a forced expression can't be applied
+function checkNoForcedExpression(req, res, next) {
+  if (req.user.expression && req.user.expression.length > 0) {
+    return res.send("Moloch Permision Denied - Not allowed with a forced expression");
+  }
+
+  return next();
+}
 //////////////////////////////////////////////////////////////////////////////////
 //// Pages
 //////////////////////////////////////////////////////////////////////////////////
@@ -2583,6 +2592,79 @@ app.get('/unique.txt', function(req, res) {
   });
 });
 
+// Sessions saved with packetPosRanges have psr instead of ps, negative file
+// numbers followed by start,count pairs of packets written back to back.
+// psl still has a length for every entry.
+function psrToRanges(fields) {
+  var ranges = [];
+  var fileNum = 0;
+  var p = 0;
+  var packets = 0;
+  var MAX_READ = 1024*1024;
+
+  for (var i = 0, ilen = fields.psr.length; i < ilen; i++) {
+    if (fields.psr[i] < 0) {
+      fileNum = -1 * fields.psr[i];
+      p++;
+      continue;
+    }
+
+    var pos = fields.psr[i];
+    var count = fields.psr[++i];
+    var range = {fileNum: fileNum, pos: pos, lens: [], first: packets, size: 0};
+    ranges.push(range);
+
+    for (var c = 0; c < count; c++, p++) {
+      // Don't let one read get too large
+      if (range.size + fields.psl[p] > MAX_READ && range.lens.length > 0) {
+        range = {fileNum: fileNum, pos: pos, lens: [], first: packets, size: 0};
+        ranges.push(range);
+      }
+      range.lens.push(fields.psl[p]);
+      range.size += fields.psl[p];
+      pos += fields.psl[p];
+      packets++;
+    }
+  }
+  return ranges;
+}
+
+function psrToPs(fields) {
+  var ps = [];
+  var p = 0;
+  for (var i = 0, ilen = fields.psr.length; i < ilen; i++) {
+    if (fields.psr[i] < 0) {
+      ps.push(fields.psr[i]);
+      p++;
+      continue;
+    }
+    var pos = fields.psr[i];
+    var count = fields.psr[++i];
+    for (var c = 0; c < count; c++, p++) {
+      ps.push(pos);
+      pos += fields.psl[p];
+    }
+  }
+  return ps;
+}
+
+// Shorten psr so it only covers the first maxPackets packets
+function psrTruncate(fields, maxPackets) {
+  var packets = 0;
+  for (var i = 0, ilen = fields.psr.length; i < ilen; i++) {
+    if (fields.psr[i] < 0) {
+      continue;
+    }
+    i++;
+    if (packets + fields.psr[i] >= maxPackets) {
+      fields.psr[i] = maxPackets - packets;
+      fields.psr.length = i + 1;
+      return;
+    }
+    packets += fields.psr[i];
+  }
+}
+
 function processSessionIdDisk(session, headerCb, packetCb, endCb, limit) {
   function processFile(pcap, pos, i, nextCb) {
     pcap.ref();
@@ -2601,10 +2683,74 @@ function processSessionIdDisk(session, headerCb, packetCb, endCb, limit) {
     });
   }
 
+  function processRange(pcap, range, nextCb) {
+    pcap.ref();
+    pcap.readPacketRange(range.pos, range.lens, function(packets) {
+      pcap.unref();
+      if (!packets) {
+        return endCb("Error loading data for session " + session._id, null);
+      }
+      var i = range.first;
+      async.eachSeries(packets, function(packet, packetNextCb) {
+        packetCb(pcap, packet, packetNextCb, i++);
+      }, nextCb);
+    });
+  }
+
+  // Get the pcap file for this node a filenum, if it isn't opened then do the filename lookup and open it
+  function getPcap(fileNum, pcapCb) {
+    var opcap = Pcap.get(fields.no + ":" + fileNum);
+    if (opcap.isOpen()) {
+      if (headerCb) {
+        headerCb(opcap, opcap.readHeader());
+        headerCb = null;
+      }
+      return pcapCb(null, opcap);
+    }
+
+    Db.fileIdToFile(fields.no, fileNum, function(file) {
+      if (!file) {
+        console.log("WARNING - Only have SPI data, PCAP file no longer available", fields.no + '-' + fileNum);
+        return pcapCb("Only have SPI data, PCAP file no longer available for " + fields.no + '-' + fileNum);
+      }
+
+      var ipcap = Pcap.get(fields.no + ":" + file.num);
+
+      try {
+        ipcap.open(file.name);
+      } catch (err) {
+        console.log("ERROR - Couldn't open file ", err);
+        return pcapCb("Couldn't open file " + err);
+      }
+
+      if (headerCb) {
+        headerCb(ipcap, ipcap.readHeader());
+        headerCb = null;
+      }
+      pcapCb(null, ipcap);
+    });
+  }
+
   var fields;
 
   fields = session._source || session.fields;
 
+  // Range encoded positions, one read per run of back to back packets
+  if (fields.psr) {
+    async.eachLimit(psrToRanges(fields), limit || 1, function(range, nextCb) {
+      getPcap(range.fileNum, function(err, pcap) {
+        if (err) {
+          return nextCb(err);
+        }
+        processRange(pcap, range, nextCb);
+      });
+    },
+    function (pcapErr, results) {
+      endCb(pcapErr, fields);
+    });
+    return;
+  }
+
   var fileNum;
   var itemPos = 0;
   async.eachLimit(fields.ps, limit || 1, function(pos, nextCb) {
@@ -2613,38 +2759,13 @@ function processSessionIdDisk(session, headerCb, packetCb, endCb, limit) {
       return nextCb(null);
     }
 
-    // Get the pcap file for this node a filenum, if it isn't opened then do the filename lookup and open it
-    var opcap = Pcap.get(fields.no + ":" + fileNum);
-    if (!opcap.isOpen()) {
-      Db.fileIdToFile(fields.no, fileNum, function(file) {
-
-        if (!file) {
-          console.log("WARNING - Only have SPI data, PCAP file no longer available", fields.no + '-' + fileNum);
-          return nextCb("Only have SPI data, PCAP file no longer available for " + fields.no + '-' + fileNum);
-        }
-
-        var ipcap = Pcap.get(fields.no + ":" + file.num);
-
-        try {
-          ipcap.open(file.name);
-        } catch (err) {
-          console.log("ERROR - Couldn't open file ", err);
-          return nextCb("Couldn't open file " + err);
-        }
-
-        if (headerCb) {
-          headerCb(ipcap, ipcap.readHeader());
-          headerCb = null;
-        }
-        processFile(ipcap, pos, itemPos++, nextCb);
-      });
-    } else {
-      if (headerCb) {
-        headerCb(opcap, opcap.readHeader());
-        headerCb = null;
+    var i = itemPos++;
+    getPcap(fileNum, function(err, pcap) {
+      if (err) {
+        return nextCb(err);
       }
-      processFile(opcap, pos, itemPos++, nextCb);
-    }
+      processFile(pcap, pos, i, nextCb);
+    });
   },
   function (pcapErr, results) {
     endCb(pcapErr, fields);
@@ -2654,7 +2775,7 @@ function processSessionIdDisk(session, headerCb, packetCb, endCb, limit) {
 function processSessionId(id, fullSession, headerCb, packetCb, endCb, maxPackets, limit) {
   var options;
   if (!fullSession) {
-    options  = {fields: "no,ps,psl"};
+    options  = {fields: "no,ps,psr,psl"};
   }
 
   Db.getWithOptions(Db.id2Index(id), 'session', id, options, function(err, session) {
@@ -2665,19 +2786,25 @@ function processSessionId(id, fullSession, headerCb, packetCb, endCb, maxPackets
 
     var fields = session._source || session.fields;
 
-    if (maxPackets && fields.ps.length > maxPackets) {
+    if (fields.psr) {
+      if (maxPackets) {
+        psrTruncate(fields, maxPackets);
+      }
+    } else if (maxPackets && fields.ps.length > maxPackets) {
       fields.ps.length = maxPackets;
     }
 
+    var positions = fields.ps || fields.psr;
+
     /* Go through the list of prefetch the id to file name if we are running in parallel to
      * reduce the number of elasticsearch queries and problems
      */
     var outstanding = 0;
     var saveInfo;
-    for (var i = 0, ilen = fields.ps.length; i < ilen; i++) {
-      if (fields.ps[i] < 0) {
+    for (var i = 0, ilen = positions.length; i < ilen; i++) {
+      if (positions[i] < 0) {
         outstanding++;
-        Db.fileIdToFile(fields.no, -1 * fields.ps[i], function (info) {
+        Db.fileIdToFile(fields.no, -1 * positions[i], function (info) {
           outstanding--;
           if (i === 0) {
             saveInfo = info;
@@ -2700,6 +2827,11 @@ function processSessionId(id, fullSession, headerCb, packetCb, endCb, maxPackets
       var writer = internals.writers[pcapWriteMethod];
       if (writer && writer.processSessionId) {
         psid = writer.processSessionId;
+        // Other writers only know about ps
+        if (fields.psr) {
+          fields.ps = psrToPs(fields);
+          delete fields.psr;
+        }
       }
 
       psid(session, headerCb, packetCb, function (err, fields) {
@@ -3228,6 +3360,7 @@ function writePcapNg(res, id, options, doneCb) {
 
     session.version = molochversion.version;
     delete session.ps;
+    delete session.psr;
     var json = JSON.stringify(session);
 
     var len = ((json.length + 20 + 3) >> 2) << 2;
@@ -3333,6 +3466,142 @@ app.get('/:nodeName/entirePcap/:id.pcap', checkProxyRequest, function(req, res)
   });
 });
 
+// Every packet this node wrote between startTime and stopTime, in file order.
+// The .tidx next to each pcap file gives where to start reading, files
+// without one are read from the start.
+app.get('/:nodeName/timeSlice.pcap', checkNoForcedExpression, checkProxyRequest, function(req, res) {
+  var startTime = parseInt(req.query.startTime, 10);
+  var stopTime = parseInt(req.query.stopTime, 10);
+  if (isNaN(startTime) || isNaN(stopTime) || stopTime < startTime) {
+    return res.send("Missing or bad startTime/stopTime");
+  }
+
+  noCache(req, res, "application/vnd.tcpdump.pcap");
+
+  var startUs = startTime*1000000;
+  var stopUs = (stopTime+1)*1000000;
+
+  // Stop reading once the client goes away, otherwise wait for the response
+  // to drain whenever write says it is full before reading more
+  var closed = false;
+  var full = false;
+  req.on('close', function() {
+    closed = true;
+  });
+  var write = function(buf) {
+    if (!res.write(buf)) {
+      full = true;
+    }
+  };
+  var wait = function(cb) {
+    if (!full || closed) {
+      return cb();
+    }
+    var resume = function() {
+      res.removeListener('drain', resume);
+      req.removeListener('close', resume);
+      full = false;
+      cb();
+    };
+    res.once('drain', resume);
+    req.once('close', resume);
+  };
+
+  var wroteHeader = false;
+  var sliceFile = function(file, nextCb) {
+    if (closed) {
+      return nextCb("closed");
+    }
+    if (file.name.indexOf("s3://") === 0) {
+      console.log("WARNING - timeSlice can't read", file.name);
+      return nextCb();
+    }
+
+    var pcap = Pcap.get(req.params.nodeName + ":" + file.num);
+    try {
+      pcap.open(file.name);
+    } catch (err) {
+      console.log("WARNING - timeSlice couldn't open", file.name, err);
+      return nextCb();
+    }
+    pcap.ref();
+
+    if (!wroteHeader) {
+      write(pcap.readHeader());
+      wroteHeader = true;
+    }
+
+    Pcap.readTimeIndex(file.name, function(index) {
+      // Start at the last entry before the slice, stop once past the first entry after it
+      var startPos = 24;
+      var stopPos = Infinity;
+      if (index) {
+        for (var i = 0, ilen = index.length; i < ilen; i++) {
+          if (index[i].time < startUs) {
+            startPos = index[i].pos;
+          } else if (index[i].time >= stopUs) {
+            stopPos = index[i].pos;
+            break;
+          }
+        }
+      }
+
+      pcap.walkPackets(startPos, function(packet, pos) {
+        if (closed) {
+          return false;
+        }
+        var time = (pcap.bigEndian?packet.readUInt32BE(0)*1000000 + packet.readUInt32BE(4)
+                                  :packet.readUInt32LE(0)*1000000 + packet.readUInt32LE(4));
+        if (time >= stopUs && (pos >= stopPos || !index)) {
+          return false;
+        }
+        if (time >= startUs && time < stopUs) {
+          write(packet);
+        }
+      }, function(err) {
+        if (err) {
+          console.log("ERROR - timeSlice", err);
+        }
+        pcap.unref();
+        wait(nextCb);
+      }, wait);
+    });
+  };
+
+  // Files still being written, and ones from before capture recorded last, have no last.
+  // Page through them by num so long slices aren't cut off at one search's worth.
+  var lastNum = -1;
+  var more = true;
+  async.doWhilst(function(whilstCb) {
+    var query = { size: 1000,
+                  query: {filtered: {query: {bool: {must: [{term: {node: req.params.nodeName}},
+                                                           {range: {first: {lte: stopTime}}},
+                                                           {range: {num: {gt: lastNum}}}]}},
+                                     filter: {bool: {should: [{range: {last: {gte: startTime}}},
+                                                              {missing: {field: "last"}}]}}}},
+                  sort: { num: { order: 'asc' } }
+                };
+
+    Db.search('files', 'file', query, function(err, data) {
+      if (err || data.error || !data.hits) {
+        console.log("ERROR - timeSlice files search", err, data);
+        return whilstCb("ERR");
+      }
+
+      var files = data.hits.hits.map(function(item) {return item._source || item.fields;});
+      more = files.length === query.size;
+      if (files.length > 0) {
+        lastNum = files[files.length-1].num;
+      }
+      async.forEachSeries(files, sliceFile, whilstCb);
+    });
+  }, function () {
+    return more;
+  }, function () {
+    res.end();
+  });
+});
+
 function sessionsPcapList(req, res, list, pcapWriter, extension) {
 
   if (list.length > 0 && list[0].fields) {
@@ -3913,34 +4182,61 @@ function pcapScrub(req, res, id, entire, endCb) {
     }
   }
 
+  // Packets that couldn't be scrubbed, the session is left alone if there are any
+  var failed = 0;
+  var noPcap = false;
+
   function processFile(pcap, pos, i, nextCb) {
     pcap.ref();
     pcap.readPacket(pos, function(packet) {
-      pcap.unref();
+      if (!packet || packet.length <= 16) {
+        pcap.unref();
+        console.log("Couldn't scrub packet at ", pos);
+        failed++;
+        return nextCb(null);
+      }
 
-      if (packet) {
-        if (packet.length > 16) {
-          try {
-            var obj = {};
-            pcap.decode(packet, obj);
-            pcap.scrubPacket(obj, pos, pcapScrub.scrubbingBuffers[0], entire);
-            pcap.scrubPacket(obj, pos, pcapScrub.scrubbingBuffers[1], entire);
-            pcap.scrubPacket(obj, pos, pcapScrub.scrubbingBuffers[2], entire);
-          } catch (e) {
-            console.log("Couldn't scrub packet at ", pos, e);
+      var obj = {};
+      try {
+        pcap.decode(packet, obj);
+      } catch (e) {
+        pcap.unref();
+        console.log("Couldn't scrub packet at ", pos, e);
+        failed++;
+        return nextCb(null);
+      }
+
+      if (pcap.compressed) {
+        return pcap.scrubCompressedPacket(obj, pos, pcapScrub.scrubbingBuffers[2], entire, function(err) {
+          pcap.unref();
+          if (err) {
+            console.log("Couldn't scrub packet at ", pos, err);
+            failed++;
           }
           return nextCb(null);
-        } else {
-          console.log("Couldn't scrub packet at ", pos);
-          return nextCb(null);
-        }
+        });
+      }
+
+      try {
+        pcap.scrubPacket(obj, pos, pcapScrub.scrubbingBuffers[0], entire);
+        pcap.scrubPacket(obj, pos, pcapScrub.scrubbingBuffers[1], entire);
+        pcap.scrubPacket(obj, pos, pcapScrub.scrubbingBuffers[2], entire);
+      } catch (e) {
+        console.log("Couldn't scrub packet at ", pos, e);
+        failed++;
       }
+      pcap.unref();
+      return nextCb(null);
     });
   }
 
-  Db.getWithOptions(Db.id2Index(id), 'session', id, {fields: "no,pr,ps,psl"}, function(err, session) {
+  Db.getWithOptions(Db.id2Index(id), 'session', id, {fields: "no,pr,ps,psr,psl"}, function(err, session) {
     var fields = session._source || session.fields;
 
+    if (fields.psr) {
+      fields.ps = psrToPs(fields);
+    }
+
     var fileNum;
     var itemPos = 0;
     async.eachLimit(fields.ps, 10, function(pos, nextCb) {
@@ -3956,6 +4252,7 @@ function pcapScrub(req, res, id, entire, endCb) {
 
           if (!file) {
             console.log("WARNING - Only have SPI data, PCAP file no longer available", fields.no + '-' + fileNum);
+            noPcap = true;
             return nextCb("Only have SPI data, PCAP file no longer available for " + fields.no + '-' + fileNum);
           }
 
@@ -3975,9 +4272,19 @@ function pcapScrub(req, res, id, entire, endCb) {
       }
     },
     function (pcapErr, results) {
+      if (!pcapErr && failed > 0) {
+        pcapErr = "Couldn't scrub " + failed + " packets of session " + id;
+      }
+
+      // Don't claim a session was scrubbed or delete its SPI data if its packets
+      // weren't, unless they are already gone
+      if (pcapErr && !noPcap) {
+        return endCb(pcapErr, fields);
+      }
+
       if (entire) {
         Db.deleteDocument(Db.id2Index(session._id), 'session', session._id, function(err, data) {
-          endCb(pcapErr, fields);
+          endCb(null, fields);
         });
       } else {
         // Do the ES update
@@ -3988,7 +4295,7 @@ function pcapScrub(req, res, id, entire, endCb) {
           }
         };
         Db.update(Db.id2Index(session._id), 'session', session._id, document, function(err, data) {
-          endCb(pcapErr, fields);
+          endCb(null, fields);
         });
       }
     });
@@ -4004,7 +4311,7 @@ app.get('/:nodeName/scrub/:id', checkProxyRequest, function(req, res) {
   res.statusCode = 200;
 
   pcapScrub(req, res, req.params.id, false, function(err) {
-    res.end();
+    res.end(JSON.stringify({success: !err, text: err}));
   });
 });
 
@@ -4017,7 +4324,7 @@ app.get('/:nodeName/delete/:id', checkProxyRequest, function(req, res) {
   res.statusCode = 200;
 
   pcapScrub(req, res, req.params.id, true, function(err) {
-    res.end();
+    res.end(JSON.stringify({success: !err, text: err}));
   });
 });
 
@@ -4027,12 +4334,18 @@ function scrubList(req, res, entire, list) {
     return res.end(JSON.stringify({success: false, text: "Missing list of sessions"}));
   }
 
+  var failures = [];
   async.eachLimit(list, 10, function(item, nextCb) {
     var fields = item._source || item.fields;
 
     isLocalView(fields.no, function () {
       // Get from our DISK
-      pcapScrub(req, res, item._id, entire, nextCb);
+      pcapScrub(req, res, item._id, entire, function(err) {
+        if (err) {
+          failures.push(err);
+        }
+        nextCb(null);
+      });
     },
     function () {
       // Get from remote DISK
@@ -4043,18 +4356,34 @@ function scrubList(req, res, entire, list) {
         addAuth(info, req.user, fields.no);
         addCaTrust(info, fields.no);
         var preq = client.request(info, function(pres) {
+          var body = "";
+          pres.on('data', function (chunk) {
+            body += chunk;
+          });
           pres.on('end', function () {
+            try {
+              var result = JSON.parse(body);
+              if (!result.success) {
+                failures.push(result.text);
+              }
+            } catch (e) {
+              failures.push("Bad response from " + fields.no + " for " + item._id);
+            }
             setImmediate(nextCb);
           });
         });
         preq.on('error', function (e) {
           console.log("ERROR - Couldn't proxy scrub request=", info, "\nerror=", e);
+          failures.push("Couldn't reach " + fields.no + " for " + item._id);
           nextCb(null);
         });
         preq.end();
       });
     });
   }, function(err) {
+    if (failures.length > 0) {
+      return res.end(JSON.stringify({success: false, text: (entire?"Deleting of ":"Scrubbing of ") + failures.length + " of " + list.length + " sessions failed: " + failures.join(", ")}));
+    }
     return res.end(JSON.stringify({success: true, text: (entire?"Deleting of ":"Scrubbing of ") + list.length + " sessions complete"}));
   });
 }
@@ -4146,6 +4475,7 @@ function sendSessionWorker(options, cb) {
     }
     session.id = options.id;
     session.ps = ps;
+    delete session.psr;
     delete session.fs;
 
     if (options.tags) {